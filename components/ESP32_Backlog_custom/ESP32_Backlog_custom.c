@@ -0,0 +1,693 @@
+#include "ESP32_Backlog_custom.h"
+#include "../ESP32_Mqtt_custom/telemetry_codec.h"
+
+#include "string.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+/**
+ * @file ESP32_Backlog_custom.c
+ * @brief Implementation file for the store-and-forward backlog of telemetry frames.
+ *
+ * Flash layout: every sector starts with a backlog_sector_header_t carrying a sequence number that
+ * grows with every sector opened, followed by records of a backlog_record_header_t and the record
+ * bytes. The sectors holding data form a contiguous run in ring order, from the tail (lowest
+ * sequence, oldest) to the head (highest sequence, being written). A record's payload is written
+ * before its header, so a write torn by a reset leaves an invalid header that ends the sector.
+ *
+ * The RAM ring is shared under backlog_lock. The flash log belongs to the backfill task, which spills,
+ * reads and acknowledges without the lock, so pushing a record never waits for a flash write or erase.
+ */
+
+#define BACKLOG_SECTOR_SIZE     4096            ///< Flash sector size in bytes
+#define BACKLOG_SECTOR_MAGIC    0x474C4B42      ///< "BKLG", marks an opened sector
+#define RECORD_STATE_PENDING    0xFF            ///< Record written but not sent, the erased value
+#define RECORD_STATE_CONSUMED   0x00            ///< Record sent, cleared in place without an erase
+#define RECORD_LENGTH_ERASED    0xFFFF          ///< Length field of unwritten flash
+
+/* Notification bits of the backfill task */
+#define BACKFILL_NOTIFY_SPILL       (1 << 0)    ///< The RAM ring passed BACKLOG_SPILL_LEVEL
+#define BACKFILL_NOTIFY_CONFIRMED   (1 << 1)    ///< The broker acknowledged the outstanding batch
+#define BACKFILL_NOTIFY_DROPPED     (1 << 2)    ///< The outstanding batch was lost on its way
+
+/**
+ * @brief Header at the start of every opened flash sector.
+ */
+typedef struct {
+    uint32_t magic;             ///< BACKLOG_SECTOR_MAGIC
+    uint32_t sequence;          ///< Sequence number of the sector, grows by one per opened sector
+    uint32_t sequence_check;    ///< Bitwise inverse of sequence
+    uint32_t reserved;          ///< Left erased
+} backlog_sector_header_t;
+
+/**
+ * @brief Header in front of every record in flash.
+ */
+typedef struct {
+    uint16_t length;            ///< Length of the record
+    uint16_t crc;               ///< CRC-16 of the record bytes
+    uint8_t state;              ///< RECORD_STATE_PENDING or RECORD_STATE_CONSUMED
+    uint8_t reserved[3];        ///< Left erased
+} backlog_record_header_t;
+
+#define SECTOR_DATA_START   sizeof(backlog_sector_header_t)     ///< Offset of the first record in a sector
+
+/**
+ * @brief Where the outstanding batch was read from.
+ */
+typedef enum {
+    BATCH_NONE,     ///< No batch outstanding
+    BATCH_FLASH,    ///< Records of the tail sector
+    BATCH_RAM       ///< Records at the tail of the RAM ring
+} backlog_batch_source_t;
+
+static uint32_t backfill_interval_ms = BACKLOG_BACKFILL_INTERVAL_MS;
+static SemaphoreHandle_t backlog_lock = NULL;
+static backlog_counters_t backlog_counters;
+static TaskHandle_t backfill_task_handle = NULL;
+
+// RAM ring of [uint16_t length][record] entries
+static uint8_t ram_ring[BACKLOG_RAM_SIZE];
+static size_t ram_tail = 0;
+static size_t ram_used = 0;
+static uint32_t ram_generation = 0;     ///< Changes whenever records leave the RAM ring other than by an ack
+
+// Flash log
+static const esp_partition_t *flash_partition = NULL;
+static uint32_t flash_sectors = 0;
+static uint32_t head_sector = 0;
+static uint32_t head_offset = 0;
+static uint32_t head_sequence = 0;
+static uint32_t tail_sector = 0;
+static uint32_t tail_offset = 0;
+static uint32_t flash_generation = 0;   ///< Changes whenever the tail sector is dropped
+
+// Outstanding batch
+static backlog_batch_source_t batch_source = BATCH_NONE;
+static uint32_t batch_generation = 0;
+static size_t batch_ram_bytes = 0;
+static uint32_t batch_records = 0;
+static uint16_t batch_offsets[BACKLOG_BATCH_RECORDS];
+static uint32_t batch_end_offset = 0;
+
+/**
+ * @brief Backfill task parameters.
+ */
+typedef struct {
+    esp_mqtt_client_handle_t client;    ///< MQTT client handle
+    const char *topic;                  ///< Backfill topic
+} backfill_args_t;
+
+static backfill_args_t backfill_args;
+
+// Setter, Getter
+
+void set_backlog_backfill_interval_ms(uint32_t interval_ms) {
+    backfill_interval_ms = interval_ms;
+}
+
+uint32_t get_backlog_backfill_interval_ms(void) {
+    return backfill_interval_ms;
+}
+
+void get_backlog_counters(backlog_counters_t *counters) {
+    xSemaphoreTake(backlog_lock, portMAX_DELAY);
+    *counters = backlog_counters;
+    xSemaphoreGive(backlog_lock);
+}
+
+/**
+ * @brief Count lost records, from the pushing task or the backfill task.
+ * @param records Number of records lost.
+ */
+static void count_dropped(uint32_t records) {
+    xSemaphoreTake(backlog_lock, portMAX_DELAY);
+    backlog_counters.records_dropped += records;
+    xSemaphoreGive(backlog_lock);
+}
+
+// RAM ring
+
+static void ram_copy_in(size_t position, const void *data, size_t length) {
+    size_t first = BACKLOG_RAM_SIZE - position < length ? BACKLOG_RAM_SIZE - position : length;
+    memcpy(&ram_ring[position], data, first);
+    memcpy(ram_ring, (const uint8_t *)data + first, length - first);
+}
+
+static void ram_copy_out(size_t position, void *data, size_t length) {
+    position %= BACKLOG_RAM_SIZE;
+    size_t first = BACKLOG_RAM_SIZE - position < length ? BACKLOG_RAM_SIZE - position : length;
+    memcpy(data, &ram_ring[position], first);
+    memcpy((uint8_t *)data + first, ram_ring, length - first);
+}
+
+/**
+ * @brief Length of the record at a position of the RAM ring.
+ * @param position Offset from the start of the ring buffer.
+ * @return Record length in bytes.
+ */
+static uint16_t ram_record_length(size_t position) {
+    uint16_t length;
+    ram_copy_out(position, &length, sizeof(length));
+    return length;
+}
+
+static void ram_append(const uint8_t *record, uint16_t length) {
+    size_t position = (ram_tail + ram_used) % BACKLOG_RAM_SIZE;
+    ram_copy_in(position, &length, sizeof(length));
+    ram_copy_in((position + sizeof(length)) % BACKLOG_RAM_SIZE, record, length);
+    ram_used += sizeof(length) + length;
+}
+
+static void ram_remove_oldest(void) {
+    size_t entry = sizeof(uint16_t) + ram_record_length(ram_tail);
+    ram_tail = (ram_tail + entry) % BACKLOG_RAM_SIZE;
+    ram_used -= entry;
+}
+
+// Flash log
+
+static size_t sector_address(uint32_t sector, uint32_t offset) {
+    return (size_t)sector * BACKLOG_SECTOR_SIZE + offset;
+}
+
+static bool flash_is_empty(void) {
+    return tail_sector == head_sector && tail_offset >= head_offset;
+}
+
+/**
+ * @brief Read the header of the record at a position.
+ * @param sector Sector index.
+ * @param offset Offset of the record inside the sector.
+ * @param header Destination for the header.
+ * @return true if a complete record starts there, false at the end of the sector's data.
+ */
+static bool flash_read_record_header(uint32_t sector, uint32_t offset, backlog_record_header_t *header) {
+    if (offset + sizeof(*header) > BACKLOG_SECTOR_SIZE) {
+        return false;
+    }
+    if (sector == head_sector && offset >= head_offset) {
+        return false;
+    }
+    if (esp_partition_read(flash_partition, sector_address(sector, offset), header, sizeof(*header)) != ESP_OK) {
+        return false;
+    }
+    return header->length != RECORD_LENGTH_ERASED && header->length != 0 &&
+           offset + sizeof(*header) + header->length <= BACKLOG_SECTOR_SIZE;
+}
+
+/**
+ * @brief Count the records of a sector that were not sent yet.
+ * @param sector Sector index.
+ * @return Number of pending records.
+ */
+static uint32_t flash_count_pending(uint32_t sector) {
+    backlog_record_header_t header;
+    uint32_t count = 0;
+
+    for (uint32_t offset = SECTOR_DATA_START; flash_read_record_header(sector, offset, &header);
+         offset += sizeof(header) + header.length) {
+        if (header.state == RECORD_STATE_PENDING) {
+            count++;
+        }
+    }
+    return count;
+}
+
+static esp_err_t flash_erase_sector(uint32_t sector) {
+    // The counters are read by other tasks with get_backlog_counters()
+    xSemaphoreTake(backlog_lock, portMAX_DELAY);
+    backlog_counters.sector_erases++;
+    xSemaphoreGive(backlog_lock);
+    return esp_partition_erase_range(flash_partition, sector_address(sector, 0), BACKLOG_SECTOR_SIZE);
+}
+
+/**
+ * @brief Open the sector after the head for writing, dropping the tail sector if the log is full.
+ * @return esp_err_t ESP_OK on success, or the flash error.
+ */
+static esp_err_t flash_open_next_sector(void) {
+    uint32_t next = (head_sector + 1) % flash_sectors;
+
+    if (next == tail_sector) {
+        uint32_t dropped = flash_count_pending(tail_sector);
+        count_dropped(dropped);
+        ESP_LOGW(BACKLOG_TAG, "Flash backlog full, dropped %lu records", (unsigned long)dropped);
+        tail_sector = (tail_sector + 1) % flash_sectors;
+        tail_offset = SECTOR_DATA_START;
+        flash_generation++;
+    }
+
+    esp_err_t err = flash_erase_sector(next);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    backlog_sector_header_t header = {
+            .magic = BACKLOG_SECTOR_MAGIC,
+            .sequence = head_sequence + 1,
+            .sequence_check = ~(head_sequence + 1),
+            .reserved = 0xFFFFFFFF,
+    };
+    err = esp_partition_write(flash_partition, sector_address(next, 0), &header, sizeof(header));
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    head_sector = next;
+    head_offset = SECTOR_DATA_START;
+    head_sequence = header.sequence;
+    return ESP_OK;
+}
+
+/**
+ * @brief Append a record to the head of the flash log.
+ * @param record Record bytes.
+ * @param length Length of the record.
+ * @return esp_err_t ESP_OK on success, or the flash error.
+ */
+static esp_err_t flash_append(const uint8_t *record, uint16_t length) {
+    backlog_record_header_t header = {
+            .length = length,
+            .crc = esp_rom_crc16_le(0, record, length),
+            .state = RECORD_STATE_PENDING,
+            .reserved = {0xFF, 0xFF, 0xFF},
+    };
+
+    if (head_offset + sizeof(header) + length > BACKLOG_SECTOR_SIZE) {
+        esp_err_t err = flash_open_next_sector();
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    // Payload first, so a torn write never leaves a valid header in front of a partial record
+    esp_err_t err = esp_partition_write(flash_partition, sector_address(head_sector, head_offset + sizeof(header)),
+                                        record, length);
+    if (err == ESP_OK) {
+        err = esp_partition_write(flash_partition, sector_address(head_sector, head_offset), &header, sizeof(header));
+    }
+    if (err != ESP_OK) {
+        // Readers stop at the broken record, so nothing may follow it in this sector
+        head_offset = BACKLOG_SECTOR_SIZE;
+        return err;
+    }
+    head_offset += sizeof(header) + length;
+    return ESP_OK;
+}
+
+/**
+ * @brief Find the flash sectors that hold data and open a fresh head sector.
+ *
+ * A sector written before a reset may end in a torn record, so writing always continues in a new sector.
+ *
+ * @return esp_err_t ESP_OK on success, or the flash error.
+ */
+static esp_err_t flash_recover(void) {
+    bool found = false;
+    uint32_t lowest = 0;
+
+    for (uint32_t sector = 0; sector < flash_sectors; sector++) {
+        backlog_sector_header_t header;
+        if (esp_partition_read(flash_partition, sector_address(sector, 0), &header, sizeof(header)) != ESP_OK ||
+            header.magic != BACKLOG_SECTOR_MAGIC || header.sequence_check != ~header.sequence) {
+            continue;
+        }
+        if (!found || header.sequence > head_sequence) {
+            head_sector = sector;
+            head_sequence = header.sequence;
+        }
+        if (!found || header.sequence < lowest) {
+            tail_sector = sector;
+            lowest = header.sequence;
+        }
+        found = true;
+    }
+
+    tail_offset = SECTOR_DATA_START;
+    if (!found) {
+        // Fresh partition: open sector 0 as the first head
+        head_sector = flash_sectors - 1;
+        tail_sector = flash_sectors - 1;
+        head_sequence = 0;
+        esp_err_t err = flash_open_next_sector();
+        tail_sector = head_sector;
+        return err;
+    }
+
+    // Treat the old head as full; records past a torn write are never read
+    head_offset = BACKLOG_SECTOR_SIZE;
+    esp_err_t err = flash_open_next_sector();
+
+    uint32_t pending = 0;
+    for (uint32_t sector = tail_sector; sector != head_sector; sector = (sector + 1) % flash_sectors) {
+        pending += flash_count_pending(sector);
+    }
+    ESP_LOGI(BACKLOG_TAG, "Recovered %lu unsent records from flash", (unsigned long)pending);
+    return err;
+}
+
+/**
+ * @brief Move the oldest RAM records to flash until the RAM ring is at most half full.
+ *
+ * Runs in the backfill task. Each record is copied out under the lock and written without it.
+ */
+static void ram_spill_to_flash(void) {
+    static uint8_t record[BACKLOG_MAX_RECORD];
+
+    while (1) {
+        xSemaphoreTake(backlog_lock, portMAX_DELAY);
+        if (ram_used <= BACKLOG_RAM_SIZE / 2) {
+            xSemaphoreGive(backlog_lock);
+            return;
+        }
+        uint16_t length = ram_record_length(ram_tail);
+        ram_copy_out(ram_tail + sizeof(length), record, length);
+        uint32_t generation = ram_generation;
+        xSemaphoreGive(backlog_lock);
+
+        esp_err_t err = flash_append(record, length);
+
+        xSemaphoreTake(backlog_lock, portMAX_DELAY);
+        // A push that found the ring full meanwhile has dropped this record, then it only lives on in flash
+        if (generation == ram_generation) {
+            ram_remove_oldest();
+        }
+        ram_generation++;
+        if (err == ESP_OK) {
+            backlog_counters.records_spilled++;
+        } else {
+            backlog_counters.records_dropped++;
+        }
+        xSemaphoreGive(backlog_lock);
+
+        if (err != ESP_OK) {
+            ESP_LOGE(BACKLOG_TAG, "Flash write failed, dropping record");
+        }
+    }
+}
+
+/**
+ * @brief Fill a batch from the tail sector of the flash log.
+ * @param buffer Destination for the records.
+ * @param size Size of the destination.
+ * @return Length of the batch.
+ */
+static size_t flash_read_batch(uint8_t *buffer, size_t size) {
+    backlog_record_header_t header;
+    size_t length = 0;
+
+    while (true) {
+        // Leave fully sent sectors behind the head; flash_open_next_sector() erases them when it reuses them,
+        // and flash_recover() tells them from newer ones by their sequence
+        while (!flash_read_record_header(tail_sector, tail_offset, &header) && tail_sector != head_sector) {
+            tail_sector = (tail_sector + 1) % flash_sectors;
+            tail_offset = SECTOR_DATA_START;
+        }
+        if (!flash_read_record_header(tail_sector, tail_offset, &header) || header.state != RECORD_STATE_CONSUMED) {
+            break;
+        }
+        tail_offset += sizeof(header) + header.length;
+    }
+
+    batch_records = 0;
+    uint32_t offset = tail_offset;
+    while (batch_records < BACKLOG_BATCH_RECORDS && flash_read_record_header(tail_sector, offset, &header)) {
+        uint32_t next = offset + sizeof(header) + header.length;
+        if (header.state == RECORD_STATE_PENDING) {
+            if (length + header.length > size) {
+                break;
+            }
+            esp_partition_read(flash_partition, sector_address(tail_sector, offset + sizeof(header)),
+                               buffer + length, header.length);
+            if (esp_rom_crc16_le(0, buffer + length, header.length) == header.crc) {
+                length += header.length;
+            } else {
+                ESP_LOGW(BACKLOG_TAG, "Corrupt record in sector %lu, skipping it", (unsigned long)tail_sector);
+            }
+            // Corrupt records are consumed along with the batch
+            batch_offsets[batch_records++] = (uint16_t)offset;
+        }
+        offset = next;
+    }
+    batch_end_offset = offset;
+    return length;
+}
+
+/**
+ * @brief Fill a batch from the tail of the RAM ring.
+ * @param buffer Destination for the records.
+ * @param size Size of the destination.
+ * @return Length of the batch.
+ */
+static size_t ram_read_batch(uint8_t *buffer, size_t size) {
+    size_t length = 0;
+
+    batch_ram_bytes = 0;
+    batch_records = 0;
+    while (batch_ram_bytes < ram_used && batch_records < BACKLOG_BATCH_RECORDS) {
+        size_t position = (ram_tail + batch_ram_bytes) % BACKLOG_RAM_SIZE;
+        uint16_t record_length = ram_record_length(position);
+        if (length + record_length > size) {
+            break;
+        }
+        ram_copy_out(position + sizeof(record_length), buffer + length, record_length);
+        length += record_length;
+        batch_ram_bytes += sizeof(record_length) + record_length;
+        batch_records++;
+    }
+    return length;
+}
+
+// Public functions
+
+esp_err_t backlog_init(void) {
+    if (backlog_lock != NULL) {
+        return ESP_OK;
+    }
+    backlog_lock = xSemaphoreCreateMutex();
+    if (backlog_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    flash_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, BACKLOG_PARTITION_LABEL);
+    flash_sectors = flash_partition != NULL ? flash_partition->size / BACKLOG_SECTOR_SIZE : 0;
+    if (flash_sectors < 2) {
+        ESP_LOGW(BACKLOG_TAG, "No \"%s\" partition, keeping the backlog in RAM only", BACKLOG_PARTITION_LABEL);
+        flash_partition = NULL;
+        return ESP_OK;
+    }
+
+    if (flash_recover() != ESP_OK) {
+        ESP_LOGE(BACKLOG_TAG, "Flash backlog unusable, keeping the backlog in RAM only");
+        flash_partition = NULL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t backlog_push(const uint8_t *record, size_t length) {
+    if (backlog_lock == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (length == 0 || length > BACKLOG_MAX_RECORD) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    xSemaphoreTake(backlog_lock, portMAX_DELAY);
+    size_t entry = sizeof(uint16_t) + length;
+    if (ram_used + entry > BACKLOG_RAM_SIZE) {
+        // Without flash, or with the backfill task behind on spilling, the oldest records make room
+        while (ram_used + entry > BACKLOG_RAM_SIZE) {
+            ram_remove_oldest();
+            backlog_counters.records_dropped++;
+        }
+        ram_generation++;
+    }
+    ram_append(record, (uint16_t)length);
+    backlog_counters.records_stored++;
+    bool spill = flash_partition != NULL && ram_used > BACKLOG_SPILL_LEVEL;
+    xSemaphoreGive(backlog_lock);
+
+    if (spill && backfill_task_handle != NULL) {
+        xTaskNotify(backfill_task_handle, BACKFILL_NOTIFY_SPILL, eSetBits);
+    }
+    return ESP_OK;
+}
+
+esp_err_t backlog_push_frame(const sensor_field_t *fields, size_t field_count, const void *frame,
+                             uint32_t sequence, int64_t timestamp_us) {
+    uint8_t record[BACKLOG_MAX_RECORD];
+    size_t length = telemetry_encode_frame(record, sizeof(record), fields, field_count, frame, sequence, timestamp_us);
+    return backlog_push(record, length);
+}
+
+size_t backlog_read_batch(uint8_t *buffer, size_t size) {
+    if (backlog_lock == NULL) {
+        return 0;
+    }
+
+    size_t length = 0;
+    batch_source = BATCH_NONE;
+
+    // Flash holds the oldest records, the RAM ring the newer ones
+    if (flash_partition != NULL && !flash_is_empty()) {
+        length = flash_read_batch(buffer, size);
+        if (batch_records > 0) {
+            batch_source = BATCH_FLASH;
+            batch_generation = flash_generation;
+        }
+    }
+    if (batch_source == BATCH_NONE) {
+        xSemaphoreTake(backlog_lock, portMAX_DELAY);
+        length = ram_read_batch(buffer, size);
+        if (batch_records > 0) {
+            batch_source = BATCH_RAM;
+            batch_generation = ram_generation;
+        }
+        xSemaphoreGive(backlog_lock);
+    }
+    return length;
+}
+
+void backlog_ack_batch(void) {
+    if (backlog_lock == NULL) {
+        return;
+    }
+
+    // A batch whose records were dropped or moved meanwhile is not removed again
+    if (batch_source == BATCH_FLASH && batch_generation == flash_generation) {
+        static const uint8_t consumed = RECORD_STATE_CONSUMED;
+        for (uint32_t i = 0; i < batch_records; i++) {
+            esp_partition_write(flash_partition,
+                                sector_address(tail_sector, batch_offsets[i] + offsetof(backlog_record_header_t, state)),
+                                &consumed, sizeof(consumed));
+        }
+        tail_offset = batch_end_offset;
+        xSemaphoreTake(backlog_lock, portMAX_DELAY);
+        backlog_counters.records_sent += batch_records;
+        xSemaphoreGive(backlog_lock);
+    } else if (batch_source == BATCH_RAM) {
+        xSemaphoreTake(backlog_lock, portMAX_DELAY);
+        if (batch_generation == ram_generation) {
+            ram_tail = (ram_tail + batch_ram_bytes) % BACKLOG_RAM_SIZE;
+            ram_used -= batch_ram_bytes;
+            backlog_counters.records_sent += batch_records;
+        }
+        xSemaphoreGive(backlog_lock);
+    }
+    batch_source = BATCH_NONE;
+}
+
+/**
+ * @brief Forget the outstanding batch without removing its records, the next read starts from them again.
+ */
+static void release_batch(void) {
+    batch_source = BATCH_NONE;
+}
+
+bool backlog_is_empty(void) {
+    if (backlog_lock == NULL) {
+        return true;
+    }
+
+    xSemaphoreTake(backlog_lock, portMAX_DELAY);
+    bool empty = ram_used == 0 && (flash_partition == NULL || flash_is_empty());
+    xSemaphoreGive(backlog_lock);
+    return empty;
+}
+
+/**
+ * @brief Tell the backfill task the outcome of its outstanding batch.
+ * @param delivery Outcome of the batch.
+ * @param arg Unused.
+ */
+static void backfill_delivered(mqtt_delivery_t delivery, void *arg) {
+    xTaskNotify(backfill_task_handle,
+                delivery == MQTT_DELIVERY_CONFIRMED ? BACKFILL_NOTIFY_CONFIRMED : BACKFILL_NOTIFY_DROPPED, eSetBits);
+}
+
+/**
+ * @brief Task that spills the RAM ring to flash and sends the backlog in throttled batches.
+ *
+ * One batch is in flight at a time. It is removed from the backlog once the broker acknowledged it; a
+ * batch lost on its way stays and is read again for the next round.
+ *
+ * @param arg Pointer to the backfill_args_t.
+ */
+static void backlog_backfill_task(void *arg) {
+    const backfill_args_t *args = arg;
+    static uint8_t batch[BACKLOG_BATCH_SIZE];
+    bool in_flight = false;
+    TickType_t next_batch = xTaskGetTickCount();
+
+    // Records pushed before the task started may already fill the ring
+    ram_spill_to_flash();
+    while (1) {
+        // Sleep until the next batch is due; a spill request or the outcome of the batch wakes it earlier
+        TickType_t wait = 0;
+        if (in_flight) {
+            wait = portMAX_DELAY;
+        } else if ((int32_t)(next_batch - xTaskGetTickCount()) > 0) {
+            wait = next_batch - xTaskGetTickCount();
+        }
+        uint32_t notified = 0;
+        xTaskNotifyWait(0, UINT32_MAX, &notified, wait);
+
+        if (notified & BACKFILL_NOTIFY_SPILL) {
+            ram_spill_to_flash();
+        }
+        if (notified & BACKFILL_NOTIFY_CONFIRMED) {
+            backlog_ack_batch();
+            in_flight = false;
+        }
+        if (notified & BACKFILL_NOTIFY_DROPPED) {
+            release_batch();
+            in_flight = false;
+        }
+        if (in_flight || (int32_t)(xTaskGetTickCount() - next_batch) < 0) {
+            continue;
+        }
+
+        // Only take a batch out of the backlog when a full one would be admitted
+        if (!mqtt_can_publish(args->client, MQTT_CLASS_BACKFILL, sizeof(batch))) {
+            next_batch = xTaskGetTickCount() + pdMS_TO_TICKS(BACKLOG_IDLE_INTERVAL_MS);
+            continue;
+        }
+        size_t length = backlog_read_batch(batch, sizeof(batch));
+        if (length == 0) {
+            // Records that were read but encode to nothing are corrupt, they are consumed right away
+            if (batch_source != BATCH_NONE) {
+                backlog_ack_batch();
+            }
+            next_batch = xTaskGetTickCount() + pdMS_TO_TICKS(BACKLOG_IDLE_INTERVAL_MS);
+            continue;
+        }
+
+        // Backfill has the smallest outbox share, a full outbox leaves the batch for the next round
+        in_flight = mqtt_publish_tracked(args->client, args->topic, (const char *)batch, (int)length,
+                                         MQTT_CLASS_BACKFILL, 0, backfill_delivered, NULL) >= 0;
+        if (!in_flight) {
+            release_batch();
+        }
+        next_batch = xTaskGetTickCount() + pdMS_TO_TICKS(backfill_interval_ms);
+    }
+}
+
+esp_err_t start_backlog_backfill(esp_mqtt_client_handle_t client, const char *topic) {
+    if (backfill_task_handle != NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    backfill_args.client = client;
+    backfill_args.topic = topic;
+    if (xTaskCreate(backlog_backfill_task, "backlog_backfill", BACKLOG_TASK_STACK, &backfill_args,
+                    BACKLOG_TASK_PRIORITY, &backfill_task_handle) != pdPASS) {
+        backfill_task_handle = NULL;
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,135 @@
+#ifndef ESP_GYRO_ESP32_BACKLOG_CUSTOM_H
+#define ESP_GYRO_ESP32_BACKLOG_CUSTOM_H
+
+#include "stddef.h"
+#include "stdint.h"
+#include "stdbool.h"
+#include "esp_err.h"
+#include "../ESP32_Mqtt_custom/ESP32_Mqtt_custom.h"
+
+/**
+ * @file ESP32_Backlog_custom.h
+ * @brief Header file for the store-and-forward backlog of telemetry frames.
+ *
+ * Frames that cannot be published are kept in a RAM ring. Once the ring is BACKLOG_SPILL_LEVEL full,
+ * the backfill task spills its oldest half to a flash partition, so backlog_push() never waits for the
+ * flash. The partition is written as a log: sectors are filled front to back and reused round-robin,
+ * so every sector is erased equally often, and sent records are only marked as consumed in place
+ * instead of being erased. When the flash is full the oldest sector is dropped; without flash, or if
+ * the task falls behind, a full RAM ring drops its oldest record. The backfill task sends the backlog,
+ * oldest first, in batches at a throttled rate once the client is connected again, and removes a
+ * batch only once the broker has acknowledged it.
+ *
+ * Records are stored and sent as they are, so they must be self-delimiting when concatenated;
+ * packed telemetry frames are. Delivery is at-least-once: frames may be sent twice around a reboot
+ * or while the backlog overflows, the sequence number in every frame identifies duplicates.
+ */
+
+#define BACKLOG_RAM_SIZE                8192        ///< Size of the RAM ring in bytes
+#define BACKLOG_SPILL_LEVEL             (BACKLOG_RAM_SIZE * 3 / 4) ///< Bytes in the RAM ring at which the backfill task spills to flash
+#define BACKLOG_MAX_RECORD              256         ///< Largest record in bytes
+#define BACKLOG_BATCH_SIZE              1024        ///< Largest backfill message in bytes
+#define BACKLOG_BATCH_RECORDS           64          ///< Largest number of records in one backfill message
+#define BACKLOG_BACKFILL_INTERVAL_MS    250         ///< Default pause between two backfill messages
+#define BACKLOG_IDLE_INTERVAL_MS        1000        ///< Pause of the backfill task while there is nothing to send
+#define BACKLOG_PARTITION_LABEL         "backlog"   ///< Label of the flash partition, see partitions.csv
+#define BACKLOG_TASK_STACK              4096        ///< Stack size of the backfill task in bytes
+#define BACKLOG_TASK_PRIORITY           3           ///< FreeRTOS priority of the backfill task, below the sampling task
+#define BACKLOG_TAG                     "BACKLOG"
+
+/**
+ * @brief Counters of the backlog since startup.
+ */
+typedef struct {
+    uint32_t records_stored;    ///< Records pushed into the backlog
+    uint32_t records_spilled;   ///< Records moved from RAM to flash
+    uint32_t records_sent;      ///< Records acknowledged as sent
+    uint32_t records_dropped;   ///< Records lost because RAM and flash were full
+    uint32_t sector_erases;     ///< Flash sector erases
+} backlog_counters_t;
+
+/**
+ * @brief Set the pause between two backfill messages.
+ * @param interval_ms Pause in milliseconds; with BACKLOG_BATCH_SIZE it bounds the backfill rate.
+ */
+void set_backlog_backfill_interval_ms(uint32_t interval_ms);
+
+/**
+ * @brief Get the pause between two backfill messages.
+ * @return Pause in milliseconds.
+ */
+uint32_t get_backlog_backfill_interval_ms(void);
+
+/**
+ * @brief Get the backlog counters.
+ * @param counters Destination for the counters.
+ */
+void get_backlog_counters(backlog_counters_t *counters);
+
+/**
+ * @brief Initialize the backlog.
+ *
+ * Recovers unsent records from the flash partition. Without a partition labelled
+ * BACKLOG_PARTITION_LABEL the backlog only uses RAM.
+ *
+ * @return esp_err_t ESP_OK on success, ESP_ERR_NO_MEM if the lock could not be created.
+ */
+esp_err_t backlog_init(void);
+
+/**
+ * @brief Append a record to the backlog.
+ *
+ * Only touches the RAM ring, and asks the backfill task to spill it to flash once it fills up.
+ *
+ * @param record Record bytes.
+ * @param length Length of the record, 1 to BACKLOG_MAX_RECORD bytes.
+ * @return esp_err_t ESP_OK on success, ESP_ERR_INVALID_SIZE for an empty or too large record,
+ *         ESP_ERR_INVALID_STATE before backlog_init().
+ */
+esp_err_t backlog_push(const uint8_t *record, size_t length);
+
+/**
+ * @brief Append a sample frame to the backlog as a packed telemetry frame.
+ * @param fields Array of field descriptors for the frame.
+ * @param field_count Number of field descriptors.
+ * @param frame Frame the descriptors refer to.
+ * @param sequence Frame sequence number.
+ * @param timestamp_us Sample time of the frame in microseconds.
+ * @return esp_err_t ESP_OK on success, otherwise see backlog_push().
+ */
+esp_err_t backlog_push_frame(const sensor_field_t *fields, size_t field_count, const void *frame,
+                             uint32_t sequence, int64_t timestamp_us);
+
+/**
+ * @brief Copy the oldest records into a batch without removing them.
+ *
+ * The records stay in the backlog until backlog_ack_batch() is called. Only one batch can be
+ * outstanding at a time. The flash log belongs to the backfill task, so once it runs only that
+ * task reads and acknowledges batches.
+ *
+ * @param buffer Destination for the concatenated records.
+ * @param size Size of the destination in bytes.
+ * @return Length of the batch, 0 if the backlog is empty.
+ */
+size_t backlog_read_batch(uint8_t *buffer, size_t size);
+
+/**
+ * @brief Remove the records of the last batch once the broker has acknowledged it.
+ */
+void backlog_ack_batch(void);
+
+/**
+ * @brief Check whether the backlog holds records.
+ * @return true if there is nothing to backfill.
+ */
+bool backlog_is_empty(void);
+
+/**
+ * @brief Start the task that sends the backlog while the client is connected and spills it to flash.
+ * @param client MQTT client handle.
+ * @param topic MQTT topic for the backfill messages, published as MQTT_CLASS_BACKFILL.
+ * @return esp_err_t ESP_OK on success, ESP_ERR_INVALID_STATE if already running, or ESP_FAIL.
+ */
+esp_err_t start_backlog_backfill(esp_mqtt_client_handle_t client, const char *topic);
+
+#endif //ESP_GYRO_ESP32_BACKLOG_CUSTOM_H
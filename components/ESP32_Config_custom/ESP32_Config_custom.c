@@ -0,0 +1,251 @@
+#include "ESP32_Config_custom.h"
+#include "../ESP32_Mqtt_custom/json_writer.h"
+
+#include "math.h"
+#include "string.h"
+#include "cJSON.h"
+#include "esp_log.h"
+#include "nvs.h"
+
+#define CONFIG_MAX_ERRORS 8     ///< Number of rejected keys reported in a response
+
+/**
+ * @brief Topics of the command handler.
+ */
+typedef struct {
+    const char *response_topic;     ///< Topic the responses are published on
+} config_command_args_t;
+
+/**
+ * @brief Key of a command that failed validation.
+ */
+typedef struct {
+    const char *key;        ///< Key as given in the command
+    const char *reason;     ///< Why it was rejected
+} config_error_t;
+
+static const config_param_t *config_params = NULL;
+static size_t config_param_count = 0;
+static config_command_args_t config_command_args;
+
+/**
+ * @brief Find a parameter by its key.
+ * @param key JSON key.
+ * @return The parameter, or NULL if there is none with this key.
+ */
+static const config_param_t *find_param(const char *key) {
+    for (size_t i = 0; i < config_param_count; i++) {
+        if (strcmp(config_params[i].key, key) == 0) {
+            return &config_params[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Validate the value of a parameter in a command.
+ * @param param Parameter the value is for.
+ * @param item JSON value from the command.
+ * @param value Filled with the value if it is valid.
+ * @return NULL if the value is valid, otherwise why it is not.
+ */
+static const char *parse_value(const config_param_t *param, const cJSON *item, int32_t *value) {
+    if (cJSON_IsString(item)) {
+        if (param->names == NULL) {
+            return "expected a number";
+        }
+        for (int32_t i = 0; i <= param->max - param->min; i++) {
+            if (strcmp(param->names[i], item->valuestring) == 0) {
+                *value = param->min + i;
+                return NULL;
+            }
+        }
+        return "unknown name";
+    }
+
+    if (!cJSON_IsNumber(item)) {
+        return "invalid type";
+    }
+    if (item->valuedouble != floor(item->valuedouble)) {
+        return "not an integer";
+    }
+    if (item->valuedouble < param->min || item->valuedouble > param->max) {
+        return "out of range";
+    }
+    *value = (int32_t)item->valuedouble;
+    return NULL;
+}
+
+/**
+ * @brief Write the current value of every parameter into an object.
+ * @param writer JSON writer with an open object.
+ */
+static void write_config(json_writer_t *writer) {
+    json_writer_begin_object(writer, "config");
+    for (size_t i = 0; i < config_param_count; i++) {
+        const config_param_t *param = &config_params[i];
+        int32_t value = param->get();
+        if (param->names != NULL && value >= param->min && value <= param->max) {
+            json_writer_string(writer, param->key, param->names[value - param->min]);
+        } else {
+            json_writer_int(writer, param->key, value);
+        }
+    }
+    json_writer_end_object(writer);
+}
+
+/**
+ * @brief Store the values of a command in NVS.
+ * @param root Validated command.
+ * @return ESP_OK, or the first NVS error.
+ */
+static esp_err_t store_command(const cJSON *root) {
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(CONFIG_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    const cJSON *item;
+    cJSON_ArrayForEach(item, root) {
+        const config_param_t *param = find_param(item->string);
+        if (param != NULL && err == ESP_OK) {
+            err = nvs_set_i32(handle, param->key, param->get());
+        }
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    return err;
+}
+
+esp_err_t config_init(const config_param_t *params, size_t count) {
+    config_params = params;
+    config_param_count = count;
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(CONFIG_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        ESP_LOGW(CONFIG_TAG, "No stored configuration: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        int32_t value;
+        if (nvs_get_i32(handle, params[i].key, &value) != ESP_OK) {
+            continue;
+        }
+        // The range may have changed with the firmware since the value was stored
+        if (value < params[i].min || value > params[i].max) {
+            ESP_LOGW(CONFIG_TAG, "Stored %s=%ld is out of range, erased", params[i].key, (long)value);
+            nvs_erase_key(handle, params[i].key);
+            continue;
+        }
+        params[i].set(value);
+        ESP_LOGI(CONFIG_TAG, "Restored %s=%ld", params[i].key, (long)value);
+    }
+    nvs_commit(handle);
+    nvs_close(handle);
+    return ESP_OK;
+}
+
+size_t config_handle_command(const char *data, size_t length, char *response, size_t size) {
+    config_error_t errors[CONFIG_MAX_ERRORS];
+    int error_count = 0;
+    json_writer_t writer;
+
+    json_writer_init(&writer, response, size, false);
+    json_writer_begin_object(&writer, NULL);
+
+    cJSON *root = length <= CONFIG_COMMAND_MAX_SIZE ? cJSON_ParseWithLength(data, length) : NULL;
+    if (root == NULL || !cJSON_IsObject(root)) {
+        json_writer_string(&writer, "status", "rejected");
+        json_writer_string(&writer, "error", length <= CONFIG_COMMAND_MAX_SIZE ? "expected a JSON object" : "too large");
+        json_writer_end_object(&writer);
+        cJSON_Delete(root);
+        return json_writer_finish(&writer) != NULL ? writer.length : 0;
+    }
+
+    // Echo the ID so the sender can match the response to its command
+    const cJSON *id = cJSON_GetObjectItemCaseSensitive(root, "id");
+    if (cJSON_IsString(id)) {
+        json_writer_string(&writer, "id", id->valuestring);
+    } else if (cJSON_IsNumber(id)) {
+        json_writer_int(&writer, "id", (int64_t)id->valuedouble);
+    }
+
+    // Validate everything before applying anything, a command takes effect completely or not at all
+    const cJSON *item;
+    int invalid = 0;
+    cJSON_ArrayForEach(item, root) {
+        if (strcmp(item->string, "id") == 0) {
+            continue;
+        }
+        int32_t value;
+        const config_param_t *param = find_param(item->string);
+        const char *reason = param == NULL ? "unknown key" : parse_value(param, item, &value);
+        if (reason != NULL) {
+            if (error_count < CONFIG_MAX_ERRORS) {
+                errors[error_count++] = (config_error_t) {item->string, reason};
+            }
+            invalid++;
+        }
+    }
+
+    if (invalid > 0) {
+        json_writer_string(&writer, "status", "rejected");
+        json_writer_begin_object(&writer, "errors");
+        for (int i = 0; i < error_count; i++) {
+            json_writer_string(&writer, errors[i].key, errors[i].reason);
+        }
+        json_writer_end_object(&writer);
+        ESP_LOGW(CONFIG_TAG, "Rejected command with %d invalid keys", invalid);
+    } else {
+        cJSON_ArrayForEach(item, root) {
+            int32_t value;
+            const config_param_t *param = find_param(item->string);
+            if (param != NULL && parse_value(param, item, &value) == NULL) {
+                param->set(value);
+                ESP_LOGI(CONFIG_TAG, "Set %s=%ld", param->key, (long)value);
+            }
+        }
+
+        esp_err_t err = store_command(root);
+        if (err != ESP_OK) {
+            ESP_LOGW(CONFIG_TAG, "Applied but not stored: %s", esp_err_to_name(err));
+        }
+        json_writer_string(&writer, "status", err == ESP_OK ? "ok" : "not_persisted");
+    }
+
+    write_config(&writer);
+    json_writer_end_object(&writer);
+    cJSON_Delete(root);
+    return json_writer_finish(&writer) != NULL ? writer.length : 0;
+}
+
+/**
+ * @brief Handle a command received on the command topic.
+ * @param client MQTT client handle.
+ * @param topic Command topic.
+ * @param data Command, not NUL-terminated.
+ * @param length Length of the command in bytes.
+ * @param arg Pointer to the config_command_args_t.
+ */
+static void handle_command(esp_mqtt_client_handle_t client, const char *topic, const char *data, int length, void *arg) {
+    const config_command_args_t *args = arg;
+    // Only the MQTT client task calls this, so one buffer is enough and spares its stack
+    static char response[CONFIG_RESPONSE_BUFFER_SIZE];
+
+    size_t response_length = config_handle_command(data, (size_t)length, response, sizeof(response));
+    if (response_length == 0) {
+        ESP_LOGE(CONFIG_TAG, "Response does not fit into %u bytes", (unsigned)sizeof(response));
+        return;
+    }
+    mqtt_publish_message(client, args->response_topic, response, (int)response_length, MQTT_CLASS_EVENT, 0);
+}
+
+esp_err_t start_config_commands(esp_mqtt_client_handle_t client, const char *command_topic, const char *response_topic) {
+    config_command_args.response_topic = response_topic;
+    return mqtt_subscribe_handler(client, command_topic, 1, handle_command, &config_command_args);
+}
@@ -0,0 +1,70 @@
+#ifndef ESP_GYRO_ESP32_CONFIG_CUSTOM_H
+#define ESP_GYRO_ESP32_CONFIG_CUSTOM_H
+
+#include "stddef.h"
+#include "stdint.h"
+#include "esp_err.h"
+#include "../ESP32_Mqtt_custom/ESP32_Mqtt_custom.h"
+
+/**
+ * @file ESP32_Config_custom.h
+ * @brief Header file for runtime configuration over an MQTT command topic.
+ *
+ * The application describes its tunable parameters in a table of config_param_t, each with an
+ * accepted range and the setter that applies it live. A command is a flat JSON object mapping
+ * parameter keys to new values, for example {"id":"42","publish_ms":5000,"telemetry_fmt":"json"}.
+ * A command is validated as a whole and either applied completely or rejected; applied values are
+ * stored in NVS and restored by config_init() on the next boot. Every command is answered on the
+ * response topic with the outcome and the resulting configuration.
+ */
+
+#define CONFIG_NVS_NAMESPACE        "config"    ///< NVS namespace of the stored parameters
+#define CONFIG_RESPONSE_BUFFER_SIZE 768         ///< Buffer for a command response in bytes
+#define CONFIG_COMMAND_MAX_SIZE     512         ///< Largest accepted command in bytes
+#define CONFIG_TAG                  "CONFIG"
+
+/**
+ * @struct config_param_t
+ * @brief Runtime-tunable parameter.
+ */
+typedef struct {
+    const char *key;                ///< JSON key in commands and NVS key, at most 15 characters
+    int32_t min;                    ///< Smallest accepted value
+    int32_t max;                    ///< Largest accepted value
+    const char *const *names;       ///< Names of the values min to max, accepted instead of numbers, or NULL
+    int32_t (*get)(void);           ///< Read the current value
+    void (*set)(int32_t value);     ///< Apply a value that passed validation
+} config_param_t;
+
+/**
+ * @brief Register the parameter table and apply the values stored in NVS.
+ *
+ * Call it after nvs_flash_init() and after the defaults were set, so stored values override them.
+ * Stored values outside the current range are erased.
+ *
+ * @param params Parameter table, must stay valid.
+ * @param count Number of parameters.
+ * @return ESP_OK, or the error of opening the NVS namespace.
+ */
+esp_err_t config_init(const config_param_t *params, size_t count);
+
+/**
+ * @brief Validate and apply a command and write its response.
+ * @param data Command document, not necessarily NUL-terminated.
+ * @param length Length of the command in bytes.
+ * @param response Buffer for the response document.
+ * @param size Size of the response buffer in bytes.
+ * @return Length of the response, 0 if it did not fit.
+ */
+size_t config_handle_command(const char *data, size_t length, char *response, size_t size);
+
+/**
+ * @brief Accept commands on a topic and answer them on another.
+ * @param client MQTT client handle.
+ * @param command_topic Topic the commands arrive on.
+ * @param response_topic Topic the responses are published on, as MQTT_CLASS_EVENT.
+ * @return ESP_OK, or the error of subscribing to the command topic.
+ */
+esp_err_t start_config_commands(esp_mqtt_client_handle_t client, const char *command_topic, const char *response_topic);
+
+#endif //ESP_GYRO_ESP32_CONFIG_CUSTOM_H
@@ -3,16 +3,240 @@
 //
 
 #include "ESP32_Mqtt_custom.h"
+#include "json_writer.h"
+#include "telemetry_codec.h"
+#include "mqtt_tls_transport.h"
+#include "mqtt_lanes.h"
 
+#include "stdlib.h"
+#include "math.h"
 #include "esp_log.h"
-#include "cJSON.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "sys/time.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
 
 
 // Variables for MQTT Configuration
 const char* mqtt_broker = MQTT_BROKER;               ///< MQTT broker URI
 const char* mqtt_username = MQTT_USERNAME;           ///< MQTT username
 const char* mqtt_password = MQTT_PASSWORD;           ///< MQTT password
+const char* mqtt_ca_certificate = NULL;              ///< CA of TLS connections, NULL for plain TCP
 const char* mqtt_log_tag = MQTT_TAG;                 ///< Tag for ESP logging
+mqtt_state_mode_t mqtt_state_mode = MQTT_STATE_MODE; ///< How sensor frames are published
+const char* mqtt_device_state_topic = NULL;          ///< Device state topic for MQTT_STATE_MODE_BATCHED
+mqtt_discovery_mode_t mqtt_discovery_mode = MQTT_DISCOVERY_MODE; ///< How discovery messages are published
+
+size_t mqtt_outbox_budget = MQTT_OUTBOX_BUDGET;      ///< Upper bound of the outbox in bytes
+bool mqtt_publish_lanes = MQTT_PUBLISH_LANES;        ///< Publish through the lanes of mqtt_lanes.h
+bool mqtt_report_on_change = MQTT_REPORT_ON_CHANGE;  ///< Apply the report rules of sensor_field_t
+esp_mqtt_protocol_ver_t mqtt_protocol_version = MQTT_PROTOCOL_VERSION; ///< Protocol of the connection
+uint32_t mqtt5_properties = MQTT5_PROPERTIES;        ///< MQTT5_PROPERTY_* bits sent with frames
+
+/**
+ * @brief Options of one topic, see set_mqtt_payload_format() and set_mqtt_topic_class().
+ */
+typedef struct {
+    const char *topic;                      ///< MQTT topic, NULL if the entry is unused
+    mqtt_payload_format_t format;           ///< Payload format of the topic
+    mqtt_message_class_t message_class;     ///< Message class of the topic
+} mqtt_topic_options_t;
+
+static mqtt_topic_options_t mqtt_topic_options[MQTT_TOPIC_OPTIONS];
+
+/**
+ * @brief Topic subscribed with mqtt_subscribe_handler().
+ */
+typedef struct {
+    const char *volatile topic;         ///< MQTT topic, NULL if the entry is unused
+    int qos;                            ///< QoS of the subscription
+    mqtt_message_handler_t handler;     ///< Handler of the topic's messages
+    void *arg;                          ///< Argument passed to the handler
+} mqtt_subscription_t;
+
+static mqtt_subscription_t mqtt_subscriptions[MQTT_SUBSCRIPTIONS];
+
+// Lower classes get a smaller share of the outbox budget, so they are dropped first when the broker is slow
+// Only events and discovery wait in the outbox while disconnected, stale state is not worth replaying
+// Events have a lane of their own and are published ahead of all bulk data
+static mqtt_publish_policy_t mqtt_publish_policies[MQTT_CLASS_COUNT] = {
+        [MQTT_CLASS_TELEMETRY] = {.qos = 0, .retain = false, .expiry_ms = 1000, .outbox_share = 50,  .queue_offline = false, .lane = MQTT_LANE_BULK},
+        [MQTT_CLASS_BACKFILL]  = {.qos = 1, .retain = false, .expiry_ms = 0,    .outbox_share = 50,  .queue_offline = false, .lane = MQTT_LANE_BULK},
+        [MQTT_CLASS_CAPTURE]   = {.qos = 1, .retain = false, .expiry_ms = 0,    .outbox_share = 60,  .queue_offline = false, .lane = MQTT_LANE_BULK},
+        [MQTT_CLASS_STATE]     = {.qos = 1, .retain = false, .expiry_ms = 0,    .outbox_share = 75,  .queue_offline = false, .lane = MQTT_LANE_BULK},
+        [MQTT_CLASS_STATS]     = {.qos = 1, .retain = false, .expiry_ms = 0,    .outbox_share = 75,  .queue_offline = false, .lane = MQTT_LANE_BULK},
+        [MQTT_CLASS_EVENT]     = {.qos = 1, .retain = false, .expiry_ms = 0,    .outbox_share = 100, .queue_offline = true,  .lane = MQTT_LANE_URGENT},
+        [MQTT_CLASS_DISCOVERY] = {.qos = 1, .retain = true,  .expiry_ms = 0,    .outbox_share = 100, .queue_offline = true,  .lane = MQTT_LANE_BULK},
+};
+
+// Counted by the publishing tasks, the lanes task and the delivery outcome handlers
+static portMUX_TYPE mqtt_counters_lock = portMUX_INITIALIZER_UNLOCKED;
+static mqtt_publish_counters_t mqtt_publish_counters;
+static EventGroupHandle_t mqtt_event_group = NULL;
+static esp_transport_handle_t mqtt_tls_transport = NULL;  ///< TLS transport, NULL for plain TCP
+static portMUX_TYPE mqtt_pipeline_lock = portMUX_INITIALIZER_UNLOCKED;
+static int mqtt_in_flight = 0;
+static uint32_t mqtt_errors = 0;
+
+/**
+ * @brief Last value of a channel send_sensor_frame() delivered, and the one on its way.
+ */
+typedef struct {
+    bool reported;              ///< A value was delivered since the last resync
+    sensor_value_t value;       ///< Delivered value
+    int64_t reported_us;        ///< esp_timer time the value was published
+    uint32_t pending;           ///< Publish of the value on its way, 0 if none
+    sensor_value_t pending_value; ///< Value on its way
+    int64_t pending_us;         ///< esp_timer time the value on its way was published
+} mqtt_report_state_t;
+
+// Shared between the publishing task and the tasks reporting delivery outcomes
+static portMUX_TYPE mqtt_report_lock = portMUX_INITIALIZER_UNLOCKED;
+static mqtt_report_state_t mqtt_report_states[MQTT_REPORT_CHANNELS];
+static uint32_t mqtt_report_publish = 0;                    ///< Number of the last report publish
+static const sensor_field_t *mqtt_report_fields = NULL;    ///< Fields the report states belong to
+static volatile bool mqtt_report_resync = true;            ///< Publish every channel with the next frame
+static uint32_t mqtt_report_sent = 0;
+static uint32_t mqtt_report_suppressed = 0;
+
+#define MQTT_TOPIC_SEQUENCES (MQTT_REPORT_CHANNELS + 2)    ///< Frame topics that count their messages
+
+/**
+ * @brief Messages published on one frame topic, sent as "seq" so a gap on the topic is a lost message.
+ */
+typedef struct {
+    const char *topic;      ///< MQTT topic, NULL if the entry is unused
+    uint32_t published;     ///< Messages on the topic the client accepted
+} mqtt_topic_sequence_t;
+
+// Only the publishing task sends frames
+static mqtt_topic_sequence_t mqtt_topic_sequences[MQTT_TOPIC_SEQUENCES];
+
+static int publish_now(esp_mqtt_client_handle_t client, const char *topic, const char *data, int length,
+                       mqtt_message_class_t message_class, int64_t timestamp_us, const char *content_type,
+                       uint32_t sequence, int tracker);
+static int publish_queued(esp_mqtt_client_handle_t client, const char *topic, const char *data, int length,
+                          mqtt_message_class_t message_class, int64_t timestamp_us, const char *content_type,
+                          uint32_t sequence, int tracker);
+
+/**
+ * @brief Message of mqtt_publish_tracked() whose outcome is pending.
+ */
+typedef struct {
+    mqtt_delivery_handler_t handler;    ///< Handler of the outcome, NULL if the slot is free
+    void *arg;                          ///< Argument passed to the handler
+    int msg_id;                         ///< Message ID once a QoS 1 or 2 message is in the outbox, -1 before
+} mqtt_delivery_slot_t;
+
+/**
+ * @brief Acknowledgement or deletion that matched no tracked message when it arrived.
+ */
+typedef struct {
+    int msg_id;                 ///< Message ID of the outcome
+    mqtt_delivery_t delivery;   ///< Outcome
+    int64_t at_us;              ///< esp_timer time it arrived, 0 if the entry is unused
+} mqtt_early_outcome_t;
+
+/**
+ * @brief Drop handler of a message class, see set_mqtt_drop_handler().
+ */
+typedef struct {
+    mqtt_drop_handler_t handler;    ///< Handler, NULL for none
+    void *arg;                      ///< Argument passed to the handler
+} mqtt_drop_hook_t;
+
+// The client task may see the acknowledgement before the publish that caused it returned, it is kept a while
+static mqtt_delivery_slot_t mqtt_deliveries[MQTT_DELIVERY_SLOTS];
+static mqtt_early_outcome_t mqtt_early_outcomes[MQTT_EARLY_OUTCOMES];
+static int mqtt_early_next = 0;
+static portMUX_TYPE mqtt_delivery_lock = portMUX_INITIALIZER_UNLOCKED;
+static mqtt_drop_hook_t mqtt_drop_hooks[MQTT_CLASS_COUNT];
+
+/**
+ * @brief Outcome of the admission checks of a message.
+ */
+typedef enum {
+    MQTT_ADMIT,             ///< Message may be published
+    MQTT_DROP_EXPIRED,      ///< Sample is older than the class's expiry
+    MQTT_DROP_OFFLINE,      ///< Client is disconnected and the class does not queue offline
+    MQTT_DROP_BUDGET        ///< Outbox would grow past the class's share of the budget
+} mqtt_admission_t;
+
+/**
+ * @brief Discovery message kept in the discovery cache.
+ */
+typedef struct {
+    const char *topic;      ///< Config topic, owned by the sensor configuration
+    const char *payload;    ///< JSON document inside the cache
+    int length;             ///< Length of the document in bytes
+} mqtt_discovery_entry_t;
+
+// Discovery messages are built once per boot and republished from here when Home Assistant restarts
+static char mqtt_discovery_cache[MQTT_DISCOVERY_CACHE_SIZE];
+static mqtt_discovery_entry_t mqtt_discovery_entries[MQTT_DISCOVERY_MAX];
+static volatile int mqtt_discovery_count = 0;
+
+/**
+ * @brief Discovery messages of send_all_sensor_discoveries() whose acknowledgement is pending.
+ */
+typedef struct {
+    uint32_t round;         ///< Number of the round, outcomes of older rounds are ignored
+    uint32_t hash;          ///< Hash stored once every message of the round was acknowledged
+    int pending;            ///< Messages of the round without an outcome yet
+    bool failed;            ///< A message of the round was not published or was dropped
+} mqtt_discovery_round_t;
+
+static portMUX_TYPE mqtt_discovery_lock = portMUX_INITIALIZER_UNLOCKED;
+static mqtt_discovery_round_t mqtt_discovery_round;
+
+#ifdef CONFIG_MQTT_PROTOCOL_5
+#define MQTT5_REASON_UNSUPPORTED_PROTOCOL 0x84  ///< CONNACK reason code of a broker that does not speak MQTT 5
+
+/**
+ * @brief Topic alias of one topic, the alias is the index in mqtt_topic_aliases plus one.
+ */
+typedef struct {
+    char topic[MQTT_TOPIC_MAX_LENGTH];  ///< MQTT topic, empty if the alias is unused
+    uint32_t connection;                ///< Connection the broker learned the alias on, 0 if it has not yet
+} mqtt_topic_alias_t;
+
+// Aliases only live as long as a connection, mqtt_connection tells the connections apart
+static mqtt_topic_alias_t mqtt_topic_aliases[MQTT_TOPIC_ALIASES];
+static volatile uint32_t mqtt_connection = 0;
+static volatile uint32_t mqtt_aliases_refused = 0;     ///< Connection on which the broker allowed fewer aliases
+static SemaphoreHandle_t mqtt5_publish_lock = NULL;
+static TaskHandle_t mqtt_client_task = NULL;
+static volatile bool mqtt5_properties_taken = false;
+#endif
+
+/**
+ * @brief Find the options of a topic.
+ * @param topic MQTT topic.
+ * @param create Take a free entry if the topic has none yet.
+ * @return Options of the topic, or NULL if it has none and none could be created.
+ */
+static mqtt_topic_options_t *find_topic_options(const char *topic, bool create) {
+    mqtt_topic_options_t *free_entry = NULL;
+
+    for (int i = 0; i < MQTT_TOPIC_OPTIONS; i++) {
+        mqtt_topic_options_t *entry = &mqtt_topic_options[i];
+        if (entry->topic != NULL && strcmp(entry->topic, topic) == 0) {
+            return entry;
+        }
+        if (entry->topic == NULL && free_entry == NULL) {
+            free_entry = entry;
+        }
+    }
+
+    if (!create || free_entry == NULL) {
+        return NULL;
+    }
+    free_entry->topic = topic;
+    free_entry->format = MQTT_PAYLOAD_FORMAT_JSON;
+    free_entry->message_class = MQTT_CLASS_STATE;
+    return free_entry;
+}
 
 // Setter functions
 
@@ -28,12 +252,89 @@ void set_mqtt_password(const char* password) {
     mqtt_password = password;
 }
 
+void set_mqtt_ca_certificate(const char* certificate) {
+    mqtt_ca_certificate = certificate;
+}
+
 void set_mqtt_log_tag(const char* log_tag) {
     mqtt_log_tag = log_tag;
 }
 
+void set_mqtt_state_mode(mqtt_state_mode_t mode) {
+    mqtt_state_mode = mode;
+}
+
+void set_mqtt_discovery_mode(mqtt_discovery_mode_t mode) {
+    mqtt_discovery_mode = mode;
+}
+
+void set_mqtt_device_state_topic(const char* topic) {
+    mqtt_device_state_topic = topic;
+}
+
+esp_err_t set_mqtt_payload_format(const char* topic, mqtt_payload_format_t format) {
+    mqtt_topic_options_t *options = find_topic_options(topic, true);
+    if (options == NULL) {
+        ESP_LOGE(mqtt_log_tag, "No room for the options of %s", topic);
+        return ESP_ERR_NO_MEM;
+    }
+    options->format = format;
+    return ESP_OK;
+}
+
+esp_err_t set_mqtt_topic_class(const char* topic, mqtt_message_class_t message_class) {
+    mqtt_topic_options_t *options = find_topic_options(topic, true);
+    if (options == NULL) {
+        ESP_LOGE(mqtt_log_tag, "No room for the options of %s", topic);
+        return ESP_ERR_NO_MEM;
+    }
+    options->message_class = message_class;
+    return ESP_OK;
+}
+
+void set_mqtt_publish_policy(mqtt_message_class_t message_class, const mqtt_publish_policy_t *policy) {
+    if (message_class < MQTT_CLASS_COUNT) {
+        mqtt_publish_policies[message_class] = *policy;
+    }
+}
+
+void set_mqtt_protocol_version(esp_mqtt_protocol_ver_t version) {
+    mqtt_protocol_version = version;
+}
+
+void set_mqtt5_properties(uint32_t properties) {
+    mqtt5_properties = properties;
+}
+
+void set_mqtt_outbox_budget(size_t budget) {
+    mqtt_outbox_budget = budget;
+}
+
+void set_mqtt_drop_handler(mqtt_message_class_t message_class, mqtt_drop_handler_t handler, void *arg) {
+    if (message_class < MQTT_CLASS_COUNT) {
+        mqtt_drop_hooks[message_class].arg = arg;
+        mqtt_drop_hooks[message_class].handler = handler;
+    }
+}
+
+void set_mqtt_publish_lanes(bool enabled) {
+    mqtt_publish_lanes = enabled;
+}
+
+void set_mqtt_report_on_change(bool enabled) {
+    mqtt_report_on_change = enabled;
+}
+
 // Getter functions
 
+esp_mqtt_protocol_ver_t get_mqtt_protocol_version(void) {
+    return mqtt_protocol_version;
+}
+
+uint32_t get_mqtt5_properties(void) {
+    return mqtt5_properties;
+}
+
 const char* get_mqtt_broker() {
     return mqtt_broker;
 }
@@ -46,92 +347,1702 @@ const char* get_mqtt_password() {
     return mqtt_password;
 }
 
+const char* get_mqtt_ca_certificate() {
+    return mqtt_ca_certificate;
+}
+
 const char* get_mqtt_log_tag() {
     return mqtt_log_tag;
 }
 
+mqtt_state_mode_t get_mqtt_state_mode() {
+    return mqtt_state_mode;
+}
+
+mqtt_discovery_mode_t get_mqtt_discovery_mode() {
+    return mqtt_discovery_mode;
+}
+
+const char* get_mqtt_device_state_topic() {
+    return mqtt_device_state_topic;
+}
+
+mqtt_payload_format_t get_mqtt_payload_format(const char* topic) {
+    const mqtt_topic_options_t *options = find_topic_options(topic, false);
+    return options != NULL ? options->format : MQTT_PAYLOAD_FORMAT_JSON;
+}
+
+mqtt_message_class_t get_mqtt_topic_class(const char* topic) {
+    const mqtt_topic_options_t *options = find_topic_options(topic, false);
+    return options != NULL ? options->message_class : MQTT_CLASS_STATE;
+}
+
+mqtt_publish_policy_t get_mqtt_publish_policy(mqtt_message_class_t message_class) {
+    return mqtt_publish_policies[message_class < MQTT_CLASS_COUNT ? message_class : MQTT_CLASS_STATE];
+}
+
+size_t get_mqtt_outbox_budget() {
+    return mqtt_outbox_budget;
+}
+
+bool get_mqtt_report_on_change(void) {
+    return mqtt_report_on_change;
+}
+
+void get_mqtt_report_counters(uint32_t *sent, uint32_t *suppressed) {
+    portENTER_CRITICAL(&mqtt_report_lock);
+    *sent = mqtt_report_sent;
+    *suppressed = mqtt_report_suppressed;
+    portEXIT_CRITICAL(&mqtt_report_lock);
+}
+
+void get_mqtt_publish_counters(mqtt_publish_counters_t *counters) {
+    portENTER_CRITICAL(&mqtt_counters_lock);
+    *counters = mqtt_publish_counters;
+    portEXIT_CRITICAL(&mqtt_counters_lock);
+}
+
+const char* get_mqtt_sensor_state_topic(const sensor_config_t *config) {
+    if (mqtt_state_mode == MQTT_STATE_MODE_BATCHED && mqtt_device_state_topic != NULL) {
+        return mqtt_device_state_topic;
+    }
+    return config->state_topic;
+}
+
+bool mqtt_is_connected(void) {
+    return mqtt_event_group != NULL && (xEventGroupGetBits(mqtt_event_group) & MQTT_CONNECTED_BIT) != 0;
+}
+
+bool mqtt_wait_connected(uint32_t timeout_ms) {
+    if (mqtt_event_group == NULL) {
+        return false;
+    }
+    EventBits_t bits = xEventGroupWaitBits(mqtt_event_group, MQTT_CONNECTED_BIT, pdFALSE, pdTRUE,
+                                           pdMS_TO_TICKS(timeout_ms));
+    return (bits & MQTT_CONNECTED_BIT) != 0;
+}
+
+EventGroupHandle_t get_mqtt_event_group(void) {
+    return mqtt_event_group;
+}
+
+/**
+ * @brief Add to the number of unacknowledged QoS 1 and 2 messages.
+ * @param delta Messages handed to the client (positive) or acknowledged or deleted (negative).
+ */
+static void add_in_flight(int delta) {
+    portENTER_CRITICAL(&mqtt_pipeline_lock);
+    mqtt_in_flight += delta;
+    portEXIT_CRITICAL(&mqtt_pipeline_lock);
+}
+
+/**
+ * @brief Take a free delivery slot for a tracked message.
+ * @param handler Handler of the outcome.
+ * @param arg Argument passed to the handler.
+ * @return Index of the slot, or -1 if all MQTT_DELIVERY_SLOTS are taken.
+ */
+static int reserve_delivery(mqtt_delivery_handler_t handler, void *arg) {
+    int slot = -1;
+    portENTER_CRITICAL(&mqtt_delivery_lock);
+    for (int i = 0; i < MQTT_DELIVERY_SLOTS; i++) {
+        if (mqtt_deliveries[i].handler == NULL) {
+            mqtt_deliveries[i].handler = handler;
+            mqtt_deliveries[i].arg = arg;
+            mqtt_deliveries[i].msg_id = -1;
+            slot = i;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&mqtt_delivery_lock);
+    return slot;
+}
+
+/**
+ * @brief Free a delivery slot without calling its handler, for a message whose drop the sender was told about.
+ * @param slot Index of the slot.
+ */
+static void release_delivery(int slot) {
+    portENTER_CRITICAL(&mqtt_delivery_lock);
+    mqtt_deliveries[slot].handler = NULL;
+    portEXIT_CRITICAL(&mqtt_delivery_lock);
+}
+
+/**
+ * @brief Free a delivery slot and pass the outcome to its handler.
+ * @param slot Index of the slot.
+ * @param delivery Outcome of the message.
+ */
+static void finish_delivery(int slot, mqtt_delivery_t delivery) {
+    portENTER_CRITICAL(&mqtt_delivery_lock);
+    mqtt_delivery_handler_t handler = mqtt_deliveries[slot].handler;
+    void *arg = mqtt_deliveries[slot].arg;
+    mqtt_deliveries[slot].handler = NULL;
+    portEXIT_CRITICAL(&mqtt_delivery_lock);
+
+    if (handler != NULL) {
+        handler(delivery, arg);
+    }
+}
+
+/**
+ * @brief Confirm a tracked QoS 0 message, or wait for the acknowledgement of a QoS 1 or 2 message.
+ * @param slot Index of the slot.
+ * @param qos QoS the message was published with.
+ * @param msg_id Message ID returned by the client.
+ */
+static void delivery_published(int slot, int qos, int msg_id) {
+    if (qos == 0) {
+        finish_delivery(slot, MQTT_DELIVERY_CONFIRMED);
+        return;
+    }
+
+    int64_t now_us = esp_timer_get_time();
+    bool early = false;
+    mqtt_delivery_t delivery = MQTT_DELIVERY_CONFIRMED;
+    portENTER_CRITICAL(&mqtt_delivery_lock);
+    for (int i = 0; i < MQTT_EARLY_OUTCOMES; i++) {
+        mqtt_early_outcome_t *outcome = &mqtt_early_outcomes[i];
+        if (outcome->at_us != 0 && outcome->msg_id == msg_id &&
+            now_us - outcome->at_us < (int64_t)MQTT_EARLY_OUTCOME_MS * 1000) {
+            early = true;
+            delivery = outcome->delivery;
+            outcome->at_us = 0;
+            break;
+        }
+    }
+    if (!early) {
+        mqtt_deliveries[slot].msg_id = msg_id;
+    }
+    portEXIT_CRITICAL(&mqtt_delivery_lock);
+
+    if (early) {
+        finish_delivery(slot, delivery);
+    }
+}
+
+/**
+ * @brief Pass the acknowledgement or deletion of a QoS 1 or 2 message to the tracked message it belongs to.
+ * @param msg_id Message ID of the event.
+ * @param delivery Outcome of the message.
+ */
+static void delivery_outcome(int msg_id, mqtt_delivery_t delivery) {
+    int64_t now_us = esp_timer_get_time();
+    int slot = -1;
+    portENTER_CRITICAL(&mqtt_delivery_lock);
+    for (int i = 0; i < MQTT_DELIVERY_SLOTS; i++) {
+        if (mqtt_deliveries[i].handler != NULL && mqtt_deliveries[i].msg_id == msg_id) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot < 0) {
+        // Untracked, or tracked and its publish has not returned yet
+        mqtt_early_outcome_t *outcome = &mqtt_early_outcomes[mqtt_early_next];
+        mqtt_early_next = (mqtt_early_next + 1) % MQTT_EARLY_OUTCOMES;
+        outcome->msg_id = msg_id;
+        outcome->delivery = delivery;
+        outcome->at_us = now_us;
+    }
+    portEXIT_CRITICAL(&mqtt_delivery_lock);
+
+    if (slot >= 0) {
+        finish_delivery(slot, delivery);
+    }
+}
+
+/**
+ * @brief Pass a received message to the handler of its topic.
+ * @param event MQTT_EVENT_DATA event.
+ */
+static void dispatch_message(const esp_mqtt_event_t *event) {
+    // Messages larger than the receive buffer arrive in pieces, no handler expects those
+    if (event->current_data_offset != 0 || event->data_len != event->total_data_len) {
+        ESP_LOGW(mqtt_log_tag, "Ignored fragmented message of %d bytes", event->total_data_len);
+        return;
+    }
+
+    for (int i = 0; i < MQTT_SUBSCRIPTIONS; i++) {
+        const mqtt_subscription_t *subscription = &mqtt_subscriptions[i];
+        if (subscription->topic != NULL && event->topic_len == strlen(subscription->topic) &&
+            strncmp(event->topic, subscription->topic, event->topic_len) == 0) {
+            subscription->handler(event->client, subscription->topic, event->data, event->data_len, subscription->arg);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Fill the client configuration from the current settings.
+ * @param config Configuration to fill.
+ */
+static void fill_client_config(esp_mqtt_client_config_t *config) {
+    *config = (esp_mqtt_client_config_t) {
+            .broker.address.uri = mqtt_broker,
+            .credentials.username = mqtt_username,
+            .credentials.authentication.password = mqtt_password,
+            .session.protocol_ver = mqtt_protocol_version,
+            .outbox.limit = mqtt_outbox_budget,
+            .network.transport = mqtt_tls_transport,
+    };
+}
+
+#ifdef CONFIG_MQTT_PROTOCOL_5
+/**
+ * @brief Switch to MQTT 3.1.1 if the broker refused the connection for its protocol version.
+ * @param client MQTT client handle.
+ * @param error Error of the MQTT_EVENT_ERROR event.
+ */
+static void fall_back_to_mqtt311(esp_mqtt_client_handle_t client, const esp_mqtt_error_codes_t *error) {
+    // Brokers that only speak 3.1.1 answer with its "unacceptable protocol version" code
+    if (mqtt_protocol_version != MQTT_PROTOCOL_V_5 || error == NULL ||
+        error->error_type != MQTT_ERROR_TYPE_CONNECTION_REFUSED ||
+        (error->connect_return_code != MQTT_CONNECTION_REFUSE_PROTOCOL &&
+         error->connect_return_code != MQTT5_REASON_UNSUPPORTED_PROTOCOL)) {
+        return;
+    }
+
+    ESP_LOGW(mqtt_log_tag, "Broker refused MQTT 5, falling back to MQTT 3.1.1");
+    mqtt_protocol_version = MQTT_PROTOCOL_V_3_1_1;
+    esp_mqtt_client_config_t config;
+    fill_client_config(&config);
+    // Takes effect with the client's next reconnect
+    esp_mqtt_set_config(client, &config);
+}
+#endif
+
 void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data) {
+    esp_mqtt_event_handle_t event = event_data;
     ESP_LOGD("MQTT", "Event dispatched from event loop base=%s, event_id=%ld", base, (long)event_id);
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    // Events run in the client task, publishes from here must not wait for mqtt5_publish_lock
+    mqtt_client_task = xTaskGetCurrentTaskHandle();
+#endif
+
+    switch ((esp_mqtt_event_id_t)event_id) {
+        case MQTT_EVENT_CONNECTED:
+#ifdef CONFIG_MQTT_PROTOCOL_5
+            mqtt_connection++;
+#endif
+            mqtt_metrics_connected();
+            // Messages held back while offline are lost, Home Assistant gets a full state again
+            mqtt_report_resync = true;
+            xEventGroupClearBits(mqtt_event_group, MQTT_ERROR_BIT);
+            xEventGroupSetBits(mqtt_event_group, MQTT_CONNECTED_BIT);
+            ESP_LOGI(mqtt_log_tag, "Connected to the broker");
+            // Subscriptions do not survive a clean session
+            for (int i = 0; i < MQTT_SUBSCRIPTIONS; i++) {
+                if (mqtt_subscriptions[i].topic != NULL) {
+                    esp_mqtt_client_subscribe(event->client, mqtt_subscriptions[i].topic, mqtt_subscriptions[i].qos);
+                }
+            }
+            break;
+        case MQTT_EVENT_DISCONNECTED:
+            xEventGroupClearBits(mqtt_event_group, MQTT_CONNECTED_BIT);
+            mqtt_metrics_disconnected();
+            ESP_LOGW(mqtt_log_tag, "Disconnected from the broker");
+            break;
+        case MQTT_EVENT_PUBLISHED:
+            add_in_flight(-1);
+            mqtt_metrics_acked(event->msg_id);
+            delivery_outcome(event->msg_id, MQTT_DELIVERY_CONFIRMED);
+            break;
+        case MQTT_EVENT_DELETED:
+            // Dropped from the outbox after it expired
+            add_in_flight(-1);
+            mqtt_metrics_deleted(event->msg_id);
+            delivery_outcome(event->msg_id, MQTT_DELIVERY_DROPPED);
+            break;
+        case MQTT_EVENT_ERROR:
+            portENTER_CRITICAL(&mqtt_pipeline_lock);
+            mqtt_errors++;
+            portEXIT_CRITICAL(&mqtt_pipeline_lock);
+            xEventGroupSetBits(mqtt_event_group, MQTT_ERROR_BIT);
+            ESP_LOGW(mqtt_log_tag, "MQTT error, last transport error 0x%x",
+                     event->error_handle != NULL ? event->error_handle->esp_tls_last_esp_err : 0);
+#ifdef CONFIG_MQTT_PROTOCOL_5
+            fall_back_to_mqtt311(event->client, event->error_handle);
+#endif
+            break;
+        case MQTT_EVENT_DATA:
+            dispatch_message(event);
+            break;
+        default:
+            break;
+    }
+}
+
+esp_err_t mqtt_subscribe_handler(esp_mqtt_client_handle_t client, const char *topic, int qos,
+                                 mqtt_message_handler_t handler, void *arg) {
+    for (int i = 0; i < MQTT_SUBSCRIPTIONS; i++) {
+        mqtt_subscription_t *subscription = &mqtt_subscriptions[i];
+        if (subscription->topic != NULL) {
+            continue;
+        }
+        subscription->qos = qos;
+        subscription->handler = handler;
+        subscription->arg = arg;
+        // The topic marks the entry as used, the event handler may read it at any time
+        subscription->topic = topic;
+
+        if (mqtt_is_connected()) {
+            esp_mqtt_client_subscribe(client, topic, qos);
+        }
+        return ESP_OK;
+    }
+
+    ESP_LOGE(mqtt_log_tag, "No room for a subscription to %s", topic);
+    return ESP_ERR_NO_MEM;
+}
+
+/**
+ * @brief Handle Home Assistant's birth and last will messages.
+ * @param client MQTT client handle.
+ * @param topic MQTT_DISCOVERY_STATUS_TOPIC.
+ * @param data Payload, not NUL-terminated.
+ * @param length Length of the payload in bytes.
+ * @param arg Unused.
+ */
+static void handle_discovery_status(esp_mqtt_client_handle_t client, const char *topic, const char *data, int length, void *arg) {
+    if (length == strlen(MQTT_DISCOVERY_ONLINE) && strncmp(data, MQTT_DISCOVERY_ONLINE, length) == 0) {
+        ESP_LOGI(mqtt_log_tag, "Home Assistant is online, republishing discovery");
+        republish_sensor_discoveries(client);
+        mqtt_report_resync = true;
+    }
 }
 
 esp_mqtt_client_handle_t mqtt_app_start(void) {
-    esp_mqtt_client_config_t mqtt_cfg = {
-            .broker.address.uri = MQTT_BROKER,
-            .credentials.username = MQTT_USERNAME,
-            .credentials.authentication.password = MQTT_PASSWORD,
-    };
+    if (mqtt_event_group == NULL) {
+        mqtt_event_group = xEventGroupCreate();
+        if (mqtt_event_group == NULL) {
+            ESP_LOGE(mqtt_log_tag, "Failed to create the MQTT event group");
+            return NULL;
+        }
+    }
+
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    if (mqtt5_publish_lock == NULL) {
+        mqtt5_publish_lock = xSemaphoreCreateMutex();
+        if (mqtt5_publish_lock == NULL) {
+            ESP_LOGE(mqtt_log_tag, "Failed to create the MQTT 5 publish lock");
+            return NULL;
+        }
+    }
+#else
+    if (mqtt_protocol_version == MQTT_PROTOCOL_V_5) {
+        ESP_LOGW(mqtt_log_tag, "MQTT 5 needs CONFIG_MQTT_PROTOCOL_5, using MQTT 3.1.1");
+        mqtt_protocol_version = MQTT_PROTOCOL_V_3_1_1;
+    }
+#endif
+
+    if (mqtt_ca_certificate != NULL && mqtt_tls_transport == NULL) {
+        mqtt_tls_transport = mqtt_tls_transport_init(mqtt_ca_certificate);
+        if (mqtt_tls_transport == NULL) {
+            ESP_LOGE(mqtt_log_tag, "Failed to create the TLS transport");
+            return NULL;
+        }
+    }
+
+    esp_mqtt_client_config_t mqtt_cfg;
+    fill_client_config(&mqtt_cfg);
     esp_mqtt_client_handle_t client = esp_mqtt_client_init(&mqtt_cfg);
     esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, client);
+    // Home Assistant announces itself here after a restart and may have lost the retained discovery
+    mqtt_subscribe_handler(client, MQTT_DISCOVERY_STATUS_TOPIC, 0, handle_discovery_status, NULL);
     esp_mqtt_client_start(client);
+
+    // Events get a lane of their own so they never wait behind bulk data
+    if (mqtt_publish_lanes && mqtt_lanes_start(client, publish_queued) != ESP_OK) {
+        ESP_LOGW(mqtt_log_tag, "Publishing without lanes");
+    }
     return client;
 }
 
-void send_sensor_discovery(esp_mqtt_client_handle_t client, const sensor_config_t *config) {
-    cJSON *root = cJSON_CreateObject();
-    if(strcmp(config->device_class, "None") != 0) {
-        cJSON_AddStringToObject(root, "device_class", config->device_class);
+/**
+ * @brief Run the admission checks of the publish policy on a message.
+ * @param client MQTT client handle.
+ * @param policy Publish policy of the message's class.
+ * @param length Length of the payload in bytes.
+ * @param timestamp_us Sample time of the content in microseconds, 0 if it does not expire.
+ * @param outbox_size Filled with the outbox size if it was read, otherwise left alone.
+ * @return Whether the message may be published, or why not.
+ */
+static mqtt_admission_t admit_message(esp_mqtt_client_handle_t client, const mqtt_publish_policy_t *policy, int length,
+                                      int64_t timestamp_us, int *outbox_size) {
+    // A stale sample is worth less than the outbox space it would take
+    if (policy->expiry_ms > 0 && timestamp_us > 0 &&
+        esp_timer_get_time() - timestamp_us > (int64_t)policy->expiry_ms * 1000) {
+        return MQTT_DROP_EXPIRED;
     }
-    cJSON_AddStringToObject(root, "state_topic", config->state_topic);
-    cJSON_AddStringToObject(root, "unit_of_measurement", config->unit_of_measurement);
-    cJSON_AddStringToObject(root, "value_template", config->value_template);
-    cJSON_AddStringToObject(root, "unique_id", config->unique_id);
 
-    cJSON *device = cJSON_CreateObject();
-    cJSON_AddItemToObject(root, "device", device);
-    cJSON_AddItemToObject(device, "identifiers", cJSON_CreateStringArray(&config->identifiers, 1));
-    cJSON_AddStringToObject(device, "name", config->name);
-    cJSON_AddStringToObject(device, "manufacturer", config->manufacturer);
-    cJSON_AddStringToObject(device, "model", config->model);
+    // QoS 0 messages are lost while disconnected, QoS 1 and 2 messages may wait in the outbox
+    if (!mqtt_is_connected() && (policy->qos == 0 || !policy->queue_offline)) {
+        return MQTT_DROP_OFFLINE;
+    }
+    if (policy->qos > 0) {
+        *outbox_size = esp_mqtt_client_get_outbox_size(client);
+        mqtt_metrics_outbox(*outbox_size);
+        size_t limit = mqtt_outbox_budget * policy->outbox_share / 100;
+        if (*outbox_size < 0 || (size_t)*outbox_size + (size_t)length > limit) {
+            return MQTT_DROP_BUDGET;
+        }
+    }
+    return MQTT_ADMIT;
+}
 
-    char *message = cJSON_Print(root);
-    char topic[256];
-    snprintf(topic, 256, "homeassistant/sensor/%s/%s/config", config->identifiers, config->sensor_type);
+bool mqtt_can_publish(esp_mqtt_client_handle_t client, mqtt_message_class_t message_class, int length) {
+    if (message_class >= MQTT_CLASS_COUNT) {
+        message_class = MQTT_CLASS_STATE;
+    }
+    const mqtt_publish_policy_t *policy = &mqtt_publish_policies[message_class];
+    if (mqtt_lanes_running() && !mqtt_lane_has_room(policy->lane, MQTT_TOPIC_MAX_LENGTH, length)) {
+        return false;
+    }
+    int outbox_size;
+    return admit_message(client, policy, length, 0, &outbox_size) == MQTT_ADMIT;
+}
+
+void get_mqtt_pipeline_state(esp_mqtt_client_handle_t client, mqtt_pipeline_state_t *state) {
+    state->connected = mqtt_is_connected();
+    state->outbox_bytes = esp_mqtt_client_get_outbox_size(client);
+    mqtt_metrics_outbox(state->outbox_bytes);
+    state->outbox_budget = mqtt_outbox_budget;
+    portENTER_CRITICAL(&mqtt_pipeline_lock);
+    // An acknowledgement may be counted before the publish that caused it returned
+    state->in_flight = mqtt_in_flight > 0 ? mqtt_in_flight : 0;
+    state->errors = mqtt_errors;
+    portEXIT_CRITICAL(&mqtt_pipeline_lock);
+}
 
-    esp_mqtt_client_publish(client, topic, message, 0, 1, 0);
-    ESP_LOGI("MQTT", "Sent discovery message: %s", message);
+#ifdef CONFIG_MQTT_PROTOCOL_5
+/**
+ * @brief Find the topic alias of a topic, assigning a free one on first use.
+ *
+ * The topic is copied, publishes from a lane pass topics that live in a ringbuffer item.
+ *
+ * @param topic MQTT topic.
+ * @return Alias of the topic, or NULL if all aliases belong to other topics or the topic is too long.
+ */
+static mqtt_topic_alias_t *find_topic_alias(const char *topic) {
+    mqtt_topic_alias_t *free_alias = NULL;
+    size_t length = strlen(topic);
 
-    cJSON_Delete(root);
-    free(message);
+    if (length == 0 || length >= MQTT_TOPIC_MAX_LENGTH) {
+        return NULL;
+    }
+
+    for (int i = 0; i < MQTT_TOPIC_ALIASES; i++) {
+        mqtt_topic_alias_t *alias = &mqtt_topic_aliases[i];
+        if (alias->topic[0] != '\0' && strcmp(alias->topic, topic) == 0) {
+            return alias;
+        }
+        if (alias->topic[0] == '\0' && free_alias == NULL) {
+            free_alias = alias;
+        }
+    }
+
+    if (free_alias != NULL) {
+        memcpy(free_alias->topic, topic, length + 1);
+        free_alias->connection = 0;
+    }
+    return free_alias;
 }
 
-void send_all_sensor_discoveries(esp_mqtt_client_handle_t client, const sensor_config_t *sensor_configs, int number_of_configs) {
+/**
+ * @brief Publish a message with the MQTT 5 properties selected by set_mqtt5_properties().
+ *
+ * esp-mqtt applies publish properties to the next publish of any task, so setting them and publishing is
+ * serialized by mqtt5_publish_lock. Handlers in the client task cannot wait for it: the client task holds the
+ * client's own lock while they run, which the holder of mqtt5_publish_lock may be waiting for. They publish
+ * without it and flag that they may have taken the holder's properties, so the holder announces its alias again.
+ *
+ * @param client MQTT client handle.
+ * @param topic MQTT topic.
+ * @param data Payload.
+ * @param length Length of the payload in bytes.
+ * @param policy Publish policy of the message's class.
+ * @param timestamp_us Sample time of the content in microseconds, 0 if it does not expire.
+ * @param content_type MQTT_CONTENT_TYPE_* of the payload, NULL if unknown.
+ * @param sequence Frame sequence number, 0 if the message has none.
+ * @return Message ID as returned by esp_mqtt_client_publish().
+ */
+static int publish_mqtt5(esp_mqtt_client_handle_t client, const char *topic, const char *data, int length,
+                         const mqtt_publish_policy_t *policy, int64_t timestamp_us, const char *content_type,
+                         uint32_t sequence) {
+    bool in_client_task = xTaskGetCurrentTaskHandle() == mqtt_client_task;
+    bool locked = xSemaphoreTake(mqtt5_publish_lock, in_client_task ? 0 : portMAX_DELAY) == pdTRUE;
+    mqtt5_properties_taken = !locked;
+
+    esp_mqtt5_publish_property_config_t property = {0};
+    if ((mqtt5_properties & MQTT5_PROPERTY_CONTENT_TYPE) && content_type != NULL) {
+        property.content_type = content_type;
+        property.payload_format_indicator = strcmp(content_type, MQTT_CONTENT_TYPE_JSON) == 0;
+    }
+    if ((mqtt5_properties & MQTT5_PROPERTY_EXPIRY) && policy->expiry_ms > 0) {
+        // What is left of the class's expiry, in whole seconds and at least one
+        int64_t age_ms = timestamp_us > 0 ? (esp_timer_get_time() - timestamp_us) / 1000 : 0;
+        int64_t remaining_ms = (int64_t)policy->expiry_ms - age_ms;
+        property.message_expiry_interval = remaining_ms > 1000 ? (uint32_t)((remaining_ms + 999) / 1000) : 1;
+    }
+    char sequence_text[11];
+    esp_mqtt5_user_property_item_t sequence_item = {"seq", sequence_text};
+    if ((mqtt5_properties & MQTT5_PROPERTY_SEQUENCE) && sequence != 0) {
+        snprintf(sequence_text, sizeof(sequence_text), "%lu", (unsigned long)sequence);
+        esp_mqtt5_client_set_user_property(&property.user_property, &sequence_item, 1);
+    }
+
+    // Only QoS 0 messages go out with the alias alone, QoS 1 and 2 messages may be resent on a new connection
+    mqtt_topic_alias_t *alias = NULL;
+    uint32_t connection = mqtt_connection;
+    if (locked && policy->qos == 0 && (mqtt5_properties & MQTT5_PROPERTY_TOPIC_ALIAS) && mqtt_aliases_refused != connection) {
+        alias = find_topic_alias(topic);
+    }
+
+    const char *publish_topic = topic;
+    if (alias != NULL) {
+        property.topic_alias = (uint16_t)(alias - mqtt_topic_aliases + 1);
+        if (esp_mqtt5_client_set_publish_property(client, &property) == ESP_OK) {
+            if (connection != 0 && alias->connection == connection) {
+                publish_topic = "";
+            }
+        } else {
+            // The broker allows fewer aliases than MQTT_TOPIC_ALIASES, use none on this connection
+            ESP_LOGW(mqtt_log_tag, "Broker refused topic alias %u", property.topic_alias);
+            mqtt_aliases_refused = connection;
+            property.topic_alias = 0;
+            alias = NULL;
+            esp_mqtt5_client_set_publish_property(client, &property);
+        }
+    } else {
+        esp_mqtt5_client_set_publish_property(client, &property);
+    }
+
+    int msg_id = esp_mqtt_client_publish(client, publish_topic, data, length, policy->qos, policy->retain);
+    if (alias != NULL) {
+        // The broker only knows the alias if this message carried it, announce it again otherwise
+        alias->connection = msg_id >= 0 && !mqtt5_properties_taken ? connection : 0;
+    }
+
+    esp_mqtt5_client_delete_user_property(property.user_property);
+    if (locked) {
+        xSemaphoreGive(mqtt5_publish_lock);
+    }
+    return msg_id;
+}
+#endif
+
+/**
+ * @brief Count a message in one of the publish counters.
+ * @param counter Counter inside mqtt_publish_counters.
+ */
+static void count_message(uint32_t *counter) {
+    portENTER_CRITICAL(&mqtt_counters_lock);
+    (*counter)++;
+    portEXIT_CRITICAL(&mqtt_counters_lock);
+}
+
+/**
+ * @brief Run the admission checks of a message's class and count a drop.
+ * @param client MQTT client handle.
+ * @param topic MQTT topic, for the log.
+ * @param length Length of the payload in bytes.
+ * @param message_class Message class of the message.
+ * @param timestamp_us Sample time of the content in microseconds, 0 if it does not expire.
+ * @return true if the message may be published.
+ */
+static bool admit_and_count(esp_mqtt_client_handle_t client, const char *topic, int length,
+                            mqtt_message_class_t message_class, int64_t timestamp_us) {
+    const mqtt_publish_policy_t *policy = &mqtt_publish_policies[message_class];
+
+    int outbox_size = 0;
+    switch (admit_message(client, policy, length, timestamp_us, &outbox_size)) {
+        case MQTT_ADMIT:
+            return true;
+        case MQTT_DROP_EXPIRED:
+            count_message(&mqtt_publish_counters.dropped_expired[message_class]);
+            return false;
+        case MQTT_DROP_OFFLINE:
+            count_message(&mqtt_publish_counters.dropped_offline[message_class]);
+            return false;
+        case MQTT_DROP_BUDGET:
+        default:
+            count_message(&mqtt_publish_counters.dropped_budget[message_class]);
+            ESP_LOGW(mqtt_log_tag, "Outbox at %d of %u bytes, dropped message for %s", outbox_size,
+                     (unsigned)(mqtt_outbox_budget * policy->outbox_share / 100), topic);
+            return false;
+    }
+}
+
+/**
+ * @brief Hand a message to the MQTT client under the publish policy of its class.
+ *
+ * Called for every message taken out of a lane, and directly while the lanes do not run.
+ *
+ * @param client MQTT client handle.
+ * @param topic MQTT topic.
+ * @param data Payload.
+ * @param length Length of the payload in bytes.
+ * @param message_class Message class whose publish policy applies.
+ * @param timestamp_us Sample time of the content in microseconds, 0 if it does not expire.
+ * @param content_type MQTT_CONTENT_TYPE_* of the payload for MQTT 5, NULL if unknown.
+ * @param sequence Frame sequence number for MQTT 5, 0 if the message has none.
+ * @param tracker Delivery slot of a tracked message, -1 if it is not tracked. Left to the caller on a drop.
+ * @return Message ID, or -1 if the message was dropped.
+ */
+static int publish_now(esp_mqtt_client_handle_t client, const char *topic, const char *data, int length,
+                       mqtt_message_class_t message_class, int64_t timestamp_us, const char *content_type,
+                       uint32_t sequence, int tracker) {
+    if (message_class >= MQTT_CLASS_COUNT) {
+        message_class = MQTT_CLASS_STATE;
+    }
+    const mqtt_publish_policy_t *policy = &mqtt_publish_policies[message_class];
+
+    if (!admit_and_count(client, topic, length, message_class, timestamp_us)) {
+        return -1;
+    }
+
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    int msg_id = mqtt_protocol_version == MQTT_PROTOCOL_V_5
+                 ? publish_mqtt5(client, topic, data, length, policy, timestamp_us, content_type, sequence)
+                 : esp_mqtt_client_publish(client, topic, data, length, policy->qos, policy->retain);
+#else
+    int msg_id = esp_mqtt_client_publish(client, topic, data, length, policy->qos, policy->retain);
+#endif
+    if (msg_id == -2) {
+        // The client's own outbox limit was hit
+        count_message(&mqtt_publish_counters.dropped_budget[message_class]);
+        return -1;
+    }
+    if (msg_id < 0) {
+        count_message(&mqtt_publish_counters.dropped_failed[message_class]);
+        return -1;
+    }
+    if (policy->qos > 0) {
+        add_in_flight(1);
+    }
+    mqtt_metrics_sent(policy->qos > 0 ? msg_id : 0, length + (int)strlen(topic));
+    count_message(&mqtt_publish_counters.published[message_class]);
+    if (tracker >= 0) {
+        delivery_published(tracker, policy->qos, msg_id);
+    }
+    return msg_id;
+}
+
+/**
+ * @brief Publish a message taken out of its lane, reporting a drop the sender could not see.
+ *
+ * The lanes' publish function, see publish_now() for the parameters.
+ *
+ * @return Message ID, or -1 if the message was dropped.
+ */
+static int publish_queued(esp_mqtt_client_handle_t client, const char *topic, const char *data, int length,
+                          mqtt_message_class_t message_class, int64_t timestamp_us, const char *content_type,
+                          uint32_t sequence, int tracker) {
+    int msg_id = publish_now(client, topic, data, length, message_class, timestamp_us, content_type, sequence, tracker);
+    if (msg_id >= 0) {
+        return msg_id;
+    }
+
+    if (tracker >= 0) {
+        finish_delivery(tracker, MQTT_DELIVERY_DROPPED);
+    }
+    const mqtt_drop_hook_t *hook = &mqtt_drop_hooks[message_class < MQTT_CLASS_COUNT ? message_class : MQTT_CLASS_STATE];
+    if (hook->handler != NULL) {
+        hook->handler(message_class, data, length, hook->arg);
+    }
+    return -1;
+}
+
+/**
+ * @brief Publish a message under the publish policy of its class, through its lane once the lanes run.
+ * @param client MQTT client handle.
+ * @param topic MQTT topic.
+ * @param data Payload.
+ * @param length Length of the payload in bytes.
+ * @param message_class Message class whose publish policy applies.
+ * @param timestamp_us Sample time of the content in microseconds, 0 if it does not expire.
+ * @param content_type MQTT_CONTENT_TYPE_* of the payload for MQTT 5, NULL if unknown.
+ * @param sequence Frame sequence number for MQTT 5, 0 if the message has none.
+ * @param handler Handler of the message's outcome, NULL if it is not tracked.
+ * @param arg Argument passed to the handler.
+ * @return Message ID, 0 if the message was queued in its lane, or -1 if it was dropped.
+ */
+static int publish_message(esp_mqtt_client_handle_t client, const char *topic, const char *data, int length,
+                           mqtt_message_class_t message_class, int64_t timestamp_us, const char *content_type,
+                           uint32_t sequence, mqtt_delivery_handler_t handler, void *arg) {
+    if (message_class >= MQTT_CLASS_COUNT) {
+        message_class = MQTT_CLASS_STATE;
+    }
+
+    int tracker = -1;
+    if (handler != NULL) {
+        tracker = reserve_delivery(handler, arg);
+        if (tracker < 0) {
+            count_message(&mqtt_publish_counters.dropped_budget[message_class]);
+            ESP_LOGW(mqtt_log_tag, "%d messages awaiting their outcome, dropped message for %s",
+                     MQTT_DELIVERY_SLOTS, topic);
+            return -1;
+        }
+    }
+
+    if (!mqtt_lanes_running()) {
+        int msg_id = publish_now(client, topic, data, length, message_class, timestamp_us, content_type, sequence,
+                                 tracker);
+        if (msg_id < 0 && tracker >= 0) {
+            release_delivery(tracker);
+        }
+        return msg_id;
+    }
+
+    // Checked now as well as at its turn, so the caller learns of a drop while it can still keep the message
+    const mqtt_publish_policy_t *policy = &mqtt_publish_policies[message_class];
+    if (!admit_and_count(client, topic, length, message_class, timestamp_us)) {
+        if (tracker >= 0) {
+            release_delivery(tracker);
+        }
+        return -1;
+    }
+    if (!mqtt_lane_enqueue(policy->lane, topic, data, length, message_class, timestamp_us, content_type, sequence,
+                           tracker)) {
+        if (tracker >= 0) {
+            release_delivery(tracker);
+        }
+        count_message(&mqtt_publish_counters.dropped_budget[message_class]);
+        ESP_LOGW(mqtt_log_tag, "Publish lane %d full, dropped message for %s", policy->lane, topic);
+        return -1;
+    }
+    return 0;
+}
+
+int mqtt_publish_message(esp_mqtt_client_handle_t client, const char *topic, const char *data, int length,
+                         mqtt_message_class_t message_class, int64_t timestamp_us) {
+    return publish_message(client, topic, data, length, message_class, timestamp_us, NULL, 0, NULL, NULL);
+}
+
+int mqtt_publish_tracked(esp_mqtt_client_handle_t client, const char *topic, const char *data, int length,
+                         mqtt_message_class_t message_class, int64_t timestamp_us,
+                         mqtt_delivery_handler_t handler, void *arg) {
+    return publish_message(client, topic, data, length, message_class, timestamp_us, NULL, 0, handler, arg);
+}
+
+/**
+ * @brief Add a sensor value to a JSON object.
+ * @param writer JSON writer with an open object.
+ * @param key JSON key of the value.
+ * @param value Value to add.
+ */
+static void add_sensor_value(json_writer_t *writer, const char *key, const sensor_value_t *value) {
+    switch (value->type) {
+        case VALUE_TYPE_FLOAT:
+            // Same text as snprintf("%.2f"), without going through printf
+            json_writer_fixed_string(writer, key, value->float_value, 2);
+            break;
+        case VALUE_TYPE_INT:
+        case VALUE_TYPE_INT16:
+            json_writer_int(writer, key, value->int_value);
+            break;
+        case VALUE_TYPE_DOUBLE:
+            json_writer_fixed_string(writer, key, value->double_value, 2);
+            break;
+        case VALUE_TYPE_STRING:
+            json_writer_string(writer, key, value->string_value);
+            break;
+    }
+}
+
+/**
+ * @brief Publish the document of a JSON writer.
+ * @param client MQTT client handle.
+ * @param topic MQTT topic to publish on.
+ * @param writer JSON writer holding a complete document.
+ * @param message_class Message class whose publish policy applies.
+ * @param timestamp_us Sample time of the content in microseconds, 0 if it does not expire.
+ * @param sequence Frame sequence number, 0 if the document has none.
+ * @param handler Handler of the delivery outcome, see mqtt_publish_tracked(), NULL for none.
+ * @param arg Argument of the handler.
+ * @return Message ID, or -1 if the document did not fit into the writer's buffer or was dropped.
+ */
+static int publish_json(esp_mqtt_client_handle_t client, const char *topic, json_writer_t *writer,
+                         mqtt_message_class_t message_class, int64_t timestamp_us, uint32_t sequence,
+                         mqtt_delivery_handler_t handler, void *arg) {
+    const char *message = json_writer_finish(writer);
+    if (message == NULL) {
+        ESP_LOGE(mqtt_log_tag, "JSON document for %s does not fit into %u bytes", topic, (unsigned)writer->size);
+        return -1;
+    }
+    return publish_message(client, topic, message, (int)writer->length, message_class, timestamp_us,
+                           MQTT_CONTENT_TYPE_JSON, sequence, handler, arg);
+}
+
+bool mqtt_wall_clock_ms(int64_t timer_us, int64_t *wall_ms) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    if (now.tv_sec < MQTT_WALL_CLOCK_VALID_AFTER) {
+        return false;
+    }
+
+    // Shift the esp_timer time by the current offset between the two clocks
+    int64_t now_us = (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+    *wall_ms = (now_us - (esp_timer_get_time() - timer_us)) / 1000;
+    return true;
+}
+
+/**
+ * @brief Find the message counter of a frame topic, adding one on first use.
+ *
+ * The topic string is stored, not copied.
+ *
+ * @param topic MQTT topic.
+ * @return Counter of the topic, or NULL if all counters belong to other topics.
+ */
+static mqtt_topic_sequence_t *find_topic_sequence(const char *topic) {
+    for (int i = 0; i < MQTT_TOPIC_SEQUENCES; i++) {
+        mqtt_topic_sequence_t *entry = &mqtt_topic_sequences[i];
+        if (entry->topic == NULL) {
+            entry->topic = topic;
+            entry->published = 0;
+            return entry;
+        }
+        if (entry->topic == topic || strcmp(entry->topic, topic) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Add the message and frame numbers and the sample and publish times of a frame to a JSON object.
+ *
+ * "seq" counts the messages on the topic, report-on-change and per-channel topics leave no gaps in it.
+ * "frame" is the frame sequence number. The times are only added once the wall clock is set, see
+ * mqtt_wall_clock_ms().
+ *
+ * @param writer JSON writer with an open object.
+ * @param sequence Frame sequence number, 0 to add nothing.
+ * @param message Number of the message on its topic, 0 to leave out "seq".
+ * @param timestamp_us Sample time of the frame in esp_timer microseconds.
+ */
+static void add_frame_metadata(json_writer_t *writer, uint32_t sequence, uint32_t message, int64_t timestamp_us) {
+    if (sequence == 0) {
+        return;
+    }
+    if (message != 0) {
+        json_writer_int(writer, "seq", message);
+    }
+    json_writer_int(writer, "frame", sequence);
+
+    int64_t sample_ms, publish_ms;
+    if (mqtt_wall_clock_ms(timestamp_us, &sample_ms) && mqtt_wall_clock_ms(esp_timer_get_time(), &publish_ms)) {
+        json_writer_int(writer, "ts", sample_ms);
+        json_writer_int(writer, "pts", publish_ms);
+    }
+}
+
+/**
+ * @brief Publish a JSON document of a frame, counting it on its topic if the client accepted it.
+ * @param client MQTT client handle.
+ * @param topic MQTT topic.
+ * @param writer JSON writer holding the document.
+ * @param counter Message counter of the topic, NULL if it has none.
+ * @param message Number the document carries as "seq".
+ * @param sequence Frame sequence number.
+ * @param timestamp_us Sample time of the frame in microseconds.
+ * @param handler Handler of the delivery outcome, see mqtt_publish_tracked(), NULL for none.
+ * @param arg Argument of the handler.
+ * @return Message ID, or -1 if the document was not published.
+ */
+static int publish_frame_json(esp_mqtt_client_handle_t client, const char *topic, json_writer_t *writer,
+                              mqtt_topic_sequence_t *counter, uint32_t message, uint32_t sequence, int64_t timestamp_us,
+                              mqtt_delivery_handler_t handler, void *arg) {
+    int msg_id = publish_json(client, topic, writer, get_mqtt_topic_class(topic), timestamp_us, sequence, handler, arg);
+    // A message the client refused never existed, its number goes to the next one
+    if (msg_id >= 0 && counter != NULL) {
+        counter->published = message;
+    }
+    return msg_id;
+}
+
+/**
+ * @brief Publish a single sensor value as a one-key JSON object.
+ * @param client MQTT client handle.
+ * @param topic MQTT topic for the value.
+ * @param key JSON key of the value.
+ * @param value Value to publish.
+ * @param sequence Sequence number of the frame the value belongs to, 0 if it has none.
+ * @param timestamp_us Sample time of the value in microseconds.
+ * @param handler Handler of the delivery outcome, see mqtt_publish_tracked(), NULL for none.
+ * @param arg Argument of the handler.
+ * @return Message ID, or -1 if the value was not published.
+ */
+static int publish_sensor_value(esp_mqtt_client_handle_t client, const char *topic, const char *key, const sensor_value_t *value,
+                                uint32_t sequence, int64_t timestamp_us, mqtt_delivery_handler_t handler, void *arg) {
+    char message[MQTT_JSON_BUFFER_SIZE];
+    json_writer_t writer;
+
+    mqtt_topic_sequence_t *counter = sequence != 0 ? find_topic_sequence(topic) : NULL;
+    uint32_t number = counter != NULL ? counter->published + 1 : 0;
+
+    json_writer_init(&writer, message, sizeof(message), false);
+    json_writer_begin_object(&writer, NULL);
+    add_sensor_value(&writer, key, value);
+    add_frame_metadata(&writer, sequence, number, timestamp_us);
+    json_writer_end_object(&writer);
+    return publish_frame_json(client, topic, &writer, counter, number, sequence, timestamp_us, handler, arg);
+}
+
+/**
+ * @brief Write the device block of a discovery document.
+ * @param writer JSON writer with an open object.
+ * @param config Sensor configuration holding the device.
+ */
+static void write_discovery_device(json_writer_t *writer, const sensor_config_t *config) {
+    json_writer_begin_object(writer, "device");
+    json_writer_begin_array(writer, "identifiers");
+    json_writer_string(writer, NULL, config->identifiers);
+    json_writer_end_array(writer);
+    json_writer_string(writer, "name", config->name);
+    json_writer_string(writer, "manufacturer", config->manufacturer);
+    json_writer_string(writer, "model", config->model);
+    json_writer_end_object(writer);
+}
+
+/**
+ * @brief Write the Home Assistant discovery document of a sensor.
+ * @param writer JSON writer to write the document into.
+ * @param config Sensor configuration.
+ */
+static void write_discovery_document(json_writer_t *writer, const sensor_config_t *config) {
+    json_writer_begin_object(writer, NULL);
+    if(strcmp(config->device_class, "None") != 0) {
+        json_writer_string(writer, "device_class", config->device_class);
+    }
+    json_writer_string(writer, "state_topic", get_mqtt_sensor_state_topic(config));
+    json_writer_string(writer, "unit_of_measurement", config->unit_of_measurement);
+    json_writer_string(writer, "value_template", config->value_template);
+    json_writer_string(writer, "unique_id", config->unique_id);
+    write_discovery_device(writer, config);
+    json_writer_end_object(writer);
+}
+
+/**
+ * @brief Write the Home Assistant device discovery document of all sensors.
+ *
+ * The device block and, when batching, the state topic are written once at the top level and
+ * shared by every component.
+ *
+ * @param writer JSON writer to write the document into.
+ * @param sensor_configs Array of sensor configurations, the device is taken from the first one.
+ * @param number_of_configs Number of sensor configurations.
+ */
+static void write_device_discovery_document(json_writer_t *writer, const sensor_config_t *sensor_configs, int number_of_configs) {
+    bool shared_state_topic = mqtt_state_mode == MQTT_STATE_MODE_BATCHED && mqtt_device_state_topic != NULL;
+
+    json_writer_begin_object(writer, NULL);
+    write_discovery_device(writer, &sensor_configs[0]);
+    json_writer_begin_object(writer, "origin");
+    json_writer_string(writer, "name", MQTT_DISCOVERY_ORIGIN);
+    json_writer_end_object(writer);
+    if (shared_state_topic) {
+        json_writer_string(writer, "state_topic", mqtt_device_state_topic);
+    }
+
+    json_writer_begin_object(writer, "components");
     for (int i = 0; i < number_of_configs; i++) {
         const sensor_config_t *config = &sensor_configs[i];
-        send_sensor_discovery(client, config);
+        json_writer_begin_object(writer, config->sensor_type);
+        json_writer_string(writer, "platform", "sensor");
+        if(strcmp(config->device_class, "None") != 0) {
+            json_writer_string(writer, "device_class", config->device_class);
+        }
+        if (!shared_state_topic) {
+            json_writer_string(writer, "state_topic", config->state_topic);
+        }
+        json_writer_string(writer, "unit_of_measurement", config->unit_of_measurement);
+        json_writer_string(writer, "value_template", config->value_template);
+        json_writer_string(writer, "unique_id", config->unique_id);
+        json_writer_end_object(writer);
     }
+    json_writer_end_object(writer);
+    json_writer_end_object(writer);
 }
 
-void send_sensor_data_array(esp_mqtt_client_handle_t client, const sensor_data_t *sensor_data_array, size_t data_count) {
-    char json_string[256]; // Stellen Sie sicher, dass dieser Puffer groß genug ist.
-    cJSON *root;
+void send_sensor_discovery(esp_mqtt_client_handle_t client, const sensor_config_t *config) {
+    char message[MQTT_JSON_BUFFER_SIZE];
+    json_writer_t writer;
+
+    json_writer_init(&writer, message, sizeof(message), false);
+    write_discovery_document(&writer, config);
+
+    if (config->discovery_topic == NULL) {
+        ESP_LOGE(mqtt_log_tag, "No discovery topic, %s not sent", config->unique_id);
+        return;
+    }
+    if (publish_json(client, config->discovery_topic, &writer, MQTT_CLASS_DISCOVERY, 0, 0, NULL, NULL) >= 0) {
+        ESP_LOGD(mqtt_log_tag, "Sent discovery message: %s", message);
+    }
+}
+
+/**
+ * @brief Append one discovery message to the discovery cache.
+ * @param used Bytes of the cache in use, advanced past the message.
+ * @param hash Running FNV-1a hash, updated with the topic and document.
+ * @param sensor_configs Array of sensor configurations.
+ * @param number_of_configs Number of sensor configurations.
+ * @param index Sensor to write the per-sensor message of, or -1 for the device message of all sensors.
+ */
+static void add_discovery_cache_entry(size_t *used, uint32_t *hash, const sensor_config_t *sensor_configs,
+                                      int number_of_configs, int index) {
+    const char *unique_id = index < 0 ? sensor_configs[0].identifiers : sensor_configs[index].unique_id;
+    if (mqtt_discovery_count == MQTT_DISCOVERY_MAX) {
+        ESP_LOGE(mqtt_log_tag, "More than %d discovery messages, %s not sent", MQTT_DISCOVERY_MAX, unique_id);
+        return;
+    }
+
+    const char *topic = index < 0 ? sensor_configs[0].device_discovery_topic : sensor_configs[index].discovery_topic;
+    if (topic == NULL) {
+        ESP_LOGE(mqtt_log_tag, "No discovery topic, %s not sent", unique_id);
+        return;
+    }
+
+    json_writer_t writer;
+    json_writer_init(&writer, &mqtt_discovery_cache[*used], sizeof(mqtt_discovery_cache) - *used, false);
+    if (index < 0) {
+        write_device_discovery_document(&writer, sensor_configs, number_of_configs);
+    } else {
+        write_discovery_document(&writer, &sensor_configs[index]);
+    }
+    const char *payload = json_writer_finish(&writer);
+    if (payload == NULL) {
+        ESP_LOGE(mqtt_log_tag, "Discovery cache of %u bytes is full, %s not sent",
+                 (unsigned)sizeof(mqtt_discovery_cache), unique_id);
+        return;
+    }
+
+    // The NUL after the topic separates it from the document in the hash
+    for (size_t i = 0; i <= strlen(topic); i++) {
+        *hash = (*hash ^ (uint8_t)topic[i]) * 16777619u;
+    }
+    for (size_t i = 0; i < writer.length; i++) {
+        *hash = (*hash ^ (uint8_t)payload[i]) * 16777619u;
+    }
+
+    mqtt_discovery_entry_t *entry = &mqtt_discovery_entries[mqtt_discovery_count];
+    entry->topic = topic;
+    entry->payload = payload;
+    entry->length = (int)writer.length;
+    mqtt_discovery_count++;
+    *used += writer.length + 1;
+}
+
+/**
+ * @brief Build the discovery messages of all sensors into the discovery cache.
+ * @param sensor_configs Array of sensor configurations.
+ * @param number_of_configs Number of sensor configurations.
+ * @return FNV-1a hash of every cached topic and document.
+ */
+static uint32_t build_discovery_cache(const sensor_config_t *sensor_configs, int number_of_configs) {
+    size_t used = 0;
+    uint32_t hash = 2166136261u;
+
+    mqtt_discovery_count = 0;
+    if (number_of_configs == 0) {
+        return hash;
+    }
+    if (mqtt_discovery_mode == MQTT_DISCOVERY_MODE_DEVICE) {
+        add_discovery_cache_entry(&used, &hash, sensor_configs, number_of_configs, -1);
+    } else {
+        for (int i = 0; i < number_of_configs; i++) {
+            add_discovery_cache_entry(&used, &hash, sensor_configs, number_of_configs, i);
+        }
+    }
+    return hash;
+}
+
+/**
+ * @brief Read the discovery hash stored by the last boot that published discovery.
+ * @param hash Destination for the hash.
+ * @return true if a hash was stored.
+ */
+static bool load_discovery_hash(uint32_t *hash) {
+    nvs_handle_t handle;
+    if (nvs_open(MQTT_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return false;
+    }
+    esp_err_t err = nvs_get_u32(handle, MQTT_NVS_DISCOVERY_HASH_KEY, hash);
+    nvs_close(handle);
+    return err == ESP_OK;
+}
+
+/**
+ * @brief Store the hash of the published discovery messages.
+ * @param hash Hash returned by build_discovery_cache().
+ */
+static void store_discovery_hash(uint32_t hash) {
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(MQTT_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err == ESP_OK) {
+        err = nvs_set_u32(handle, MQTT_NVS_DISCOVERY_HASH_KEY, hash);
+        if (err == ESP_OK) {
+            err = nvs_commit(handle);
+        }
+        nvs_close(handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(mqtt_log_tag, "Could not store the discovery hash: %s", esp_err_to_name(err));
+    }
+}
+
+/**
+ * @brief Tell a discovery round the outcome of one of its messages.
+ *
+ * Once every message of the round has its outcome and all were acknowledged, the hash of the round is
+ * stored. Runs in the task reporting the outcome, the NVS write happens at most once per changed discovery.
+ *
+ * @param delivery Outcome of the message.
+ * @param arg Number of the round, see begin_discovery_round().
+ */
+static void discovery_delivered(mqtt_delivery_t delivery, void *arg) {
+    uint32_t round = (uint32_t)(uintptr_t)arg;
+
+    portENTER_CRITICAL(&mqtt_discovery_lock);
+    if (round != mqtt_discovery_round.round || mqtt_discovery_round.pending == 0) {
+        portEXIT_CRITICAL(&mqtt_discovery_lock);
+        return;
+    }
+    if (delivery != MQTT_DELIVERY_CONFIRMED) {
+        mqtt_discovery_round.failed = true;
+    }
+    bool done = --mqtt_discovery_round.pending == 0;
+    bool failed = mqtt_discovery_round.failed;
+    uint32_t hash = mqtt_discovery_round.hash;
+    portEXIT_CRITICAL(&mqtt_discovery_lock);
+
+    if (done && !failed) {
+        store_discovery_hash(hash);
+        ESP_LOGI(mqtt_log_tag, "Discovery acknowledged by the broker (hash %08lx)", (unsigned long)hash);
+    } else if (done) {
+        ESP_LOGW(mqtt_log_tag, "Discovery not fully acknowledged, it is sent again with the next boot");
+    }
+}
 
+/**
+ * @brief Start a discovery round, replacing a running one.
+ *
+ * The round holds one pending outcome of its own until the caller ends it with
+ * discovery_delivered(MQTT_DELIVERY_CONFIRMED), so it cannot complete while messages are still being added.
+ *
+ * @param hash Hash to store once the round is acknowledged.
+ * @return Number of the round, never 0.
+ */
+static uint32_t begin_discovery_round(uint32_t hash) {
+    portENTER_CRITICAL(&mqtt_discovery_lock);
+    if (++mqtt_discovery_round.round == 0) {
+        mqtt_discovery_round.round = 1;
+    }
+    mqtt_discovery_round.hash = hash;
+    mqtt_discovery_round.pending = 1;
+    mqtt_discovery_round.failed = false;
+    uint32_t round = mqtt_discovery_round.round;
+    portEXIT_CRITICAL(&mqtt_discovery_lock);
+    return round;
+}
+
+/**
+ * @brief Publish a retained discovery message, as part of a discovery round or on its own.
+ * @param client MQTT client handle.
+ * @param topic Discovery topic.
+ * @param payload Discovery document, or "" to clear the topic.
+ * @param length Length of the payload in bytes.
+ * @param round Number of the round from begin_discovery_round(), 0 for none.
+ * @return Message ID, or -1 if the message was not published.
+ */
+static int publish_discovery_message(esp_mqtt_client_handle_t client, const char *topic, const char *payload, int length,
+                                     uint32_t round) {
+    if (round == 0) {
+        return mqtt_publish_message(client, topic, payload, length, MQTT_CLASS_DISCOVERY, 0);
+    }
+
+    portENTER_CRITICAL(&mqtt_discovery_lock);
+    if (round == mqtt_discovery_round.round) {
+        mqtt_discovery_round.pending++;
+    }
+    portEXIT_CRITICAL(&mqtt_discovery_lock);
+
+    int msg_id = mqtt_publish_tracked(client, topic, payload, length, MQTT_CLASS_DISCOVERY, 0,
+                                      discovery_delivered, (void *)(uintptr_t)round);
+    if (msg_id < 0) {
+        discovery_delivered(MQTT_DELIVERY_DROPPED, (void *)(uintptr_t)round);
+    }
+    return msg_id;
+}
+
+/**
+ * @brief Clear the retained discovery messages of the discovery mode not in use.
+ * @param client MQTT client handle.
+ * @param sensor_configs Array of sensor configurations.
+ * @param number_of_configs Number of sensor configurations.
+ * @param round Number of the discovery round the clears belong to.
+ */
+static void clear_other_discovery_mode(esp_mqtt_client_handle_t client, const sensor_config_t *sensor_configs,
+                                       int number_of_configs, uint32_t round) {
+    // An empty retained message removes the config from the broker and the entity from Home Assistant
+    if (mqtt_discovery_mode == MQTT_DISCOVERY_MODE_DEVICE) {
+        for (int i = 0; i < number_of_configs; i++) {
+            publish_discovery_message(client, sensor_configs[i].discovery_topic, "", 0, round);
+        }
+    } else if (number_of_configs > 0) {
+        publish_discovery_message(client, sensor_configs[0].device_discovery_topic, "", 0, round);
+    }
+}
+
+/**
+ * @brief Publish the cached discovery messages.
+ * @param client MQTT client handle.
+ * @param round Number of the discovery round the messages belong to, 0 for none.
+ * @return true if every cached message was accepted by the client.
+ */
+static bool publish_discovery_cache(esp_mqtt_client_handle_t client, uint32_t round) {
+    bool sent = true;
+    int count = mqtt_discovery_count;
+
+    for (int i = 0; i < count; i++) {
+        const mqtt_discovery_entry_t *entry = &mqtt_discovery_entries[i];
+        if (publish_discovery_message(client, entry->topic, entry->payload, entry->length, round) < 0) {
+            sent = false;
+            continue;
+        }
+        ESP_LOGD(mqtt_log_tag, "Sent discovery message: %s", entry->payload);
+    }
+    return sent;
+}
+
+bool republish_sensor_discoveries(esp_mqtt_client_handle_t client) {
+    return publish_discovery_cache(client, 0);
+}
+
+void send_all_sensor_discoveries(esp_mqtt_client_handle_t client, const sensor_config_t *sensor_configs, int number_of_configs) {
+    uint32_t hash = build_discovery_cache(sensor_configs, number_of_configs);
+
+    // The broker still retains the messages of the last boot if nothing has changed since
+    uint32_t stored_hash;
+    if (load_discovery_hash(&stored_hash) && stored_hash == hash) {
+        ESP_LOGI(mqtt_log_tag, "Discovery unchanged (hash %08lx), not sent", (unsigned long)hash);
+        return;
+    }
+
+    // The hash is stored once the retained messages and clears are acknowledged, see discovery_delivered()
+    uint32_t round = begin_discovery_round(hash);
+    clear_other_discovery_mode(client, sensor_configs, number_of_configs, round);
+    if (publish_discovery_cache(client, round)) {
+        ESP_LOGI(mqtt_log_tag, "Sent %d discovery messages (hash %08lx)", mqtt_discovery_count, (unsigned long)hash);
+    }
+    discovery_delivered(MQTT_DELIVERY_CONFIRMED, (void *)(uintptr_t)round);
+}
+
+void send_sensor_data_array(esp_mqtt_client_handle_t client, const sensor_data_t *sensor_data_array, size_t data_count) {
     for (int i = 0; i < data_count; i++) {
         const sensor_data_t *data = &sensor_data_array[i];
-        root = cJSON_CreateObject();
-
-        switch (data->value.type) {
-            case VALUE_TYPE_FLOAT:
-                // Formatierung hier direkt im cJSON-Objekt
-                snprintf(json_string, sizeof(json_string), "%.2f", data->value.float_value);
-                cJSON_AddStringToObject(root, data->sensor_type, json_string);
-                break;
-            case VALUE_TYPE_INT:
-                cJSON_AddNumberToObject(root, data->sensor_type, data->value.int_value);
-                break;
-            case VALUE_TYPE_DOUBLE:
-                // Formatierung hier direkt im cJSON-Objekt
-                snprintf(json_string, sizeof(json_string), "%.2f", data->value.double_value);
-                cJSON_AddStringToObject(root, data->sensor_type, json_string);
-                break;
-            case VALUE_TYPE_STRING:
-                cJSON_AddStringToObject(root, data->sensor_type, data->value.string_value);
-                break;
-        }
-
-        char *formatted_json = cJSON_PrintUnformatted(root);
-        esp_mqtt_client_publish(client, data->topic, formatted_json, 0, 1, 0);
-        free(formatted_json);
-        cJSON_Delete(root);
+        publish_sensor_value(client, data->topic, data->sensor_type, &data->value, 0, 0, NULL, NULL);
+    }
+}
+
+/**
+ * @brief Check whether a value moved past the deadband of its rule.
+ * @param rule Report rule of the channel.
+ * @param last Last published value.
+ * @param value New value.
+ * @return true if the value changed by more than the deadband, or at all without one.
+ */
+static bool sensor_value_changed(const sensor_report_rule_t *rule, const sensor_value_t *last, const sensor_value_t *value) {
+    double from, to;
+    switch (value->type) {
+        case VALUE_TYPE_FLOAT:
+            from = last->float_value;
+            to = value->float_value;
+            break;
+        case VALUE_TYPE_INT:
+        case VALUE_TYPE_INT16:
+            from = last->int_value;
+            to = value->int_value;
+            break;
+        case VALUE_TYPE_DOUBLE:
+            from = last->double_value;
+            to = value->double_value;
+            break;
+        case VALUE_TYPE_STRING:
+        default:
+            return strcmp(last->string_value, value->string_value) != 0;
+    }
+
+    // The larger of the two deadbands applies
+    double deadband = rule->deadband;
+    double relative = fabs(from) * rule->deadband_percent / 100;
+    if (relative > deadband) {
+        deadband = relative;
+    }
+    return deadband > 0 ? fabs(to - from) > deadband : to != from;
+}
+
+/**
+ * @brief Decide which channels of a frame are due by their report rules.
+ * @param fields Array of field descriptors for the frame.
+ * @param field_count Number of field descriptors, at most MQTT_REPORT_CHANNELS.
+ * @param values Values of the frame.
+ * @param now_us esp_timer time of the publish.
+ * @param due Destination, true for every channel to publish.
+ * @return Number of channels due.
+ */
+static size_t select_due_channels(const sensor_field_t *fields, size_t field_count, const sensor_value_t *values,
+                                  int64_t now_us, bool *due) {
+    portENTER_CRITICAL(&mqtt_report_lock);
+    // A connect or another field table starts over with every channel, outcomes still on their way are ignored
+    if (mqtt_report_resync || fields != mqtt_report_fields) {
+        mqtt_report_resync = false;
+        mqtt_report_fields = fields;
+        memset(mqtt_report_states, 0, sizeof(mqtt_report_states));
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < field_count; i++) {
+        const sensor_report_rule_t *rule = &fields[i].report;
+        const mqtt_report_state_t *state = &mqtt_report_states[i];
+        // A value on its way counts as reported until it turns out to be dropped
+        bool reported = state->reported || state->pending != 0;
+        const sensor_value_t *last = state->pending != 0 ? &state->pending_value : &state->value;
+        int64_t last_us = state->pending != 0 ? state->pending_us : state->reported_us;
+        int64_t elapsed_ms = (now_us - last_us) / 1000;
+
+        due[i] = !mqtt_report_on_change || !reported ||
+                 (rule->max_interval_ms > 0 && elapsed_ms >= rule->max_interval_ms) ||
+                 (elapsed_ms >= rule->min_interval_ms && sensor_value_changed(rule, last, &values[i]));
+        if (due[i]) {
+            count++;
+        }
+    }
+    mqtt_report_suppressed += field_count - count;
+    portEXIT_CRITICAL(&mqtt_report_lock);
+    return count;
+}
+
+/**
+ * @brief Take the number of the next report publish.
+ * @return Number passed to report_delivered() as its argument, never 0.
+ */
+static uint32_t next_report_publish(void) {
+    portENTER_CRITICAL(&mqtt_report_lock);
+    if (++mqtt_report_publish == 0) {
+        mqtt_report_publish = 1;
+    }
+    uint32_t publish = mqtt_report_publish;
+    portEXIT_CRITICAL(&mqtt_report_lock);
+    return publish;
+}
+
+/**
+ * @brief Remember a value that was handed to a publish until its outcome is known.
+ * @param channel Index of the channel.
+ * @param publish Number of the publish from next_report_publish().
+ * @param value Published value.
+ * @param now_us esp_timer time of the publish.
+ */
+static void mark_pending(size_t channel, uint32_t publish, const sensor_value_t *value, int64_t now_us) {
+    portENTER_CRITICAL(&mqtt_report_lock);
+    mqtt_report_state_t *state = &mqtt_report_states[channel];
+    state->pending = publish;
+    state->pending_value = *value;
+    state->pending_us = now_us;
+    portEXIT_CRITICAL(&mqtt_report_lock);
+}
+
+/**
+ * @brief Delivery handler of report publishes.
+ *
+ * A confirmed value becomes the reference of its channel's report rule; a dropped one leaves the last
+ * delivered value in place, so the channel is due again with the next frame.
+ *
+ * @param delivery Outcome of the publish.
+ * @param arg Number of the publish from next_report_publish().
+ */
+static void report_delivered(mqtt_delivery_t delivery, void *arg) {
+    uint32_t publish = (uint32_t)(uintptr_t)arg;
+
+    portENTER_CRITICAL(&mqtt_report_lock);
+    for (size_t i = 0; i < MQTT_REPORT_CHANNELS; i++) {
+        mqtt_report_state_t *state = &mqtt_report_states[i];
+        if (state->pending != publish) {
+            continue;
+        }
+        if (delivery == MQTT_DELIVERY_CONFIRMED) {
+            state->reported = true;
+            state->value = state->pending_value;
+            state->reported_us = state->pending_us;
+            mqtt_report_sent++;
+        }
+        state->pending = 0;
+    }
+    portEXIT_CRITICAL(&mqtt_report_lock);
+}
+
+/**
+ * @brief Publish channels of a frame as one JSON document.
+ * @param client MQTT client handle.
+ * @param topic MQTT topic for the document.
+ * @param fields Array of field descriptors for the frame.
+ * @param values Values of the frame.
+ * @param field_count Number of field descriptors.
+ * @param include Channels to add, NULL for all.
+ * @param sequence Frame sequence number.
+ * @param timestamp_us Sample time of the frame in microseconds.
+ * @param handler Handler of the delivery outcome, see mqtt_publish_tracked(), NULL for none.
+ * @param arg Argument of the handler.
+ * @return Message ID, or -1 if the document was not published.
+ */
+static int publish_sensor_document(esp_mqtt_client_handle_t client, const char *topic, const sensor_field_t *fields,
+                                   const sensor_value_t *values, size_t field_count, const bool *include,
+                                   uint32_t sequence, int64_t timestamp_us, mqtt_delivery_handler_t handler, void *arg) {
+    int64_t start_us = esp_timer_get_time();
+    char message[MQTT_JSON_BUFFER_SIZE];
+    json_writer_t writer;
+
+    mqtt_topic_sequence_t *counter = sequence != 0 ? find_topic_sequence(topic) : NULL;
+    uint32_t number = counter != NULL ? counter->published + 1 : 0;
+
+    // The value templates pick their key out of the document, and keep their state if it is missing
+    json_writer_init(&writer, message, sizeof(message), false);
+    json_writer_begin_object(&writer, NULL);
+    for (size_t i = 0; i < field_count; i++) {
+        if (include == NULL || include[i]) {
+            add_sensor_value(&writer, fields[i].sensor_type, &values[i]);
+        }
+    }
+    add_frame_metadata(&writer, sequence, number, timestamp_us);
+    json_writer_end_object(&writer);
+    mqtt_metrics_serialized(esp_timer_get_time() - start_us);
+    return publish_frame_json(client, topic, &writer, counter, number, sequence, timestamp_us, handler, arg);
+}
+
+void send_sensor_frame(esp_mqtt_client_handle_t client, const sensor_field_t *fields, size_t field_count, const void *frame,
+                       uint32_t sequence, int64_t timestamp_us) {
+    bool batched = mqtt_state_mode == MQTT_STATE_MODE_BATCHED && mqtt_device_state_topic != NULL;
+    if (batched && get_mqtt_payload_format(mqtt_device_state_topic) == MQTT_PAYLOAD_FORMAT_PACKED) {
+        send_sensor_record(client, mqtt_device_state_topic, fields, field_count, frame, sequence, timestamp_us);
+        return;
+    }
+    if (field_count > MQTT_REPORT_CHANNELS) {
+        ESP_LOGE(mqtt_log_tag, "Frame has more than %d channels", MQTT_REPORT_CHANNELS);
+        return;
+    }
+
+    sensor_value_t values[MQTT_REPORT_CHANNELS];
+    bool due[MQTT_REPORT_CHANNELS];
+    for (size_t i = 0; i < field_count; i++) {
+        values[i] = sensor_field_value(&fields[i], frame);
+    }
+    int64_t now_us = esp_timer_get_time();
+    if (select_due_channels(fields, field_count, values, now_us, due) == 0) {
+        return;
+    }
+
+    // The values are pending before the publish, its outcome may be reported before it returns
+    if (batched) {
+        uint32_t publish = next_report_publish();
+        for (size_t i = 0; i < field_count; i++) {
+            if (due[i]) {
+                mark_pending(i, publish, &values[i], now_us);
+            }
+        }
+        if (publish_sensor_document(client, mqtt_device_state_topic, fields, values, field_count, due,
+                                    sequence, timestamp_us, report_delivered, (void *)(uintptr_t)publish) < 0) {
+            report_delivered(MQTT_DELIVERY_DROPPED, (void *)(uintptr_t)publish);
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < field_count; i++) {
+        if (!due[i]) {
+            continue;
+        }
+        // A value that was dropped stays due for the next frame
+        uint32_t publish = next_report_publish();
+        mark_pending(i, publish, &values[i], now_us);
+        if (publish_sensor_value(client, fields[i].topic, fields[i].sensor_type, &values[i], sequence, timestamp_us,
+                                 report_delivered, (void *)(uintptr_t)publish) < 0) {
+            report_delivered(MQTT_DELIVERY_DROPPED, (void *)(uintptr_t)publish);
+        }
+    }
+}
+
+int send_sensor_record(esp_mqtt_client_handle_t client, const char *topic, const sensor_field_t *fields,
+                       size_t field_count, const void *frame, uint32_t sequence, int64_t timestamp_us) {
+    if (get_mqtt_payload_format(topic) == MQTT_PAYLOAD_FORMAT_PACKED) {
+        int64_t start_us = esp_timer_get_time();
+        uint8_t packed[MQTT_PACKED_BUFFER_SIZE];
+        size_t length = telemetry_encode_frame(packed, sizeof(packed), fields, field_count, frame, sequence, timestamp_us);
+        mqtt_metrics_serialized(esp_timer_get_time() - start_us);
+        if (length == 0) {
+            ESP_LOGE(mqtt_log_tag, "Packed frame for %s does not fit into %u bytes", topic, (unsigned)sizeof(packed));
+            return -1;
+        }
+        return publish_message(client, topic, (const char *)packed, (int)length, get_mqtt_topic_class(topic), timestamp_us,
+                               MQTT_CONTENT_TYPE_PACKED, sequence, NULL, NULL);
+    }
+
+    if (field_count > MQTT_REPORT_CHANNELS) {
+        ESP_LOGE(mqtt_log_tag, "Frame for %s has more than %d channels", topic, MQTT_REPORT_CHANNELS);
+        return -1;
+    }
+    sensor_value_t values[MQTT_REPORT_CHANNELS];
+    for (size_t i = 0; i < field_count; i++) {
+        values[i] = sensor_field_value(&fields[i], frame);
     }
+    return publish_sensor_document(client, topic, fields, values, field_count, NULL, sequence, timestamp_us, NULL, NULL);
 }
 
+void send_sensor_stats(esp_mqtt_client_handle_t client, const char *topic, const sensor_field_t *fields,
+                       const sensor_stats_t *stats, size_t field_count, uint32_t window_ms, uint32_t skipped_windows) {
+    // Too large for the caller's stack; only the publishing task sends statistics
+    static char message[MQTT_STATS_BUFFER_SIZE];
+    json_writer_t writer;
+
+    json_writer_init(&writer, message, sizeof(message), false);
+    json_writer_begin_object(&writer, NULL);
+    json_writer_int(&writer, "window_ms", window_ms);
+    if (skipped_windows > 0) {
+        json_writer_int(&writer, "skipped_windows", skipped_windows);
+    }
+
+    for (size_t i = 0; i < field_count; i++) {
+        const sensor_stats_t *channel = &stats[i];
+        if (channel->count == 0) {
+            continue;
+        }
+
+        // Population variance of the window, RMS follows from mean and variance
+        float variance = channel->m2 / channel->count;
+        float rms = sqrtf(channel->mean * channel->mean + variance);
+
+        json_writer_begin_object(&writer, fields[i].sensor_type);
+        json_writer_int(&writer, "count", channel->count);
+        json_writer_decimal(&writer, "mean", channel->mean, 2);
+        json_writer_decimal(&writer, "min", channel->min, 2);
+        json_writer_decimal(&writer, "max", channel->max, 2);
+        json_writer_decimal(&writer, "rms", rms, 2);
+        json_writer_decimal(&writer, "variance", variance, 2);
+        json_writer_end_object(&writer);
+    }
+
+    json_writer_end_object(&writer);
+    publish_json(client, topic, &writer, MQTT_CLASS_STATS, 0, 0, NULL, NULL);
+}
+
+void send_mqtt_diagnostics(esp_mqtt_client_handle_t client, const char *topic) {
+    mqtt_pipeline_state_t state;
+    mqtt_metrics_t metrics;
+    get_mqtt_pipeline_state(client, &state);
+    get_mqtt_metrics(&metrics);
+
+    // Too large for the caller's stack; only the publishing task sends diagnostics
+    static char message[MQTT_DIAGNOSTICS_BUFFER_SIZE];
+    json_writer_t writer;
+
+    json_writer_init(&writer, message, sizeof(message), false);
+    json_writer_begin_object(&writer, NULL);
+    json_writer_int(&writer, "uptime_s", esp_timer_get_time() / 1000000);
+    json_writer_int(&writer, "connected", state.connected);
+    json_writer_int(&writer, "protocol", mqtt_protocol_version == MQTT_PROTOCOL_V_5 ? 5 : 4);
+    json_writer_int(&writer, "errors", state.errors);
+
+    json_writer_begin_object(&writer, "outbox");
+    json_writer_int(&writer, "bytes", state.outbox_bytes);
+    json_writer_int(&writer, "peak", metrics.outbox_peak);
+    json_writer_int(&writer, "budget", state.outbox_budget);
+    json_writer_int(&writer, "in_flight", state.in_flight);
+    json_writer_end_object(&writer);
+
+    json_writer_begin_object(&writer, "throughput");
+    json_writer_int(&writer, "messages", metrics.messages);
+    json_writer_int(&writer, "bytes", metrics.bytes);
+    json_writer_decimal(&writer, "messages_s", metrics.messages_per_second, 1);
+    json_writer_decimal(&writer, "bytes_s", metrics.bytes_per_second, 0);
+    json_writer_end_object(&writer);
+
+    json_writer_begin_object(&writer, "ack");
+    json_writer_int(&writer, "count", metrics.acked);
+    json_writer_int(&writer, "untracked", metrics.untracked);
+    json_writer_int(&writer, "expired", metrics.expired);
+    json_writer_int(&writer, "mean_ms", metrics.acked > 0 ? metrics.ack_latency_total_ms / metrics.acked : 0);
+    json_writer_int(&writer, "p50_ms", mqtt_metrics_latency_percentile(&metrics, 50));
+    json_writer_int(&writer, "p90_ms", mqtt_metrics_latency_percentile(&metrics, 90));
+    json_writer_int(&writer, "p99_ms", mqtt_metrics_latency_percentile(&metrics, 99));
+    json_writer_int(&writer, "max_ms", metrics.ack_latency_max_ms);
+    // Bucket i counts acknowledgements within 2^i ms, the last one all slower ones
+    json_writer_begin_array(&writer, "histogram");
+    for (int i = 0; i < MQTT_METRICS_LATENCY_BUCKETS; i++) {
+        json_writer_int(&writer, NULL, metrics.ack_latency[i]);
+    }
+    json_writer_end_array(&writer);
+    json_writer_end_object(&writer);
+
+    json_writer_begin_object(&writer, "connection");
+    json_writer_int(&writer, "connects", metrics.connects);
+    json_writer_int(&writer, "reconnects", metrics.connects > 0 ? metrics.connects - 1 : 0);
+    json_writer_int(&writer, "last_offline_ms", metrics.last_offline_ms);
+    json_writer_int(&writer, "max_offline_ms", metrics.max_offline_ms);
+    json_writer_int(&writer, "total_offline_ms", metrics.total_offline_ms);
+    if (mqtt_tls_transport != NULL) {
+        mqtt_tls_stats_t tls;
+        get_mqtt_tls_stats(&tls);
+        json_writer_int(&writer, "tls_handshakes", tls.handshakes);
+        json_writer_int(&writer, "tls_resumed", tls.resumed);
+        json_writer_int(&writer, "tls_last_handshake_ms", tls.last_handshake_ms);
+    }
+    json_writer_end_object(&writer);
+
+    static const char *const lane_names[MQTT_LANE_COUNT] = {[MQTT_LANE_BULK] = "bulk", [MQTT_LANE_URGENT] = "urgent"};
+    json_writer_begin_object(&writer, "lanes");
+    for (int i = 0; i < MQTT_LANE_COUNT; i++) {
+        mqtt_lane_stats_t lane;
+        get_mqtt_lane_stats((mqtt_lane_t)i, &lane);
+        json_writer_begin_object(&writer, lane_names[i]);
+        json_writer_int(&writer, "queued", lane.queued);
+        json_writer_int(&writer, "dropped", lane.dropped_full);
+        json_writer_int(&writer, "free_bytes", lane.free_bytes);
+        json_writer_int(&writer, "wait_mean_us", lane.published > 0 ? lane.latency_total_us / lane.published : 0);
+        json_writer_int(&writer, "wait_max_us", lane.latency_max_us);
+        json_writer_end_object(&writer);
+    }
+    json_writer_end_object(&writer);
+
+    uint32_t report_sent, report_suppressed;
+    get_mqtt_report_counters(&report_sent, &report_suppressed);
+    json_writer_begin_object(&writer, "report");
+    json_writer_int(&writer, "on_change", mqtt_report_on_change);
+    json_writer_int(&writer, "sent", report_sent);
+    json_writer_int(&writer, "suppressed", report_suppressed);
+    json_writer_end_object(&writer);
+
+    json_writer_begin_object(&writer, "serialize");
+    json_writer_int(&writer, "count", metrics.serialized);
+    json_writer_int(&writer, "mean_us", metrics.serialized > 0 ? metrics.serialize_total_us / metrics.serialized : 0);
+    json_writer_int(&writer, "max_us", metrics.serialize_max_us);
+    json_writer_end_object(&writer);
+
+    mqtt_publish_counters_t counters;
+    get_mqtt_publish_counters(&counters);
+    uint32_t budget = 0, expired = 0, offline = 0, failed = 0;
+    for (int i = 0; i < MQTT_CLASS_COUNT; i++) {
+        budget += counters.dropped_budget[i];
+        expired += counters.dropped_expired[i];
+        offline += counters.dropped_offline[i];
+        failed += counters.dropped_failed[i];
+    }
+    json_writer_begin_object(&writer, "dropped");
+    json_writer_int(&writer, "budget", budget);
+    json_writer_int(&writer, "expired", expired);
+    json_writer_int(&writer, "offline", offline);
+    json_writer_int(&writer, "failed", failed);
+    json_writer_end_object(&writer);
+
+    json_writer_end_object(&writer);
+    publish_json(client, topic, &writer, MQTT_CLASS_STATS, 0, 0, NULL, NULL);
+}
@@ -6,8 +6,12 @@
 #define ESP_TEST_MANUELL_CUSTOM_MQTT_H
 
 #include "mqtt_client.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
 #include "ESP32_Mqtt_custom_defs.h"
+#include "mqtt_metrics.h"
 #include "string.h"
+#include "stdbool.h"
 
 /**
  * @file ESP32_Mqtt_custom.h
@@ -21,15 +25,227 @@
 #define MQTT_USERNAME   "Dominik"                             ///< Default MQTT username
 #define MQTT_PASSWORD   "dv7-2160eg"                          ///< Default MQTT password
 #define MQTT_TAG        "MQTT"
+#define MQTT_STATE_MODE MQTT_STATE_MODE_BATCHED               ///< Default way of publishing sensor frames
+#define MQTT_DISCOVERY_MODE MQTT_DISCOVERY_MODE_DEVICE        ///< Default way of publishing discovery messages
+#define MQTT_DISCOVERY_ORIGIN "ESP_Gyro"                      ///< Origin name in device discovery messages
+#ifdef CONFIG_MQTT_PROTOCOL_5
+#define MQTT_PROTOCOL_VERSION MQTT_PROTOCOL_V_5                 ///< Default protocol, falls back to 3.1.1 if the broker refuses it
+#else
+#define MQTT_PROTOCOL_VERSION MQTT_PROTOCOL_V_3_1_1             ///< Default protocol, esp-mqtt is built without MQTT 5
+#endif
+#define MQTT5_PROPERTIES      (MQTT5_PROPERTY_TOPIC_ALIAS | MQTT5_PROPERTY_CONTENT_TYPE | MQTT5_PROPERTY_SEQUENCE | MQTT5_PROPERTY_EXPIRY) ///< Default MQTT 5 properties
+
+#define MQTT_JSON_BUFFER_SIZE       768     ///< Stack buffer for state and discovery documents in bytes
+#define MQTT_STATS_BUFFER_SIZE      2048    ///< Static buffer for the statistics document in bytes
+#define MQTT_DIAGNOSTICS_BUFFER_SIZE 1536   ///< Static buffer for the diagnostics document in bytes
+#define MQTT_DIAGNOSTICS_PERIOD_MS  60000   ///< Default interval of send_mqtt_diagnostics() calls in milliseconds
+#define MQTT_PACKED_BUFFER_SIZE     256     ///< Stack buffer for packed telemetry frames in bytes
+#define MQTT_TOPIC_OPTIONS          4       ///< Number of topics that can get a payload format or message class of their own
+#define MQTT_SUBSCRIPTIONS          4       ///< Number of topics that can be subscribed with mqtt_subscribe_handler()
+#define MQTT_OUTBOX_BUDGET          16384   ///< Default upper bound of the MQTT outbox in bytes
+#define MQTT_PUBLISH_LANES          true    ///< Default for publishing through the lanes of mqtt_lanes.h
+#define MQTT_TOPIC_MAX_LENGTH       160     ///< Topic length mqtt_can_publish() reserves in a lane
+#define MQTT_REPORT_ON_CHANGE       true    ///< Default for applying the report rules of sensor_field_t in send_sensor_frame()
+#define MQTT_REPORT_CHANNELS        32      ///< Channels whose last delivered value send_sensor_frame() keeps
+#define MQTT_DISCOVERY_CACHE_SIZE   6144    ///< Static buffer for the documents of all discovery messages in bytes
+#define MQTT_DISCOVERY_MAX          16      ///< Maximum number of cached discovery messages
+#define MQTT_TOPIC_ALIASES          10      ///< Topic aliases per connection with MQTT 5, Mosquitto allows 10 by default
+#define MQTT_DELIVERY_SLOTS         64      ///< Tracked messages whose outcome can be pending at a time, including send_sensor_frame() publishes
+#define MQTT_EARLY_OUTCOMES         8       ///< Acknowledgements kept for tracked messages whose publish has not returned yet
+#define MQTT_EARLY_OUTCOME_MS       1000    ///< How long such an acknowledgement is kept in milliseconds
+
+#define MQTT_CONNECTED_BIT          (1 << 0)    ///< Event group bit set while the client is connected to the broker
+#define MQTT_ERROR_BIT              (1 << 1)    ///< Event group bit set by MQTT_EVENT_ERROR, cleared on the next connect
+
+#define MQTT_WALL_CLOCK_VALID_AFTER 1704067200  ///< Unix time (2024-01-01) before which the wall clock counts as not set
+
+#define MQTT_DISCOVERY_STATUS_TOPIC "homeassistant/status"  ///< Topic of Home Assistant's birth and last will messages
+#define MQTT_DISCOVERY_ONLINE       "online"                ///< Birth message Home Assistant sends after it started
+#define MQTT_NVS_NAMESPACE          "mqtt"                  ///< NVS namespace of the MQTT component
+#define MQTT_NVS_DISCOVERY_HASH_KEY "disc_hash"             ///< NVS key of the hash of the last published discovery
+
+#define MQTT_CONTENT_TYPE_JSON      "application/json"                  ///< MQTT 5 content type of JSON documents
+#define MQTT_CONTENT_TYPE_PACKED    "application/x-packed-telemetry"    ///< MQTT 5 content type of packed frames, see telemetry_codec.h
+
+/* Bits of set_mqtt5_properties() */
+#define MQTT5_PROPERTY_TOPIC_ALIAS  (1 << 0)    ///< Replace the topic of QoS 0 messages by an alias after its first publish
+#define MQTT5_PROPERTY_CONTENT_TYPE (1 << 1)    ///< Content type and payload format indicator of JSON and packed frames
+#define MQTT5_PROPERTY_SEQUENCE     (1 << 2)    ///< Frame sequence number as the user property "seq"
+#define MQTT5_PROPERTY_EXPIRY       (1 << 3)    ///< Message expiry from the expiry of the message class, so the broker never delivers stale samples
+
+/**
+ * @enum mqtt_state_mode_t
+ * @brief How send_sensor_frame() publishes a frame.
+ */
+typedef enum {
+    MQTT_STATE_MODE_BATCHED,        ///< One JSON document with every channel on the device state topic
+    MQTT_STATE_MODE_PER_CHANNEL     ///< One JSON document per channel on the channel's own state topic
+} mqtt_state_mode_t;
+
+/**
+ * @enum mqtt_discovery_mode_t
+ * @brief How send_all_sensor_discoveries() announces the sensors to Home Assistant.
+ */
+typedef enum {
+    MQTT_DISCOVERY_MODE_DEVICE,     ///< One message per device with a component per sensor, Home Assistant 2024.11 and later
+    MQTT_DISCOVERY_MODE_ENTITY      ///< One message per sensor, for older Home Assistant versions
+} mqtt_discovery_mode_t;
+
+/**
+ * @enum mqtt_payload_format_t
+ * @brief Encoding of whole frames published with send_sensor_record().
+ */
+typedef enum {
+    MQTT_PAYLOAD_FORMAT_JSON,       ///< JSON document with one key per channel, the format Home Assistant reads
+    MQTT_PAYLOAD_FORMAT_PACKED      ///< Packed binary frame, see telemetry_codec.h
+} mqtt_payload_format_t;
+
+/**
+ * @enum mqtt_message_class_t
+ * @brief Class of a published message, selects its mqtt_publish_policy_t.
+ */
+typedef enum {
+    MQTT_CLASS_TELEMETRY,   ///< High-rate frames for the ingest pipeline, QoS 0 by default
+    MQTT_CLASS_BACKFILL,    ///< Frames recorded while offline, sent with the smallest outbox share
+    MQTT_CLASS_CAPTURE,     ///< Chunks of black box captures, admitted ahead of backfill
+    MQTT_CLASS_STATE,       ///< Home Assistant state documents
+    MQTT_CLASS_STATS,       ///< Windowed statistics
+    MQTT_CLASS_EVENT,       ///< Events that must reach the broker
+    MQTT_CLASS_DISCOVERY,   ///< Home Assistant discovery messages
+    MQTT_CLASS_COUNT        ///< Number of message classes
+} mqtt_message_class_t;
+
+/**
+ * @enum mqtt_lane_t
+ * @brief Publish lane of a message class, see mqtt_lanes.h.
+ */
+typedef enum {
+    MQTT_LANE_BULK,         ///< Periodic and replayed data, rate-limited to a share of the link bandwidth
+    MQTT_LANE_URGENT,       ///< Events, always published before any bulk message
+    MQTT_LANE_COUNT         ///< Number of publish lanes
+} mqtt_lane_t;
+
+/**
+ * @struct mqtt_publish_policy_t
+ * @brief How messages of one class are published.
+ *
+ * QoS 1 and 2 messages wait in the client's outbox until they are acknowledged. A message is only
+ * admitted while the outbox stays below outbox_share percent of the outbox budget, so under a slow
+ * broker the classes with the smallest share are dropped first and the budget is never exceeded.
+ * Before that, messages wait in the publish lane of their class.
+ */
+typedef struct {
+    int qos;                ///< MQTT QoS level
+    bool retain;            ///< Retain flag
+    uint32_t expiry_ms;     ///< Drop messages whose sample is older than this when they are published, 0 to never expire
+    uint8_t outbox_share;   ///< Percentage of the outbox budget up to which messages of this class are admitted
+    bool queue_offline;     ///< Keep QoS 1 and 2 messages in the outbox while disconnected instead of dropping them
+    mqtt_lane_t lane;       ///< Publish lane the messages wait in
+} mqtt_publish_policy_t;
+
+/**
+ * @struct mqtt_publish_counters_t
+ * @brief Outcome of all publishes since startup, per message class.
+ */
+typedef struct {
+    uint32_t published[MQTT_CLASS_COUNT];           ///< Messages handed to the MQTT client
+    uint32_t dropped_budget[MQTT_CLASS_COUNT];      ///< Messages dropped because the outbox was over its share
+    uint32_t dropped_expired[MQTT_CLASS_COUNT];     ///< Messages dropped because their sample was too old
+    uint32_t dropped_offline[MQTT_CLASS_COUNT];     ///< Messages dropped because the client was disconnected
+    uint32_t dropped_failed[MQTT_CLASS_COUNT];      ///< Messages the MQTT client refused
+} mqtt_publish_counters_t;
+
+/**
+ * @enum mqtt_delivery_t
+ * @brief Final outcome of a message published with mqtt_publish_tracked().
+ */
+typedef enum {
+    MQTT_DELIVERY_CONFIRMED,    ///< QoS 0: handed to the client; QoS 1 and 2: acknowledged by the broker
+    MQTT_DELIVERY_DROPPED       ///< Dropped in its lane or by the client, or deleted from the outbox unacknowledged
+} mqtt_delivery_t;
+
+/**
+ * @brief Handler of the outcome of a tracked message.
+ *
+ * Called exactly once for every message mqtt_publish_tracked() accepted, from the lanes' task, the MQTT
+ * client task or the publishing task itself, so it must not block for long.
+ *
+ * @param delivery Outcome of the message.
+ * @param arg Argument given to mqtt_publish_tracked().
+ */
+typedef void (*mqtt_delivery_handler_t)(mqtt_delivery_t delivery, void *arg);
+
+/**
+ * @brief Handler of the messages of a class that were accepted and then dropped at their turn in the lane.
+ *
+ * Runs in the lanes' task, so it must not block for long.
+ *
+ * @param message_class Message class of the message.
+ * @param data Payload, only valid during the call.
+ * @param length Length of the payload in bytes.
+ * @param arg Argument given to set_mqtt_drop_handler().
+ */
+typedef void (*mqtt_drop_handler_t)(mqtt_message_class_t message_class, const char *data, int length, void *arg);
+
+/**
+ * @brief Handler of the messages received on a subscribed topic.
+ *
+ * Runs in the MQTT client task, so it must not block for long.
+ *
+ * @param client MQTT client handle.
+ * @param topic Topic the handler was registered for.
+ * @param data Payload, not NUL-terminated.
+ * @param length Length of the payload in bytes.
+ * @param arg Argument given to mqtt_subscribe_handler().
+ */
+typedef void (*mqtt_message_handler_t)(esp_mqtt_client_handle_t client, const char *topic, const char *data, int length, void *arg);
+
+/**
+ * @struct mqtt_pipeline_state_t
+ * @brief Connection state and backpressure of the publish pipeline.
+ */
+typedef struct {
+    bool connected;         ///< Client is connected to the broker
+    int in_flight;          ///< QoS 1 and 2 messages handed to the client and not yet acknowledged
+    int outbox_bytes;       ///< Bytes waiting in the client's outbox, the queue depth
+    size_t outbox_budget;   ///< Upper bound of the outbox in bytes
+    uint32_t errors;        ///< MQTT_EVENT_ERROR events since startup
+} mqtt_pipeline_state_t;
 
 // Variables for MQTT Configuration
 extern const char* mqtt_broker;
 extern const char* mqtt_username;
 extern const char* mqtt_password;
+extern const char* mqtt_ca_certificate;                 ///< CA of TLS connections, NULL for plain TCP
 extern const char* mqtt_log_tag;                        ///< Tag for ESP logging
+extern mqtt_state_mode_t mqtt_state_mode;               ///< How sensor frames are published
+extern const char* mqtt_device_state_topic;             ///< Device state topic for MQTT_STATE_MODE_BATCHED
+extern size_t mqtt_outbox_budget;                       ///< Upper bound of the outbox in bytes
+extern bool mqtt_publish_lanes;                         ///< Publish through the lanes of mqtt_lanes.h
+extern bool mqtt_report_on_change;                      ///< Apply the report rules of sensor_field_t
 
 // Setter, Getter for Configuration
 
+/**
+ * @brief Set the MQTT protocol version.
+ *
+ * Call it before mqtt_app_start(). MQTT_PROTOCOL_V_5 needs CONFIG_MQTT_PROTOCOL_5; when the broker refuses it,
+ * the client falls back to MQTT_PROTOCOL_V_3_1_1 on its own.
+ *
+ * @param version MQTT_PROTOCOL_V_3_1_1 or MQTT_PROTOCOL_V_5.
+ */
+void set_mqtt_protocol_version(esp_mqtt_protocol_ver_t version);
+
+/**
+ * @brief Set which MQTT 5 properties are sent with frames.
+ *
+ * Every property costs bytes in each message, topic aliases save the length of the topic. The first
+ * MQTT_TOPIC_ALIASES topics of QoS 0 messages that are shorter than MQTT_TOPIC_MAX_LENGTH get an alias. Ignored with MQTT 3.1.1.
+ *
+ * @param properties MQTT5_PROPERTY_* bits.
+ */
+void set_mqtt5_properties(uint32_t properties);
+
 /**
  * @brief Set the MQTT broker URI.
  * @param broker URI of the MQTT broker.
@@ -48,12 +264,130 @@ void set_mqtt_username(const char* username);
  */
 void set_mqtt_password(const char* password);
 
+/**
+ * @brief Set the CA certificate the broker's certificate must chain to, and connect over TLS.
+ *
+ * Call it before mqtt_app_start() together with an mqtts:// broker URI. The connection then runs over the
+ * transport of mqtt_tls_transport.h, which resumes the TLS session on reconnects and after deep sleep.
+ *
+ * @param certificate PEM certificate, must stay valid. NULL for a plain TCP connection.
+ */
+void set_mqtt_ca_certificate(const char* certificate);
+
 /**
  * @brief Set the log tag for MQTT operations.
  * @param log_tag Log tag string.
  */
 void set_mqtt_log_tag(const char* log_tag);
 
+/**
+ * @brief Set how sensor frames are published.
+ *
+ * Takes effect for discovery messages sent afterwards, so set it before send_all_sensor_discoveries().
+ *
+ * @param mode MQTT_STATE_MODE_BATCHED or MQTT_STATE_MODE_PER_CHANNEL.
+ */
+void set_mqtt_state_mode(mqtt_state_mode_t mode);
+
+/**
+ * @brief Set how discovery messages are published.
+ *
+ * Set it before send_all_sensor_discoveries().
+ *
+ * @param mode MQTT_DISCOVERY_MODE_DEVICE or MQTT_DISCOVERY_MODE_ENTITY.
+ */
+void set_mqtt_discovery_mode(mqtt_discovery_mode_t mode);
+
+/**
+ * @brief Set the device state topic used by MQTT_STATE_MODE_BATCHED.
+ *
+ * Without a device state topic frames are published per channel.
+ *
+ * @param topic Device state topic.
+ */
+void set_mqtt_device_state_topic(const char* topic);
+
+/**
+ * @brief Set the payload format of frames published on a topic.
+ *
+ * Topics without a format of their own get MQTT_PAYLOAD_FORMAT_JSON. The topic string is stored, not copied.
+ *
+ * @param topic MQTT topic.
+ * @param format Payload format for the topic.
+ * @return esp_err_t ESP_OK on success, ESP_ERR_NO_MEM if MQTT_TOPIC_OPTIONS topics already have options.
+ */
+esp_err_t set_mqtt_payload_format(const char* topic, mqtt_payload_format_t format);
+
+/**
+ * @brief Set the message class of frames published on a topic.
+ *
+ * Topics without a class of their own are MQTT_CLASS_STATE. The topic string is stored, not copied.
+ *
+ * @param topic MQTT topic.
+ * @param message_class Message class for the topic.
+ * @return esp_err_t ESP_OK on success, ESP_ERR_NO_MEM if MQTT_TOPIC_OPTIONS topics already have options.
+ */
+esp_err_t set_mqtt_topic_class(const char* topic, mqtt_message_class_t message_class);
+
+/**
+ * @brief Set the publish policy of a message class.
+ * @param message_class Message class.
+ * @param policy QoS, retain flag, expiry, outbox share and lane for the class.
+ */
+void set_mqtt_publish_policy(mqtt_message_class_t message_class, const mqtt_publish_policy_t *policy);
+
+/**
+ * @brief Set the handler of the messages of a class that are dropped after they were queued.
+ *
+ * Such a drop happens after the publish function returned success, so the sender cannot see it; the
+ * handler gets the payload instead, e.g. to keep the message for backfill.
+ *
+ * @param message_class Message class.
+ * @param handler Handler, NULL for none.
+ * @param arg Argument passed to the handler.
+ */
+void set_mqtt_drop_handler(mqtt_message_class_t message_class, mqtt_drop_handler_t handler, void *arg);
+
+/**
+ * @brief Set whether messages are published through the lanes of mqtt_lanes.h.
+ *
+ * Call it before mqtt_app_start(). Without lanes every message is handed to the client by the task that
+ * sends it, and an event may wait behind bulk data.
+ *
+ * @param enabled true to publish through the lanes.
+ */
+void set_mqtt_publish_lanes(bool enabled);
+
+/**
+ * @brief Set whether send_sensor_frame() applies the report rules of its fields.
+ *
+ * Without them every channel of every frame is published.
+ *
+ * @param enabled true to publish only values that are due by their sensor_report_rule_t.
+ */
+void set_mqtt_report_on_change(bool enabled);
+
+/**
+ * @brief Set the upper bound of the MQTT outbox.
+ *
+ * Call it before mqtt_app_start(), which also passes it to the client as its outbox limit.
+ *
+ * @param budget Outbox budget in bytes.
+ */
+void set_mqtt_outbox_budget(size_t budget);
+
+/**
+ * @brief Get the MQTT protocol version.
+ * @return Version requested, or MQTT_PROTOCOL_V_3_1_1 after falling back from MQTT 5.
+ */
+esp_mqtt_protocol_ver_t get_mqtt_protocol_version(void);
+
+/**
+ * @brief Get which MQTT 5 properties are sent with frames.
+ * @return MQTT5_PROPERTY_* bits.
+ */
+uint32_t get_mqtt5_properties(void);
+
 /**
  * @brief Get the MQTT broker URI.
  * @return URI of the MQTT broker.
@@ -72,12 +406,129 @@ const char* get_mqtt_username();
  */
 const char* get_mqtt_password();
 
+/**
+ * @brief Get the CA certificate of TLS connections.
+ * @return PEM certificate, or NULL for plain TCP connections.
+ */
+const char* get_mqtt_ca_certificate();
+
 /**
  * @brief Get the log tag for MQTT operations.
  * @return Log tag string.
  */
 const char* get_mqtt_log_tag();
 
+/**
+ * @brief Get how sensor frames are published.
+ * @return Current state mode.
+ */
+mqtt_state_mode_t get_mqtt_state_mode();
+
+/**
+ * @brief Get how discovery messages are published.
+ * @return Current discovery mode.
+ */
+mqtt_discovery_mode_t get_mqtt_discovery_mode();
+
+/**
+ * @brief Get the device state topic used by MQTT_STATE_MODE_BATCHED.
+ * @return Device state topic, or NULL if none is set.
+ */
+const char* get_mqtt_device_state_topic();
+
+/**
+ * @brief Get the payload format of frames published on a topic.
+ * @param topic MQTT topic.
+ * @return Payload format set for the topic, MQTT_PAYLOAD_FORMAT_JSON if none was set.
+ */
+mqtt_payload_format_t get_mqtt_payload_format(const char* topic);
+
+/**
+ * @brief Get the message class of frames published on a topic.
+ * @param topic MQTT topic.
+ * @return Message class set for the topic, MQTT_CLASS_STATE if none was set.
+ */
+mqtt_message_class_t get_mqtt_topic_class(const char* topic);
+
+/**
+ * @brief Get the publish policy of a message class.
+ * @param message_class Message class.
+ * @return Publish policy of the class.
+ */
+mqtt_publish_policy_t get_mqtt_publish_policy(mqtt_message_class_t message_class);
+
+/**
+ * @brief Get the upper bound of the MQTT outbox.
+ * @return Outbox budget in bytes.
+ */
+size_t get_mqtt_outbox_budget();
+
+/**
+ * @brief Get whether send_sensor_frame() applies the report rules of its fields.
+ * @return true if only values that are due are published.
+ */
+bool get_mqtt_report_on_change(void);
+
+/**
+ * @brief Get how many channel values send_sensor_frame() delivered and held back by their report rules.
+ * @param sent Destination for the values whose delivery was confirmed.
+ * @param suppressed Destination for the values held back.
+ */
+void get_mqtt_report_counters(uint32_t *sent, uint32_t *suppressed);
+
+/**
+ * @brief Get the publish and drop counters.
+ * @param counters Destination for the counters.
+ */
+void get_mqtt_publish_counters(mqtt_publish_counters_t *counters);
+
+/**
+ * @brief Get the topic a sensor's state is published on in the current state mode.
+ * @param config Sensor configuration.
+ * @return The device state topic when batching, otherwise the sensor's own state topic.
+ */
+const char* get_mqtt_sensor_state_topic(const sensor_config_t *config);
+
+/**
+ * @brief Check whether the client is connected to the broker.
+ * @return true between MQTT_EVENT_CONNECTED and MQTT_EVENT_DISCONNECTED.
+ */
+bool mqtt_is_connected(void);
+
+/**
+ * @brief Wait until the client is connected to the broker.
+ * @param timeout_ms Maximum time to wait in milliseconds.
+ * @return true if the client is connected, false on timeout or before mqtt_app_start().
+ */
+bool mqtt_wait_connected(uint32_t timeout_ms);
+
+/**
+ * @brief Get the event group holding MQTT_CONNECTED_BIT and MQTT_ERROR_BIT.
+ * @return Event group, or NULL before mqtt_app_start().
+ */
+EventGroupHandle_t get_mqtt_event_group(void);
+
+/**
+ * @brief Check without blocking whether a message would currently be admitted.
+ *
+ * Applies the same connection and outbox checks as mqtt_publish_message(), and checks that the class's
+ * lane has room, so producers can skip building a message, or keep it for later, instead of handing it
+ * to a client that would drop it.
+ *
+ * @param client MQTT client handle.
+ * @param message_class Message class whose publish policy applies.
+ * @param length Length of the payload in bytes.
+ * @return true if the message would be admitted.
+ */
+bool mqtt_can_publish(esp_mqtt_client_handle_t client, mqtt_message_class_t message_class, int length);
+
+/**
+ * @brief Get the connection state and backpressure of the publish pipeline.
+ * @param client MQTT client handle.
+ * @param state Destination for the state.
+ */
+void get_mqtt_pipeline_state(esp_mqtt_client_handle_t client, mqtt_pipeline_state_t *state);
+
 /**
  * @brief Event handler for MQTT events.
  * @param handler_args Handler arguments.
@@ -87,20 +538,118 @@ const char* get_mqtt_log_tag();
  */
 void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data);
 
+/**
+ * @brief Subscribe to a topic and pass its messages to a handler.
+ *
+ * The subscription is renewed on every connect. Only exact topics are matched, no wildcards.
+ *
+ * @param client MQTT client handle.
+ * @param topic MQTT topic, must stay valid.
+ * @param qos QoS of the subscription.
+ * @param handler Handler of the topic's messages.
+ * @param arg Argument passed to the handler.
+ * @return ESP_OK, or ESP_ERR_NO_MEM if MQTT_SUBSCRIPTIONS topics are subscribed already.
+ */
+esp_err_t mqtt_subscribe_handler(esp_mqtt_client_handle_t client, const char *topic, int qos,
+                                 mqtt_message_handler_t handler, void *arg);
+
 /**
  * @brief Initialize and start the MQTT client.
  * @return Handle to the MQTT client.
  */
 esp_mqtt_client_handle_t mqtt_app_start(void);
 
+/**
+ * @brief Publish a message under the policy of its message class.
+ *
+ * Drops the message instead of publishing it if its sample has expired, if the outbox would grow
+ * past the class's share of the outbox budget, or if the client is not connected and the message
+ * is QoS 0 or its class does not queue offline. Every outcome is counted, see get_mqtt_publish_counters().
+ * Once the lanes run, the message is checked, copied into its class's lane and checked again when its
+ * turn comes; a full lane drops it at once. A drop at its turn is only reported to the class's drop
+ * handler, see set_mqtt_drop_handler(), use mqtt_publish_tracked() to learn the outcome of a message.
+ *
+ * @param client MQTT client handle.
+ * @param topic MQTT topic.
+ * @param data Payload.
+ * @param length Length of the payload in bytes.
+ * @param message_class Message class whose publish policy applies.
+ * @param timestamp_us Sample time of the content in microseconds, 0 if it does not expire.
+ * @return Message ID (0 for QoS 0 or a queued message), or -1 if the message was dropped.
+ */
+int mqtt_publish_message(esp_mqtt_client_handle_t client, const char *topic, const char *data, int length,
+                         mqtt_message_class_t message_class, int64_t timestamp_us);
+
+/**
+ * @brief Publish a message like mqtt_publish_message() and report its final outcome.
+ *
+ * The handler learns whether the message reached the broker, also for a message that was queued in a
+ * lane first; for QoS 1 and 2 that is its acknowledgement. Up to MQTT_DELIVERY_SLOTS outcomes can be
+ * pending, further messages are dropped.
+ *
+ * @param client MQTT client handle.
+ * @param topic MQTT topic.
+ * @param data Payload.
+ * @param length Length of the payload in bytes.
+ * @param message_class Message class whose publish policy applies.
+ * @param timestamp_us Sample time of the content in microseconds, 0 if it does not expire.
+ * @param handler Handler of the outcome, called exactly once unless the message is dropped at once.
+ * @param arg Argument passed to the handler.
+ * @return Message ID (0 for QoS 0 or a queued message), or -1 if the message was dropped at once.
+ */
+int mqtt_publish_tracked(esp_mqtt_client_handle_t client, const char *topic, const char *data, int length,
+                         mqtt_message_class_t message_class, int64_t timestamp_us,
+                         mqtt_delivery_handler_t handler, void *arg);
+
+/**
+ * @brief Send the discovery message of a single sensor, retained and uncached.
+ * @param client MQTT client handle.
+ * @param config Sensor configuration.
+ */
+void send_sensor_discovery(esp_mqtt_client_handle_t client, const sensor_config_t *config);
+
+/**
+ * @brief Convert an esp_timer time to wall-clock time.
+ *
+ * The wall clock is only trusted once it has been set, e.g. by SNTP (see wifi_start_time_sync()).
+ *
+ * @param timer_us Time from esp_timer_get_time() in microseconds.
+ * @param wall_ms Filled with the Unix time in milliseconds.
+ * @return true if the wall clock is set and wall_ms was filled.
+ */
+bool mqtt_wall_clock_ms(int64_t timer_us, int64_t *wall_ms);
+
 /**
  * @brief Send discovery messages for all sensors.
+ *
+ * In MQTT_DISCOVERY_MODE_DEVICE a single message on homeassistant/device/<identifiers>/config
+ * carries every sensor as a component of the device of the first configuration, otherwise every
+ * sensor gets its own message on homeassistant/sensor/<identifiers>/<sensor_type>/config.
+ *
+ * Builds the messages once into a static cache and hashes them. They are published retained, so
+ * if the hash matches the one stored in NVS by an earlier boot the broker still has them and
+ * nothing is sent. Otherwise the retained messages of the other mode are cleared first, so switching
+ * modes does not leave duplicate entities behind. The hash is stored once the broker has acknowledged
+ * every message and clear, see mqtt_publish_tracked(); if one is lost, the next boot sends them all
+ * again. Call it after the state mode and device state topic are set, and after nvs_flash_init().
+ *
  * @param client MQTT client handle.
  * @param sensor_configs Array of sensor configurations.
  * @param number_of_configs Number of sensor configurations.
  */
 void send_all_sensor_discoveries(esp_mqtt_client_handle_t client, const sensor_config_t *sensor_configs, int number_of_configs);
 
+/**
+ * @brief Publish the cached discovery messages again.
+ *
+ * Called from the event handler when Home Assistant sends its birth message on
+ * MQTT_DISCOVERY_STATUS_TOPIC, since it may have lost the retained messages.
+ *
+ * @param client MQTT client handle.
+ * @return true if every cached message was accepted by the client.
+ */
+bool republish_sensor_discoveries(esp_mqtt_client_handle_t client);
+
 /**
  * @brief Send sensor data.
  * @param client MQTT client handle.
@@ -109,4 +658,79 @@ void send_all_sensor_discoveries(esp_mqtt_client_handle_t client, const sensor_c
  */
 void send_sensor_data_array(esp_mqtt_client_handle_t client, const sensor_data_t *sensor_data_array, size_t data_count);
 
+/**
+ * @brief Send sensor data straight out of a sample frame.
+ *
+ * In MQTT_STATE_MODE_BATCHED the frame is sent as one JSON document on the device state topic,
+ * otherwise every channel is published as JSON on its own topic, with the same "seq", "frame", "ts"
+ * and "pts" keys as send_sensor_record(). A device state topic with the packed payload format gets the whole
+ * frame from send_sensor_record().
+ *
+ * With set_mqtt_report_on_change() only channels due by the report rule of their field are sent: a
+ * value that moved past the deadband once the minimum interval is over, or any value once the
+ * maximum interval is over. The first frame after a connect, and after Home Assistant came online,
+ * sends every channel. A batched document without any due channel is not sent at all. A value only
+ * becomes the reference of its rule once its delivery is confirmed, see mqtt_publish_tracked(); a
+ * dropped value leaves the channel due for the next frame.
+ *
+ * @param client MQTT client handle.
+ * @param fields Array of field descriptors for the frame.
+ * @param field_count Number of field descriptors.
+ * @param frame Frame the descriptors refer to.
+ * @param sequence Frame sequence number.
+ * @param timestamp_us Sample time of the frame in microseconds.
+ */
+void send_sensor_frame(esp_mqtt_client_handle_t client, const sensor_field_t *fields, size_t field_count, const void *frame,
+                       uint32_t sequence, int64_t timestamp_us);
+
+/**
+ * @brief Send all channels of a sample frame as one message.
+ *
+ * JSON documents also carry the number of the message on its topic as "seq", the frame's sequence
+ * number as "frame" and, once the wall clock is set, the sample and publish times as "ts" and "pts" in
+ * Unix milliseconds, so receivers can measure latency and loss. Packed frames carry the sequence number and sample time in their header.
+ *
+ * The message is encoded in the payload format set for the topic with set_mqtt_payload_format().
+ * Sequence number and timestamp are only part of packed frames.
+ *
+ * @param client MQTT client handle.
+ * @param topic MQTT topic for the frame.
+ * @param fields Array of field descriptors for the frame.
+ * @param field_count Number of field descriptors.
+ * @param frame Frame the descriptors refer to.
+ * @param sequence Frame sequence number.
+ * @param timestamp_us Sample time of the frame in microseconds.
+ * @return Message ID, or -1 if the frame was not published.
+ */
+int send_sensor_record(esp_mqtt_client_handle_t client, const char *topic, const sensor_field_t *fields,
+                        size_t field_count, const void *frame, uint32_t sequence, int64_t timestamp_us);
+
+/**
+ * @brief Send the statistics of one window as a single JSON document.
+ *
+ * Each channel with samples becomes an object with count, mean, min, max, rms and variance.
+ * "skipped_windows" is only sent when windows before this one were never published.
+ *
+ * @param client MQTT client handle.
+ * @param topic MQTT topic for the statistics.
+ * @param fields Array of field descriptors naming the channels.
+ * @param stats Array of channel statistics in fields order.
+ * @param field_count Number of channels.
+ * @param window_ms Time between the first and last sample of the window in milliseconds.
+ * @param skipped_windows Windows closed since the last published one that were never published.
+ */
+void send_sensor_stats(esp_mqtt_client_handle_t client, const char *topic, const sensor_field_t *fields,
+                       const sensor_stats_t *stats, size_t field_count, uint32_t window_ms, uint32_t skipped_windows);
+
+/**
+ * @brief Send the pipeline metrics and state as a single JSON document.
+ *
+ * Holds the outbox size and peak, throughput, acknowledgement latency percentiles and histogram,
+ * connection outages, serialization time and drop totals, see get_mqtt_metrics(). Sent as MQTT_CLASS_STATS.
+ *
+ * @param client MQTT client handle.
+ * @param topic MQTT topic for the diagnostics.
+ */
+void send_mqtt_diagnostics(esp_mqtt_client_handle_t client, const char *topic);
+
 #endif //ESP_TEST_MANUELL_CUSTOM_MQTT_H
@@ -5,6 +5,9 @@
 #ifndef ESP_GYRO_ESP32_MQTT_CUSTOM_DEFS_H
 #define ESP_GYRO_ESP32_MQTT_CUSTOM_DEFS_H
 
+#include "stddef.h"
+#include "stdint.h"
+
 /**
  * @file ESP32_Mqtt_custom_defs.h
  * @brief Definitions for custom MQTT sensor data and configurations.
@@ -21,7 +24,8 @@ typedef enum {
     VALUE_TYPE_FLOAT,   ///< Floating point value
     VALUE_TYPE_INT,     ///< Integer value
     VALUE_TYPE_DOUBLE,  ///< Double precision floating point value
-    VALUE_TYPE_STRING   ///< String value
+    VALUE_TYPE_STRING,  ///< String value
+    VALUE_TYPE_INT16    ///< 16-bit integer value, only used by sensor_field_t
 } value_type_t;
 
 /**
@@ -48,6 +52,81 @@ typedef struct {
     const char *sensor_type;  ///< Type of the sensor
 } sensor_data_t;
 
+/**
+ * @struct sensor_report_rule_t
+ * @brief When a channel's new value is worth publishing, see send_sensor_frame().
+ *
+ * A value is published when it differs from the last published one by more than the larger of the two
+ * deadbands, but not sooner than min_interval_ms after it; and at the latest max_interval_ms after it,
+ * changed or not. All zero publishes every value.
+ */
+typedef struct {
+    float deadband;             ///< Absolute change to publish, in the channel's unit; 0 for any change
+    float deadband_percent;     ///< Change to publish relative to the last published value, in percent; 0 for none
+    uint32_t min_interval_ms;   ///< Shortest time between two published values, 0 for none
+    uint32_t max_interval_ms;   ///< Longest time without a published value, 0 for none
+} sensor_report_rule_t;
+
+/**
+ * @struct sensor_field_t
+ * @brief Struct describing where a channel lives inside a sample frame.
+ *
+ * Serializers read the value straight out of the frame instead of from a copied sensor_data_t.
+ */
+typedef struct {
+    const char *topic;        ///< MQTT topic for the sensor data
+    const char *sensor_type;  ///< Type of the sensor, used as JSON key
+    value_type_t type;        ///< Type of the value stored in the frame
+    size_t offset;            ///< Byte offset of the value inside the frame
+    float scale;              ///< Fixed-point factor of FLOAT and DOUBLE values in packed telemetry frames
+    sensor_report_rule_t report; ///< When a changed value is published to Home Assistant
+} sensor_field_t;
+
+/**
+ * @brief Read a channel out of a sample frame.
+ * @param field Field descriptor of the channel.
+ * @param frame Frame the descriptor refers to.
+ * @return Value of the channel. VALUE_TYPE_INT16 channels are widened to VALUE_TYPE_INT.
+ */
+static inline sensor_value_t sensor_field_value(const sensor_field_t *field, const void *frame) {
+    const void *src = (const char *)frame + field->offset;
+    sensor_value_t value = {.type = field->type};
+
+    switch (field->type) {
+        case VALUE_TYPE_FLOAT:
+            value.float_value = *(const float *)src;
+            break;
+        case VALUE_TYPE_INT:
+            value.int_value = *(const int *)src;
+            break;
+        case VALUE_TYPE_INT16:
+            value.type = VALUE_TYPE_INT;
+            value.int_value = *(const int16_t *)src;
+            break;
+        case VALUE_TYPE_DOUBLE:
+            value.double_value = *(const double *)src;
+            break;
+        case VALUE_TYPE_STRING:
+            value.string_value = *(const char *const *)src;
+            break;
+    }
+    return value;
+}
+
+/**
+ * @struct sensor_stats_t
+ * @brief Struct holding running statistics of one channel over a window.
+ *
+ * Updated per sample with Welford's algorithm; variance and RMS are derived when the window is reported.
+ */
+typedef struct {
+    uint32_t count;  ///< Number of samples in the window
+    float mean;      ///< Running mean
+    float m2;        ///< Sum of squared deviations from the mean
+    float min;       ///< Smallest sample
+    float max;       ///< Largest sample
+} sensor_stats_t;
+
 /**
  * @struct sensor_config_t
  * @brief Struct representing the configuration of a sensor for MQTT discovery messages.
@@ -63,6 +142,8 @@ typedef struct {
     const char *name;                 ///< Name of the device
     const char *manufacturer;         ///< Manufacturer of the device
     const char *model;                ///< Model of the device
+    const char *discovery_topic;      ///< Config topic of the sensor's own discovery message
+    const char *device_discovery_topic; ///< Config topic of the device discovery message of all sensors
 } sensor_config_t;
 
 #endif //ESP_GYRO_ESP32_MQTT_CUSTOM_DEFS_H
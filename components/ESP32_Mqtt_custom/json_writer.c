@@ -0,0 +1,317 @@
+#include "json_writer.h"
+#include "math.h"
+#include "stdio.h"
+#include "string.h"
+
+/**
+ * @file json_writer.c
+ * @brief Implementation file for the heap-free streaming JSON writer.
+ *
+ * Floats are formatted with integer arithmetic instead of snprintf. A float widened to double and
+ * scaled by at most 10^9 is exact, so ties are detected exactly: rounded half to even they give
+ * the same digits as "%.*f", rounded away from zero the same digits cJSON prints for round().
+ */
+
+static const uint64_t powers_of_ten[] = {
+        1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL
+};
+
+#define JSON_WRITER_MAX_DECIMALS 9          ///< Largest supported number of decimals
+#define JSON_WRITER_FAST_LIMIT 1e15         ///< Magnitudes from here on are formatted with snprintf
+#define JSON_WRITER_SCALED_LIMIT 1.8e19     ///< Scaled magnitudes from here on, close to 2^64, are formatted with snprintf
+
+/**
+ * @brief Append raw bytes to the buffer.
+ * @param writer JSON writer.
+ * @param data Bytes to append.
+ * @param length Number of bytes.
+ */
+static void put_bytes(json_writer_t *writer, const char *data, size_t length) {
+    if (writer->overflow) {
+        return;
+    }
+    // Always keep room for the terminator
+    if (writer->length + length >= writer->size) {
+        writer->overflow = true;
+        return;
+    }
+    memcpy(writer->buffer + writer->length, data, length);
+    writer->length += length;
+}
+
+/**
+ * @brief Append a single character to the buffer.
+ * @param writer JSON writer.
+ * @param c Character to append.
+ */
+static void put_char(json_writer_t *writer, char c) {
+    put_bytes(writer, &c, 1);
+}
+
+/**
+ * @brief Append tabs for the given depth in pretty mode.
+ * @param writer JSON writer.
+ * @param depth Number of tabs.
+ */
+static void put_indent(json_writer_t *writer, uint8_t depth) {
+    if (!writer->pretty) {
+        return;
+    }
+    for (uint8_t i = 0; i < depth; i++) {
+        put_char(writer, '\t');
+    }
+}
+
+/**
+ * @brief Append an unsigned integer in decimal.
+ * @param writer JSON writer.
+ * @param value Value to append.
+ * @param min_digits Minimum number of digits, padded with leading zeros.
+ */
+static void put_unsigned(json_writer_t *writer, uint64_t value, uint8_t min_digits) {
+    char digits[20];
+    int count = 0;
+
+    do {
+        digits[sizeof(digits) - 1 - count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0 || count < min_digits);
+
+    put_bytes(writer, &digits[sizeof(digits) - count], count);
+}
+
+/**
+ * @brief Append a quoted, escaped string.
+ * @param writer JSON writer.
+ * @param value NUL-terminated string.
+ */
+static void put_string(json_writer_t *writer, const char *value) {
+    put_char(writer, '"');
+
+    const char *run = value;
+    for (const char *p = value; *p != '\0'; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c >= 32 && c != '"' && c != '\\') {
+            continue;
+        }
+
+        // Flush the unescaped run before the character that needs escaping
+        put_bytes(writer, run, p - run);
+        run = p + 1;
+
+        char escaped[7];
+        switch (c) {
+            case '"':  put_bytes(writer, "\\\"", 2); break;
+            case '\\': put_bytes(writer, "\\\\", 2); break;
+            case '\b': put_bytes(writer, "\\b", 2); break;
+            case '\f': put_bytes(writer, "\\f", 2); break;
+            case '\n': put_bytes(writer, "\\n", 2); break;
+            case '\r': put_bytes(writer, "\\r", 2); break;
+            case '\t': put_bytes(writer, "\\t", 2); break;
+            default:
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                put_bytes(writer, escaped, 6);
+                break;
+        }
+    }
+    put_bytes(writer, run, strlen(run));
+
+    put_char(writer, '"');
+}
+
+/**
+ * @brief Write the separator and key that precede a value.
+ * @param writer JSON writer.
+ * @param key Key inside the enclosing object, ignored inside an array or at the root.
+ */
+static void begin_value(json_writer_t *writer, const char *key) {
+    if (writer->depth == 0) {
+        return;
+    }
+
+    uint8_t level = writer->depth - 1;
+    bool in_array = writer->is_array[level];
+
+    if (writer->has_items[level]) {
+        put_char(writer, ',');
+        if (writer->pretty) {
+            put_char(writer, in_array ? ' ' : '\n');
+        }
+    }
+    writer->has_items[level] = true;
+
+    if (!in_array) {
+        put_indent(writer, writer->depth);
+        put_string(writer, key != NULL ? key : "");
+        put_char(writer, ':');
+        if (writer->pretty) {
+            put_char(writer, '\t');
+        }
+    }
+}
+
+/**
+ * @brief Open an object or array.
+ * @param writer JSON writer.
+ * @param key Key inside the enclosing object.
+ * @param is_array true for an array, false for an object.
+ */
+static void begin_container(json_writer_t *writer, const char *key, bool is_array) {
+    begin_value(writer, key);
+    if (writer->depth >= JSON_WRITER_MAX_DEPTH) {
+        writer->overflow = true;
+        return;
+    }
+
+    put_char(writer, is_array ? '[' : '{');
+    writer->is_array[writer->depth] = is_array;
+    writer->has_items[writer->depth] = false;
+    writer->depth++;
+    if (!is_array && writer->pretty) {
+        put_char(writer, '\n');
+    }
+}
+
+/**
+ * @brief Close the innermost object or array.
+ * @param writer JSON writer.
+ * @param is_array true for an array, false for an object.
+ */
+static void end_container(json_writer_t *writer, bool is_array) {
+    if (writer->depth == 0 || writer->is_array[writer->depth - 1] != is_array) {
+        writer->overflow = true;
+        return;
+    }
+
+    writer->depth--;
+    if (!is_array && writer->pretty) {
+        if (writer->has_items[writer->depth]) {
+            put_char(writer, '\n');
+        }
+        put_indent(writer, writer->depth);
+    }
+    put_char(writer, is_array ? ']' : '}');
+}
+
+/**
+ * @brief Append a fixed-point number.
+ * @param writer JSON writer.
+ * @param value Value to append.
+ * @param decimals Number of decimals.
+ * @param trim Drop trailing zeros and the sign of zero, like cJSON printing a rounded double.
+ */
+static void put_fixed(json_writer_t *writer, double value, uint8_t decimals, bool trim) {
+    if (decimals > JSON_WRITER_MAX_DECIMALS) {
+        decimals = JSON_WRITER_MAX_DECIMALS;
+    }
+
+    // The scaled value has to fit into 64 bits, so the limit of the value shrinks with every decimal
+    double magnitude = fabs(value) * (double)powers_of_ten[decimals];
+    if (!isfinite(value) || fabs(value) >= JSON_WRITER_FAST_LIMIT || magnitude >= JSON_WRITER_SCALED_LIMIT) {
+        char fallback[64];
+        int length;
+        if (!trim) {
+            length = snprintf(fallback, sizeof(fallback), "%.*f", decimals, value);
+        } else if (!isfinite(value)) {
+            length = snprintf(fallback, sizeof(fallback), "null");
+        } else {
+            length = snprintf(fallback, sizeof(fallback), "%1.15g", value);
+        }
+        put_bytes(writer, fallback, length > 0 && length < (int)sizeof(fallback) ? length : 0);
+        return;
+    }
+
+    // Exact for float inputs, so the remainder tells ties apart from values just above or below.
+    // printf rounds ties to even, round() as used before cJSON rounds them away from zero.
+    double integral = floor(magnitude);
+    double remainder = magnitude - integral;
+    uint64_t scaled = (uint64_t)integral;
+    if (remainder > 0.5 || (remainder == 0.5 && (trim || (scaled & 1)))) {
+        scaled++;
+    }
+
+    uint64_t integer_part = scaled / powers_of_ten[decimals];
+    uint64_t fraction = scaled % powers_of_ten[decimals];
+
+    if (signbit(value) && !(trim && scaled == 0)) {
+        put_char(writer, '-');
+    }
+    put_unsigned(writer, integer_part, 1);
+
+    if (trim) {
+        if (fraction == 0) {
+            return;
+        }
+        while (fraction % 10 == 0) {
+            fraction /= 10;
+            decimals--;
+        }
+    }
+    if (decimals > 0) {
+        put_char(writer, '.');
+        put_unsigned(writer, fraction, decimals);
+    }
+}
+
+void json_writer_init(json_writer_t *writer, char *buffer, size_t size, bool pretty) {
+    memset(writer, 0, sizeof(*writer));
+    writer->buffer = buffer;
+    writer->size = size;
+    writer->pretty = pretty;
+    writer->overflow = (buffer == NULL || size == 0);
+}
+
+void json_writer_begin_object(json_writer_t *writer, const char *key) {
+    begin_container(writer, key, false);
+}
+
+void json_writer_end_object(json_writer_t *writer) {
+    end_container(writer, false);
+}
+
+void json_writer_begin_array(json_writer_t *writer, const char *key) {
+    begin_container(writer, key, true);
+}
+
+void json_writer_end_array(json_writer_t *writer) {
+    end_container(writer, true);
+}
+
+void json_writer_string(json_writer_t *writer, const char *key, const char *value) {
+    // cJSON drops a NULL string entirely, so do the same
+    if (value == NULL) {
+        return;
+    }
+    begin_value(writer, key);
+    put_string(writer, value);
+}
+
+void json_writer_int(json_writer_t *writer, const char *key, int64_t value) {
+    begin_value(writer, key);
+    if (value < 0) {
+        put_char(writer, '-');
+        put_unsigned(writer, (uint64_t)0 - (uint64_t)value, 1);
+    } else {
+        put_unsigned(writer, (uint64_t)value, 1);
+    }
+}
+
+void json_writer_fixed_string(json_writer_t *writer, const char *key, double value, uint8_t decimals) {
+    begin_value(writer, key);
+    put_char(writer, '"');
+    put_fixed(writer, value, decimals, false);
+    put_char(writer, '"');
+}
+
+void json_writer_decimal(json_writer_t *writer, const char *key, double value, uint8_t decimals) {
+    begin_value(writer, key);
+    put_fixed(writer, value, decimals, true);
+}
+
+const char *json_writer_finish(json_writer_t *writer) {
+    if (writer->overflow || writer->depth != 0) {
+        return NULL;
+    }
+    writer->buffer[writer->length] = '\0';
+    return writer->buffer;
+}
@@ -0,0 +1,117 @@
+#ifndef ESP_GYRO_JSON_WRITER_H
+#define ESP_GYRO_JSON_WRITER_H
+
+#include "stddef.h"
+#include "stdint.h"
+#include "stdbool.h"
+
+/**
+ * @file json_writer.h
+ * @brief Header file for the heap-free streaming JSON writer.
+ *
+ * The writer appends keys and values directly into a caller-provided buffer, without building a tree
+ * and without allocating. Its output is byte-identical to cJSON_PrintUnformatted() (or cJSON_Print() when
+ * pretty is set) for the same document. If the buffer is too small the writer stops appending and
+ * json_writer_finish() reports the overflow. The file has no ESP-IDF dependencies so host tools can use it.
+ */
+
+#define JSON_WRITER_MAX_DEPTH 8  ///< Maximum nesting depth of objects and arrays
+
+/**
+ * @brief State of a JSON writer.
+ */
+typedef struct {
+    char *buffer;                           ///< Output buffer
+    size_t size;                            ///< Size of the output buffer
+    size_t length;                          ///< Number of characters written, excluding the terminator
+    bool overflow;                          ///< Set once a write did not fit into the buffer
+    bool pretty;                            ///< Format like cJSON_Print() instead of cJSON_PrintUnformatted()
+    uint8_t depth;                          ///< Current nesting depth
+    bool has_items[JSON_WRITER_MAX_DEPTH];  ///< Whether the container at each depth already has an item
+    bool is_array[JSON_WRITER_MAX_DEPTH];   ///< Whether the container at each depth is an array
+} json_writer_t;
+
+/**
+ * @brief Start writing a document into a buffer.
+ * @param writer Writer to initialize.
+ * @param buffer Output buffer.
+ * @param size Size of the output buffer in bytes.
+ * @param pretty true to format like cJSON_Print(), false for cJSON_PrintUnformatted().
+ */
+void json_writer_init(json_writer_t *writer, char *buffer, size_t size, bool pretty);
+
+/**
+ * @brief Open an object.
+ * @param writer JSON writer.
+ * @param key Key of the object inside the enclosing object, NULL for the root or inside an array.
+ */
+void json_writer_begin_object(json_writer_t *writer, const char *key);
+
+/**
+ * @brief Close the innermost object.
+ * @param writer JSON writer.
+ */
+void json_writer_end_object(json_writer_t *writer);
+
+/**
+ * @brief Open an array.
+ * @param writer JSON writer.
+ * @param key Key of the array inside the enclosing object, NULL inside an array.
+ */
+void json_writer_begin_array(json_writer_t *writer, const char *key);
+
+/**
+ * @brief Close the innermost array.
+ * @param writer JSON writer.
+ */
+void json_writer_end_array(json_writer_t *writer);
+
+/**
+ * @brief Write a string value, escaped like cJSON does.
+ * @param writer JSON writer.
+ * @param key Key inside the enclosing object, NULL inside an array.
+ * @param value NUL-terminated string. NULL writes nothing, like cJSON_AddStringToObject().
+ */
+void json_writer_string(json_writer_t *writer, const char *key, const char *value);
+
+/**
+ * @brief Write an integer number.
+ * @param writer JSON writer.
+ * @param key Key inside the enclosing object, NULL inside an array.
+ * @param value Value to write.
+ */
+void json_writer_int(json_writer_t *writer, const char *key, int64_t value);
+
+/**
+ * @brief Write a float as a fixed-point string, identical to snprintf("%.*f").
+ *
+ * This is how the telemetry channels have always been published, e.g. "23.45".
+ *
+ * @param writer JSON writer.
+ * @param key Key inside the enclosing object, NULL inside an array.
+ * @param value Value to write.
+ * @param decimals Number of decimals, at most 9.
+ */
+void json_writer_fixed_string(json_writer_t *writer, const char *key, double value, uint8_t decimals);
+
+/**
+ * @brief Write a float as a number rounded to a number of decimals.
+ *
+ * Trailing zeros are dropped, which matches cJSON printing a double that was rounded to the same
+ * number of decimals, e.g. 23.4 or 23.
+ *
+ * @param writer JSON writer.
+ * @param key Key inside the enclosing object, NULL inside an array.
+ * @param value Value to write.
+ * @param decimals Number of decimals, at most 9.
+ */
+void json_writer_decimal(json_writer_t *writer, const char *key, double value, uint8_t decimals);
+
+/**
+ * @brief Terminate the document.
+ * @param writer JSON writer.
+ * @return The NUL-terminated document, or NULL if it did not fit into the buffer or is not closed.
+ */
+const char *json_writer_finish(json_writer_t *writer);
+
+#endif //ESP_GYRO_JSON_WRITER_H
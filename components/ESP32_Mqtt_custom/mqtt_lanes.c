@@ -0,0 +1,215 @@
+#include "mqtt_lanes.h"
+
+#include "string.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/ringbuf.h"
+
+/**
+ * @brief Header of a message in a lane, followed by the NUL-terminated topic and the payload.
+ */
+typedef struct {
+    int64_t queued_us;              ///< esp_timer time the message was queued
+    int64_t timestamp_us;           ///< Sample time of the content, 0 if it does not expire
+    const char *content_type;       ///< MQTT_CONTENT_TYPE_* of the payload, NULL if unknown
+    uint32_t sequence;              ///< Frame sequence number, 0 if none
+    int tracker;                    ///< Tracker handed back to the publish function, -1 if unused
+    int length;                     ///< Length of the payload in bytes
+    uint16_t topic_size;            ///< Length of the topic in bytes, including its terminator
+    uint8_t message_class;          ///< mqtt_message_class_t of the message
+} mqtt_lane_item_t;
+
+static RingbufHandle_t mqtt_lanes[MQTT_LANE_COUNT];
+static const size_t mqtt_lane_sizes[MQTT_LANE_COUNT] = {
+        [MQTT_LANE_BULK] = MQTT_LANE_BULK_SIZE,
+        [MQTT_LANE_URGENT] = MQTT_LANE_URGENT_SIZE,
+};
+static mqtt_lane_stats_t mqtt_lane_stats[MQTT_LANE_COUNT];
+static portMUX_TYPE mqtt_lanes_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static TaskHandle_t mqtt_lanes_task_handle = NULL;
+static esp_mqtt_client_handle_t mqtt_lanes_client = NULL;
+static mqtt_lane_publish_t mqtt_lanes_publish = NULL;
+
+static uint32_t mqtt_link_bandwidth = MQTT_LINK_BANDWIDTH;
+static uint8_t mqtt_bulk_share = MQTT_BULK_SHARE;
+
+// Setter functions
+
+void set_mqtt_link_bandwidth(uint32_t bytes_per_second) {
+    mqtt_link_bandwidth = bytes_per_second > 0 ? bytes_per_second : 1;
+}
+
+void set_mqtt_bulk_share(uint8_t percent) {
+    mqtt_bulk_share = percent < 1 ? 1 : percent > 100 ? 100 : percent;
+}
+
+// Getter functions
+
+uint32_t get_mqtt_link_bandwidth(void) {
+    return mqtt_link_bandwidth;
+}
+
+uint8_t get_mqtt_bulk_share(void) {
+    return mqtt_bulk_share;
+}
+
+bool mqtt_lanes_running(void) {
+    return mqtt_lanes_task_handle != NULL;
+}
+
+void get_mqtt_lane_stats(mqtt_lane_t lane, mqtt_lane_stats_t *stats) {
+    portENTER_CRITICAL(&mqtt_lanes_lock);
+    *stats = mqtt_lane_stats[lane];
+    portEXIT_CRITICAL(&mqtt_lanes_lock);
+    stats->free_bytes = mqtt_lanes[lane] != NULL ? xRingbufferGetCurFreeSize(mqtt_lanes[lane]) : 0;
+}
+
+bool mqtt_lane_has_room(mqtt_lane_t lane, size_t topic_length, int length) {
+    if (lane >= MQTT_LANE_COUNT || mqtt_lanes[lane] == NULL) {
+        return false;
+    }
+    // The ring buffer adds a header of its own and rounds items up to 4 bytes
+    size_t size = sizeof(mqtt_lane_item_t) + topic_length + 1 + (size_t)length + 16;
+    return xRingbufferGetCurFreeSize(mqtt_lanes[lane]) >= size;
+}
+
+bool mqtt_lane_enqueue(mqtt_lane_t lane, const char *topic, const char *data, int length,
+                       mqtt_message_class_t message_class, int64_t timestamp_us, const char *content_type,
+                       uint32_t sequence, int tracker) {
+    if (lane >= MQTT_LANE_COUNT || mqtt_lanes[lane] == NULL) {
+        return false;
+    }
+
+    size_t topic_size = strlen(topic) + 1;
+    void *slot = NULL;
+    if (xRingbufferSendAcquire(mqtt_lanes[lane], &slot, sizeof(mqtt_lane_item_t) + topic_size + (size_t)length, 0) != pdTRUE) {
+        portENTER_CRITICAL(&mqtt_lanes_lock);
+        mqtt_lane_stats[lane].dropped_full++;
+        portEXIT_CRITICAL(&mqtt_lanes_lock);
+        return false;
+    }
+
+    // Filled in place, the message is copied once
+    mqtt_lane_item_t *item = slot;
+    item->queued_us = esp_timer_get_time();
+    item->timestamp_us = timestamp_us;
+    item->content_type = content_type;
+    item->sequence = sequence;
+    item->tracker = tracker;
+    item->length = length;
+    item->topic_size = (uint16_t)topic_size;
+    item->message_class = (uint8_t)message_class;
+    char *text = (char *)(item + 1);
+    memcpy(text, topic, topic_size);
+    memcpy(text + topic_size, data, (size_t)length);
+    xRingbufferSendComplete(mqtt_lanes[lane], slot);
+
+    portENTER_CRITICAL(&mqtt_lanes_lock);
+    mqtt_lane_stats[lane].queued++;
+    portEXIT_CRITICAL(&mqtt_lanes_lock);
+    xTaskNotifyGive(mqtt_lanes_task_handle);
+    return true;
+}
+
+/**
+ * @brief Publish the oldest message of a lane.
+ * @param lane Lane.
+ * @return Topic and payload bytes of the message, 0 if the lane is empty.
+ */
+static size_t publish_next(mqtt_lane_t lane) {
+    size_t size = 0;
+    mqtt_lane_item_t *item = xRingbufferReceive(mqtt_lanes[lane], &size, 0);
+    if (item == NULL) {
+        return 0;
+    }
+
+    int64_t waited_us = esp_timer_get_time() - item->queued_us;
+    const char *topic = (const char *)(item + 1);
+    mqtt_lanes_publish(mqtt_lanes_client, topic, topic + item->topic_size, item->length,
+                       (mqtt_message_class_t)item->message_class, item->timestamp_us, item->content_type,
+                       item->sequence, item->tracker);
+    size_t bytes = item->topic_size - 1 + (size_t)item->length;
+    vRingbufferReturnItem(mqtt_lanes[lane], item);
+
+    portENTER_CRITICAL(&mqtt_lanes_lock);
+    mqtt_lane_stats_t *stats = &mqtt_lane_stats[lane];
+    stats->published++;
+    stats->latency_total_us += (uint64_t)waited_us;
+    if (waited_us > stats->latency_max_us) {
+        stats->latency_max_us = (uint32_t)waited_us;
+    }
+    portEXIT_CRITICAL(&mqtt_lanes_lock);
+    return bytes;
+}
+
+/**
+ * @brief Task that publishes all urgent messages first and bulk messages within their share of the bandwidth.
+ *
+ * The bulk rate is a token bucket counted in byte-microseconds, so short intervals lose no fractions. It holds
+ * at most one second of bulk bandwidth and may run into debt by one message, which is then paid off by waiting.
+ *
+ * @param arg Unused.
+ */
+static void mqtt_lanes_task(void *arg) {
+    int64_t credit = 0;
+    int64_t refilled_us = esp_timer_get_time();
+
+    while (1) {
+        while (publish_next(MQTT_LANE_URGENT) > 0) {
+        }
+
+        int64_t rate = (int64_t)mqtt_link_bandwidth * mqtt_bulk_share / 100;
+        if (rate < 1) {
+            rate = 1;
+        }
+        int64_t now_us = esp_timer_get_time();
+        credit += (now_us - refilled_us) * rate;
+        refilled_us = now_us;
+        if (credit > rate * 1000000) {
+            credit = rate * 1000000;
+        }
+
+        if (credit > 0) {
+            size_t bytes = publish_next(MQTT_LANE_BULK);
+            if (bytes > 0) {
+                credit -= (int64_t)bytes * 1000000;
+                continue;
+            }
+            // Both lanes are empty, every enqueue notifies
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        } else {
+            // Wait until the bucket has refilled, an urgent message wakes the task earlier
+            int64_t wait_ms = -credit / rate / 1000 + 1;
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait_ms));
+        }
+    }
+}
+
+esp_err_t mqtt_lanes_start(esp_mqtt_client_handle_t client, mqtt_lane_publish_t publish) {
+    if (mqtt_lanes_task_handle != NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    for (int lane = 0; lane < MQTT_LANE_COUNT; lane++) {
+        if (mqtt_lanes[lane] == NULL) {
+            mqtt_lanes[lane] = xRingbufferCreate(mqtt_lane_sizes[lane], RINGBUF_TYPE_NOSPLIT);
+        }
+        if (mqtt_lanes[lane] == NULL) {
+            ESP_LOGE(mqtt_log_tag, "Failed to create publish lane %d", lane);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    mqtt_lanes_client = client;
+    mqtt_lanes_publish = publish;
+    if (xTaskCreate(mqtt_lanes_task, "mqtt_lanes", MQTT_LANES_TASK_STACK, NULL, MQTT_LANES_TASK_PRIORITY,
+                    &mqtt_lanes_task_handle) != pdPASS) {
+        mqtt_lanes_task_handle = NULL;
+        ESP_LOGE(mqtt_log_tag, "Failed to start the publish lanes task");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,130 @@
+#ifndef ESP_GYRO_MQTT_LANES_H
+#define ESP_GYRO_MQTT_LANES_H
+
+#include "stdint.h"
+#include "stdbool.h"
+#include "ESP32_Mqtt_custom.h"
+
+/**
+ * @file mqtt_lanes.h
+ * @brief Publish lanes, so events are never stuck behind bulk telemetry.
+ *
+ * Messages are copied into the ring buffer of their class's lane and published by one task. It publishes
+ * every waiting urgent message before the next bulk one, and bulk messages only as fast as a token bucket
+ * allows: MQTT_BULK_SHARE percent of the link bandwidth. The rest of the link stays free for events, so
+ * they do not wait behind bulk data in the socket's send buffer either. Each lane has its own buffer,
+ * a full bulk lane never refuses an event.
+ */
+
+#define MQTT_LANE_URGENT_SIZE       4096    ///< Ring buffer of the urgent lane in bytes
+#define MQTT_LANE_BULK_SIZE         16384   ///< Ring buffer of the bulk lane in bytes, holds the largest discovery message twice
+#define MQTT_LANES_TASK_STACK       4096    ///< Stack size of the publishing task in bytes
+#define MQTT_LANES_TASK_PRIORITY    6       ///< FreeRTOS priority of the publishing task, above the sampling task
+#define MQTT_LINK_BANDWIDTH         32768   ///< Default bandwidth of the link to the broker in bytes per second
+#define MQTT_BULK_SHARE             80      ///< Default percentage of the link bandwidth bulk messages may use
+
+/**
+ * @struct mqtt_lane_stats_t
+ * @brief Counters and queueing latency of one lane since startup.
+ */
+typedef struct {
+    uint32_t queued;            ///< Messages put into the lane
+    uint32_t published;         ///< Messages taken out of the lane and published or dropped by their policy
+    uint32_t dropped_full;      ///< Messages refused because the lane was full
+    size_t free_bytes;          ///< Free space of the lane's ring buffer in bytes
+    uint64_t latency_total_us;  ///< Sum of the time messages waited in the lane in microseconds
+    uint32_t latency_max_us;    ///< Longest time a message waited in the lane in microseconds
+} mqtt_lane_stats_t;
+
+/**
+ * @brief Publishes a message taken out of a lane.
+ * @param client MQTT client handle.
+ * @param topic MQTT topic.
+ * @param data Payload.
+ * @param length Length of the payload in bytes.
+ * @param message_class Message class of the message.
+ * @param timestamp_us Sample time of the content in microseconds, 0 if it does not expire.
+ * @param content_type MQTT_CONTENT_TYPE_* of the payload, NULL if unknown.
+ * @param sequence Frame sequence number, 0 if the message has none.
+ * @param tracker Tracker passed to mqtt_lane_enqueue(), handed back unchanged.
+ * @return Message ID, or -1 if the message was dropped.
+ */
+typedef int (*mqtt_lane_publish_t)(esp_mqtt_client_handle_t client, const char *topic, const char *data, int length,
+                                   mqtt_message_class_t message_class, int64_t timestamp_us, const char *content_type,
+                                   uint32_t sequence, int tracker);
+
+/**
+ * @brief Create the lanes and start the task that publishes from them.
+ * @param client MQTT client handle.
+ * @param publish Function that publishes a message taken out of a lane.
+ * @return ESP_OK, ESP_ERR_INVALID_STATE if the lanes run already, or ESP_ERR_NO_MEM.
+ */
+esp_err_t mqtt_lanes_start(esp_mqtt_client_handle_t client, mqtt_lane_publish_t publish);
+
+/**
+ * @brief Check whether messages go through the lanes.
+ * @return true once mqtt_lanes_start() succeeded.
+ */
+bool mqtt_lanes_running(void);
+
+/**
+ * @brief Copy a message into a lane.
+ *
+ * Never blocks, so it may also be called from the MQTT client's event handlers.
+ *
+ * @param lane Lane of the message's class.
+ * @param topic MQTT topic, copied.
+ * @param data Payload, copied.
+ * @param length Length of the payload in bytes.
+ * @param message_class Message class of the message.
+ * @param timestamp_us Sample time of the content in microseconds, 0 if it does not expire.
+ * @param content_type MQTT_CONTENT_TYPE_* of the payload, NULL if unknown. Stored, not copied.
+ * @param sequence Frame sequence number, 0 if the message has none.
+ * @param tracker Handed to the publish function with the message, e.g. to report its outcome; -1 if unused.
+ * @return true if the message was queued, false if the lane is full.
+ */
+bool mqtt_lane_enqueue(mqtt_lane_t lane, const char *topic, const char *data, int length,
+                       mqtt_message_class_t message_class, int64_t timestamp_us, const char *content_type,
+                       uint32_t sequence, int tracker);
+
+/**
+ * @brief Check whether a lane has room for a message.
+ * @param lane Lane.
+ * @param topic_length Length of the topic in bytes.
+ * @param length Length of the payload in bytes.
+ * @return true if a message of this size would be queued now.
+ */
+bool mqtt_lane_has_room(mqtt_lane_t lane, size_t topic_length, int length);
+
+/**
+ * @brief Set the bandwidth of the link to the broker.
+ * @param bytes_per_second Bandwidth in bytes per second, at least 1.
+ */
+void set_mqtt_link_bandwidth(uint32_t bytes_per_second);
+
+/**
+ * @brief Set the share of the link bandwidth bulk messages may use.
+ * @param percent Share between 1 and 100 percent.
+ */
+void set_mqtt_bulk_share(uint8_t percent);
+
+/**
+ * @brief Get the bandwidth of the link to the broker.
+ * @return Bandwidth in bytes per second.
+ */
+uint32_t get_mqtt_link_bandwidth(void);
+
+/**
+ * @brief Get the share of the link bandwidth bulk messages may use.
+ * @return Share in percent.
+ */
+uint8_t get_mqtt_bulk_share(void);
+
+/**
+ * @brief Get the counters and queueing latency of a lane.
+ * @param lane Lane.
+ * @param stats Destination for the counters.
+ */
+void get_mqtt_lane_stats(mqtt_lane_t lane, mqtt_lane_stats_t *stats);
+
+#endif //ESP_GYRO_MQTT_LANES_H
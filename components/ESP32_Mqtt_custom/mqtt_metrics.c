@@ -0,0 +1,188 @@
+#include "mqtt_metrics.h"
+
+#include "string.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+/**
+ * @brief Send time of an unacknowledged publish.
+ */
+typedef struct {
+    int msg_id;         ///< Message ID, 0 if the entry is unused
+    int64_t sent_us;    ///< esp_timer time the message was handed to the client
+} mqtt_pending_t;
+
+/**
+ * @brief Messages and bytes handed to the client in one second.
+ */
+typedef struct {
+    int64_t second;     ///< esp_timer second the counts belong to
+    uint32_t messages;  ///< Messages in that second
+    uint32_t bytes;     ///< Bytes in that second
+} mqtt_rate_slot_t;
+
+// Publishes come from the application's tasks, acknowledgements and connection events from the client task
+static portMUX_TYPE mqtt_metrics_lock = portMUX_INITIALIZER_UNLOCKED;
+static mqtt_metrics_t mqtt_metrics;
+static mqtt_pending_t mqtt_pending[MQTT_METRICS_PENDING];
+static mqtt_rate_slot_t mqtt_rate_slots[MQTT_METRICS_RATE_SECONDS];
+static int64_t mqtt_disconnected_us = 0;
+
+/**
+ * @brief Find the histogram bucket of a latency.
+ * @param latency_ms Latency in milliseconds.
+ * @return Bucket index.
+ */
+static int latency_bucket(uint32_t latency_ms) {
+    int bucket = 0;
+    while (bucket < MQTT_METRICS_LATENCY_BUCKETS - 1 && latency_ms > (1u << bucket)) {
+        bucket++;
+    }
+    return bucket;
+}
+
+void mqtt_metrics_sent(int msg_id, int bytes) {
+    int64_t now_us = esp_timer_get_time();
+    int64_t second = now_us / 1000000;
+    mqtt_rate_slot_t *slot = &mqtt_rate_slots[second % MQTT_METRICS_RATE_SECONDS];
+
+    portENTER_CRITICAL(&mqtt_metrics_lock);
+    mqtt_metrics.messages++;
+    mqtt_metrics.bytes += bytes;
+    if (slot->second != second) {
+        slot->second = second;
+        slot->messages = 0;
+        slot->bytes = 0;
+    }
+    slot->messages++;
+    slot->bytes += bytes;
+    if (msg_id > 0) {
+        // A message unacknowledged for MQTT_METRICS_PENDING IDs gives up its entry
+        mqtt_pending_t *pending = &mqtt_pending[msg_id % MQTT_METRICS_PENDING];
+        pending->msg_id = msg_id;
+        pending->sent_us = now_us;
+    }
+    portEXIT_CRITICAL(&mqtt_metrics_lock);
+}
+
+void mqtt_metrics_acked(int msg_id) {
+    int64_t now_us = esp_timer_get_time();
+    mqtt_pending_t *pending = &mqtt_pending[msg_id % MQTT_METRICS_PENDING];
+
+    portENTER_CRITICAL(&mqtt_metrics_lock);
+    // The acknowledgement may also arrive before the publish that sent the message returned
+    if (msg_id <= 0 || pending->msg_id != msg_id) {
+        mqtt_metrics.untracked++;
+    } else {
+        uint32_t latency_ms = (uint32_t)((now_us - pending->sent_us) / 1000);
+        pending->msg_id = 0;
+        mqtt_metrics.acked++;
+        mqtt_metrics.ack_latency[latency_bucket(latency_ms)]++;
+        mqtt_metrics.ack_latency_total_ms += latency_ms;
+        if (latency_ms > mqtt_metrics.ack_latency_max_ms) {
+            mqtt_metrics.ack_latency_max_ms = latency_ms;
+        }
+    }
+    portEXIT_CRITICAL(&mqtt_metrics_lock);
+}
+
+void mqtt_metrics_deleted(int msg_id) {
+    mqtt_pending_t *pending = &mqtt_pending[msg_id % MQTT_METRICS_PENDING];
+
+    portENTER_CRITICAL(&mqtt_metrics_lock);
+    if (msg_id > 0 && pending->msg_id == msg_id) {
+        pending->msg_id = 0;
+    }
+    mqtt_metrics.expired++;
+    portEXIT_CRITICAL(&mqtt_metrics_lock);
+}
+
+void mqtt_metrics_outbox(int outbox_bytes) {
+    if (outbox_bytes < 0) {
+        return;
+    }
+    portENTER_CRITICAL(&mqtt_metrics_lock);
+    mqtt_metrics.outbox_bytes = outbox_bytes;
+    if (outbox_bytes > mqtt_metrics.outbox_peak) {
+        mqtt_metrics.outbox_peak = outbox_bytes;
+    }
+    portEXIT_CRITICAL(&mqtt_metrics_lock);
+}
+
+void mqtt_metrics_connected(void) {
+    int64_t now_us = esp_timer_get_time();
+
+    portENTER_CRITICAL(&mqtt_metrics_lock);
+    mqtt_metrics.connects++;
+    if (mqtt_disconnected_us > 0) {
+        uint32_t offline_ms = (uint32_t)((now_us - mqtt_disconnected_us) / 1000);
+        mqtt_metrics.last_offline_ms = offline_ms;
+        mqtt_metrics.total_offline_ms += offline_ms;
+        if (offline_ms > mqtt_metrics.max_offline_ms) {
+            mqtt_metrics.max_offline_ms = offline_ms;
+        }
+        mqtt_disconnected_us = 0;
+    }
+    portEXIT_CRITICAL(&mqtt_metrics_lock);
+}
+
+void mqtt_metrics_disconnected(void) {
+    int64_t now_us = esp_timer_get_time();
+
+    portENTER_CRITICAL(&mqtt_metrics_lock);
+    // Failed reconnects report disconnects too, the outage started with the first
+    if (mqtt_disconnected_us == 0) {
+        mqtt_disconnected_us = now_us;
+    }
+    portEXIT_CRITICAL(&mqtt_metrics_lock);
+}
+
+void mqtt_metrics_serialized(int64_t duration_us) {
+    uint32_t duration = duration_us > 0 ? (uint32_t)duration_us : 0;
+
+    portENTER_CRITICAL(&mqtt_metrics_lock);
+    mqtt_metrics.serialized++;
+    mqtt_metrics.serialize_total_us += duration;
+    if (duration > mqtt_metrics.serialize_max_us) {
+        mqtt_metrics.serialize_max_us = duration;
+    }
+    portEXIT_CRITICAL(&mqtt_metrics_lock);
+}
+
+void get_mqtt_metrics(mqtt_metrics_t *metrics) {
+    int64_t second = esp_timer_get_time() / 1000000;
+    uint64_t messages = 0, bytes = 0;
+
+    portENTER_CRITICAL(&mqtt_metrics_lock);
+    *metrics = mqtt_metrics;
+    // Only whole seconds count, the current one is still filling
+    for (int i = 0; i < MQTT_METRICS_RATE_SECONDS; i++) {
+        const mqtt_rate_slot_t *slot = &mqtt_rate_slots[i];
+        if (slot->second < second && slot->second > second - MQTT_METRICS_RATE_SECONDS) {
+            messages += slot->messages;
+            bytes += slot->bytes;
+        }
+    }
+    portEXIT_CRITICAL(&mqtt_metrics_lock);
+
+    metrics->messages_per_second = (float)messages / (MQTT_METRICS_RATE_SECONDS - 1);
+    metrics->bytes_per_second = (float)bytes / (MQTT_METRICS_RATE_SECONDS - 1);
+}
+
+uint32_t mqtt_metrics_latency_percentile(const mqtt_metrics_t *metrics, uint32_t percent) {
+    if (metrics->acked == 0) {
+        return 0;
+    }
+
+    // Rank of the percentile, by nearest rank
+    uint64_t rank = ((uint64_t)metrics->acked * percent + 99) / 100;
+    uint64_t count = 0;
+    for (int bucket = 0; bucket < MQTT_METRICS_LATENCY_BUCKETS - 1; bucket++) {
+        count += metrics->ack_latency[bucket];
+        if (count >= rank) {
+            uint32_t bound = 1u << bucket;
+            return bound < metrics->ack_latency_max_ms ? bound : metrics->ack_latency_max_ms;
+        }
+    }
+    return metrics->ack_latency_max_ms;
+}
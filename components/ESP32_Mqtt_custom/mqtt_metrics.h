@@ -0,0 +1,105 @@
+#ifndef ESP_GYRO_MQTT_METRICS_H
+#define ESP_GYRO_MQTT_METRICS_H
+
+#include "stdint.h"
+
+/**
+ * @file mqtt_metrics.h
+ * @brief Metrics of the MQTT client pipeline: acknowledgement latency, outbox depth, throughput,
+ * connection outages and serialization time.
+ *
+ * ESP32_Mqtt_custom.c feeds the metrics from its publish path and event handler, get_mqtt_metrics()
+ * reads them and send_mqtt_diagnostics() publishes them. They are the numbers to tune QoS, batching
+ * and keepalive for a site with.
+ */
+
+#define MQTT_METRICS_LATENCY_BUCKETS    16      ///< Buckets of the acknowledgement latency histogram
+#define MQTT_METRICS_PENDING            32      ///< Unacknowledged publishes whose send time is kept
+#define MQTT_METRICS_RATE_SECONDS       10      ///< Window of the message and byte rates in seconds
+
+/**
+ * @struct mqtt_metrics_t
+ * @brief Pipeline metrics since startup.
+ *
+ * Bucket 0 of the latency histogram counts acknowledgements within 1 ms, bucket i those within
+ * 2^i ms, and the last bucket everything slower.
+ */
+typedef struct {
+    uint32_t acked;                                         ///< Acknowledged QoS 1 and 2 publishes with a known send time
+    uint32_t untracked;                                     ///< Acknowledgements whose send time was not kept
+    uint32_t expired;                                       ///< QoS 1 and 2 publishes deleted from the outbox unacknowledged
+    uint32_t ack_latency[MQTT_METRICS_LATENCY_BUCKETS];     ///< Acknowledgements per latency bucket
+    uint64_t ack_latency_total_ms;                          ///< Sum of all acknowledgement latencies in milliseconds
+    uint32_t ack_latency_max_ms;                            ///< Largest acknowledgement latency in milliseconds
+    int outbox_bytes;                                       ///< Outbox size when it was last read
+    int outbox_peak;                                        ///< Largest outbox size read
+    uint64_t messages;                                      ///< Messages handed to the MQTT client
+    uint64_t bytes;                                         ///< Topic and payload bytes handed to the MQTT client
+    float messages_per_second;                              ///< Messages per second over the last MQTT_METRICS_RATE_SECONDS
+    float bytes_per_second;                                 ///< Bytes per second over the last MQTT_METRICS_RATE_SECONDS
+    uint32_t connects;                                      ///< Connections to the broker
+    uint32_t last_offline_ms;                               ///< Time from the last disconnect to the reconnect in milliseconds
+    uint32_t max_offline_ms;                                ///< Longest time from a disconnect to the reconnect in milliseconds
+    uint64_t total_offline_ms;                              ///< Total time from disconnects to reconnects in milliseconds
+    uint32_t serialized;                                    ///< Frames serialized
+    uint64_t serialize_total_us;                            ///< Total serialization time in microseconds
+    uint32_t serialize_max_us;                              ///< Longest serialization time in microseconds
+} mqtt_metrics_t;
+
+/**
+ * @brief Count a message handed to the MQTT client and note when a QoS 1 or 2 message was sent.
+ * @param msg_id Message ID returned by the client, 0 for QoS 0.
+ * @param bytes Length of topic and payload in bytes.
+ */
+void mqtt_metrics_sent(int msg_id, int bytes);
+
+/**
+ * @brief Account the acknowledgement of a QoS 1 or 2 message, MQTT_EVENT_PUBLISHED.
+ * @param msg_id Message ID of the event.
+ */
+void mqtt_metrics_acked(int msg_id);
+
+/**
+ * @brief Forget a QoS 1 or 2 message deleted from the outbox without acknowledgement, MQTT_EVENT_DELETED.
+ * @param msg_id Message ID of the event.
+ */
+void mqtt_metrics_deleted(int msg_id);
+
+/**
+ * @brief Record an outbox size read from the client.
+ * @param outbox_bytes Outbox size in bytes, negative if it could not be read.
+ */
+void mqtt_metrics_outbox(int outbox_bytes);
+
+/**
+ * @brief Account a connection to the broker, MQTT_EVENT_CONNECTED.
+ */
+void mqtt_metrics_connected(void);
+
+/**
+ * @brief Note when the connection was lost, MQTT_EVENT_DISCONNECTED.
+ */
+void mqtt_metrics_disconnected(void);
+
+/**
+ * @brief Account the time one frame took to serialize.
+ * @param duration_us Serialization time in microseconds.
+ */
+void mqtt_metrics_serialized(int64_t duration_us);
+
+/**
+ * @brief Get the pipeline metrics.
+ * @param metrics Destination for the metrics.
+ */
+void get_mqtt_metrics(mqtt_metrics_t *metrics);
+
+/**
+ * @brief Estimate a percentile of the acknowledgement latency from the histogram.
+ * @param metrics Metrics.
+ * @param percent Percentile between 1 and 100.
+ * @return Upper bound of the bucket holding the percentile in milliseconds, the maximum for the last bucket,
+ * 0 if nothing was acknowledged.
+ */
+uint32_t mqtt_metrics_latency_percentile(const mqtt_metrics_t *metrics, uint32_t percent);
+
+#endif //ESP_GYRO_MQTT_METRICS_H
@@ -0,0 +1,413 @@
+#include "mqtt_tls_transport.h"
+
+#include "stdio.h"
+#include "string.h"
+#include "errno.h"
+#include "fcntl.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/net_sockets.h"
+#ifdef MBEDTLS_USE_PSA_CRYPTO
+#include "psa/crypto.h"
+#endif
+
+#define MQTT_TLS_SESSION_MAGIC 0x544C5331  ///< Marks a valid session cache, "TLS1"
+
+/**
+ * @brief Serialized session kept in RTC memory.
+ */
+typedef struct {
+    uint32_t magic;                             ///< MQTT_TLS_SESSION_MAGIC if the cache holds a session
+    uint32_t broker_hash;                       ///< Hash of the host and port the session belongs to
+    uint32_t length;                            ///< Length of the serialized session in bytes
+    uint8_t data[MQTT_TLS_SESSION_CACHE_SIZE];  ///< mbedtls_ssl_session_save() output
+} mqtt_tls_session_cache_t;
+
+/**
+ * @brief State of the TLS transport.
+ */
+typedef struct {
+    int fd;                         ///< Socket, -1 while closed
+    mbedtls_ssl_context ssl;        ///< TLS connection
+    mbedtls_ssl_config config;      ///< TLS settings shared by all connections
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context drbg;
+    mbedtls_x509_crt ca;            ///< CA the broker's certificate must chain to
+    bool verified;                  ///< The broker's certificate was verified in this handshake
+} mqtt_tls_t;
+
+// Zeroed at power-on, kept across deep sleep
+static RTC_DATA_ATTR mqtt_tls_session_cache_t mqtt_tls_session_cache;
+
+static mqtt_tls_t mqtt_tls = {.fd = -1};
+static esp_transport_handle_t mqtt_tls_transport = NULL;
+static mqtt_tls_stats_t mqtt_tls_stats;
+
+void get_mqtt_tls_stats(mqtt_tls_stats_t *stats) {
+    *stats = mqtt_tls_stats;
+}
+
+void mqtt_tls_forget_session(void) {
+    mqtt_tls_session_cache.magic = 0;
+}
+
+/**
+ * @brief FNV-1a hash of the broker a session belongs to.
+ * @param host Host name.
+ * @param port Port.
+ * @return Hash.
+ */
+static uint32_t broker_hash(const char *host, int port) {
+    uint32_t hash = 2166136261u;
+    for (const char *c = host; *c != '\0'; c++) {
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+    return (hash ^ (uint32_t)port) * 16777619u;
+}
+
+/**
+ * @brief Count certificate verifications, which only happen in a full handshake.
+ *
+ * Registered with mbedtls_ssl_conf_verify(), the result of the verification is left to mbedtls.
+ */
+static int note_verification(void *context, mbedtls_x509_crt *certificate, int depth, uint32_t *flags) {
+    ((mqtt_tls_t *)context)->verified = true;
+    return 0;
+}
+
+/**
+ * @brief Send callback of mbedtls on the socket.
+ */
+static int socket_send(void *context, const unsigned char *buffer, size_t length) {
+    int sent = send(*(int *)context, buffer, length, 0);
+    if (sent < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? MBEDTLS_ERR_SSL_WANT_WRITE
+                                                                         : MBEDTLS_ERR_NET_SEND_FAILED;
+    }
+    return sent;
+}
+
+/**
+ * @brief Receive callback of mbedtls on the socket.
+ */
+static int socket_receive(void *context, unsigned char *buffer, size_t length) {
+    int received = recv(*(int *)context, buffer, length, 0);
+    if (received < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? MBEDTLS_ERR_SSL_WANT_READ
+                                                                         : MBEDTLS_ERR_NET_RECV_FAILED;
+    }
+    return received;
+}
+
+/**
+ * @brief Wait until the socket is readable or writable.
+ * @param fd Socket.
+ * @param write Wait for writability instead of readability.
+ * @param timeout_ms Timeout, negative to wait forever.
+ * @return 1 if ready, 0 on timeout, -1 on an error.
+ */
+static int wait_socket(int fd, bool write, int timeout_ms) {
+    fd_set ready, errors;
+    FD_ZERO(&ready);
+    FD_ZERO(&errors);
+    FD_SET(fd, &ready);
+    FD_SET(fd, &errors);
+    struct timeval timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+
+    int result = select(fd + 1, write ? NULL : &ready, write ? &ready : NULL, &errors, timeout_ms < 0 ? NULL : &timeout);
+    if (result > 0 && FD_ISSET(fd, &errors)) {
+        return -1;
+    }
+    return result > 0 ? 1 : result;
+}
+
+/**
+ * @brief Open a TCP connection.
+ * @param host Host name or address.
+ * @param port Port.
+ * @param timeout_ms Connect timeout.
+ * @return Connected blocking socket with send and receive timeouts, or -1.
+ */
+static int connect_socket(const char *host, int port, int timeout_ms) {
+    char service[8];
+    snprintf(service, sizeof(service), "%d", port);
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *address;
+    if (getaddrinfo(host, service, &hints, &address) != 0 || address == NULL) {
+        ESP_LOGE(MQTT_TLS_TAG, "Cannot resolve %s", host);
+        return -1;
+    }
+
+    int fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (fd >= 0) {
+        // Connect without blocking so the timeout applies, then go back to blocking for mbedtls
+        int flags = fcntl(fd, F_GETFL, 0);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        int result = connect(fd, address->ai_addr, address->ai_addrlen);
+        if (result < 0 && errno == EINPROGRESS && wait_socket(fd, true, timeout_ms) == 1) {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+            result = error == 0 ? 0 : -1;
+        }
+        fcntl(fd, F_SETFL, flags);
+        if (result < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(address);
+    if (fd < 0) {
+        ESP_LOGE(MQTT_TLS_TAG, "TCP connect to %s:%d failed", host, port);
+        return -1;
+    }
+
+    struct timeval timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+/**
+ * @brief Offer the cached session to the next handshake, if it belongs to this broker.
+ * @param hash Hash of the broker.
+ * @return true if a session is offered.
+ */
+static bool offer_cached_session(uint32_t hash) {
+    if (mqtt_tls_session_cache.magic != MQTT_TLS_SESSION_MAGIC || mqtt_tls_session_cache.broker_hash != hash ||
+        mqtt_tls_session_cache.length > sizeof(mqtt_tls_session_cache.data)) {
+        return false;
+    }
+
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+    // Fails if the cache was written by a firmware with a different mbedtls configuration
+    bool offered = mbedtls_ssl_session_load(&session, mqtt_tls_session_cache.data, mqtt_tls_session_cache.length) == 0 &&
+                   mbedtls_ssl_set_session(&mqtt_tls.ssl, &session) == 0;
+    mbedtls_ssl_session_free(&session);
+    if (!offered) {
+        mqtt_tls_forget_session();
+    }
+    return offered;
+}
+
+/**
+ * @brief Store the session of the current connection in the cache.
+ * @param hash Hash of the broker.
+ */
+static void cache_session(uint32_t hash) {
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+    size_t length = 0;
+
+    mqtt_tls_session_cache.magic = 0;
+    if (mbedtls_ssl_get_session(&mqtt_tls.ssl, &session) == 0 &&
+        mbedtls_ssl_session_save(&session, mqtt_tls_session_cache.data, sizeof(mqtt_tls_session_cache.data), &length) == 0) {
+        mqtt_tls_session_cache.broker_hash = hash;
+        mqtt_tls_session_cache.length = length;
+        mqtt_tls_session_cache.magic = MQTT_TLS_SESSION_MAGIC;
+    } else {
+        // With CONFIG_MBEDTLS_SSL_KEEP_PEER_CERTIFICATE the session holds the broker's certificate
+        ESP_LOGW(MQTT_TLS_TAG, "Session does not fit into %u bytes, not cached", (unsigned)sizeof(mqtt_tls_session_cache.data));
+    }
+    mbedtls_ssl_session_free(&session);
+}
+
+/**
+ * @brief Close the connection without a close_notify.
+ */
+static void drop_connection(void) {
+    if (mqtt_tls.fd >= 0) {
+        close(mqtt_tls.fd);
+        mqtt_tls.fd = -1;
+    }
+}
+
+static int tls_connect(esp_transport_handle_t transport, const char *host, int port, int timeout_ms) {
+    int64_t start_us = esp_timer_get_time();
+    drop_connection();
+
+    mqtt_tls.fd = connect_socket(host, port, timeout_ms);
+    if (mqtt_tls.fd < 0) {
+        mqtt_tls_stats.failures++;
+        return -1;
+    }
+    int64_t connected_us = esp_timer_get_time();
+
+    uint32_t hash = broker_hash(host, port);
+    mbedtls_ssl_session_reset(&mqtt_tls.ssl);
+    mbedtls_ssl_set_hostname(&mqtt_tls.ssl, host);
+    mbedtls_ssl_set_bio(&mqtt_tls.ssl, &mqtt_tls.fd, socket_send, socket_receive, NULL);
+    bool offered = offer_cached_session(hash);
+    mqtt_tls.verified = false;
+
+    int result;
+    int64_t deadline_us = connected_us + (int64_t)timeout_ms * 1000;
+    do {
+        result = mbedtls_ssl_handshake(&mqtt_tls.ssl);
+    } while ((result == MBEDTLS_ERR_SSL_WANT_READ || result == MBEDTLS_ERR_SSL_WANT_WRITE) &&
+             esp_timer_get_time() < deadline_us);
+
+    if (result != 0) {
+        ESP_LOGE(MQTT_TLS_TAG, "TLS handshake with %s failed: -0x%04x", host, (unsigned)-result);
+        // A session the broker chokes on must not be offered again
+        mqtt_tls_forget_session();
+        drop_connection();
+        mqtt_tls_stats.failures++;
+        return -1;
+    }
+
+    // A resumed handshake has no certificate to verify
+    bool resumed = offered && !mqtt_tls.verified;
+    uint32_t tcp_ms = (uint32_t)((connected_us - start_us) / 1000);
+    uint32_t handshake_ms = (uint32_t)((esp_timer_get_time() - connected_us) / 1000);
+    mqtt_tls_stats.handshakes++;
+    mqtt_tls_stats.last_tcp_ms = tcp_ms;
+    mqtt_tls_stats.last_handshake_ms = handshake_ms;
+    mqtt_tls_stats.last_resumed = resumed;
+    if (resumed) {
+        mqtt_tls_stats.resumed++;
+        mqtt_tls_stats.resumed_handshake_ms += handshake_ms;
+    } else {
+        mqtt_tls_stats.full_handshake_ms += handshake_ms;
+    }
+    ESP_LOGI(MQTT_TLS_TAG, "Connected to %s:%d, TCP %lu ms, %s handshake %lu ms", host, port, (unsigned long)tcp_ms,
+             resumed ? "resumed" : "full", (unsigned long)handshake_ms);
+
+    // The broker may have issued a new ticket, even when resuming
+    cache_session(hash);
+    return 0;
+}
+
+static int tls_poll_read(esp_transport_handle_t transport, int timeout_ms) {
+    if (mqtt_tls.fd < 0) {
+        return -1;
+    }
+    // Decrypted bytes of an earlier record are not visible to select()
+    if (mbedtls_ssl_get_bytes_avail(&mqtt_tls.ssl) > 0) {
+        return 1;
+    }
+    return wait_socket(mqtt_tls.fd, false, timeout_ms);
+}
+
+static int tls_poll_write(esp_transport_handle_t transport, int timeout_ms) {
+    if (mqtt_tls.fd < 0) {
+        return -1;
+    }
+    return wait_socket(mqtt_tls.fd, true, timeout_ms);
+}
+
+static int tls_read(esp_transport_handle_t transport, char *buffer, int length, int timeout_ms) {
+    int ready = tls_poll_read(transport, timeout_ms);
+    if (ready < 0) {
+        return ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+    }
+    if (ready == 0) {
+        return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+    }
+
+    int result = mbedtls_ssl_read(&mqtt_tls.ssl, (unsigned char *)buffer, length);
+    if (result > 0) {
+        return result;
+    }
+    if (result == MBEDTLS_ERR_SSL_WANT_READ || result == MBEDTLS_ERR_SSL_WANT_WRITE) {
+        return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+    }
+    if (result == 0 || result == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+        return ERR_TCP_TRANSPORT_CONNECTION_CLOSED_BY_FIN;
+    }
+    ESP_LOGE(MQTT_TLS_TAG, "TLS read failed: -0x%04x", (unsigned)-result);
+    return ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+}
+
+static int tls_write(esp_transport_handle_t transport, const char *buffer, int length, int timeout_ms) {
+    int ready = tls_poll_write(transport, timeout_ms);
+    if (ready <= 0) {
+        return ready < 0 ? ERR_TCP_TRANSPORT_CONNECTION_FAILED : ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+    }
+
+    int result = mbedtls_ssl_write(&mqtt_tls.ssl, (const unsigned char *)buffer, length);
+    if (result >= 0) {
+        return result;
+    }
+    if (result == MBEDTLS_ERR_SSL_WANT_READ || result == MBEDTLS_ERR_SSL_WANT_WRITE) {
+        return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+    }
+    ESP_LOGE(MQTT_TLS_TAG, "TLS write failed: -0x%04x", (unsigned)-result);
+    return ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+}
+
+static int tls_close(esp_transport_handle_t transport) {
+    if (mqtt_tls.fd >= 0) {
+        mbedtls_ssl_close_notify(&mqtt_tls.ssl);
+    }
+    drop_connection();
+    return 0;
+}
+
+static int tls_destroy(esp_transport_handle_t transport) {
+    tls_close(transport);
+    mbedtls_ssl_free(&mqtt_tls.ssl);
+    mbedtls_ssl_config_free(&mqtt_tls.config);
+    mbedtls_ctr_drbg_free(&mqtt_tls.drbg);
+    mbedtls_entropy_free(&mqtt_tls.entropy);
+    mbedtls_x509_crt_free(&mqtt_tls.ca);
+    mqtt_tls_transport = NULL;
+    return 0;
+}
+
+esp_transport_handle_t mqtt_tls_transport_init(const char *ca_certificate) {
+    if (mqtt_tls_transport != NULL) {
+        return mqtt_tls_transport;
+    }
+
+#ifdef MBEDTLS_USE_PSA_CRYPTO
+    psa_crypto_init();
+#endif
+    mbedtls_ssl_init(&mqtt_tls.ssl);
+    mbedtls_ssl_config_init(&mqtt_tls.config);
+    mbedtls_entropy_init(&mqtt_tls.entropy);
+    mbedtls_ctr_drbg_init(&mqtt_tls.drbg);
+    mbedtls_x509_crt_init(&mqtt_tls.ca);
+
+    int result = mbedtls_ctr_drbg_seed(&mqtt_tls.drbg, mbedtls_entropy_func, &mqtt_tls.entropy, NULL, 0);
+    if (result == 0) {
+        // The length includes the NUL terminator, which mbedtls needs to recognise PEM
+        result = mbedtls_x509_crt_parse(&mqtt_tls.ca, (const unsigned char *)ca_certificate, strlen(ca_certificate) + 1);
+    }
+    if (result == 0) {
+        result = mbedtls_ssl_config_defaults(&mqtt_tls.config, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                             MBEDTLS_SSL_PRESET_DEFAULT);
+    }
+    if (result == 0) {
+        mbedtls_ssl_conf_authmode(&mqtt_tls.config, MBEDTLS_SSL_VERIFY_REQUIRED);
+        mbedtls_ssl_conf_ca_chain(&mqtt_tls.config, &mqtt_tls.ca, NULL);
+        mbedtls_ssl_conf_rng(&mqtt_tls.config, mbedtls_ctr_drbg_random, &mqtt_tls.drbg);
+        mbedtls_ssl_conf_verify(&mqtt_tls.config, note_verification, &mqtt_tls);
+        // TLS 1.3 delivers tickets after the handshake and resumes differently, 1.2 covers both session IDs and tickets
+        mbedtls_ssl_conf_max_tls_version(&mqtt_tls.config, MBEDTLS_SSL_VERSION_TLS1_2);
+#ifdef MBEDTLS_SSL_SESSION_TICKETS
+        mbedtls_ssl_conf_session_tickets(&mqtt_tls.config, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+        result = mbedtls_ssl_setup(&mqtt_tls.ssl, &mqtt_tls.config);
+    }
+
+    esp_transport_handle_t transport = result == 0 ? esp_transport_init() : NULL;
+    if (transport == NULL) {
+        ESP_LOGE(MQTT_TLS_TAG, "Failed to set up TLS: -0x%04x", (unsigned)-result);
+        tls_destroy(NULL);
+        return NULL;
+    }
+    esp_transport_set_func(transport, tls_connect, tls_read, tls_write, tls_close, tls_poll_read, tls_poll_write,
+                           tls_destroy);
+    esp_transport_set_default_port(transport, MQTT_TLS_DEFAULT_PORT);
+    mqtt_tls_transport = transport;
+    return transport;
+}
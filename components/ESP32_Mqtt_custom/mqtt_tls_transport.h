@@ -0,0 +1,61 @@
+#ifndef ESP_GYRO_MQTT_TLS_TRANSPORT_H
+#define ESP_GYRO_MQTT_TLS_TRANSPORT_H
+
+#include "stdint.h"
+#include "stdbool.h"
+#include "esp_transport.h"
+
+/**
+ * @file mqtt_tls_transport.h
+ * @brief TLS transport for the MQTT client that resumes sessions across reconnects and deep sleep.
+ *
+ * A full TLS handshake costs an ESP32 seconds of CPU and radio time. After every handshake the session,
+ * including a session ticket if the broker issued one, is serialized into RTC memory. The next connect to
+ * the same broker offers it, and a broker that still knows it skips the certificate exchange and the key
+ * agreement. The cache survives reconnects and deep sleep, but not a power cycle.
+ *
+ * The transport speaks TLS 1.2, whose session IDs and tickets resume in the handshake itself. It is handed
+ * to esp-mqtt as a custom transport, see set_mqtt_ca_certificate().
+ */
+
+#define MQTT_TLS_DEFAULT_PORT       8883    ///< Port of mqtts:// URIs without a port
+#define MQTT_TLS_SESSION_CACHE_SIZE 2048    ///< RTC memory for the serialized session in bytes
+#define MQTT_TLS_TAG                "MQTT_TLS"
+
+/**
+ * @struct mqtt_tls_stats_t
+ * @brief Handshake counters and timings since power-on.
+ */
+typedef struct {
+    uint32_t handshakes;            ///< Completed handshakes
+    uint32_t resumed;               ///< Handshakes that resumed the cached session
+    uint32_t failures;              ///< Connects that failed in TCP or TLS
+    uint32_t last_tcp_ms;           ///< TCP connect time of the last connect in milliseconds
+    uint32_t last_handshake_ms;     ///< TLS handshake time of the last connect in milliseconds
+    bool last_resumed;              ///< The last handshake resumed the cached session
+    uint64_t full_handshake_ms;     ///< Total time of all full handshakes in milliseconds
+    uint64_t resumed_handshake_ms;  ///< Total time of all resumed handshakes in milliseconds
+} mqtt_tls_stats_t;
+
+/**
+ * @brief Create the TLS transport.
+ *
+ * There is one transport, calling it again returns the same handle.
+ *
+ * @param ca_certificate PEM certificate of the CA that signed the broker's certificate, stored, not copied.
+ * @return Transport handle, or NULL if the certificate cannot be parsed or memory is short.
+ */
+esp_transport_handle_t mqtt_tls_transport_init(const char *ca_certificate);
+
+/**
+ * @brief Get the handshake counters and timings.
+ * @param stats Destination for the counters.
+ */
+void get_mqtt_tls_stats(mqtt_tls_stats_t *stats);
+
+/**
+ * @brief Drop the cached session, so the next connect does a full handshake.
+ */
+void mqtt_tls_forget_session(void);
+
+#endif //ESP_GYRO_MQTT_TLS_TRANSPORT_H
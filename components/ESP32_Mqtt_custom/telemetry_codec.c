@@ -0,0 +1,224 @@
+#include "telemetry_codec.h"
+#include "math.h"
+#include "string.h"
+
+/**
+ * @file telemetry_codec.c
+ * @brief Implementation file for the packed binary telemetry frame codec.
+ */
+
+#define FNV_OFFSET_BASIS 2166136261u    ///< FNV-1a 32-bit offset basis
+#define FNV_PRIME        16777619u      ///< FNV-1a 32-bit prime
+
+/**
+ * @brief Fixed-point factor of a field, 1 if the schema does not give a usable one.
+ * @param field Field descriptor.
+ * @return Scale factor.
+ */
+static double field_scale(const sensor_field_t *field) {
+    return field->scale > 0.0f ? (double)field->scale : 1.0;
+}
+
+static uint32_t fnv1a(uint32_t hash, const void *data, size_t length) {
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+static void put_u16(uint8_t *p, uint16_t value) {
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+}
+
+static void put_u32(uint8_t *p, uint32_t value) {
+    put_u16(p, (uint16_t)value);
+    put_u16(p + 2, (uint16_t)(value >> 16));
+}
+
+static void put_u64(uint8_t *p, uint64_t value) {
+    put_u32(p, (uint32_t)value);
+    put_u32(p + 4, (uint32_t)(value >> 32));
+}
+
+static uint16_t get_u16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return get_u16(p) | ((uint32_t)get_u16(p + 2) << 16);
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+    return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+/**
+ * @brief Convert a value to its fixed-point wire representation.
+ * @param value Value to convert.
+ * @param scale Fixed-point factor.
+ * @return Rounded and saturated value, TELEMETRY_PACKED_MISSING for NaN.
+ */
+static int32_t to_fixed(double value, double scale) {
+    if (isnan(value)) {
+        return TELEMETRY_PACKED_MISSING;
+    }
+    double scaled = round(value * scale);
+    if (scaled >= (double)INT32_MAX) {
+        return INT32_MAX;
+    }
+    if (scaled <= (double)(TELEMETRY_PACKED_MISSING + 1)) {
+        return TELEMETRY_PACKED_MISSING + 1;
+    }
+    return (int32_t)scaled;
+}
+
+uint16_t telemetry_schema_id(const sensor_field_t *fields, size_t field_count) {
+    uint32_t hash = FNV_OFFSET_BASIS;
+
+    for (size_t i = 0; i < field_count; i++) {
+        uint8_t type = (uint8_t)fields[i].type;
+        uint8_t scale[4];
+        put_u32(scale, (uint32_t)lround(field_scale(&fields[i])));
+
+        // Include the terminator so that "ab","c" and "a","bc" differ
+        hash = fnv1a(hash, fields[i].sensor_type, strlen(fields[i].sensor_type) + 1);
+        hash = fnv1a(hash, &type, 1);
+        hash = fnv1a(hash, scale, sizeof(scale));
+    }
+
+    return (uint16_t)((hash >> 16) ^ (hash & 0xFFFF));
+}
+
+size_t telemetry_encode_frame(uint8_t *buffer, size_t size, const sensor_field_t *fields, size_t field_count,
+                              const void *frame, uint32_t sequence, int64_t timestamp_us) {
+    if (field_count > UINT8_MAX || size < TELEMETRY_PACKED_HEADER_SIZE) {
+        return 0;
+    }
+
+    buffer[0] = TELEMETRY_PACKED_VERSION;
+    buffer[1] = (uint8_t)field_count;
+    put_u16(buffer + 2, telemetry_schema_id(fields, field_count));
+    put_u32(buffer + 4, sequence);
+    put_u64(buffer + 8, (uint64_t)timestamp_us);
+    size_t length = TELEMETRY_PACKED_HEADER_SIZE;
+
+    for (size_t i = 0; i < field_count; i++) {
+        sensor_value_t value = sensor_field_value(&fields[i], frame);
+        uint8_t *p = buffer + length;
+        size_t width;
+
+        switch (fields[i].type) {
+            case VALUE_TYPE_FLOAT:
+            case VALUE_TYPE_DOUBLE:
+                width = 4;
+                if (length + width > size) {
+                    return 0;
+                }
+                put_u32(p, (uint32_t)to_fixed(fields[i].type == VALUE_TYPE_FLOAT ? value.float_value : value.double_value,
+                                              field_scale(&fields[i])));
+                break;
+            case VALUE_TYPE_INT:
+                width = 4;
+                if (length + width > size) {
+                    return 0;
+                }
+                put_u32(p, (uint32_t)value.int_value);
+                break;
+            case VALUE_TYPE_INT16:
+                width = 2;
+                if (length + width > size) {
+                    return 0;
+                }
+                put_u16(p, (uint16_t)value.int_value);
+                break;
+            case VALUE_TYPE_STRING:
+            default: {
+                const char *string = value.string_value != NULL ? value.string_value : "";
+                width = strlen(string) + 1;
+                if (length + width > size) {
+                    return 0;
+                }
+                memcpy(p, string, width);
+                break;
+            }
+        }
+        length += width;
+    }
+
+    return length;
+}
+
+telemetry_status_t telemetry_decode_frame(const uint8_t *payload, size_t length, const sensor_field_t *fields,
+                                          size_t field_count, telemetry_header_t *header, sensor_value_t *values,
+                                          size_t *consumed) {
+    if (length < TELEMETRY_PACKED_HEADER_SIZE) {
+        return TELEMETRY_ERR_TRUNCATED;
+    }
+
+    header->version = payload[0];
+    header->channel_count = payload[1];
+    header->schema_id = get_u16(payload + 2);
+    header->sequence = get_u32(payload + 4);
+    header->timestamp_us = (int64_t)get_u64(payload + 8);
+
+    if (header->version != TELEMETRY_PACKED_VERSION) {
+        return TELEMETRY_ERR_VERSION;
+    }
+    if (header->channel_count != field_count || header->schema_id != telemetry_schema_id(fields, field_count)) {
+        return TELEMETRY_ERR_SCHEMA;
+    }
+
+    size_t offset = TELEMETRY_PACKED_HEADER_SIZE;
+    for (size_t i = 0; i < field_count; i++) {
+        const uint8_t *p = payload + offset;
+        size_t remaining = length - offset;
+        size_t width;
+
+        switch (fields[i].type) {
+            case VALUE_TYPE_FLOAT:
+            case VALUE_TYPE_DOUBLE: {
+                width = 4;
+                if (remaining < width) {
+                    return TELEMETRY_ERR_TRUNCATED;
+                }
+                int32_t fixed = (int32_t)get_u32(p);
+                values[i].type = VALUE_TYPE_DOUBLE;
+                values[i].double_value = fixed == TELEMETRY_PACKED_MISSING ? NAN : fixed / field_scale(&fields[i]);
+                break;
+            }
+            case VALUE_TYPE_INT:
+                width = 4;
+                if (remaining < width) {
+                    return TELEMETRY_ERR_TRUNCATED;
+                }
+                values[i].type = VALUE_TYPE_INT;
+                values[i].int_value = (int32_t)get_u32(p);
+                break;
+            case VALUE_TYPE_INT16:
+                width = 2;
+                if (remaining < width) {
+                    return TELEMETRY_ERR_TRUNCATED;
+                }
+                values[i].type = VALUE_TYPE_INT;
+                values[i].int_value = (int16_t)get_u16(p);
+                break;
+            case VALUE_TYPE_STRING:
+            default: {
+                const uint8_t *end = memchr(p, '\0', remaining);
+                if (end == NULL) {
+                    return TELEMETRY_ERR_TRUNCATED;
+                }
+                width = (size_t)(end - p) + 1;
+                values[i].type = VALUE_TYPE_STRING;
+                values[i].string_value = (const char *)p;
+                break;
+            }
+        }
+        offset += width;
+    }
+
+    *consumed = offset;
+    return TELEMETRY_OK;
+}
@@ -0,0 +1,103 @@
+#ifndef ESP_GYRO_TELEMETRY_CODEC_H
+#define ESP_GYRO_TELEMETRY_CODEC_H
+
+#include "stddef.h"
+#include "stdint.h"
+#include "ESP32_Mqtt_custom_defs.h"
+
+/**
+ * @file telemetry_codec.h
+ * @brief Header file for the packed binary telemetry frame codec.
+ *
+ * A packed frame carries all channels of one sample in the order of a sensor_field_t list. All integers
+ * are little-endian.
+ *
+ * Header, TELEMETRY_PACKED_HEADER_SIZE bytes:
+ * - uint8 version, TELEMETRY_PACKED_VERSION
+ * - uint8 number of channels
+ * - uint16 schema ID, see telemetry_schema_id()
+ * - uint32 frame sequence number
+ * - int64 sample time in microseconds
+ *
+ * Followed by one value per channel:
+ * - VALUE_TYPE_FLOAT, VALUE_TYPE_DOUBLE: int32 of round(value * scale), TELEMETRY_PACKED_MISSING for NaN
+ * - VALUE_TYPE_INT: int32
+ * - VALUE_TYPE_INT16: int16
+ * - VALUE_TYPE_STRING: the bytes of the string including its NUL terminator
+ *
+ * Frames have no length prefix, the decoder finds the end of a frame from its content. Captures of
+ * several frames can therefore simply be concatenated. The file has no ESP-IDF dependencies so host
+ * tools can use it.
+ */
+
+#define TELEMETRY_PACKED_VERSION        1           ///< Version written into the header
+#define TELEMETRY_PACKED_HEADER_SIZE    16          ///< Size of the header in bytes
+#define TELEMETRY_PACKED_MISSING        INT32_MIN   ///< Wire value of a NaN channel
+
+/**
+ * @brief Header of a packed frame.
+ */
+typedef struct {
+    uint8_t version;        ///< Format version
+    uint8_t channel_count;  ///< Number of channels in the frame
+    uint16_t schema_id;     ///< Schema ID of the channel list the frame was encoded with
+    uint32_t sequence;      ///< Frame sequence number
+    int64_t timestamp_us;   ///< Sample time in microseconds
+} telemetry_header_t;
+
+/**
+ * @brief Result of decoding a packed frame.
+ */
+typedef enum {
+    TELEMETRY_OK,               ///< Frame decoded
+    TELEMETRY_ERR_TRUNCATED,    ///< Payload ends inside the frame
+    TELEMETRY_ERR_VERSION,      ///< Unsupported format version
+    TELEMETRY_ERR_SCHEMA,       ///< Channel count or schema ID does not match the channel list
+} telemetry_status_t;
+
+/**
+ * @brief Compute the schema ID of a channel list.
+ *
+ * The ID is a hash of the keys, types and scales, so encoder and decoder only agree when they were
+ * built from the same schema.
+ *
+ * @param fields Array of field descriptors.
+ * @param field_count Number of field descriptors.
+ * @return Schema ID.
+ */
+uint16_t telemetry_schema_id(const sensor_field_t *fields, size_t field_count);
+
+/**
+ * @brief Encode a sample frame as a packed frame.
+ * @param buffer Output buffer.
+ * @param size Size of the output buffer in bytes.
+ * @param fields Array of field descriptors for the frame.
+ * @param field_count Number of field descriptors, at most 255.
+ * @param frame Frame the descriptors refer to.
+ * @param sequence Frame sequence number.
+ * @param timestamp_us Sample time in microseconds.
+ * @return Length of the packed frame, or 0 if it does not fit into the buffer.
+ */
+size_t telemetry_encode_frame(uint8_t *buffer, size_t size, const sensor_field_t *fields, size_t field_count,
+                              const void *frame, uint32_t sequence, int64_t timestamp_us);
+
+/**
+ * @brief Decode a packed frame.
+ *
+ * Scaled channels are returned as VALUE_TYPE_DOUBLE (NaN if missing), VALUE_TYPE_INT16 channels as
+ * VALUE_TYPE_INT. Strings point into the payload.
+ *
+ * @param payload Packed frame, possibly followed by further frames.
+ * @param length Length of the payload in bytes.
+ * @param fields Array of field descriptors the frame was encoded with.
+ * @param field_count Number of field descriptors.
+ * @param header Destination for the header.
+ * @param values Destination for field_count values.
+ * @param consumed Number of bytes of the frame, set on success.
+ * @return TELEMETRY_OK or the reason the frame could not be decoded.
+ */
+telemetry_status_t telemetry_decode_frame(const uint8_t *payload, size_t length, const sensor_field_t *fields,
+                                          size_t field_count, telemetry_header_t *header, sensor_value_t *values,
+                                          size_t *consumed);
+
+#endif //ESP_GYRO_TELEMETRY_CODEC_H
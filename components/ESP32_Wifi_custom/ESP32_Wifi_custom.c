@@ -1,5 +1,9 @@
 #include "ESP32_Wifi_custom.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_netif_sntp.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
 #include "string.h"
 
 // Global configuration variables
@@ -7,32 +11,62 @@ static char *wifi_ssid = WIFI_SSID;
 static char *wifi_pass = WIFI_PASS;
 static int wifi_maximum_retry = WIFI_MAX_RETRY;
 static const char *wifi_log_tag = WIFI_TAG;
+static wifi_ps_type_t wifi_power_save = WIFI_POWER_SAVE;
 
 static int s_retry_num = 0;
+static uint32_t s_retry_delay_ms = WIFI_RETRY_DELAY_MIN_MS;
+static esp_timer_handle_t s_retry_timer = NULL;
+static EventGroupHandle_t s_wifi_event_group = NULL;
+
+/**
+ * @brief Reconnect once the retry delay has passed.
+ * @param arg Unused.
+ */
+static void retry_timer_callback(void* arg) {
+    esp_wifi_connect();
+}
 
 void event_handler(void* arg, esp_event_base_t event_base,
                    int32_t event_id, void* event_data) {
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
         esp_wifi_connect();
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        if (s_retry_num < wifi_maximum_retry) {
-            esp_wifi_connect();
+        xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+        if (wifi_maximum_retry < 0 || s_retry_num < wifi_maximum_retry) {
+            // Back off instead of hammering the AP while out of range
+            esp_timer_stop(s_retry_timer);
+            esp_timer_start_once(s_retry_timer, (uint64_t)s_retry_delay_ms * 1000);
             s_retry_num++;
-            ESP_LOGI(WIFI_TAG, "retry to connect to the AP");
+            ESP_LOGI(WIFI_TAG, "retry to connect to the AP in %lu ms", (unsigned long)s_retry_delay_ms);
+            s_retry_delay_ms = s_retry_delay_ms * 2 > WIFI_RETRY_DELAY_MAX_MS ? WIFI_RETRY_DELAY_MAX_MS : s_retry_delay_ms * 2;
         } else {
             ESP_LOGI(WIFI_TAG, "connect to the AP fail");
         }
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         s_retry_num = 0;
+        s_retry_delay_ms = WIFI_RETRY_DELAY_MIN_MS;
         ESP_LOGI(WIFI_TAG, "got ip");
+        xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
     }
 }
 
 void wifi_init_sta(void) {
+    s_wifi_event_group = xEventGroupCreate();
+    if (s_wifi_event_group == NULL) {
+        ESP_LOGE(WIFI_TAG, "Failed to create the WiFi event group");
+        return;
+    }
+
     ESP_ERROR_CHECK(esp_netif_init());
     ESP_ERROR_CHECK(esp_event_loop_create_default());
     esp_netif_create_default_wifi_sta();
 
+    const esp_timer_create_args_t retry_timer_args = {
+            .callback = retry_timer_callback,
+            .name = "wifi_retry",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&retry_timer_args, &s_retry_timer));
+
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
 
@@ -65,10 +99,33 @@ void wifi_init_sta(void) {
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
     ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
     ESP_ERROR_CHECK(esp_wifi_start());
+    esp_wifi_set_ps(wifi_power_save);
 
     ESP_LOGI(WIFI_TAG, "wifi_init_sta finished.");
 }
 
+bool wifi_wait_for_ip(uint32_t timeout_ms) {
+    if (s_wifi_event_group == NULL) {
+        return false;
+    }
+    EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group, WIFI_CONNECTED_BIT, pdFALSE, pdTRUE,
+                                           pdMS_TO_TICKS(timeout_ms));
+    return (bits & WIFI_CONNECTED_BIT) != 0;
+}
+
+esp_err_t wifi_start_time_sync(const char* server) {
+    esp_sntp_config_t config = ESP_NETIF_SNTP_DEFAULT_CONFIG(server);
+    esp_err_t err = esp_netif_sntp_init(&config);
+    if (err != ESP_OK) {
+        ESP_LOGE(WIFI_TAG, "Failed to start SNTP: %s", esp_err_to_name(err));
+    }
+    return err;
+}
+
+bool wifi_is_connected(void) {
+    return s_wifi_event_group != NULL && (xEventGroupGetBits(s_wifi_event_group) & WIFI_CONNECTED_BIT) != 0;
+}
+
 void set_wifi_ssid(const char* ssid) {
     strncpy(wifi_ssid, ssid, sizeof(wifi_ssid) - 1);
     wifi_ssid[sizeof(wifi_ssid) - 1] = '\0'; // Ensure null termination
@@ -87,6 +144,13 @@ void set_wifi_log_tag(const char* log_tag) {
     wifi_log_tag = log_tag;
 }
 
+void set_wifi_power_save(wifi_ps_type_t power_save) {
+    wifi_power_save = power_save;
+    if (s_wifi_event_group != NULL && esp_wifi_set_ps(power_save) != ESP_OK) {
+        ESP_LOGW(wifi_log_tag, "Failed to set power save %d", power_save);
+    }
+}
+
 const char* get_wifi_ssid(void) {
     return wifi_ssid;
 }
@@ -102,3 +166,7 @@ int get_wifi_maximum_retry(void) {
 const char* get_wifi_log_tag() {
     return wifi_log_tag;
 }
+
+wifi_ps_type_t get_wifi_power_save(void) {
+    return wifi_power_save;
+}
@@ -12,13 +12,21 @@
 #include <string.h>
 #include "esp_event.h"
 #include "esp_wifi.h"
+#include "stdbool.h"
 
 // Default WiFi Configuration
 #define WIFI_SSID           "MyWIFI"              ///< Default SSID
 #define WIFI_PASS           "baumannDo1995"       ///< Default Password
-#define WIFI_MAX_RETRY      10                    ///< Default maximum retry attempts
+#define WIFI_MAX_RETRY      -1                    ///< Default maximum retry attempts, negative to retry forever
+#define WIFI_RETRY_DELAY_MIN_MS 500               ///< Delay before the first reconnect attempt
+#define WIFI_RETRY_DELAY_MAX_MS 30000             ///< Upper bound of the doubling reconnect delay
+#define WIFI_CONNECT_TIMEOUT_MS 15000             ///< Default time to wait for an IP address at startup
+#define WIFI_SNTP_SERVER    "pool.ntp.org"        ///< Default SNTP server for wifi_start_time_sync()
+#define WIFI_POWER_SAVE     WIFI_PS_MIN_MODEM     ///< Default modem power save, the one of ESP-IDF
 #define WIFI_TAG            "WIFI"
 
+#define WIFI_CONNECTED_BIT  (1 << 0)              ///< Event group bit set while the station has an IP address
+
 // Setter, Getter for Configuration
 
 /**
@@ -38,7 +46,7 @@ void set_wifi_pass(const char* password);
 /**
  * @brief Set the maximum number of retries for connecting to WiFi.
  *
- * @param max_retry New maximum retry attempts.
+ * @param max_retry New maximum retry attempts, negative to retry forever.
  */
 void set_wifi_maximum_retry(int max_retry);
 
@@ -48,6 +56,16 @@ void set_wifi_maximum_retry(int max_retry);
  */
 void set_wifi_log_tag(const char* log_tag);
 
+/**
+ * @brief Set the modem power save of the station.
+ *
+ * Takes effect at once if WiFi is running, otherwise with wifi_init_sta(). Deeper power save
+ * sleeps through more beacons, which saves current but delays incoming packets.
+ *
+ * @param power_save WIFI_PS_NONE, WIFI_PS_MIN_MODEM or WIFI_PS_MAX_MODEM.
+ */
+void set_wifi_power_save(wifi_ps_type_t power_save);
+
 /**
  * @brief Get the WiFi SSID.
  *
@@ -65,7 +83,7 @@ const char* get_wifi_pass(void);
 /**
  * @brief Get the maximum number of retries for connecting to WiFi.
  *
- * @return Current maximum retry attempts.
+ * @return Current maximum retry attempts, negative if retrying forever.
  */
 int get_wifi_maximum_retry(void);
 
@@ -75,11 +93,20 @@ int get_wifi_maximum_retry(void);
  */
 const char* get_wifi_log_tag();
 
+/**
+ * @brief Get the modem power save of the station.
+ * @return Power save set last.
+ */
+wifi_ps_type_t get_wifi_power_save(void);
+
 // Functions
 
 /**
  * @brief WiFi event handler.
  *
+ * After a disconnect it reconnects with a delay that doubles from WIFI_RETRY_DELAY_MIN_MS up to
+ * WIFI_RETRY_DELAY_MAX_MS, and starts again from the minimum once an IP address was obtained.
+ *
  * @param arg User argument passed to the handler
  * @param event_base Base ID of the event
  * @param event_id ID of the event
@@ -90,7 +117,33 @@ void event_handler(void* arg, esp_event_base_t event_base,
 
 /**
  * @brief Initialize WiFi in station mode.
+ *
+ * Returns without waiting for the connection, see wifi_wait_for_ip().
  */
 void wifi_init_sta(void);
 
+/**
+ * @brief Wait until the station has an IP address.
+ * @param timeout_ms Maximum time to wait in milliseconds.
+ * @return true if the station has an IP address, false on timeout.
+ */
+bool wifi_wait_for_ip(uint32_t timeout_ms);
+
+/**
+ * @brief Keep the system time synchronised over SNTP.
+ *
+ * Returns at once; the first synchronisation happens as soon as the station has an IP address, and
+ * the time is refreshed periodically afterwards. Call it after wifi_init_sta().
+ *
+ * @param server SNTP server name, e.g. WIFI_SNTP_SERVER.
+ * @return ESP_OK, or the error of starting the SNTP client.
+ */
+esp_err_t wifi_start_time_sync(const char* server);
+
+/**
+ * @brief Check whether the station has an IP address, without blocking.
+ * @return true between IP_EVENT_STA_GOT_IP and the next disconnect.
+ */
+bool wifi_is_connected(void);
+
 #endif //ESP_TEST_MANUELL_CUSTOM_WIFI_H
@@ -0,0 +1,250 @@
+#include "gy86_activity.h"
+#include "gy86_data.h"
+#include "math.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+/**
+ * @file gy86_activity.c
+ * @brief Implementation file for the activity classifier of the GY-86 sensor suite.
+ *
+ * The features are exponentially weighted with a coefficient derived from the time between samples, so
+ * they keep their time constant whatever the sampling period and the barometer divider are.
+ */
+
+static gy86_activity_level_t activity_levels[GY86_ACTIVITY_COUNT] = {
+        [GY86_ACTIVITY_IDLE] = {"idle", 0, 0, 0, 0, 0, 50},
+        [GY86_ACTIVITY_ACTIVE] = {"active", 0.0004f, 4.0f, 0.3f, 0, 60000, 0},
+        [GY86_ACTIVITY_MOVING] = {"moving", 0.01f, 400.0f, 1.0f, 1000, 30000, 5},
+};
+static bool activity_enabled = GY86_ACTIVITY_ENABLED;
+static gy86_activity_callback_t activity_callback = NULL;
+static void *activity_callback_arg = NULL;
+
+// The sampling task writes the report, any task may read it
+static portMUX_TYPE activity_lock = portMUX_INITIALIZER_UNLOCKED;
+static gy86_activity_t activity_report;
+
+// Owned by the sampling task
+static bool activity_started = false;
+static int64_t entered_us = 0;          ///< esp_timer time the current state was entered
+static int64_t imu_us = 0;              ///< Sample time of the last IMU sample
+static int64_t baro_us = 0;             ///< Sample time of the last barometer sample
+static float accel_mean[3], accel_variance[3];
+static float gyro_mean[3], gyro_variance[3];
+static float pressure_filtered = 0;
+static gy86_activity_state_t rising_target = GY86_ACTIVITY_IDLE;
+static int64_t rising_since_us = 0;     ///< Time a busier state's threshold was first reached
+static int64_t quiet_since_us = 0;      ///< Time the features first fell below the current state's exit level
+
+void set_gy86_activity_enabled(bool enabled) {
+    activity_enabled = enabled;
+}
+
+bool get_gy86_activity_enabled(void) {
+    return activity_enabled;
+}
+
+void set_gy86_activity_level(gy86_activity_state_t state, const gy86_activity_level_t *level) {
+    if (state < GY86_ACTIVITY_COUNT) {
+        activity_levels[state] = *level;
+    }
+}
+
+gy86_activity_level_t get_gy86_activity_level(gy86_activity_state_t state) {
+    return activity_levels[state < GY86_ACTIVITY_COUNT ? state : GY86_ACTIVITY_IDLE];
+}
+
+uint32_t gy86_activity_baro_divider(uint32_t configured) {
+    uint32_t divider = configured;
+    if (activity_enabled) {
+        gy86_activity_state_t state = activity_report.state;
+        uint32_t level = activity_levels[state].baro_divider;
+        // Idle only slows the configured rate down, moving only speeds it up
+        if (level > 0 && (state == GY86_ACTIVITY_ACTIVE ||
+                          (state < GY86_ACTIVITY_ACTIVE ? level > configured : level < configured))) {
+            divider = level;
+        }
+    }
+    return divider > 0 ? divider : 1;
+}
+
+void set_gy86_activity_callback(gy86_activity_callback_t callback, void *arg) {
+    activity_callback = callback;
+    activity_callback_arg = arg;
+}
+
+/**
+ * @brief Fold a sample into an exponentially weighted mean and variance.
+ * @param mean Mean, updated in place.
+ * @param variance Variance, updated in place.
+ * @param x New sample.
+ * @param alpha Weight of the new sample.
+ */
+static void weighted_variance_add(float *mean, float *variance, float x, float alpha) {
+    float delta = x - *mean;
+    *mean += alpha * delta;
+    *variance = (1 - alpha) * (*variance + alpha * delta * delta);
+}
+
+/**
+ * @brief Get the weight of a new sample for a time constant.
+ * @param dt_us Time since the previous sample in microseconds.
+ * @param time_constant_ms Time constant in milliseconds.
+ * @return Weight between 0 and 1.
+ */
+static float sample_weight(int64_t dt_us, uint32_t time_constant_ms) {
+    float dt_ms = dt_us / 1000.0f;
+    return dt_ms / (time_constant_ms + dt_ms);
+}
+
+/**
+ * @brief Check whether a feature reaches a share of the thresholds of a state.
+ * @param level Thresholds of the state, a threshold of 0 is not used.
+ * @param ratio Share of the thresholds.
+ * @return true if at least one feature reaches its share.
+ */
+static bool level_reached(const gy86_activity_level_t *level, float ratio) {
+    return (level->accel_variance > 0 && activity_report.accel_variance >= level->accel_variance * ratio) ||
+           (level->gyro_variance > 0 && activity_report.gyro_variance >= level->gyro_variance * ratio) ||
+           (level->pressure_trend > 0 && fabsf(activity_report.pressure_trend) >= level->pressure_trend * ratio);
+}
+
+/**
+ * @brief Switch to a state and tell the callback.
+ * @param state New state.
+ * @param now_us esp_timer time of the switch.
+ */
+static void enter_state(gy86_activity_state_t state, int64_t now_us) {
+    gy86_activity_state_t previous = activity_report.state;
+
+    portENTER_CRITICAL(&activity_lock);
+    if (activity_started) {
+        activity_report.time_ms[previous] += (now_us - entered_us) / 1000;
+        activity_report.transitions++;
+    }
+    activity_report.state = state;
+    activity_report.entered_ms = (uint32_t)(now_us / 1000);
+    portEXIT_CRITICAL(&activity_lock);
+
+    entered_us = now_us;
+    rising_target = GY86_ACTIVITY_IDLE;
+    rising_since_us = 0;
+    quiet_since_us = 0;
+
+    const gy86_activity_level_t *level = &activity_levels[state];
+    if (activity_started) {
+        ESP_LOGI("GY86", "Activity %s -> %s", activity_levels[previous].name, level->name);
+    }
+    if (activity_callback != NULL) {
+        activity_callback(state, activity_callback_arg);
+    }
+}
+
+/**
+ * @brief Update the features with the fresh sensors of a frame.
+ * @param frame Frame that was just sampled.
+ */
+static void update_features(const sensor_snapshot_t *frame) {
+    if (frame->fresh & GY86_FRAME_IMU_FRESH) {
+        float accel[3] = {frame->imu.accel_x / MPU6050_ACCEL_LSB_PER_G, frame->imu.accel_y / MPU6050_ACCEL_LSB_PER_G,
+                          frame->imu.accel_z / MPU6050_ACCEL_LSB_PER_G};
+        float gyro[3] = {frame->imu.gyro_x / MPU6050_GYRO_LSB_PER_DPS, frame->imu.gyro_y / MPU6050_GYRO_LSB_PER_DPS,
+                         frame->imu.gyro_z / MPU6050_GYRO_LSB_PER_DPS};
+        if (imu_us == 0) {
+            for (int i = 0; i < 3; i++) {
+                accel_mean[i] = accel[i];
+                gyro_mean[i] = gyro[i];
+            }
+        } else {
+            float alpha = sample_weight(frame->timestamp_us - imu_us, GY86_ACTIVITY_TIME_CONSTANT_MS);
+            for (int i = 0; i < 3; i++) {
+                weighted_variance_add(&accel_mean[i], &accel_variance[i], accel[i], alpha);
+                weighted_variance_add(&gyro_mean[i], &gyro_variance[i], gyro[i], alpha);
+            }
+        }
+        imu_us = frame->timestamp_us;
+    }
+
+    float trend = activity_report.pressure_trend;
+    if (frame->fresh & GY86_FRAME_BARO_FRESH) {
+        // The trend is the slope of the smoothed pressure, smoothed once more over a longer time
+        if (baro_us == 0) {
+            pressure_filtered = frame->baro.pressure;
+        } else {
+            int64_t dt_us = frame->timestamp_us - baro_us;
+            float previous = pressure_filtered;
+            pressure_filtered += sample_weight(dt_us, GY86_ACTIVITY_TIME_CONSTANT_MS) * (frame->baro.pressure - previous);
+            float slope = (pressure_filtered - previous) / (dt_us / 60e6f);
+            trend += sample_weight(dt_us, GY86_ACTIVITY_TREND_TIME_CONSTANT_MS) * (slope - trend);
+        }
+        baro_us = frame->timestamp_us;
+    }
+
+    portENTER_CRITICAL(&activity_lock);
+    activity_report.accel_variance = accel_variance[0] + accel_variance[1] + accel_variance[2];
+    activity_report.gyro_variance = gyro_variance[0] + gyro_variance[1] + gyro_variance[2];
+    activity_report.pressure_trend = trend;
+    portEXIT_CRITICAL(&activity_lock);
+}
+
+void gy86_activity_add_frame(const sensor_snapshot_t *frame) {
+    int64_t now_us = frame->timestamp_us;
+    update_features(frame);
+
+    if (!activity_started) {
+        enter_state(activity_enabled ? GY86_ACTIVITY_INITIAL_STATE : GY86_ACTIVITY_IDLE, now_us);
+        activity_started = true;
+        return;
+    }
+    if (!activity_enabled) {
+        return;
+    }
+
+    // Go up to the busiest state whose threshold is reached once it was reached for that state's enter time
+    gy86_activity_state_t target = GY86_ACTIVITY_IDLE;
+    for (int state = GY86_ACTIVITY_COUNT - 1; state > GY86_ACTIVITY_IDLE; state--) {
+        if (level_reached(&activity_levels[state], 1.0f)) {
+            target = (gy86_activity_state_t)state;
+            break;
+        }
+    }
+    if (target > activity_report.state) {
+        if (rising_target != target) {
+            rising_target = target;
+            rising_since_us = now_us;
+        }
+        if (now_us - rising_since_us >= (int64_t)activity_levels[target].enter_ms * 1000) {
+            enter_state(target, now_us);
+            return;
+        }
+    } else {
+        rising_target = GY86_ACTIVITY_IDLE;
+    }
+
+    // Go down one state once everything stayed well below the current state's thresholds for its hold time
+    if (activity_report.state > GY86_ACTIVITY_IDLE && !level_reached(&activity_levels[activity_report.state], GY86_ACTIVITY_EXIT_RATIO)) {
+        if (quiet_since_us == 0) {
+            quiet_since_us = now_us;
+        }
+        if (now_us - quiet_since_us >= (int64_t)activity_levels[activity_report.state].hold_ms * 1000) {
+            enter_state(activity_report.state - 1, now_us);
+        }
+    } else {
+        quiet_since_us = 0;
+    }
+}
+
+void gy86_activity_read(gy86_activity_t *activity) {
+    int64_t now_ms = esp_timer_get_time() / 1000;
+
+    portENTER_CRITICAL(&activity_lock);
+    *activity = activity_report;
+    portEXIT_CRITICAL(&activity_lock);
+
+    // The current state counts up to now
+    if (activity_started) {
+        activity->time_ms[activity->state] += (uint32_t)now_ms - activity->entered_ms;
+    }
+}
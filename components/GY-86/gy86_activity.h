@@ -0,0 +1,140 @@
+#ifndef ESP_GYRO_GY86_ACTIVITY_H
+#define ESP_GYRO_GY86_ACTIVITY_H
+
+#include "stdbool.h"
+#include "gy86_data_defs.h"
+
+/**
+ * @file gy86_activity.h
+ * @brief Activity classifier that adapts the sampling rate of the GY-86 sensor suite to the signal.
+ *
+ * Every sampled frame updates three activity features: the variance of the acceleration and of the rotation
+ * rate, summed over the axes so they do not depend on the orientation, and the magnitude of the pressure
+ * trend. The features select one of the activity states with hysteresis: a state is entered once one
+ * feature reaches its threshold for enter_ms, and left for the state below once all features stayed below
+ * GY86_ACTIVITY_EXIT_RATIO of their thresholds for hold_ms. Each state bounds the barometer divider, and a
+ * callback lets the application change its publish interval and radio with it. The IMU keeps the sampling
+ * period of set_gy86_sample_period_ms() in every state, so the motion events are detected at the same rate.
+ *
+ * The states never work against the divider of set_gy86_baro_divider(): GY86_ACTIVITY_ACTIVE uses it,
+ * GY86_ACTIVITY_IDLE can only read the barometer less often and GY86_ACTIVITY_MOVING only more often.
+ */
+
+#define GY86_ACTIVITY_TIME_CONSTANT_MS  2000    ///< Time constant of the feature averages in milliseconds
+#define GY86_ACTIVITY_TREND_TIME_CONSTANT_MS 30000 ///< Time constant of the pressure trend in milliseconds
+#define GY86_ACTIVITY_EXIT_RATIO        0.5f    ///< Share of the thresholds the features must fall below to leave a state
+#define GY86_ACTIVITY_INITIAL_STATE     GY86_ACTIVITY_ACTIVE   ///< State after start, so the first minute is responsive
+#define GY86_ACTIVITY_ENABLED           true    ///< Default for adapting the rates, the configured ones bound them
+
+/**
+ * @enum gy86_activity_state_t
+ * @brief Activity states, from calm to busy.
+ */
+typedef enum {
+    GY86_ACTIVITY_IDLE,     ///< At rest
+    GY86_ACTIVITY_ACTIVE,   ///< Handled or vibrating
+    GY86_ACTIVITY_MOVING,   ///< Carried, driven or climbing
+    GY86_ACTIVITY_COUNT     ///< Number of states
+} gy86_activity_state_t;
+
+/**
+ * @struct gy86_activity_level_t
+ * @brief Thresholds and barometer rate of one activity state.
+ *
+ * The thresholds of GY86_ACTIVITY_IDLE are not used, it is the state every other state falls back to.
+ */
+typedef struct {
+    const char *name;               ///< Name in reports
+    float accel_variance;           ///< Acceleration variance to enter the state in g^2
+    float gyro_variance;            ///< Rotation rate variance to enter the state in (deg/s)^2
+    float pressure_trend;           ///< Magnitude of the pressure trend to enter the state in hPa/min
+    uint32_t enter_ms;              ///< Time a threshold must be reached before the state is entered
+    uint32_t hold_ms;               ///< Quiet time before the state is left for the one below
+    uint32_t baro_divider;          ///< IMU samples per barometer sample in the state, 0 for the configured divider
+} gy86_activity_level_t;
+
+/**
+ * @struct gy86_activity_t
+ * @brief Current activity state, its features and how time was spent.
+ */
+typedef struct {
+    gy86_activity_state_t state;                ///< Current state
+    float accel_variance;                       ///< Acceleration variance in g^2
+    float gyro_variance;                        ///< Rotation rate variance in (deg/s)^2
+    float pressure_trend;                       ///< Pressure trend in hPa/min, negative when climbing
+    uint32_t transitions;                       ///< State changes since start
+    uint32_t entered_ms;                        ///< Time the current state was entered, in esp_timer milliseconds
+    uint64_t time_ms[GY86_ACTIVITY_COUNT];      ///< Time spent in each state in milliseconds, including the current one
+} gy86_activity_t;
+
+/**
+ * @brief Called by the sampling task when the state changes, and once for the initial state.
+ * @param state New state.
+ * @param arg Argument given to set_gy86_activity_callback().
+ */
+typedef void (*gy86_activity_callback_t)(gy86_activity_state_t state, void *arg);
+
+/**
+ * @brief Set whether the activity state adapts the sensor rates.
+ *
+ * While disabled the features are still tracked, the state stays as it is and the barometer divider is
+ * the one of set_gy86_baro_divider(). That divider is kept while enabled and applies again at once when
+ * disabled.
+ *
+ * @param enabled true to adapt the rates.
+ */
+void set_gy86_activity_enabled(bool enabled);
+
+/**
+ * @brief Get whether the activity state adapts the sensor rates.
+ * @return true if the rates are adapted.
+ */
+bool get_gy86_activity_enabled(void);
+
+/**
+ * @brief Replace the thresholds and barometer divider of a state.
+ * @param state State to configure.
+ * @param level Thresholds and barometer divider, copied.
+ */
+void set_gy86_activity_level(gy86_activity_state_t state, const gy86_activity_level_t *level);
+
+/**
+ * @brief Get the thresholds and barometer divider of a state.
+ * @param state State.
+ * @return Thresholds and barometer divider.
+ */
+gy86_activity_level_t get_gy86_activity_level(gy86_activity_state_t state);
+
+/**
+ * @brief Get the barometer divider the sampling task applies.
+ * @param configured Divider of set_gy86_baro_divider().
+ * @return Divider of the current state bounded by configured while adapting, otherwise configured.
+ */
+uint32_t gy86_activity_baro_divider(uint32_t configured);
+
+/**
+ * @brief Set the function told about state changes.
+ *
+ * It runs in the sampling task and must not block. Set it before start_gy86_sampling().
+ *
+ * @param callback Function to call, NULL for none.
+ * @param arg Argument passed to the function.
+ */
+void set_gy86_activity_callback(gy86_activity_callback_t callback, void *arg);
+
+/**
+ * @brief Update the features with a frame and change the state when its thresholds say so.
+ *
+ * Must only be called by the sampling task.
+ *
+ * @param frame Frame that was just sampled.
+ */
+void gy86_activity_add_frame(const sensor_snapshot_t *frame);
+
+/**
+ * @brief Copy the current state, features and time per state.
+ * @param activity Destination.
+ */
+void gy86_activity_read(gy86_activity_t *activity);
+
+#endif //ESP_GYRO_GY86_ACTIVITY_H
@@ -0,0 +1,267 @@
+#include "gy86_capture.h"
+#include "math.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "freertos/semphr.h"
+
+/**
+ * @file gy86_capture.c
+ * @brief Implementation file for the black box capture ring of the GY-86 sensor suite.
+ *
+ * The ring is written by the sampling task only. While a capture is frozen the sampling task leaves the
+ * ring alone, so the uploader reads it without a lock; the state and the trigger are shared under a lock.
+ */
+
+/**
+ * @brief What the ring is doing.
+ */
+typedef enum {
+    CAPTURE_RECORDING,      ///< Overwriting the oldest sample with every frame
+    CAPTURE_POST_TRIGGER,   ///< Triggered, recording the post-trigger time
+    CAPTURE_FROZEN,         ///< Holding a capture until gy86_capture_release()
+} capture_state_t;
+
+static uint32_t capture_seconds = GY86_CAPTURE_SECONDS;
+static uint32_t capture_pre_ms = GY86_CAPTURE_PRE_MS;
+static uint32_t capture_post_ms = GY86_CAPTURE_POST_MS;
+static uint32_t capture_trigger_events = GY86_CAPTURE_TRIGGER_EVENTS;
+
+static gy86_capture_sample_t *capture_ring = NULL;
+static uint32_t capture_capacity = 0;
+static bool capture_in_psram = false;
+
+static SemaphoreHandle_t capture_ready = NULL;
+static StaticSemaphore_t capture_ready_buffer;
+
+// Shared between the triggering tasks, the sampling task and the uploader
+static portMUX_TYPE capture_lock = portMUX_INITIALIZER_UNLOCKED;
+static capture_state_t capture_state = CAPTURE_RECORDING;
+static uint32_t capture_id = 0;
+static uint8_t capture_reason = 0;
+static int64_t capture_trigger_us = 0;
+static uint32_t captures_frozen = 0;
+static uint32_t triggers_ignored = 0;
+
+// Owned by the sampling task, read by the uploader while frozen
+static uint32_t capture_head = 0;       ///< Slot the next sample is written to
+static uint32_t capture_filled = 0;     ///< Slots written since start, at most capture_capacity
+static uint32_t capture_post_count = 0; ///< Samples written since the trigger of the running capture
+
+void set_gy86_capture_seconds(uint32_t seconds) {
+    capture_seconds = seconds;
+}
+
+uint32_t get_gy86_capture_seconds(void) {
+    return capture_seconds;
+}
+
+/**
+ * @brief Shrink the pre-trigger and post-trigger times in proportion until the window fits the ring.
+ *
+ * Before gy86_capture_init() the ring is assumed to get the size set by set_gy86_capture_seconds().
+ */
+static void fit_capture_window(void) {
+    uint64_t ring_ms = capture_capacity > 0 ? (uint64_t)capture_capacity * GY86_CAPTURE_MIN_PERIOD_MS
+                                            : (uint64_t)capture_seconds * 1000;
+    uint64_t window_ms = (uint64_t)capture_pre_ms + capture_post_ms;
+    if (window_ms <= ring_ms) {
+        return;
+    }
+
+    uint32_t pre_ms = (uint32_t)(ring_ms * capture_pre_ms / window_ms);
+    capture_post_ms = (uint32_t)(ring_ms - pre_ms);
+    capture_pre_ms = pre_ms;
+    ESP_LOGW("GY86", "Capture window does not fit the ring of %lu ms, cut to %lu ms before and %lu ms after the trigger",
+             (unsigned long)ring_ms, (unsigned long)capture_pre_ms, (unsigned long)capture_post_ms);
+}
+
+void set_gy86_capture_pre_ms(uint32_t pre_ms) {
+    capture_pre_ms = pre_ms;
+    fit_capture_window();
+}
+
+uint32_t get_gy86_capture_pre_ms(void) {
+    return capture_pre_ms;
+}
+
+void set_gy86_capture_post_ms(uint32_t post_ms) {
+    capture_post_ms = post_ms;
+    fit_capture_window();
+}
+
+uint32_t get_gy86_capture_post_ms(void) {
+    return capture_post_ms;
+}
+
+void set_gy86_capture_trigger_events(uint32_t mask) {
+    capture_trigger_events = mask;
+}
+
+uint32_t get_gy86_capture_trigger_events(void) {
+    return capture_trigger_events;
+}
+
+esp_err_t gy86_capture_init(void) {
+    if (capture_ring != NULL) {
+        return ESP_OK;
+    }
+
+    capture_ready = xSemaphoreCreateBinaryStatic(&capture_ready_buffer);
+
+    uint32_t capacity = capture_seconds * 1000 / GY86_CAPTURE_MIN_PERIOD_MS;
+    size_t size = capacity * sizeof(gy86_capture_sample_t);
+    capture_ring = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    capture_in_psram = capture_ring != NULL;
+    if (capture_ring == NULL) {
+        capture_ring = heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    }
+    if (capacity == 0 || capture_ring == NULL) {
+        ESP_LOGE("GY86", "No memory for a capture ring of %lu samples", (unsigned long)capacity);
+        return ESP_ERR_NO_MEM;
+    }
+
+    capture_capacity = capacity;
+    ESP_LOGI("GY86", "Capture ring of %lu samples, %u bytes in %s", (unsigned long)capacity, (unsigned)size,
+             capture_in_psram ? "PSRAM" : "internal RAM");
+    fit_capture_window();
+    return ESP_OK;
+}
+
+bool gy86_capture_trigger(uint8_t reason, int64_t trigger_us) {
+    if (capture_ring == NULL) {
+        return false;
+    }
+
+    portENTER_CRITICAL(&capture_lock);
+    bool started = capture_state == CAPTURE_RECORDING;
+    if (started) {
+        capture_state = CAPTURE_POST_TRIGGER;
+        capture_id++;
+        capture_reason = reason;
+        capture_trigger_us = trigger_us;
+    } else {
+        triggers_ignored++;
+    }
+    portEXIT_CRITICAL(&capture_lock);
+    return started;
+}
+
+/**
+ * @brief Stop writing the ring and wake the uploader.
+ */
+static void freeze_capture(void) {
+    portENTER_CRITICAL(&capture_lock);
+    capture_state = CAPTURE_FROZEN;
+    captures_frozen++;
+    portEXIT_CRITICAL(&capture_lock);
+
+    ESP_LOGI("GY86", "Capture %lu frozen", (unsigned long)capture_id);
+    xSemaphoreGive(capture_ready);
+}
+
+/**
+ * @brief Convert a frame to a capture sample.
+ * @param frame Frame that was just sampled.
+ * @param sample Destination.
+ */
+static void frame_to_sample(const sensor_snapshot_t *frame, gy86_capture_sample_t *sample) {
+    sample->time_us = (uint32_t)frame->timestamp_us;
+    sample->pressure = (int32_t)lroundf(frame->baro.pressure * 1000.0f);
+    sample->accel[0] = frame->imu.accel_x;
+    sample->accel[1] = frame->imu.accel_y;
+    sample->accel[2] = frame->imu.accel_z;
+    sample->gyro[0] = frame->imu.gyro_x;
+    sample->gyro[1] = frame->imu.gyro_y;
+    sample->gyro[2] = frame->imu.gyro_z;
+    sample->mag[0] = frame->mag.x;
+    sample->mag[1] = frame->mag.y;
+    sample->mag[2] = frame->mag.z;
+    sample->temperature = (int16_t)lroundf(frame->baro.temperature * 100.0f);
+    sample->fresh = (uint8_t)frame->fresh;
+}
+
+void gy86_capture_add_frame(const sensor_snapshot_t *frame) {
+    if (capture_ring == NULL) {
+        return;
+    }
+
+    portENTER_CRITICAL(&capture_lock);
+    capture_state_t state = capture_state;
+    int64_t trigger_us = capture_trigger_us;
+    portEXIT_CRITICAL(&capture_lock);
+
+    if (state == CAPTURE_FROZEN) {
+        return;
+    }
+    if (state == CAPTURE_RECORDING) {
+        capture_post_count = 0;
+    }
+    // Sampling faster than the ring was sized for: the window gets cut short, pre and post in proportion
+    if (state == CAPTURE_POST_TRIGGER && capture_filled == capture_capacity) {
+        int32_t age_us = (int32_t)((uint32_t)trigger_us - capture_ring[capture_head].time_us);
+        uint64_t post_share = (uint64_t)capture_capacity * capture_post_ms / (capture_pre_ms + capture_post_ms + 1);
+        if (age_us <= (int32_t)(capture_pre_ms * 1000) && capture_post_count >= post_share) {
+            freeze_capture();
+            return;
+        }
+    }
+
+    frame_to_sample(frame, &capture_ring[capture_head]);
+    capture_head = (capture_head + 1) % capture_capacity;
+    if (capture_filled < capture_capacity) {
+        capture_filled++;
+    }
+    if (state == CAPTURE_POST_TRIGGER && frame->timestamp_us >= trigger_us) {
+        capture_post_count++;
+    }
+
+    if (state == CAPTURE_POST_TRIGGER && frame->timestamp_us - trigger_us >= (int64_t)capture_post_ms * 1000) {
+        freeze_capture();
+    }
+}
+
+bool gy86_capture_take(gy86_capture_window_t *window, TickType_t wait) {
+    if (capture_ready == NULL || xSemaphoreTake(capture_ready, wait) != pdTRUE) {
+        return false;
+    }
+
+    portENTER_CRITICAL(&capture_lock);
+    window->capture_id = capture_id;
+    window->reason = capture_reason;
+    window->trigger_us = capture_trigger_us;
+    portEXIT_CRITICAL(&capture_lock);
+
+    // Walk back from the newest sample to the first one inside the pre-trigger time
+    uint32_t trigger = (uint32_t)window->trigger_us;
+    uint32_t count = 0;
+    while (count < capture_filled) {
+        uint32_t slot = (capture_head + capture_capacity - 1 - count) % capture_capacity;
+        if ((int32_t)(trigger - capture_ring[slot].time_us) > (int32_t)(capture_pre_ms * 1000)) {
+            break;
+        }
+        count++;
+    }
+
+    window->count = count;
+    window->first = (capture_head + capture_capacity - count) % capture_capacity;
+    return true;
+}
+
+const gy86_capture_sample_t *gy86_capture_sample(const gy86_capture_window_t *window, uint32_t index) {
+    return &capture_ring[(window->first + index) % capture_capacity];
+}
+
+void gy86_capture_release(void) {
+    portENTER_CRITICAL(&capture_lock);
+    capture_state = CAPTURE_RECORDING;
+    portEXIT_CRITICAL(&capture_lock);
+}
+
+void get_gy86_capture_info(gy86_capture_info_t *info) {
+    portENTER_CRITICAL(&capture_lock);
+    info->capacity = capture_capacity;
+    info->in_psram = capture_in_psram;
+    info->captures = captures_frozen;
+    info->ignored = triggers_ignored;
+    portEXIT_CRITICAL(&capture_lock);
+}
@@ -0,0 +1,163 @@
+#ifndef ESP_GYRO_GY86_CAPTURE_H
+#define ESP_GYRO_GY86_CAPTURE_H
+
+#include "stdbool.h"
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "gy86_data_defs.h"
+#include "gy86_events.h"
+#include "gy86_capture_codec.h"
+
+/**
+ * @file gy86_capture.h
+ * @brief Black box capture ring of the GY-86 sensor suite.
+ *
+ * The sampling task keeps the last frames as compact raw samples in a ring allocated once at startup,
+ * in PSRAM when the board has it. A trigger, from a motion event or from any task, keeps recording for
+ * the post-trigger time and then freezes the ring, so it holds the pre-trigger and post-trigger window
+ * until the uploader has read it with gy86_capture_take() and handed it back with gy86_capture_release().
+ * Triggers while a capture is running or frozen are counted and ignored; the first capture is kept.
+ *
+ * The ring holds GY86_CAPTURE_SECONDS at GY86_CAPTURE_MIN_PERIOD_MS. Sampling faster shortens the time
+ * it covers; the window is then cut short, the ring split between pre-trigger and post-trigger samples in
+ * proportion to their times.
+ */
+
+#define GY86_CAPTURE_SECONDS        10      ///< Default time the ring holds at the shortest sampling period
+#define GY86_CAPTURE_MIN_PERIOD_MS  20      ///< Sampling period the ring is sized for in milliseconds
+#define GY86_CAPTURE_PRE_MS         5000    ///< Default time kept before the trigger in milliseconds
+#define GY86_CAPTURE_POST_MS        5000    ///< Default time recorded after the trigger in milliseconds
+#define GY86_CAPTURE_TRIGGER_EVENTS ((1u << GY86_EVENT_FREE_FALL) | (1u << GY86_EVENT_SHOCK)) ///< Default events that trigger a capture
+
+/**
+ * @struct gy86_capture_window_t
+ * @brief A frozen capture, see gy86_capture_take().
+ */
+typedef struct {
+    uint32_t capture_id;        ///< Capture number since start, starting at 1
+    uint8_t reason;             ///< gy86_event_type_t of the trigger, or GY86_CAPTURE_REASON_COMMAND
+    int64_t trigger_us;         ///< esp_timer time of the trigger
+    uint32_t first;             ///< Ring slot of the first sample
+    uint32_t count;             ///< Number of samples in the window
+} gy86_capture_window_t;
+
+/**
+ * @struct gy86_capture_info_t
+ * @brief Size of the ring and what happened to the triggers.
+ */
+typedef struct {
+    uint32_t capacity;          ///< Samples the ring holds, 0 if it could not be allocated
+    bool in_psram;              ///< The ring lives in PSRAM
+    uint32_t captures;          ///< Captures frozen since start
+    uint32_t ignored;           ///< Triggers ignored because a capture was running or frozen
+} gy86_capture_info_t;
+
+/**
+ * @brief Set how many seconds the ring holds at GY86_CAPTURE_MIN_PERIOD_MS.
+ *
+ * Takes effect with gy86_capture_init(), the ring is never resized afterwards.
+ *
+ * @param seconds Time the ring holds.
+ */
+void set_gy86_capture_seconds(uint32_t seconds);
+
+/**
+ * @brief Get how many seconds the ring holds at GY86_CAPTURE_MIN_PERIOD_MS.
+ * @return Time the ring holds.
+ */
+uint32_t get_gy86_capture_seconds(void);
+
+/**
+ * @brief Allocate the ring, in PSRAM if available. Called by init_gy86_module().
+ * @return ESP_OK, or ESP_ERR_NO_MEM.
+ */
+esp_err_t gy86_capture_init(void);
+
+/**
+ * @brief Set the time kept before a trigger.
+ *
+ * If the pre-trigger and post-trigger times together exceed the time the ring holds at
+ * GY86_CAPTURE_MIN_PERIOD_MS, both are cut in proportion until they fit.
+ *
+ * @param pre_ms Time in milliseconds.
+ */
+void set_gy86_capture_pre_ms(uint32_t pre_ms);
+
+/**
+ * @brief Get the time kept before a trigger.
+ * @return Time in milliseconds.
+ */
+uint32_t get_gy86_capture_pre_ms(void);
+
+/**
+ * @brief Set the time recorded after a trigger before the ring freezes.
+ *
+ * Cut like the pre-trigger time, see set_gy86_capture_pre_ms().
+ *
+ * @param post_ms Time in milliseconds.
+ */
+void set_gy86_capture_post_ms(uint32_t post_ms);
+
+/**
+ * @brief Get the time recorded after a trigger before the ring freezes.
+ * @return Time in milliseconds.
+ */
+uint32_t get_gy86_capture_post_ms(void);
+
+/**
+ * @brief Set which motion events trigger a capture.
+ * @param mask Bit (1 << type) for every gy86_event_type_t that triggers, 0 for none.
+ */
+void set_gy86_capture_trigger_events(uint32_t mask);
+
+/**
+ * @brief Get which motion events trigger a capture.
+ * @return Bit (1 << type) for every gy86_event_type_t that triggers.
+ */
+uint32_t get_gy86_capture_trigger_events(void);
+
+/**
+ * @brief Request a capture. Safe to call from any task, never blocks.
+ * @param reason gy86_event_type_t of the trigger, or GY86_CAPTURE_REASON_COMMAND.
+ * @param trigger_us esp_timer time the window is centered on, e.g. the start of an event.
+ * @return true if the capture was started, false if one is running or frozen, or there is no ring.
+ */
+bool gy86_capture_trigger(uint8_t reason, int64_t trigger_us);
+
+/**
+ * @brief Store a frame in the ring and freeze it once the post-trigger time has passed.
+ *
+ * Must only be called by the sampling task.
+ *
+ * @param frame Frame that was just sampled.
+ */
+void gy86_capture_add_frame(const sensor_snapshot_t *frame);
+
+/**
+ * @brief Wait for a frozen capture.
+ * @param window Filled with the window of the capture.
+ * @param wait Ticks to wait, portMAX_DELAY to wait forever.
+ * @return true if a capture is frozen; it stays frozen until gy86_capture_release().
+ */
+bool gy86_capture_take(gy86_capture_window_t *window, TickType_t wait);
+
+/**
+ * @brief Get a sample of a frozen capture.
+ * @param window Window from gy86_capture_take().
+ * @param index Index of the sample, below window->count.
+ * @return Sample inside the ring, valid until gy86_capture_release().
+ */
+const gy86_capture_sample_t *gy86_capture_sample(const gy86_capture_window_t *window, uint32_t index);
+
+/**
+ * @brief Hand a frozen capture back, the ring records again from the next frame.
+ */
+void gy86_capture_release(void);
+
+/**
+ * @brief Get the size of the ring and the trigger counters.
+ * @param info Destination.
+ */
+void get_gy86_capture_info(gy86_capture_info_t *info);
+
+#endif //ESP_GYRO_GY86_CAPTURE_H
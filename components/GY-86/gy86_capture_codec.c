@@ -0,0 +1,228 @@
+#include "gy86_capture_codec.h"
+#include "string.h"
+
+/**
+ * @file gy86_capture_codec.c
+ * @brief Implementation file for the compressed chunk format of black box captures.
+ */
+
+#define CAPTURE_SIGNED_FIELDS 11    ///< accel, gyro, mag, temperature and pressure
+
+static void put_u16(uint8_t *p, uint16_t value) {
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+}
+
+static void put_u32(uint8_t *p, uint32_t value) {
+    put_u16(p, (uint16_t)value);
+    put_u16(p + 2, (uint16_t)(value >> 16));
+}
+
+static void put_u64(uint8_t *p, uint64_t value) {
+    put_u32(p, (uint32_t)value);
+    put_u32(p + 4, (uint32_t)(value >> 32));
+}
+
+static uint16_t get_u16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return get_u16(p) | ((uint32_t)get_u16(p + 2) << 16);
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+    return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+/**
+ * @brief Copy the signed fields of a sample in wire order.
+ * @param sample Sample.
+ * @param fields Destination for CAPTURE_SIGNED_FIELDS values.
+ */
+static void sample_to_fields(const gy86_capture_sample_t *sample, int64_t fields[CAPTURE_SIGNED_FIELDS]) {
+    for (int i = 0; i < 3; i++) {
+        fields[i] = sample->accel[i];
+        fields[3 + i] = sample->gyro[i];
+        fields[6 + i] = sample->mag[i];
+    }
+    fields[9] = sample->temperature;
+    fields[10] = sample->pressure;
+}
+
+static void fields_to_sample(const int64_t fields[CAPTURE_SIGNED_FIELDS], gy86_capture_sample_t *sample) {
+    for (int i = 0; i < 3; i++) {
+        sample->accel[i] = (int16_t)fields[i];
+        sample->gyro[i] = (int16_t)fields[3 + i];
+        sample->mag[i] = (int16_t)fields[6 + i];
+    }
+    sample->temperature = (int16_t)fields[9];
+    sample->pressure = (int32_t)fields[10];
+}
+
+/**
+ * @brief Write a LEB128 varint.
+ * @param p Output, at least 10 bytes.
+ * @param value Value to write.
+ * @return Number of bytes written.
+ */
+static size_t put_varint(uint8_t *p, uint64_t value) {
+    size_t length = 0;
+    while (value >= 0x80) {
+        p[length++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    p[length++] = (uint8_t)value;
+    return length;
+}
+
+/**
+ * @brief Read a LEB128 varint.
+ * @param p Input.
+ * @param length Bytes available.
+ * @param value Filled with the value.
+ * @return Number of bytes read, 0 if the input ends inside the varint.
+ */
+static size_t get_varint(const uint8_t *p, size_t length, uint64_t *value) {
+    *value = 0;
+    for (size_t i = 0; i < length && i < 10; i++) {
+        *value |= (uint64_t)(p[i] & 0x7F) << (7 * i);
+        if ((p[i] & 0x80) == 0) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+static uint64_t zigzag(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+bool gy86_capture_encoder_begin(gy86_capture_encoder_t *encoder, uint8_t *buffer, size_t size,
+                                const gy86_capture_header_t *header) {
+    if (size < GY86_CAPTURE_HEADER_SIZE) {
+        return false;
+    }
+
+    buffer[0] = GY86_CAPTURE_VERSION;
+    buffer[1] = 0;
+    buffer[2] = header->reason;
+    buffer[3] = 0;
+    put_u32(buffer + 4, header->capture_id);
+    put_u16(buffer + 8, header->chunk_index);
+    put_u16(buffer + 10, 0);
+    put_u32(buffer + 12, header->trigger_time_us);
+    put_u64(buffer + 16, (uint64_t)header->trigger_wall_ms);
+
+    encoder->buffer = buffer;
+    encoder->size = size;
+    encoder->length = GY86_CAPTURE_HEADER_SIZE;
+    encoder->sample_count = 0;
+    memset(&encoder->previous, 0, sizeof(encoder->previous));
+    return true;
+}
+
+bool gy86_capture_encoder_add(gy86_capture_encoder_t *encoder, const gy86_capture_sample_t *sample) {
+    if (encoder->sample_count == UINT16_MAX) {
+        return false;
+    }
+
+    uint8_t encoded[GY86_CAPTURE_SAMPLE_MAX_SIZE];
+    int64_t fields[CAPTURE_SIGNED_FIELDS];
+    int64_t previous[CAPTURE_SIGNED_FIELDS];
+    sample_to_fields(sample, fields);
+    sample_to_fields(&encoder->previous, previous);
+
+    size_t length = put_varint(encoded, (uint32_t)(sample->time_us - encoder->previous.time_us));
+    for (int i = 0; i < CAPTURE_SIGNED_FIELDS; i++) {
+        length += put_varint(encoded + length, zigzag(fields[i] - previous[i]));
+    }
+    encoded[length++] = sample->fresh;
+
+    if (encoder->size - encoder->length < length) {
+        return false;
+    }
+    memcpy(encoder->buffer + encoder->length, encoded, length);
+    encoder->length += length;
+    encoder->sample_count++;
+    encoder->previous = *sample;
+    return true;
+}
+
+size_t gy86_capture_encoder_finish(gy86_capture_encoder_t *encoder, bool last) {
+    encoder->buffer[1] = last ? GY86_CAPTURE_FLAG_LAST : 0;
+    put_u16(encoder->buffer + 10, encoder->sample_count);
+    return encoder->length;
+}
+
+gy86_capture_status_t gy86_capture_decode_header(const uint8_t *data, size_t length, gy86_capture_header_t *header) {
+    if (length < GY86_CAPTURE_HEADER_SIZE) {
+        return GY86_CAPTURE_ERR_TRUNCATED;
+    }
+    if (data[0] != GY86_CAPTURE_VERSION) {
+        return GY86_CAPTURE_ERR_VERSION;
+    }
+
+    header->version = data[0];
+    header->flags = data[1];
+    header->reason = data[2];
+    header->capture_id = get_u32(data + 4);
+    header->chunk_index = get_u16(data + 8);
+    header->sample_count = get_u16(data + 10);
+    header->trigger_time_us = get_u32(data + 12);
+    header->trigger_wall_ms = (int64_t)get_u64(data + 16);
+    return GY86_CAPTURE_OK;
+}
+
+gy86_capture_status_t gy86_capture_decode_chunk(const uint8_t *data, size_t length, gy86_capture_header_t *header,
+                                                gy86_capture_sample_t *samples, size_t max_samples, size_t *consumed) {
+    gy86_capture_status_t status = gy86_capture_decode_header(data, length, header);
+    if (status != GY86_CAPTURE_OK) {
+        return status;
+    }
+    if (header->sample_count > max_samples) {
+        return GY86_CAPTURE_ERR_SPACE;
+    }
+
+    gy86_capture_sample_t previous;
+    memset(&previous, 0, sizeof(previous));
+    size_t offset = GY86_CAPTURE_HEADER_SIZE;
+
+    for (uint16_t n = 0; n < header->sample_count; n++) {
+        uint64_t value;
+        size_t used = get_varint(data + offset, length - offset, &value);
+        if (used == 0) {
+            return GY86_CAPTURE_ERR_TRUNCATED;
+        }
+        offset += used;
+
+        gy86_capture_sample_t *sample = &samples[n];
+        memset(sample, 0, sizeof(*sample));
+        sample->time_us = previous.time_us + (uint32_t)value;
+
+        int64_t fields[CAPTURE_SIGNED_FIELDS];
+        sample_to_fields(&previous, fields);
+        for (int i = 0; i < CAPTURE_SIGNED_FIELDS; i++) {
+            used = get_varint(data + offset, length - offset, &value);
+            if (used == 0) {
+                return GY86_CAPTURE_ERR_TRUNCATED;
+            }
+            offset += used;
+            fields[i] += unzigzag(value);
+        }
+        fields_to_sample(fields, sample);
+
+        if (offset >= length) {
+            return GY86_CAPTURE_ERR_TRUNCATED;
+        }
+        sample->fresh = data[offset++];
+        previous = *sample;
+    }
+
+    *consumed = offset;
+    return GY86_CAPTURE_OK;
+}
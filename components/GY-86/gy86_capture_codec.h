@@ -0,0 +1,146 @@
+#ifndef ESP_GYRO_GY86_CAPTURE_CODEC_H
+#define ESP_GYRO_GY86_CAPTURE_CODEC_H
+
+#include "stdbool.h"
+#include "stddef.h"
+#include "stdint.h"
+
+/**
+ * @file gy86_capture_codec.h
+ * @brief Header file for the compressed chunk format of black box captures.
+ *
+ * A capture is uploaded as one or more chunks, one MQTT message each. All integers of the header are
+ * little-endian.
+ *
+ * Header, GY86_CAPTURE_HEADER_SIZE bytes:
+ * - uint8 version, GY86_CAPTURE_VERSION
+ * - uint8 flags, GY86_CAPTURE_FLAG_LAST on the last chunk of a capture
+ * - uint8 trigger reason, a gy86_event_type_t or GY86_CAPTURE_REASON_COMMAND
+ * - uint8 reserved, 0
+ * - uint32 capture ID
+ * - uint16 chunk index within the capture
+ * - uint16 number of samples in the chunk
+ * - uint32 trigger time, the low 32 bits of the esp_timer time in microseconds; it wraps every 71.6
+ *   minutes like the sample times, so only its difference to them, modulo 2^32, is meaningful
+ * - int64 trigger time in Unix milliseconds, 0 if the wall clock was not set
+ *
+ * Followed by the samples. Every field of a sample is stored as the difference to the same field of the
+ * previous sample as a LEB128 varint, signed differences zigzag-encoded; the first sample of a chunk is
+ * stored as the difference to an all-zero sample, so every chunk decodes on its own. Field order: time
+ * (unsigned, modulo 2^32), accel x/y/z, gyro x/y/z, mag x/y/z, temperature, pressure, fresh flags.
+ * A sensor at rest changes by a few counts per sample, so most fields take a single byte.
+ *
+ * Chunks have no length prefix, the decoder finds the end of a chunk from its sample count. Captures
+ * can therefore simply be concatenated. The file has no ESP-IDF dependencies so host tools can use it.
+ */
+
+#define GY86_CAPTURE_VERSION            1       ///< Version written into the header
+#define GY86_CAPTURE_HEADER_SIZE        24      ///< Size of the header in bytes
+#define GY86_CAPTURE_SAMPLE_MAX_SIZE    48      ///< Largest encoded sample in bytes
+#define GY86_CAPTURE_FLAG_LAST          0x01    ///< Header flag of the last chunk of a capture
+#define GY86_CAPTURE_REASON_COMMAND     0xFF    ///< Trigger reason of a capture requested over MQTT
+
+/**
+ * @struct gy86_capture_sample_t
+ * @brief One frame in the capture ring, raw sensor counts in 32 bytes.
+ */
+typedef struct {
+    uint32_t time_us;       ///< Low 32 bits of the esp_timer sample time
+    int32_t pressure;       ///< Pressure in 1/1000 mbar
+    int16_t accel[3];       ///< Raw accelerometer x, y, z
+    int16_t gyro[3];        ///< Raw gyroscope x, y, z
+    int16_t mag[3];         ///< Raw magnetometer x, y, z
+    int16_t temperature;    ///< Barometer temperature in 1/100 °C
+    uint8_t fresh;          ///< GY86_FRAME_*_FRESH flags of the frame
+} gy86_capture_sample_t;
+
+/**
+ * @struct gy86_capture_header_t
+ * @brief Header of a chunk.
+ */
+typedef struct {
+    uint8_t version;            ///< Format version
+    uint8_t flags;              ///< GY86_CAPTURE_FLAG_* flags
+    uint8_t reason;             ///< Trigger reason
+    uint32_t capture_id;        ///< Capture the chunk belongs to
+    uint16_t chunk_index;       ///< Index of the chunk within the capture
+    uint16_t sample_count;      ///< Number of samples in the chunk
+    uint32_t trigger_time_us;   ///< Low 32 bits of the esp_timer trigger time, same clock as the samples
+    int64_t trigger_wall_ms;    ///< Trigger time in Unix milliseconds, 0 if unknown
+} gy86_capture_header_t;
+
+/**
+ * @struct gy86_capture_encoder_t
+ * @brief State of a chunk being encoded.
+ */
+typedef struct {
+    uint8_t *buffer;                    ///< Output buffer
+    size_t size;                        ///< Size of the output buffer in bytes
+    size_t length;                      ///< Bytes written so far
+    uint16_t sample_count;              ///< Samples written so far
+    gy86_capture_sample_t previous;     ///< Sample the next one is stored as a difference to
+} gy86_capture_encoder_t;
+
+/**
+ * @brief Result of decoding a chunk.
+ */
+typedef enum {
+    GY86_CAPTURE_OK,                ///< Chunk decoded
+    GY86_CAPTURE_ERR_TRUNCATED,     ///< Payload ends inside the chunk
+    GY86_CAPTURE_ERR_VERSION,       ///< Unsupported format version
+    GY86_CAPTURE_ERR_SPACE,         ///< More samples than the destination holds
+} gy86_capture_status_t;
+
+/**
+ * @brief Start a chunk and write its header.
+ *
+ * The sample count and GY86_CAPTURE_FLAG_LAST are filled in by gy86_capture_encoder_finish().
+ *
+ * @param encoder Encoder state.
+ * @param buffer Output buffer.
+ * @param size Size of the output buffer, at least GY86_CAPTURE_HEADER_SIZE bytes.
+ * @param header Header of the chunk.
+ * @return true if the header fits.
+ */
+bool gy86_capture_encoder_begin(gy86_capture_encoder_t *encoder, uint8_t *buffer, size_t size,
+                                const gy86_capture_header_t *header);
+
+/**
+ * @brief Append a sample to the chunk.
+ * @param encoder Encoder state.
+ * @param sample Sample to append.
+ * @return true if the sample was appended, false if the chunk is full and left as it was.
+ */
+bool gy86_capture_encoder_add(gy86_capture_encoder_t *encoder, const gy86_capture_sample_t *sample);
+
+/**
+ * @brief Complete the header of the chunk.
+ * @param encoder Encoder state.
+ * @param last true if this is the last chunk of the capture.
+ * @return Length of the chunk in bytes.
+ */
+size_t gy86_capture_encoder_finish(gy86_capture_encoder_t *encoder, bool last);
+
+/**
+ * @brief Decode the header of a chunk.
+ * @param data Payload.
+ * @param length Length of the payload in bytes.
+ * @param header Filled with the header.
+ * @return GY86_CAPTURE_OK, GY86_CAPTURE_ERR_TRUNCATED or GY86_CAPTURE_ERR_VERSION.
+ */
+gy86_capture_status_t gy86_capture_decode_header(const uint8_t *data, size_t length, gy86_capture_header_t *header);
+
+/**
+ * @brief Decode a chunk.
+ * @param data Payload, may continue with further chunks.
+ * @param length Length of the payload in bytes.
+ * @param header Filled with the header.
+ * @param samples Filled with header->sample_count samples.
+ * @param max_samples Number of samples the destination holds.
+ * @param consumed Filled with the length of the chunk in bytes on success.
+ * @return GY86_CAPTURE_OK, or the reason the chunk could not be decoded.
+ */
+gy86_capture_status_t gy86_capture_decode_chunk(const uint8_t *data, size_t length, gy86_capture_header_t *header,
+                                                gy86_capture_sample_t *samples, size_t max_samples, size_t *consumed);
+
+#endif //ESP_GYRO_GY86_CAPTURE_CODEC_H
@@ -6,20 +6,76 @@
 #include "mpu6050_gyro_accel.h"
 #include "ms5611_baro.h"
 #include "hmc5883L_compas.h"
+#include "gy86_stats.h"
+#include "gy86_activity.h"
+#include "gy86_events.h"
+#include "gy86_capture.h"
+#include "gy86_kalman.h"
 #include "math.h"
+#include "string.h"
+#include "stdatomic.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
 
-
-mpu6050_raw_data_t mpu6050RawData;
 i2c_master_dev_handle_t mpu6050_dev_handle;
-
-ms5611_data_t ms5611RawData;
 i2c_master_dev_handle_t ms5611_dev_handle;
-
-hmc5883l_raw_data_t hmc5883LRawData;
 i2c_master_dev_handle_t hmc5883l_dev_handle;
 
+// Topics, unique IDs and the device identifier are left NULL here and filled in by gy86_topics_init()
+// A state document may leave out channels that did not change, those keep their state
+#define GY86_SENSOR_CONFIG(id, key, device_class, unit, value_type, kind, ctype, member, source, scale, report) \
+    [GY86_CH_##id] = {#key, device_class, NULL, unit, \
+                      "{{ value_json." #key " if value_json." #key " is defined else this.state }}", \
+                      NULL, NULL, NULL, GY86_DEVICE_MANUFACTURER, GY86_DEVICE_MODEL, NULL, NULL},
+#define GY86_SENSOR_FIELD(id, key, device_class, unit, value_type, kind, ctype, member, source, scale, report) \
+    [GY86_CH_##id] = {NULL, #key, value_type, offsetof(sensor_snapshot_t, member), scale, report},
+#define GY86_SENSOR_DATA(id, key, device_class, unit, value_type, kind, ctype, member, source, scale, report) \
+    [GY86_CH_##id] = {NULL, {value_type, GY86_INITIAL_##value_type}, #key},
+
+// Value of a channel before the first frame, string channels read "X" instead of NULL
+#define GY86_INITIAL_VALUE_TYPE_FLOAT   {.float_value = 0.0f}
+#define GY86_INITIAL_VALUE_TYPE_INT     {.int_value = 0}
+#define GY86_INITIAL_VALUE_TYPE_INT16   {.int_value = 0}
+#define GY86_INITIAL_VALUE_TYPE_DOUBLE  {.double_value = 0.0}
+#define GY86_INITIAL_VALUE_TYPE_STRING  {.string_value = "X"}
+
+// Tables generated from the channel schema, the only instance of each in the firmware
+sensor_config_t sensor_configs[GY86_CHANNEL_COUNT] = {
+        GY86_CHANNELS(GY86_SENSOR_CONFIG)
+};
+
+sensor_field_t sensor_fields[GY86_CHANNEL_COUNT] = {
+        GY86_CHANNELS(GY86_SENSOR_FIELD)
+};
+
+sensor_data_t sensor_data_array[GY86_CHANNEL_COUNT] = {
+        GY86_CHANNELS(GY86_SENSOR_DATA)
+};
+
+/**
+ * @brief Frame ring slot guarded by a sequence lock.
+ *
+ * The lock is odd while the sampling task writes the frame and even once the frame is complete.
+ */
+typedef struct {
+    atomic_uint lock;           ///< Sequence lock of the buffer
+    sensor_snapshot_t frame;    ///< Frame stored in the buffer
+} snapshot_slot_t;
+
+static snapshot_slot_t snapshot_slots[GY86_SNAPSHOT_BUFFERS];
+static atomic_uint snapshot_latest = GY86_SNAPSHOT_BUFFERS; ///< Newest published slot, out of range until the first frame
+static uint32_t snapshot_sequence = 0;                     ///< Sequence number of the last written frame
+static TaskHandle_t sampling_task_handle = NULL;
+static uint32_t sampling_period_ms = GY86_SAMPLE_PERIOD_MS;
+static uint32_t baro_divider = GY86_BARO_DIVIDER;
+static uint32_t baro_countdown = 0;                        ///< IMU samples left until the next barometer sample
+
+static gy86_kalman_t altitude_filter;                      ///< Baro-inertial filter, owned by the sampling task
+static float gravity_estimate[3];                          ///< Low-pass filtered accelerometer vector in raw units
+
 /**
  * @file gy86_data.c
  * @brief Implementation file for GY-86 Sensor Suite functions.
@@ -46,6 +102,14 @@ void init_gy86_module(i2c_master_bus_handle_t bus_handle) {
     } else {
         ESP_LOGE("HMC5883L", "INIT Failed!");
     }
+
+    if (gy86_events_init() != ESP_OK) {
+        ESP_LOGE("GY86", "Failed to create the event queue");
+    }
+
+    if (gy86_capture_init() != ESP_OK) {
+        ESP_LOGE("GY86", "Failed to allocate the capture ring");
+    }
 }
 
 float calculate_altitude(float pressure_mbar) {
@@ -80,6 +144,31 @@ sensor_orientation_t calculate_orientation(const mpu6050_raw_data_t *data) {
     return orientation;
 }
 
+float calculate_vertical_acceleration(const mpu6050_raw_data_t *data, float gravity[3]) {
+    float a[3] = {data->accel_x, data->accel_y, data->accel_z};
+
+    // Track the direction of gravity with a slow low-pass of the accelerometer vector
+    float g_norm = sqrtf(gravity[0] * gravity[0] + gravity[1] * gravity[1] + gravity[2] * gravity[2]);
+    if (g_norm == 0.0f) {
+        gravity[0] = a[0];
+        gravity[1] = a[1];
+        gravity[2] = a[2];
+    } else {
+        for (int i = 0; i < 3; i++) {
+            gravity[i] += GY86_GRAVITY_FILTER_ALPHA * (a[i] - gravity[i]);
+        }
+    }
+
+    g_norm = sqrtf(gravity[0] * gravity[0] + gravity[1] * gravity[1] + gravity[2] * gravity[2]);
+    if (g_norm == 0.0f) {
+        return 0.0f;
+    }
+
+    // Project onto the gravity direction and remove 1g
+    float along_gravity = (a[0] * gravity[0] + a[1] * gravity[1] + a[2] * gravity[2]) / g_norm;
+    return (along_gravity / MPU6050_ACCEL_LSB_PER_G - 1.0f) * STANDARD_GRAVITY;
+}
+
 // TODO: Inclination does not work
 float calculate_heading(const hmc5883l_raw_data_t *mag_data, const mpu6050_raw_data_t *accel_data) {
     float heading;
@@ -133,33 +222,179 @@ const char* get_compass_direction(float heading) {
 }
 
 /**
- * @brief Update the sensor data for the GY-86 sensor suite.
+ * @brief Sample all sensors into the next frame slot and publish it.
+ *
+ * Must only be called from a single task, it is the sole writer of the frame ring.
  */
 void update_sensor_data() {
-    mpu6050_read_data(mpu6050_dev_handle, &mpu6050RawData);
-    ms5611_read_pressure_and_temperature(ms5611_dev_handle, &ms5611RawData);
-    hmc5883l_read_data(hmc5883l_dev_handle, &hmc5883LRawData);
+    unsigned latest = atomic_load_explicit(&snapshot_latest, memory_order_relaxed);
+    unsigned next = (latest + 1) % GY86_SNAPSHOT_BUFFERS;
+    snapshot_slot_t *slot = &snapshot_slots[next];
+    sensor_snapshot_t *frame = &slot->frame;
+
+    atomic_fetch_add_explicit(&slot->lock, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    // Decode straight into the slot, readers keep using the newest slot meanwhile
+    frame->fresh = 0;
+    frame->timestamp_us = esp_timer_get_time();
+    if (mpu6050_read_data(mpu6050_dev_handle, &frame->imu) == ESP_OK) {
+        frame->fresh |= GY86_FRAME_IMU_FRESH;
+    }
+    if (baro_countdown == 0) {
+        baro_countdown = gy86_activity_baro_divider(baro_divider);
+        if (ms5611_read_pressure_and_temperature(ms5611_dev_handle, &frame->baro) == ESP_OK) {
+            frame->fresh |= GY86_FRAME_BARO_FRESH;
+        }
+    }
+    baro_countdown--;
+    if (hmc5883l_read_data(hmc5883l_dev_handle, &frame->mag) == ESP_OK) {
+        frame->fresh |= GY86_FRAME_MAG_FRESH;
+    }
+
+    // Hold the last good value of a sensor that failed to read or was not due
+    const sensor_snapshot_t *previous = NULL;
+    if (latest < GY86_SNAPSHOT_BUFFERS) {
+        previous = &snapshot_slots[latest].frame;
+        if (!(frame->fresh & GY86_FRAME_IMU_FRESH)) {
+            frame->imu = previous->imu;
+        }
+        if (!(frame->fresh & GY86_FRAME_BARO_FRESH)) {
+            frame->baro = previous->baro;
+        }
+        if (!(frame->fresh & GY86_FRAME_MAG_FRESH)) {
+            frame->mag = previous->mag;
+        }
+    }
 
     // Process the raw data
-    sensor_orientation_t orientation = calculate_orientation(&mpu6050RawData);
-    float altitude = calculate_altitude(ms5611RawData.pressure);
-    float direction = calculate_heading(&hmc5883LRawData, &mpu6050RawData);
-    const char *compass = get_compass_direction(direction);
-
-    sensor_data_array[0].value.float_value = ms5611RawData.temperature;
-    sensor_data_array[1].value.float_value = ms5611RawData.pressure;
-    sensor_data_array[2].value.float_value = orientation.roll;
-    sensor_data_array[3].value.float_value = orientation.pitch;
-    sensor_data_array[4].value.float_value = altitude;
-    sensor_data_array[5].value.float_value = direction;
-    sensor_data_array[6].value.string_value = compass;
-    sensor_data_array[7].value.int_value = mpu6050RawData.accel_x;
-    sensor_data_array[8].value.int_value = mpu6050RawData.accel_y;
-    sensor_data_array[9].value.int_value = mpu6050RawData.accel_z;
+    sensor_orientation_t orientation = calculate_orientation(&frame->imu);
+    frame->roll = orientation.roll;
+    frame->pitch = orientation.pitch;
+    frame->altitude = calculate_altitude(frame->baro.pressure);
+    frame->heading = calculate_heading(&frame->mag, &frame->imu);
+    frame->compass = get_compass_direction(frame->heading);
+
+    // Fuse vertical acceleration on every IMU sample and altitude whenever the barometer was read
+    if (previous != NULL) {
+        gy86_kalman_predict(&altitude_filter, (frame->timestamp_us - previous->timestamp_us) / 1e6f);
+    }
+    if (frame->fresh & GY86_FRAME_IMU_FRESH) {
+        gy86_kalman_update_acceleration(&altitude_filter, calculate_vertical_acceleration(&frame->imu, gravity_estimate));
+    }
+    if (frame->fresh & GY86_FRAME_BARO_FRESH) {
+        gy86_kalman_update_altitude(&altitude_filter, frame->altitude);
+    }
+    frame->altitude_filtered = altitude_filter.x[0];
+    frame->vertical_speed = altitude_filter.x[1];
+    frame->vertical_acceleration = altitude_filter.x[2];
+
+    frame->sequence = ++snapshot_sequence;
+
+    atomic_fetch_add_explicit(&slot->lock, 1, memory_order_release);
+    atomic_store_explicit(&snapshot_latest, next, memory_order_release);
+
+    gy86_stats_add_frame(frame);
+    gy86_activity_add_frame(frame);
+    gy86_events_add_frame(frame);
+    gy86_capture_add_frame(frame);
+}
+
+bool gy86_snapshot_peek(sensor_snapshot_ref_t *ref) {
+    unsigned latest;
+    unsigned lock;
+
+    do {
+        latest = atomic_load_explicit(&snapshot_latest, memory_order_acquire);
+        if (latest >= GY86_SNAPSHOT_BUFFERS) {
+            return false;
+        }
+        lock = atomic_load_explicit(&snapshot_slots[latest].lock, memory_order_acquire);
+    } while (lock & 1);
+
+    ref->frame = &snapshot_slots[latest].frame;
+    ref->slot = latest;
+    ref->lock = lock;
+    return true;
+}
+
+bool gy86_snapshot_release(const sensor_snapshot_ref_t *ref) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&snapshot_slots[ref->slot].lock, memory_order_relaxed) == ref->lock;
+}
+
+bool gy86_snapshot_read(sensor_snapshot_t *snapshot) {
+    sensor_snapshot_ref_t ref;
+
+    do {
+        if (!gy86_snapshot_peek(&ref)) {
+            return false;
+        }
+        memcpy(snapshot, ref.frame, sizeof(*snapshot));
+    } while (!gy86_snapshot_release(&ref));
+
+    return true;
+}
+
+/**
+ * @brief FreeRTOS task sampling the sensors every sampling_period_ms.
+ * @param arg Unused.
+ */
+static void gy86_sampling_task(void *arg) {
+    TickType_t last_wake = xTaskGetTickCount();
+
+    while (1) {
+        update_sensor_data();
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(sampling_period_ms));
+    }
+}
+
+void set_gy86_sample_period_ms(uint32_t period_ms) {
+    sampling_period_ms = period_ms > 0 ? period_ms : 1;
+}
+
+uint32_t get_gy86_sample_period_ms(void) {
+    return sampling_period_ms;
+}
+
+void set_gy86_baro_divider(uint32_t divider) {
+    baro_divider = divider > 0 ? divider : 1;
+}
+
+uint32_t get_gy86_baro_divider(void) {
+    return baro_divider;
+}
+
+esp_err_t start_gy86_sampling(uint32_t period_ms) {
+    if (sampling_task_handle != NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    set_gy86_sample_period_ms(period_ms);
+    if (xTaskCreate(gy86_sampling_task, "gy86_sampling", GY86_SAMPLING_TASK_STACK, NULL,
+                    GY86_SAMPLING_TASK_PRIORITY, &sampling_task_handle) != pdPASS) {
+        ESP_LOGE("GY86", "Failed to create sampling task");
+        sampling_task_handle = NULL;
+        return ESP_FAIL;
+    }
+    return ESP_OK;
 }
 
 sensor_data_t* get_sensor_data(int *count) {
-    update_sensor_data();
+    if (sampling_task_handle == NULL) {
+        update_sensor_data();
+    }
+
+    sensor_snapshot_ref_t ref;
+    do {
+        if (!gy86_snapshot_peek(&ref)) {
+            break;
+        }
+        for (int i = 0; i < NUM_SENSORS; i++) {
+            sensor_data_array[i].value = sensor_field_value(&sensor_fields[i], ref.frame);
+        }
+    } while (!gy86_snapshot_release(&ref));
+
     *count = sizeof(sensor_data_array) / sizeof(sensor_data_array[0]);
     return sensor_data_array;
 }
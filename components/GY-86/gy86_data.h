@@ -31,11 +31,85 @@ void init_gy86_module(i2c_master_bus_handle_t bus_handle);
 
 /**
  * @brief Get sensor data from the GY-86 sensor suite.
+ *
+ * Samples the sensors directly when the sampling task is not running, then expands the newest
+ * frame into an internal sensor_data_t array. Only meant for a single caller; concurrent readers
+ * should use gy86_snapshot_read() or gy86_snapshot_peek() instead.
+ *
  * @param count Pointer to store the number of sensors.
  * @return Pointer to the array of sensor data.
  */
 sensor_data_t* get_sensor_data(int *count);
 
+/**
+ * @brief Start the task that samples the GY-86 sensors periodically.
+ *
+ * The task is the only writer of the frame ring. Call it once after init_gy86_module().
+ *
+ * @param period_ms Sampling period in milliseconds.
+ * @return esp_err_t ESP_OK on success, ESP_ERR_INVALID_STATE if already running, or ESP_FAIL.
+ */
+esp_err_t start_gy86_sampling(uint32_t period_ms);
+
+/**
+ * @brief Set the period of the sampling task.
+ *
+ * Takes effect with the next sample, also while the task is running.
+ *
+ * @param period_ms Sampling period in milliseconds, at least 1.
+ */
+void set_gy86_sample_period_ms(uint32_t period_ms);
+
+/**
+ * @brief Get the period of the sampling task.
+ * @return Sampling period in milliseconds.
+ */
+uint32_t get_gy86_sample_period_ms(void);
+
+/**
+ * @brief Set how many IMU samples are taken per barometer sample.
+ *
+ * The MS5611 conversion takes about 20 ms, so a divider above 1 lets the IMU and the altitude
+ * filter run faster than the barometer.
+ *
+ * @param divider Number of IMU samples per barometer sample, at least 1.
+ */
+void set_gy86_baro_divider(uint32_t divider);
+
+/**
+ * @brief Get how many IMU samples are taken per barometer sample.
+ * @return Number of IMU samples per barometer sample.
+ */
+uint32_t get_gy86_baro_divider(void);
+
+/**
+ * @brief Copy the newest consistent snapshot.
+ *
+ * Lock-free; retries while the sampling task is writing the slot being copied.
+ *
+ * @param snapshot Destination for the frame.
+ * @return true if a frame was copied, false if no frame has been sampled yet.
+ */
+bool gy86_snapshot_read(sensor_snapshot_t *snapshot);
+
+/**
+ * @brief Borrow the newest snapshot without copying it.
+ *
+ * The frame stays in its ring slot; the reader must finish with it quickly and call
+ * gy86_snapshot_release() to learn whether the writer touched it in the meantime.
+ *
+ * @param ref Reference filled with the borrowed frame.
+ * @return true if a frame was borrowed, false if no frame has been sampled yet.
+ */
+bool gy86_snapshot_peek(sensor_snapshot_ref_t *ref);
+
+/**
+ * @brief Finish reading a borrowed snapshot.
+ * @param ref Reference obtained from gy86_snapshot_peek().
+ * @return true if the frame was consistent for the whole time it was borrowed.
+ */
+bool gy86_snapshot_release(const sensor_snapshot_ref_t *ref);
+
 /**
  * @brief Calculate the altitude based on the pressure.
  * @param pressure_mbar Pressure in millibars.
@@ -50,6 +124,18 @@ float calculate_altitude(float pressure_mbar);
  */
 sensor_orientation_t calculate_orientation(const mpu6050_raw_data_t *data);
 
+/**
+ * @brief Calculate the gravity-compensated vertical acceleration.
+ *
+ * The direction of gravity is tracked with a slow low-pass of the accelerometer vector; the
+ * acceleration along it minus 1g is the vertical acceleration.
+ *
+ * @param data Pointer to the raw accelerometer data.
+ * @param gravity Gravity estimate in raw units, updated in place. Start with all zeros.
+ * @return Vertical acceleration in m/s^2, positive upwards.
+ */
+float calculate_vertical_acceleration(const mpu6050_raw_data_t *data, float gravity[3]);
+
 /**
  * @brief Calculate the heading (compass direction) based on the magnetometer and accelerometer data.
  * @param mag_data Pointer to the raw magnetometer data.
@@ -5,167 +5,104 @@
 #ifndef ESP_GYRO_GY86_DATA_DEFS_H
 #define ESP_GYRO_GY86_DATA_DEFS_H
 
+#include "stdint.h"
+#include "stddef.h"
+#include "mpu6050_gyro_accel_defs.h"
+#include "ms5611_baro_defs.h"
+#include "hmc5883L_compas_defs.h"
+#include "gy86_schema.h"
 #include "../ESP32_Mqtt_custom/ESP32_Mqtt_custom_defs.h"
 
 #define SEA_LEVEL_PRESSURE_HPA (1013.25)
 #define PI 3.14159265358979323846
 #define RAD_TO_DEG 57.2957795131
+#define STANDARD_GRAVITY 9.80665f    ///< Standard gravity in m/s^2
 
 /**
  * @file gy86_data_defs.h
  * @brief Definitions for GY-86 Sensor Suite.
  *
- * This file contains the sensor configurations and data arrays used
- * for the GY-86 sensor suite, which includes temperature, pressure, roll,
+ * This file contains the types and table declarations generated from the channel schema in
+ * gy86_schema.h for the GY-86 sensor suite, which includes temperature, pressure, roll,
  * pitch, altitude, direction, compass, and acceleration sensors.
  */
 
 /**
- * @brief Array of sensor configurations for the GY-86 sensor suite.
+ * @brief Channel indices, generated from GY86_CHANNELS.
  */
-static const sensor_config_t sensor_configs[] = {
-        {
-                "temperature",
-                "temperature",
-                "homeassistant/sensor/GY86/temperature/state",
-                "°C",
-                "{{ value_json.temperature }}",
-                "GY86_temperature",
-                "GY86",
-                "GY86 Sensor Suite",
-                "Generic",
-                "GY86 Multi-Sensor"
-        },
-        {
-                "pressure",
-                "pressure",
-                "homeassistant/sensor/GY86/pressure/state",
-                "hPa",
-                "{{ value_json.pressure }}",
-                "GY86_pressure",
-                "GY86",
-                "GY86 Sensor Suite",
-                "Generic",
-                "GY86 Multi-Sensor"
-        },
-        {
-                "roll",
-                "None",
-                "homeassistant/sensor/GY86/roll/state",
-                "degrees",
-                "{{ value_json.roll }}",
-                "GY86_roll",
-                "GY86",
-                "GY86 Sensor Suite",
-                "Generic",
-                "GY86 Multi-Sensor"
-        },
-        {
-                "pitch",
-                "None",
-                "homeassistant/sensor/GY86/pitch/state",
-                "degrees",
-                "{{ value_json.pitch }}",
-                "GY86_pitch",
-                "GY86",
-                "GY86 Sensor Suite",
-                "Generic",
-                "GY86 Multi-Sensor"
-        },
-        {
-                "altitude",
-                "distance",
-                "homeassistant/sensor/GY86/altitude/state",
-                "m",
-                "{{ value_json.altitude }}",
-                "GY86_altitude",
-                "GY86",
-                "GY86 Sensor Suite",
-                "Generic",
-                "GY86 Multi-Sensor"
-        },
-        {
-                "direction",
-                "None",
-                "homeassistant/sensor/GY86/direction/state",
-                "degrees",
-                "{{ value_json.direction }}",
-                "GY86_direction",
-                "GY86",
-                "GY86 Sensor Suite",
-                "Generic",
-                "GY86 Multi-Sensor"
-        },
-        {
-                "compass",
-                "None",
-                "homeassistant/sensor/GY86/compass/state",
-                "",
-                "{{ value_json.compass }}",
-                "GY86_compass",
-                "GY86",
-                "GY86 Sensor Suite",
-                "Generic",
-                "GY86 Multi-Sensor"
-        },
-        {
-                "acceleration",
-                "speed",
-                "homeassistant/sensor/GY86/acceleration/X/state",
-                "G",
-                "{{ value_json.acceleration_x }}",
-                "GY86_acceleration_x",
-                "GY86",
-                "GY86 Sensor Suite",
-                "Generic",
-                "GY86 Multi-Sensor"
-        },
-        {
-                "acceleration",
-                "speed",
-                "homeassistant/sensor/GY86/acceleration/Y/state",
-                "G",
-                "{{ value_json.acceleration_y }}",
-                "GY86_acceleration_y",
-                "GY86",
-                "GY86 Sensor Suite",
-                "Generic",
-                "GY86 Multi-Sensor"
-        },
-        {
-                "acceleration",
-                "speed",
-                "homeassistant/sensor/GY86/acceleration/Z/state",
-                "G",
-                "{{ value_json.acceleration_z }}",
-                "GY86_acceleration_z",
-                "GY86",
-                "GY86 Sensor Suite",
-                "Generic",
-                "GY86 Multi-Sensor"
-        }
-};
+typedef enum {
+    GY86_CHANNELS(GY86_CHANNEL_ENUM)
+    GY86_CHANNEL_COUNT  ///< Number of channels
+} gy86_channel_t;
 
 /**
- * @brief Array of sensor data for the GY-86 sensor suite.
+ * @brief Number of sensors in the GY-86 sensor suite.
  */
-static sensor_data_t sensor_data_array[] = {
-        {sensor_configs[0].state_topic, {VALUE_TYPE_FLOAT, {.float_value = 0.0}}, "temperature"},
-        {sensor_configs[1].state_topic, {VALUE_TYPE_FLOAT, {.float_value = 0.0}}, "pressure"},
-        {sensor_configs[2].state_topic, {VALUE_TYPE_FLOAT, {.float_value = 0.0}}, "roll"},
-        {sensor_configs[3].state_topic, {VALUE_TYPE_FLOAT, {.float_value = 0.0}}, "pitch"},
-        {sensor_configs[4].state_topic, {VALUE_TYPE_FLOAT, {.float_value = 0.0}}, "altitude"},
-        {sensor_configs[5].state_topic, {VALUE_TYPE_FLOAT, {.float_value = 0.0}}, "direction"},
-        {sensor_configs[6].state_topic, {VALUE_TYPE_STRING, {.string_value = "X"}}, "compass"},
-        {sensor_configs[7].state_topic, {VALUE_TYPE_INT, {.int_value = 0}}, "acceleration_x"},
-        {sensor_configs[8].state_topic, {VALUE_TYPE_INT, {.int_value = 0}}, "acceleration_y"},
-        {sensor_configs[9].state_topic, {VALUE_TYPE_INT, {.int_value = 0}}, "acceleration_z"}
-};
+#define NUM_SENSORS GY86_CHANNEL_COUNT
 
 /**
- * @brief Number of sensors in the GY-86 sensor suite.
+ * @brief Number of frame slots in the ring the sampling task decodes into.
+ *
+ * A reader that borrows the newest frame has GY86_SNAPSHOT_BUFFERS - 1 full sample
+ * periods before the writer comes back around to that slot.
  */
-#define NUM_SENSORS (sizeof(sensor_configs) / sizeof(sensor_configs[0]))
+#define GY86_SNAPSHOT_BUFFERS 4
+
+#define GY86_SAMPLE_PERIOD_MS       20      ///< Default period of the sampling task in milliseconds, the motion event rate
+#define GY86_SAMPLING_TASK_STACK    4096    ///< Stack size of the sampling task in bytes
+#define GY86_SAMPLING_TASK_PRIORITY 5       ///< FreeRTOS priority of the sampling task
+#define GY86_BARO_DIVIDER           5       ///< Default number of IMU samples per barometer sample
+#define GY86_GRAVITY_FILTER_ALPHA   0.02f   ///< Low-pass coefficient of the gravity direction estimate
+
+/* Bits of sensor_snapshot_t::fresh */
+#define GY86_FRAME_IMU_FRESH    (1 << 0)    ///< MPU6050 was read successfully for this frame
+#define GY86_FRAME_BARO_FRESH   (1 << 1)    ///< MS5611 was read successfully for this frame
+#define GY86_FRAME_MAG_FRESH    (1 << 2)    ///< HMC5883L was read successfully for this frame
+
+/**
+ * @brief Frame of all GY-86 channels taken in one acquisition cycle.
+ *
+ * The drivers decode directly into the imu, baro and mag members of a ring slot and the derived
+ * channels are computed in place, so a sample is written exactly once. Consumers read channels
+ * through the offsets in sensor_fields. A sensor that fails to read keeps its previous value.
+ */
+typedef struct {
+    int64_t timestamp_us;       ///< esp_timer time at which the frame was sampled
+    uint32_t sequence;          ///< Monotonically increasing frame number, starting at 1
+    uint32_t fresh;             ///< GY86_FRAME_*_FRESH bits of the sensors read in this cycle
+    mpu6050_raw_data_t imu;     ///< Raw accelerometer, gyroscope and temperature data
+    ms5611_data_t baro;         ///< Temperature and pressure
+    hmc5883l_raw_data_t mag;    ///< Raw magnetometer data
+    GY86_CHANNELS(GY86_FRAME_MEMBER)    ///< One member per DERIVED channel, see gy86_schema.h
+} sensor_snapshot_t;
+
+/**
+ * @brief Discovery table of the GY-86 sensor suite, in gy86_channel_t order.
+ *
+ * State topics, unique IDs and the device are filled in by gy86_topics_init().
+ */
+extern sensor_config_t sensor_configs[GY86_CHANNEL_COUNT];
+
+/**
+ * @brief Serializer field list of sensor_snapshot_t, in gy86_channel_t order.
+ *
+ * Topics are filled in by gy86_topics_init().
+ */
+extern sensor_field_t sensor_fields[GY86_CHANNEL_COUNT];
+
+/**
+ * @brief Array of sensor data for the GY-86 sensor suite, filled by get_sensor_data().
+ */
+extern sensor_data_t sensor_data_array[GY86_CHANNEL_COUNT];
+
+/**
+ * @brief Borrowed reference to the newest snapshot, see gy86_snapshot_peek().
+ */
+typedef struct {
+    const sensor_snapshot_t *frame;     ///< Frame inside its ring slot, valid until released
+    uint32_t slot;                      ///< Ring slot the frame lives in
+    uint32_t lock;                      ///< Sequence-lock value observed when the frame was borrowed
+} sensor_snapshot_ref_t;
 
 /**
  * @brief Structure to hold the sensor orientation data (pitch and roll).
@@ -0,0 +1,277 @@
+#include "gy86_events.h"
+#include "gy86_capture.h"
+#include "math.h"
+#include "esp_log.h"
+#include "freertos/queue.h"
+
+/**
+ * @file gy86_events.c
+ * @brief Implementation file for the motion event detectors of the GY-86 sensor suite.
+ *
+ * All detector state is owned by the sampling task. Each sample costs a square root, an arc cosine and a
+ * handful of comparisons, whatever happened before.
+ */
+
+static gy86_event_thresholds_t event_thresholds = GY86_EVENT_THRESHOLDS_DEFAULT;
+
+static QueueHandle_t event_queue = NULL;
+static StaticQueue_t event_queue_buffer;
+static uint8_t event_queue_storage[GY86_EVENT_QUEUE_LENGTH * sizeof(gy86_event_t)];
+static uint32_t events_detected[GY86_EVENT_COUNT];
+static uint32_t events_dropped = 0;
+
+static const char *const event_names[GY86_EVENT_COUNT] = {
+        [GY86_EVENT_FREE_FALL] = "free_fall",
+        [GY86_EVENT_SHOCK] = "shock",
+        [GY86_EVENT_TAP] = "tap",
+        [GY86_EVENT_TILT] = "tilt",
+};
+
+// Owned by the sampling task
+static int64_t imu_us = 0;              ///< Sample time of the last IMU sample, 0 before the first
+static float accel_previous[3];         ///< Last acceleration in g
+static float gravity[3];                ///< Low-pass filtered acceleration in g
+
+static bool falling = false;
+static bool fall_reported = false;
+static int64_t fall_start_us;
+static float fall_min_g;
+
+static bool in_pulse = false;
+static bool pulse_reported = false;
+static bool pulse_shock = false;        ///< The pulse reached a shock threshold
+static int64_t pulse_start_us;
+static uint32_t pulse_sequence;
+static float pulse_peak_g;
+static float pulse_peak_jerk;
+
+static bool tilt_known = false;
+static bool tilted = false;
+
+esp_err_t gy86_events_init(void) {
+    if (event_queue == NULL) {
+        // Static storage, the footprint does not depend on the heap
+        event_queue = xQueueCreateStatic(GY86_EVENT_QUEUE_LENGTH, sizeof(gy86_event_t), event_queue_storage,
+                                         &event_queue_buffer);
+    }
+    return event_queue != NULL ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+void set_gy86_event_thresholds(const gy86_event_thresholds_t *thresholds) {
+    event_thresholds = *thresholds;
+}
+
+gy86_event_thresholds_t get_gy86_event_thresholds(void) {
+    return event_thresholds;
+}
+
+const char *gy86_event_name(gy86_event_type_t type) {
+    return type < GY86_EVENT_COUNT ? event_names[type] : "unknown";
+}
+
+void get_gy86_event_counters(uint32_t detected[GY86_EVENT_COUNT], uint32_t *dropped) {
+    for (int i = 0; i < GY86_EVENT_COUNT; i++) {
+        detected[i] = events_detected[i];
+    }
+    *dropped = events_dropped;
+}
+
+bool gy86_event_receive(gy86_event_t *event, TickType_t wait) {
+    return event_queue != NULL && xQueueReceive(event_queue, event, wait) == pdTRUE;
+}
+
+/**
+ * @brief Count an event, start a capture if the event triggers one and queue it without waiting.
+ * @param event Detected event.
+ */
+static void emit_event(const gy86_event_t *event) {
+    events_detected[event->type]++;
+    if (get_gy86_capture_trigger_events() & (1u << event->type)) {
+        gy86_capture_trigger(event->type, event->timestamp_us);
+    }
+    if (event_queue == NULL || xQueueSend(event_queue, event, 0) != pdTRUE) {
+        events_dropped++;
+    }
+}
+
+/**
+ * @brief Queue the event of the current pulse.
+ * @param type GY86_EVENT_SHOCK or GY86_EVENT_TAP.
+ * @param now_us Sample time of the frame.
+ */
+static void emit_pulse(gy86_event_type_t type, int64_t now_us) {
+    gy86_event_t event = {
+            .type = type,
+            .timestamp_us = pulse_start_us,
+            .sequence = pulse_sequence,
+            .duration_ms = (uint32_t)((now_us - pulse_start_us) / 1000),
+            .peak_g = pulse_peak_g,
+            .peak_jerk_g_per_s = pulse_peak_jerk,
+    };
+    emit_event(&event);
+    pulse_reported = true;
+}
+
+/**
+ * @brief End the current pulse and queue its event, a shock if it reached a shock threshold, else a tap if it was short.
+ * @param now_us Sample time of the frame.
+ */
+static void finish_pulse(int64_t now_us) {
+    if (!pulse_reported && pulse_shock) {
+        emit_pulse(GY86_EVENT_SHOCK, now_us);
+    } else if (!pulse_reported && now_us - pulse_start_us <= (int64_t)event_thresholds.tap_max_ms * 1000) {
+        emit_pulse(GY86_EVENT_TAP, now_us);
+    }
+    in_pulse = false;
+}
+
+/**
+ * @brief Detect free fall: the total acceleration stays below its threshold for the minimum time.
+ * @param frame Frame being processed.
+ * @param magnitude Total acceleration in g.
+ */
+static void detect_free_fall(const sensor_snapshot_t *frame, float magnitude) {
+    if (magnitude >= event_thresholds.free_fall_g) {
+        falling = false;
+        return;
+    }
+
+    if (!falling) {
+        falling = true;
+        fall_reported = false;
+        fall_start_us = frame->timestamp_us;
+        fall_min_g = magnitude;
+    }
+    fall_min_g = fminf(fall_min_g, magnitude);
+
+    // Reported once the minimum time is reached, the impact that ends the fall comes as a shock
+    if (!fall_reported && frame->timestamp_us - fall_start_us >= (int64_t)event_thresholds.free_fall_ms * 1000) {
+        gy86_event_t event = {
+                .type = GY86_EVENT_FREE_FALL,
+                .timestamp_us = fall_start_us,
+                .sequence = frame->sequence,
+                .duration_ms = (uint32_t)((frame->timestamp_us - fall_start_us) / 1000),
+                .peak_g = fall_min_g,
+        };
+        emit_event(&event);
+        fall_reported = true;
+    }
+}
+
+/**
+ * @brief Detect shocks and taps from pulses of acceleration away from the gravity estimate.
+ * @param frame Frame being processed.
+ * @param magnitude Total acceleration in g.
+ * @param deviation Acceleration away from the gravity estimate in g.
+ * @param jerk Change of the acceleration since the last sample in g/s.
+ */
+static void detect_pulse(const sensor_snapshot_t *frame, float magnitude, float deviation, float jerk) {
+    bool strong = magnitude >= event_thresholds.shock_g || jerk >= event_thresholds.jerk_g_per_s;
+
+    if (!in_pulse) {
+        if (deviation < event_thresholds.tap_g && !strong) {
+            return;
+        }
+        in_pulse = true;
+        pulse_reported = false;
+        pulse_shock = false;
+        pulse_start_us = frame->timestamp_us;
+        pulse_sequence = frame->sequence;
+        pulse_peak_g = magnitude;
+        pulse_peak_jerk = jerk;
+    }
+    pulse_shock |= strong;
+    pulse_peak_g = fmaxf(pulse_peak_g, magnitude);
+    pulse_peak_jerk = fmaxf(pulse_peak_jerk, jerk);
+
+    // The pulse ends below half the tap threshold, the peaks are known then
+    if (deviation < event_thresholds.tap_g / 2 && !strong) {
+        finish_pulse(frame->timestamp_us);
+    } else if (!pulse_reported && pulse_shock &&
+               frame->timestamp_us - pulse_start_us >= (int64_t)GY86_EVENT_PULSE_MAX_MS * 1000) {
+        // Shaking does not end, report what was seen so far
+        emit_pulse(GY86_EVENT_SHOCK, frame->timestamp_us);
+    }
+}
+
+/**
+ * @brief Detect tilt crossings of the gravity estimate, with hysteresis.
+ * @param frame Frame being processed.
+ */
+static void detect_tilt(const sensor_snapshot_t *frame) {
+    float length = sqrtf(gravity[0] * gravity[0] + gravity[1] * gravity[1] + gravity[2] * gravity[2]);
+    if (length < 0.5f) {
+        return;
+    }
+    float angle = acosf(fmaxf(-1.0f, fminf(1.0f, gravity[2] / length))) * (float)RAD_TO_DEG;
+
+    // The orientation at start is the reference, it is not an event
+    if (!tilt_known) {
+        tilt_known = true;
+        tilted = angle >= event_thresholds.tilt_deg;
+        return;
+    }
+
+    bool crossed = tilted ? angle < event_thresholds.tilt_deg - event_thresholds.tilt_hysteresis_deg
+                          : angle >= event_thresholds.tilt_deg;
+    if (crossed) {
+        tilted = !tilted;
+        gy86_event_t event = {
+                .type = GY86_EVENT_TILT,
+                .timestamp_us = frame->timestamp_us,
+                .sequence = frame->sequence,
+                .angle_deg = angle,
+                .tilted = tilted,
+        };
+        emit_event(&event);
+    }
+}
+
+void gy86_events_add_frame(const sensor_snapshot_t *frame) {
+    if (!(frame->fresh & GY86_FRAME_IMU_FRESH)) {
+        return;
+    }
+
+    float accel[3] = {frame->imu.accel_x / MPU6050_ACCEL_LSB_PER_G, frame->imu.accel_y / MPU6050_ACCEL_LSB_PER_G,
+                      frame->imu.accel_z / MPU6050_ACCEL_LSB_PER_G};
+    float magnitude = sqrtf(accel[0] * accel[0] + accel[1] * accel[1] + accel[2] * accel[2]);
+    if (imu_us == 0) {
+        for (int i = 0; i < 3; i++) {
+            accel_previous[i] = accel[i];
+            gravity[i] = accel[i];
+        }
+        imu_us = frame->timestamp_us;
+        return;
+    }
+
+    float dt_ms = (frame->timestamp_us - imu_us) / 1000.0f;
+    float alpha = dt_ms / (GY86_EVENT_GRAVITY_TIME_CONSTANT_MS + dt_ms);
+    // Falling, the accelerometer reads nothing but the orientation has not changed
+    bool weightless = magnitude < event_thresholds.free_fall_g;
+    float change = 0, deviation = 0;
+    for (int i = 0; i < 3; i++) {
+        float step = accel[i] - accel_previous[i];
+        float away = accel[i] - gravity[i];
+        change += step * step;
+        deviation += away * away;
+        accel_previous[i] = accel[i];
+        if (!weightless) {
+            gravity[i] += alpha * away;
+        }
+    }
+    float jerk = dt_ms > 0 ? sqrtf(change) * 1000.0f / dt_ms : 0;
+    deviation = sqrtf(deviation);
+    imu_us = frame->timestamp_us;
+
+    detect_free_fall(frame, magnitude);
+    if (!weightless) {
+        detect_pulse(frame, magnitude, deviation, jerk);
+    } else if (in_pulse) {
+        // The drop into free fall is not a pulse of its own
+        finish_pulse(frame->timestamp_us);
+    }
+    // Falls and pulses pull the gravity estimate away from the orientation
+    if (!falling && !in_pulse) {
+        detect_tilt(frame);
+    }
+}
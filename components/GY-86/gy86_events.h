@@ -0,0 +1,117 @@
+#ifndef ESP_GYRO_GY86_EVENTS_H
+#define ESP_GYRO_GY86_EVENTS_H
+
+#include "stdbool.h"
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "gy86_data_defs.h"
+
+/**
+ * @file gy86_events.h
+ * @brief Motion events detected on every IMU sample of the GY-86 sensor suite.
+ *
+ * The sampling task runs a few comparisons per sample: free fall is a total acceleration below a threshold
+ * for a minimum time; a pulse is an acceleration away from the gravity estimate, which ends as a shock if it
+ * reached the shock threshold or the jerk threshold, or as a tap if it was short; tilt is the angle between
+ * the gravity estimate and the z axis crossing a threshold, with hysteresis. Detected events are queued for
+ * another task, see gy86_event_receive(). How fine the timing is follows the sampling period.
+ */
+
+#define GY86_EVENT_QUEUE_LENGTH         8       ///< Events queued for the receiver before new ones are dropped
+#define GY86_EVENT_GRAVITY_TIME_CONSTANT_MS 500 ///< Time constant of the gravity estimate in milliseconds
+#define GY86_EVENT_PULSE_MAX_MS         500     ///< A pulse still going after this long is reported as a shock at once
+
+/**
+ * @enum gy86_event_type_t
+ * @brief Kinds of motion events.
+ */
+typedef enum {
+    GY86_EVENT_FREE_FALL,   ///< Total acceleration near zero, the device is falling
+    GY86_EVENT_SHOCK,       ///< Strong or abrupt acceleration, e.g. a drop ending or a hit
+    GY86_EVENT_TAP,         ///< Short light pulse
+    GY86_EVENT_TILT,        ///< Tilt crossed its threshold in either direction
+    GY86_EVENT_COUNT        ///< Number of event types
+} gy86_event_type_t;
+
+/**
+ * @struct gy86_event_thresholds_t
+ * @brief Thresholds of the detectors.
+ */
+typedef struct {
+    float free_fall_g;          ///< Total acceleration below which the device counts as falling in g
+    uint32_t free_fall_ms;      ///< Time the acceleration must stay below free_fall_g in milliseconds
+    float shock_g;              ///< Total acceleration of a shock in g
+    float jerk_g_per_s;         ///< Change of the acceleration between two samples of a shock in g/s
+    float tap_g;                ///< Acceleration away from gravity that starts a pulse in g
+    uint32_t tap_max_ms;        ///< Longest pulse below the shock thresholds that counts as a tap in milliseconds
+    float tilt_deg;             ///< Tilt from the z axis that counts as tilted in degrees
+    float tilt_hysteresis_deg;  ///< How far the tilt must fall below tilt_deg to count as upright again in degrees
+} gy86_event_thresholds_t;
+
+#define GY86_EVENT_THRESHOLDS_DEFAULT {0.35f, 100, 1.8f, 40.0f, 0.4f, 150, 45.0f, 10.0f} ///< Default thresholds
+
+/**
+ * @struct gy86_event_t
+ * @brief A detected motion event.
+ */
+typedef struct {
+    gy86_event_type_t type;     ///< Kind of event
+    int64_t timestamp_us;       ///< esp_timer time the event started
+    uint32_t sequence;          ///< Sequence number of the frame the event was detected in
+    uint32_t duration_ms;       ///< Duration of the fall or pulse up to detection, 0 for tilt
+    float peak_g;               ///< Largest total acceleration, the smallest one for free fall, in g
+    float peak_jerk_g_per_s;    ///< Largest change of the acceleration between two samples in g/s
+    float angle_deg;            ///< Tilt from the z axis at detection in degrees
+    bool tilted;                ///< Tilt: true when the threshold was crossed upwards
+} gy86_event_t;
+
+/**
+ * @brief Create the event queue. Called by init_gy86_module().
+ * @return ESP_OK, or ESP_ERR_NO_MEM.
+ */
+esp_err_t gy86_events_init(void);
+
+/**
+ * @brief Set the thresholds of the detectors.
+ * @param thresholds Thresholds, copied, take effect with the next sample.
+ */
+void set_gy86_event_thresholds(const gy86_event_thresholds_t *thresholds);
+
+/**
+ * @brief Get the thresholds of the detectors.
+ * @return Thresholds.
+ */
+gy86_event_thresholds_t get_gy86_event_thresholds(void);
+
+/**
+ * @brief Run the detectors on a frame, frames without a fresh IMU sample are skipped.
+ *
+ * Must only be called by the sampling task.
+ *
+ * @param frame Frame that was just sampled.
+ */
+void gy86_events_add_frame(const sensor_snapshot_t *frame);
+
+/**
+ * @brief Wait for the next detected event.
+ * @param event Destination for the event.
+ * @param wait Ticks to wait, portMAX_DELAY to wait forever.
+ * @return true if an event was received.
+ */
+bool gy86_event_receive(gy86_event_t *event, TickType_t wait);
+
+/**
+ * @brief Get the name of an event type, as used in event messages.
+ * @param type Event type.
+ * @return Name, e.g. "free_fall".
+ */
+const char *gy86_event_name(gy86_event_type_t type);
+
+/**
+ * @brief Get how many events of a type were detected and how many of all types were dropped.
+ * @param detected Destination for GY86_EVENT_COUNT counters.
+ * @param dropped Destination for the events dropped because the queue was full.
+ */
+void get_gy86_event_counters(uint32_t detected[GY86_EVENT_COUNT], uint32_t *dropped);
+
+#endif //ESP_GYRO_GY86_EVENTS_H
@@ -0,0 +1,132 @@
+#include "gy86_kalman.h"
+#include "string.h"
+
+/**
+ * @file gy86_kalman.c
+ * @brief Implementation file for the baro-inertial Kalman filter of the GY-86 sensor suite.
+ */
+
+static float kalman_process_noise = GY86_KALMAN_PROCESS_NOISE;
+static float kalman_baro_noise = GY86_KALMAN_BARO_NOISE;
+static float kalman_accel_noise = GY86_KALMAN_ACCEL_NOISE;
+
+// Setter functions
+
+void set_gy86_kalman_process_noise(float q) {
+    kalman_process_noise = q;
+}
+
+void set_gy86_kalman_baro_noise(float r) {
+    kalman_baro_noise = r;
+}
+
+void set_gy86_kalman_accel_noise(float r) {
+    kalman_accel_noise = r;
+}
+
+// Getter functions
+
+float get_gy86_kalman_process_noise(void) {
+    return kalman_process_noise;
+}
+
+float get_gy86_kalman_baro_noise(void) {
+    return kalman_baro_noise;
+}
+
+float get_gy86_kalman_accel_noise(void) {
+    return kalman_accel_noise;
+}
+
+void gy86_kalman_reset(gy86_kalman_t *kf) {
+    memset(kf, 0, sizeof(*kf));
+}
+
+void gy86_kalman_predict(gy86_kalman_t *kf, float dt) {
+    if (!kf->initialized || dt <= 0.0f) {
+        return;
+    }
+
+    float dt2 = dt * dt;
+    float dt3 = dt2 * dt;
+    float half_dt2 = 0.5f * dt2;
+
+    // x = F x with F = [1 dt dt^2/2; 0 1 dt; 0 0 1]
+    kf->x[0] += dt * kf->x[1] + half_dt2 * kf->x[2];
+    kf->x[1] += dt * kf->x[2];
+
+    // A = F P
+    float a[3][3];
+    for (int j = 0; j < 3; j++) {
+        a[0][j] = kf->p[0][j] + dt * kf->p[1][j] + half_dt2 * kf->p[2][j];
+        a[1][j] = kf->p[1][j] + dt * kf->p[2][j];
+        a[2][j] = kf->p[2][j];
+    }
+
+    // P = A F^T + Q, Q from white jerk noise integrated over dt
+    float q = kalman_process_noise;
+    float qm[3][3] = {
+            {q * dt3 * dt2 / 20.0f, q * dt2 * dt2 / 8.0f, q * dt3 / 6.0f},
+            {q * dt2 * dt2 / 8.0f,  q * dt3 / 3.0f,       q * dt2 / 2.0f},
+            {q * dt3 / 6.0f,        q * dt2 / 2.0f,       q * dt},
+    };
+    for (int i = 0; i < 3; i++) {
+        kf->p[i][0] = a[i][0] + dt * a[i][1] + half_dt2 * a[i][2] + qm[i][0];
+        kf->p[i][1] = a[i][1] + dt * a[i][2] + qm[i][1];
+        kf->p[i][2] = a[i][2] + qm[i][2];
+    }
+}
+
+/**
+ * @brief Scalar measurement update for a measurement of a single state.
+ * @param kf Filter to correct.
+ * @param index Index of the measured state.
+ * @param z Measurement.
+ * @param r Measurement variance.
+ */
+static void kalman_update_state(gy86_kalman_t *kf, int index, float z, float r) {
+    float s = kf->p[index][index] + r;
+    if (s <= 0.0f) {
+        return;
+    }
+
+    float k[3];
+    for (int i = 0; i < 3; i++) {
+        k[i] = kf->p[i][index] / s;
+    }
+
+    float innovation = z - kf->x[index];
+    for (int i = 0; i < 3; i++) {
+        kf->x[i] += k[i] * innovation;
+    }
+
+    // P = (I - K H) P, H selects row index
+    float row[3] = {kf->p[index][0], kf->p[index][1], kf->p[index][2]};
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            kf->p[i][j] -= k[i] * row[j];
+        }
+    }
+}
+
+void gy86_kalman_update_altitude(gy86_kalman_t *kf, float altitude) {
+    if (!kf->initialized) {
+        memset(kf->p, 0, sizeof(kf->p));
+        kf->x[0] = altitude;
+        kf->x[1] = 0.0f;
+        kf->x[2] = 0.0f;
+        kf->p[0][0] = kalman_baro_noise;
+        kf->p[1][1] = 1.0f;
+        kf->p[2][2] = 1.0f;
+        kf->initialized = true;
+        return;
+    }
+    kalman_update_state(kf, 0, altitude, kalman_baro_noise);
+}
+
+void gy86_kalman_update_acceleration(gy86_kalman_t *kf, float acceleration) {
+    if (!kf->initialized) {
+        return;
+    }
+    kalman_update_state(kf, 2, acceleration, kalman_accel_noise);
+}
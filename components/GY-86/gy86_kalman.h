@@ -0,0 +1,95 @@
+#ifndef ESP_GYRO_GY86_KALMAN_H
+#define ESP_GYRO_GY86_KALMAN_H
+
+#include "stdbool.h"
+
+/**
+ * @file gy86_kalman.h
+ * @brief Header file for the baro-inertial Kalman filter of the GY-86 sensor suite.
+ *
+ * A three-state (altitude, vertical velocity, vertical acceleration) constant-acceleration filter.
+ * It is predicted and corrected with the gravity-compensated vertical acceleration on every IMU
+ * sample, and corrected with the barometric altitude whenever a new MS5611 reading arrives.
+ * All matrices are fixed 3x3 and every update is scalar, so a step costs a few dozen multiplies.
+ */
+
+#define GY86_KALMAN_PROCESS_NOISE   1.0f    ///< Default jerk spectral density in (m/s^3)^2/Hz
+#define GY86_KALMAN_BARO_NOISE      0.25f   ///< Default variance of the barometric altitude in m^2
+#define GY86_KALMAN_ACCEL_NOISE     0.1f    ///< Default variance of the vertical acceleration in (m/s^2)^2
+
+/**
+ * @brief State of the baro-inertial Kalman filter.
+ */
+typedef struct {
+    float x[3];         ///< State: altitude (m), vertical velocity (m/s), vertical acceleration (m/s^2)
+    float p[3][3];      ///< State covariance
+    bool initialized;   ///< Set once the first barometric altitude has been applied
+} gy86_kalman_t;
+
+/**
+ * @brief Set the process noise of the filter.
+ * @param q Jerk spectral density in (m/s^3)^2/Hz.
+ */
+void set_gy86_kalman_process_noise(float q);
+
+/**
+ * @brief Set the measurement noise of the barometric altitude.
+ * @param r Variance in m^2.
+ */
+void set_gy86_kalman_baro_noise(float r);
+
+/**
+ * @brief Set the measurement noise of the vertical acceleration.
+ * @param r Variance in (m/s^2)^2.
+ */
+void set_gy86_kalman_accel_noise(float r);
+
+/**
+ * @brief Get the process noise of the filter.
+ * @return Jerk spectral density in (m/s^3)^2/Hz.
+ */
+float get_gy86_kalman_process_noise(void);
+
+/**
+ * @brief Get the measurement noise of the barometric altitude.
+ * @return Variance in m^2.
+ */
+float get_gy86_kalman_baro_noise(void);
+
+/**
+ * @brief Get the measurement noise of the vertical acceleration.
+ * @return Variance in (m/s^2)^2.
+ */
+float get_gy86_kalman_accel_noise(void);
+
+/**
+ * @brief Reset the filter to an uninitialized state.
+ * @param kf Filter to reset.
+ */
+void gy86_kalman_reset(gy86_kalman_t *kf);
+
+/**
+ * @brief Propagate the state by dt seconds.
+ * @param kf Filter to propagate.
+ * @param dt Time since the last prediction in seconds.
+ */
+void gy86_kalman_predict(gy86_kalman_t *kf, float dt);
+
+/**
+ * @brief Correct the state with a barometric altitude.
+ *
+ * The first altitude initializes the filter.
+ *
+ * @param kf Filter to correct.
+ * @param altitude Barometric altitude in meters.
+ */
+void gy86_kalman_update_altitude(gy86_kalman_t *kf, float altitude);
+
+/**
+ * @brief Correct the state with a gravity-compensated vertical acceleration.
+ * @param kf Filter to correct.
+ * @param acceleration Vertical acceleration in m/s^2, positive upwards.
+ */
+void gy86_kalman_update_acceleration(gy86_kalman_t *kf, float acceleration);
+
+#endif //ESP_GYRO_GY86_KALMAN_H
@@ -0,0 +1,86 @@
+#ifndef ESP_GYRO_GY86_SCHEMA_H
+#define ESP_GYRO_GY86_SCHEMA_H
+
+/**
+ * @file gy86_schema.h
+ * @brief Compile-time channel schema of the GY-86 sensor suite.
+ *
+ * GY86_CHANNELS is the single list every per-channel table is generated from: the channel enum,
+ * the derived members of sensor_snapshot_t, the discovery table and the serializer field list. The
+ * topics and unique IDs in those tables depend on the device and are filled in by gy86_topics_init().
+ * Adding a channel is one line here. The header only contains macros so that host-side tools can
+ * expand the same list.
+ *
+ * Columns of GY86_CHANNELS(X):
+ * - id: suffix of the GY86_CH_* enum constant
+ * - key: JSON key, topic level and unique ID suffix of the channel
+ * - device_class: Home Assistant device class, "None" to omit it
+ * - unit: unit of measurement
+ * - value_type: value_type_t of the value in the frame
+ * - kind: RAW if the value is decoded by a driver into sensor_snapshot_t, DERIVED if the frame
+ *   gets a member of its own for it
+ * - ctype: C type of the value in the frame
+ * - member: member of sensor_snapshot_t holding the value
+ * - source: sensor whose reading updates the value, IMU, BARO or MAG; the value is only new in frames
+ *   with that sensor's GY86_FRAME_*_FRESH bit
+ * - scale: fixed-point factor of the value in packed telemetry frames, e.g. 100 sends 23.456 as 2346
+ * - report: GY86_ON_CHANGE() rule of when a new value is published to Home Assistant, see
+ *   sensor_report_rule_t. Packed telemetry always carries every channel.
+ */
+
+/* Device */
+#define GY86_DEVICE_ID              "GY86"                  ///< Prefix of the device identifier, the MAC address follows it
+#define GY86_DEVICE_NAME            "GY86 Sensor Suite"     ///< Name of the device, the end of the MAC address follows it
+#define GY86_DEVICE_MANUFACTURER    "Generic"               ///< Manufacturer of the device
+#define GY86_DEVICE_MODEL           "GY86 Multi-Sensor"     ///< Model of the device
+
+/* Discovery topics, built at startup by gy86_topics_init() below the prefix Home Assistant subscribes to */
+#define GY86_DISCOVERY_PREFIX       "homeassistant"         ///< Discovery prefix, independent of the topic root
+
+/* Topics, built at startup by gy86_topics_init() as <root>/<device identifier>/<leaf> */
+#define GY86_TOPIC_ROOT             "homeassistant/sensor"  ///< Default root of all topics of the device
+#define GY86_STATE_LEAF             "state"                 ///< State topic carrying all channels at once; a channel's own is <key>/state
+#define GY86_TELEMETRY_LEAF         "telemetry"             ///< Packed frames for the ingest pipeline
+#define GY86_BACKFILL_LEAF          "backfill"              ///< Batches of packed frames recorded while offline
+#define GY86_STATS_LEAF             "stats"                 ///< Windowed statistics of all channels
+#define GY86_DIAGNOSTICS_LEAF       "diagnostics"           ///< Metrics of the MQTT pipeline, see send_mqtt_diagnostics()
+#define GY86_ACTIVITY_LEAF          "activity"              ///< Activity state and time per state, see gy86_activity.h
+#define GY86_EVENT_LEAF             "event"                 ///< Motion events as they are detected, see gy86_events.h
+#define GY86_CAPTURE_LEAF           "capture"               ///< Chunks of black box captures, see gy86_capture_codec.h
+#define GY86_CAPTURE_COMMAND_LEAF   "capture/trigger"       ///< Any message triggers a black box capture
+#define GY86_COMMAND_LEAF           "config/set"            ///< Configuration commands, see ESP32_Config_custom.h
+#define GY86_COMMAND_RESPONSE_LEAF  "config/ack"            ///< Responses to configuration commands
+
+/**
+ * @brief Report-on-change rule of a channel.
+ * @param deadband Absolute change to publish, in the channel's unit, 0 for any change.
+ * @param percent Change to publish relative to the last published value, in percent, 0 for none.
+ * @param min_ms Shortest time between two published values, 0 for none.
+ * @param max_ms Longest time without a published value, 0 for none.
+ */
+#define GY86_ON_CHANGE(deadband, percent, min_ms, max_ms) {deadband, percent, min_ms, max_ms}
+
+/* Channels */
+// Slow environmental channels are rate-limited; attitude and motion publish at once, with a heartbeat
+#define GY86_CHANNELS(X) \
+    X(TEMPERATURE,           temperature,           "temperature", "°C",      VALUE_TYPE_FLOAT,  RAW,     float,        baro.temperature,      BARO, 100, GY86_ON_CHANGE(0.1f,  0,     5000, 300000)) \
+    X(PRESSURE,              pressure,              "pressure",    "hPa",     VALUE_TYPE_FLOAT,  RAW,     float,        baro.pressure,         BARO, 100, GY86_ON_CHANGE(0,     0.01f, 5000, 300000)) \
+    X(ROLL,                  roll,                  "None",        "degrees", VALUE_TYPE_FLOAT,  DERIVED, float,        roll,                  IMU,  100, GY86_ON_CHANGE(0.5f,  0,     0,    60000)) \
+    X(PITCH,                 pitch,                 "None",        "degrees", VALUE_TYPE_FLOAT,  DERIVED, float,        pitch,                 IMU,  100, GY86_ON_CHANGE(0.5f,  0,     0,    60000)) \
+    X(ALTITUDE,              altitude,              "distance",    "m",       VALUE_TYPE_FLOAT,  DERIVED, float,        altitude,              BARO, 100, GY86_ON_CHANGE(0.5f,  0,     5000, 300000)) \
+    X(DIRECTION,             direction,             "None",        "degrees", VALUE_TYPE_FLOAT,  DERIVED, float,        heading,               MAG,  100, GY86_ON_CHANGE(1.0f,  0,     0,    60000)) \
+    X(COMPASS,               compass,               "None",        "",        VALUE_TYPE_STRING, DERIVED, const char *, compass,               MAG,    1, GY86_ON_CHANGE(0,     0,     0,    300000)) \
+    X(ACCELERATION_X,        acceleration_x,        "speed",       "G",       VALUE_TYPE_INT16,  RAW,     int16_t,      imu.accel_x,           IMU,    1, GY86_ON_CHANGE(200,   0,     0,    60000)) \
+    X(ACCELERATION_Y,        acceleration_y,        "speed",       "G",       VALUE_TYPE_INT16,  RAW,     int16_t,      imu.accel_y,           IMU,    1, GY86_ON_CHANGE(200,   0,     0,    60000)) \
+    X(ACCELERATION_Z,        acceleration_z,        "speed",       "G",       VALUE_TYPE_INT16,  RAW,     int16_t,      imu.accel_z,           IMU,    1, GY86_ON_CHANGE(200,   0,     0,    60000)) \
+    X(ALTITUDE_FILTERED,     altitude_filtered,     "distance",    "m",       VALUE_TYPE_FLOAT,  DERIVED, float,        altitude_filtered,     IMU,  100, GY86_ON_CHANGE(0.2f,  0,     1000, 300000)) \
+    X(VERTICAL_SPEED,        vertical_speed,        "speed",       "m/s",     VALUE_TYPE_FLOAT,  DERIVED, float,        vertical_speed,        IMU,  100, GY86_ON_CHANGE(0.1f,  0,     0,    60000)) \
+    X(VERTICAL_ACCELERATION, vertical_acceleration, "None",        "m/s²",    VALUE_TYPE_FLOAT,  DERIVED, float,        vertical_acceleration, IMU,  100, GY86_ON_CHANGE(0.2f,  0,     0,    60000))
+
+/* Expanders used with GY86_CHANNELS */
+#define GY86_CHANNEL_ENUM(id, key, device_class, unit, value_type, kind, ctype, member, source, scale, report) GY86_CH_##id,
+#define GY86_FRAME_MEMBER(id, key, device_class, unit, value_type, kind, ctype, member, source, scale, report) GY86_FRAME_MEMBER_##kind(ctype, member)
+#define GY86_FRAME_MEMBER_RAW(ctype, member)
+#define GY86_FRAME_MEMBER_DERIVED(ctype, member) ctype member;
+
+#endif //ESP_GYRO_GY86_SCHEMA_H
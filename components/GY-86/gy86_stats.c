@@ -0,0 +1,122 @@
+#include "gy86_stats.h"
+#include "gy86_schema.h"
+#include "string.h"
+#include "stdatomic.h"
+
+/**
+ * @file gy86_stats.c
+ * @brief Implementation file for the windowed channel statistics of the GY-86 sensor suite.
+ *
+ * The open window is owned by the sampling task. The closed window is published through a
+ * sequence lock, the same scheme the frame ring uses, so readers never block the sampling task.
+ */
+
+#define GY86_STATS_SOURCE(id, key, device_class, unit, value_type, kind, ctype, member, source, scale, report) \
+    [GY86_CH_##id] = GY86_FRAME_##source##_FRESH,
+
+// GY86_FRAME_*_FRESH bit a frame needs for a channel's value to be a new sample
+static const uint32_t channel_sources[GY86_CHANNEL_COUNT] = {
+        GY86_CHANNELS(GY86_STATS_SOURCE)
+};
+
+static uint32_t stats_window_ms = GY86_STATS_WINDOW_MS;
+
+static sensor_stats_window_t open_window;       ///< Window being accumulated by the sampling task
+static sensor_stats_window_t closed_window;     ///< Newest closed window
+static atomic_uint closed_window_lock;          ///< Sequence lock of closed_window, odd while it is written
+
+void set_gy86_stats_window_ms(uint32_t window_ms) {
+    stats_window_ms = window_ms;
+}
+
+uint32_t get_gy86_stats_window_ms(void) {
+    return stats_window_ms;
+}
+
+/**
+ * @brief Fold a sample into running statistics using Welford's algorithm.
+ * @param stats Statistics to update.
+ * @param x New sample.
+ */
+static void sensor_stats_add(sensor_stats_t *stats, float x) {
+    if (stats->count == 0) {
+        stats->min = x;
+        stats->max = x;
+    } else if (x < stats->min) {
+        stats->min = x;
+    } else if (x > stats->max) {
+        stats->max = x;
+    }
+
+    stats->count++;
+    float delta = x - stats->mean;
+    stats->mean += delta / stats->count;
+    stats->m2 += delta * (x - stats->mean);
+}
+
+/**
+ * @brief Publish the open window as the closed window and start a new one.
+ */
+static void close_window(void) {
+    atomic_fetch_add_explicit(&closed_window_lock, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    closed_window = open_window;
+    atomic_fetch_add_explicit(&closed_window_lock, 1, memory_order_release);
+
+    uint32_t sequence = open_window.sequence;
+    memset(&open_window, 0, sizeof(open_window));
+    open_window.sequence = sequence + 1;
+}
+
+void gy86_stats_add_frame(const sensor_snapshot_t *frame) {
+    if (open_window.sequence == 0) {
+        open_window.sequence = 1;
+    }
+    if (open_window.start_us == 0) {
+        open_window.start_us = frame->timestamp_us;
+    }
+    open_window.end_us = frame->timestamp_us;
+
+    for (int i = 0; i < NUM_SENSORS; i++) {
+        // A sensor that was not read this cycle repeats its last value, which would weigh it several times
+        if (!(frame->fresh & channel_sources[i])) {
+            continue;
+        }
+        sensor_value_t value = sensor_field_value(&sensor_fields[i], frame);
+        switch (value.type) {
+            case VALUE_TYPE_FLOAT:
+                sensor_stats_add(&open_window.channels[i], value.float_value);
+                break;
+            case VALUE_TYPE_INT:
+                sensor_stats_add(&open_window.channels[i], (float)value.int_value);
+                break;
+            case VALUE_TYPE_DOUBLE:
+                sensor_stats_add(&open_window.channels[i], (float)value.double_value);
+                break;
+            default:
+                break;
+        }
+    }
+
+    if (open_window.end_us - open_window.start_us >= (int64_t)stats_window_ms * 1000) {
+        close_window();
+    }
+}
+
+bool gy86_stats_read_window(sensor_stats_window_t *window) {
+    while (1) {
+        unsigned lock = atomic_load_explicit(&closed_window_lock, memory_order_acquire);
+        if (lock == 0) {
+            return false;
+        }
+        if (lock & 1) {
+            continue;
+        }
+
+        memcpy(window, &closed_window, sizeof(*window));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&closed_window_lock, memory_order_relaxed) == lock) {
+            return true;
+        }
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef ESP_GYRO_GY86_STATS_H
+#define ESP_GYRO_GY86_STATS_H
+
+#include "stdbool.h"
+#include "gy86_data_defs.h"
+
+/**
+ * @file gy86_stats.h
+ * @brief Header file for the windowed channel statistics of the GY-86 sensor suite.
+ *
+ * Every sampled frame is folded into running per-channel statistics (count, mean, variance, min, max)
+ * in O(1) without buffering samples; a channel only counts frames in which its sensor was read, so the
+ * barometer channels have one sample per barometer reading. When a window has elapsed the sampling
+ * task closes it and publishes the result, which readers copy with gy86_stats_read_window().
+ *
+ * Only the newest closed window is kept. A reader that polls less often than once per window, or
+ * cannot publish for a while, misses windows; they show as a gap in the window sequence numbers.
+ */
+
+#define GY86_STATS_WINDOW_MS 20000  ///< Default length of a statistics window in milliseconds
+
+/**
+ * @brief Statistics of all channels over one closed window.
+ */
+typedef struct {
+    uint32_t sequence;                      ///< Window number, starting at 1
+    int64_t start_us;                       ///< esp_timer time of the first frame in the window
+    int64_t end_us;                         ///< esp_timer time of the last frame in the window
+    sensor_stats_t channels[NUM_SENSORS];   ///< Statistics in sensor_fields order, count is 0 for string channels
+} sensor_stats_window_t;
+
+/**
+ * @brief Set the length of a statistics window.
+ * @param window_ms Window length in milliseconds, takes effect with the next window.
+ */
+void set_gy86_stats_window_ms(uint32_t window_ms);
+
+/**
+ * @brief Get the length of a statistics window.
+ * @return Window length in milliseconds.
+ */
+uint32_t get_gy86_stats_window_ms(void);
+
+/**
+ * @brief Fold a frame into the open window and close the window once it has elapsed.
+ *
+ * Only channels whose sensor is fresh in the frame are folded in.
+ *
+ * Must only be called by the sampling task.
+ *
+ * @param frame Frame that was just sampled.
+ */
+void gy86_stats_add_frame(const sensor_snapshot_t *frame);
+
+/**
+ * @brief Copy the newest closed window.
+ *
+ * Windows closed since the previous read except the newest are lost, compare the sequence numbers.
+ *
+ * @param window Destination for the window.
+ * @return true if a window was copied, false if no window has been closed yet.
+ */
+bool gy86_stats_read_window(sensor_stats_window_t *window);
+
+#endif //ESP_GYRO_GY86_STATS_H
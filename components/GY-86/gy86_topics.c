@@ -0,0 +1,120 @@
+#include "gy86_topics.h"
+#include "stdarg.h"
+#include "stdio.h"
+#include "string.h"
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "nvs.h"
+
+static const char *topic_root = GY86_TOPIC_ROOT;
+static char topic_root_stored[GY86_TOPIC_ROOT_MAX];
+
+// Every string of the table lives here, written once by gy86_topics_init()
+static char topic_table[GY86_TOPIC_TABLE_SIZE];
+static size_t topic_table_used = 0;
+static gy86_topics_t topics;
+
+void set_gy86_topic_root(const char *root) {
+    topic_root = root;
+}
+
+const char *get_gy86_topic_root(void) {
+    return topic_root;
+}
+
+const gy86_topics_t *gy86_get_topics(void) {
+    return &topics;
+}
+
+/**
+ * @brief Format a string into the topic table.
+ * @param format printf format.
+ * @return The string inside the table, or NULL if the table is full.
+ */
+static const char *intern(const char *format, ...) {
+    char *string = &topic_table[topic_table_used];
+    size_t free_size = sizeof(topic_table) - topic_table_used;
+
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(string, free_size, format, args);
+    va_end(args);
+
+    if (length < 0 || (size_t)length >= free_size) {
+        return NULL;
+    }
+    topic_table_used += length + 1;
+    return string;
+}
+
+/**
+ * @brief Use the topic root stored in NVS, if there is one.
+ */
+static void load_topic_root(void) {
+    nvs_handle_t handle;
+    if (nvs_open(GY86_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return;
+    }
+    size_t size = sizeof(topic_root_stored);
+    if (nvs_get_str(handle, GY86_NVS_TOPIC_ROOT_KEY, topic_root_stored, &size) == ESP_OK && topic_root_stored[0] != '\0') {
+        topic_root = topic_root_stored;
+    }
+    nvs_close(handle);
+}
+
+esp_err_t gy86_topics_init(void) {
+    uint8_t mac[6];
+    esp_err_t err = esp_efuse_mac_get_default(mac);
+    if (err != ESP_OK) {
+        ESP_LOGE("GY86", "Failed to read the MAC address: %s", esp_err_to_name(err));
+        return err;
+    }
+    load_topic_root();
+
+    topic_table_used = 0;
+    topics.device_id = intern(GY86_DEVICE_ID "_%02X%02X%02X%02X%02X%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    topics.device_name = intern(GY86_DEVICE_NAME " %02X%02X%02X", mac[3], mac[4], mac[5]);
+    topics.prefix = intern("%s/%s", topic_root, topics.device_id);
+    if (topics.prefix == NULL) {
+        ESP_LOGE("GY86", "Topic table of %u bytes is too small", (unsigned)sizeof(topic_table));
+        return ESP_ERR_NO_MEM;
+    }
+    topics.device_state = intern("%s/" GY86_STATE_LEAF, topics.prefix);
+    topics.telemetry = intern("%s/" GY86_TELEMETRY_LEAF, topics.prefix);
+    topics.backfill = intern("%s/" GY86_BACKFILL_LEAF, topics.prefix);
+    topics.stats = intern("%s/" GY86_STATS_LEAF, topics.prefix);
+    topics.diagnostics = intern("%s/" GY86_DIAGNOSTICS_LEAF, topics.prefix);
+    topics.activity = intern("%s/" GY86_ACTIVITY_LEAF, topics.prefix);
+    topics.event = intern("%s/" GY86_EVENT_LEAF, topics.prefix);
+    topics.capture = intern("%s/" GY86_CAPTURE_LEAF, topics.prefix);
+    topics.capture_command = intern("%s/" GY86_CAPTURE_COMMAND_LEAF, topics.prefix);
+    topics.command = intern("%s/" GY86_COMMAND_LEAF, topics.prefix);
+    topics.command_response = intern("%s/" GY86_COMMAND_RESPONSE_LEAF, topics.prefix);
+    topics.device_discovery = intern(GY86_DISCOVERY_PREFIX "/device/%s/config", topics.device_id);
+
+    bool complete = topics.device_discovery != NULL;
+    for (int i = 0; i < GY86_CHANNEL_COUNT && complete; i++) {
+        const char *key = sensor_fields[i].sensor_type;
+        const char *state_topic = intern("%s/%s/" GY86_STATE_LEAF, topics.prefix, key);
+        const char *unique_id = intern("%s_%s", topics.device_id, key);
+        const char *discovery_topic = intern(GY86_DISCOVERY_PREFIX "/sensor/%s/%s/config", topics.device_id, key);
+        complete = state_topic != NULL && unique_id != NULL && discovery_topic != NULL;
+
+        sensor_fields[i].topic = state_topic;
+        sensor_data_array[i].topic = state_topic;
+        sensor_configs[i].state_topic = state_topic;
+        sensor_configs[i].unique_id = unique_id;
+        sensor_configs[i].identifiers = topics.device_id;
+        sensor_configs[i].name = topics.device_name;
+        sensor_configs[i].discovery_topic = discovery_topic;
+        sensor_configs[i].device_discovery_topic = topics.device_discovery;
+    }
+    if (!complete) {
+        ESP_LOGE("GY86", "Topic table of %u bytes is too small", (unsigned)sizeof(topic_table));
+        return ESP_ERR_NO_MEM;
+    }
+
+    ESP_LOGI("GY86", "Device %s publishes under %s (%u of %u topic bytes)", topics.device_id, topics.prefix,
+             (unsigned)topic_table_used, (unsigned)sizeof(topic_table));
+    return ESP_OK;
+}
@@ -0,0 +1,76 @@
+#ifndef ESP_GYRO_GY86_TOPICS_H
+#define ESP_GYRO_GY86_TOPICS_H
+
+#include "esp_err.h"
+#include "gy86_data_defs.h"
+
+/**
+ * @file gy86_topics.h
+ * @brief Device identity and MQTT topic table of the GY-86 sensor suite.
+ *
+ * The device identifier is GY86_DEVICE_ID followed by the factory MAC address from efuse, so every
+ * unit gets its own topics and unique IDs from the same firmware image. All topics are built once
+ * at startup into a preallocated table as <root>/<device identifier>/<leaf>. The root may span
+ * several levels, e.g. "site-17/homeassistant/sensor", to shard a fleet across brokers or ACLs. The
+ * discovery config topics stay below GY86_DISCOVERY_PREFIX, where Home Assistant looks for them.
+ */
+
+#define GY86_TOPIC_TABLE_SIZE       4096            ///< Static buffer for all topics and IDs in bytes
+#define GY86_TOPIC_ROOT_MAX         96              ///< Longest topic root in bytes, including the NUL
+#define GY86_NVS_NAMESPACE          "device"        ///< NVS namespace of the device identity settings
+#define GY86_NVS_TOPIC_ROOT_KEY     "topic_root"    ///< NVS key of a topic root provisioned per unit
+
+/**
+ * @brief Topics of the device, see gy86_get_topics().
+ */
+typedef struct {
+    const char *device_id;          ///< Device identifier, e.g. GY86_240AC4A1B2C3
+    const char *device_name;        ///< Device name shown in Home Assistant
+    const char *prefix;             ///< <root>/<device identifier>, the prefix of all topics below
+    const char *device_state;       ///< State topic carrying all channels at once
+    const char *telemetry;          ///< Packed frames for the ingest pipeline
+    const char *backfill;           ///< Batches of packed frames recorded while offline
+    const char *stats;              ///< Windowed statistics of all channels
+    const char *diagnostics;        ///< Metrics of the MQTT pipeline
+    const char *activity;           ///< Activity state and time per state
+    const char *event;              ///< Motion events
+    const char *capture;            ///< Chunks of black box captures
+    const char *capture_command;    ///< Black box capture requests
+    const char *command;            ///< Configuration commands
+    const char *command_response;   ///< Responses to configuration commands
+    const char *device_discovery;   ///< Config topic of the device discovery message
+} gy86_topics_t;
+
+/**
+ * @brief Set the root of all topics.
+ *
+ * Takes effect with gy86_topics_init(); a root stored in NVS under GY86_NVS_TOPIC_ROOT_KEY takes
+ * precedence, so units can be provisioned without a build of their own.
+ *
+ * @param root Topic root without a trailing slash, e.g. GY86_TOPIC_ROOT.
+ */
+void set_gy86_topic_root(const char *root);
+
+/**
+ * @brief Get the root of all topics.
+ * @return Topic root.
+ */
+const char *get_gy86_topic_root(void);
+
+/**
+ * @brief Derive the device identity and build the topic table.
+ *
+ * Fills the topics, unique IDs and device of sensor_configs, sensor_fields and sensor_data_array.
+ * Call it once after nvs_flash_init() and before anything is published.
+ *
+ * @return ESP_OK, the error of reading the MAC address, or ESP_ERR_NO_MEM if the table is too small.
+ */
+esp_err_t gy86_topics_init(void);
+
+/**
+ * @brief Get the topics of the device.
+ * @return Topic table, valid after gy86_topics_init().
+ */
+const gy86_topics_t *gy86_get_topics(void);
+
+#endif //ESP_GYRO_GY86_TOPICS_H
@@ -60,13 +60,15 @@ esp_err_t hmc5883l_init(i2c_master_bus_handle_t bus_handle, i2c_master_dev_handl
     return ESP_OK;
 }
 
-void hmc5883l_read_data(i2c_master_dev_handle_t dev_handle, hmc5883l_raw_data_t *data_struct) {
+esp_err_t hmc5883l_read_data(i2c_master_dev_handle_t dev_handle, hmc5883l_raw_data_t *data_struct) {
     uint8_t data[6];  ///< Buffer for 6 bytes of data
-    if (i2c_read(dev_handle, HMC5883L_DATA_X_MSB, data, 6) == ESP_OK) {
+    esp_err_t ret = i2c_read(dev_handle, HMC5883L_DATA_X_MSB, data, 6);
+    if (ret == ESP_OK) {
         data_struct->x = (int16_t)((data[0] << 8) | data[1]);
         data_struct->y = (int16_t)((data[4] << 8) | data[5]);
         data_struct->z = (int16_t)((data[2] << 8) | data[3]);
     } else {
         ESP_LOGE("HMC5883L", "Failed to read sensor data");
     }
+    return ret;
 }
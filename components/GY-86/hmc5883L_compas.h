@@ -25,9 +25,14 @@ esp_err_t hmc5883l_init(i2c_master_bus_handle_t bus_handle, i2c_master_dev_handl
 
 /**
  * @brief Read magnetometer data from the HMC5883L sensor.
+ *
+ * The burst is decoded straight into data_struct, which may point into a frame slot.
+ * On failure data_struct is left untouched.
+ *
  * @param dev_handle I2C device handle.
  * @param data_struct Pointer to the structure to hold the raw magnetometer data.
+ * @return esp_err_t ESP_OK on success, or an error code on failure.
  */
-void hmc5883l_read_data(i2c_master_dev_handle_t dev_handle, hmc5883l_raw_data_t *data_struct);
+esp_err_t hmc5883l_read_data(i2c_master_dev_handle_t dev_handle, hmc5883l_raw_data_t *data_struct);
 
 #endif //ESP_GYRO_HMC5883L_COMPAS_H
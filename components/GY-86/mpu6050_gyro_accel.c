@@ -85,7 +85,7 @@ esp_err_t mpu6050_init(i2c_master_bus_handle_t bus_handle, i2c_master_dev_handle
     return ESP_OK;
 }
 
-void mpu6050_read_data(i2c_master_dev_handle_t dev_handle, mpu6050_raw_data_t *data_struct) {
+esp_err_t mpu6050_read_data(i2c_master_dev_handle_t dev_handle, mpu6050_raw_data_t *data_struct) {
     uint8_t data[14];  ///< Buffer for 14 bytes of data
     esp_err_t ret = i2c_read(dev_handle, MPU6050_ACCEL_XOUT_H, data, 14);
     if (ret == ESP_OK) {
@@ -93,14 +93,14 @@ void mpu6050_read_data(i2c_master_dev_handle_t dev_handle, mpu6050_raw_data_t *d
         data_struct->accel_x = (int16_t)((data[0] << 8) | data[1]);
         data_struct->accel_y = (int16_t)((data[2] << 8) | data[3]);
         data_struct->accel_z = (int16_t)((data[4] << 8) | data[5]);
-        data_struct->temp = (int16_t)((data[6] << 8) | data[7]);
         data_struct->gyro_x = (int16_t)((data[8] << 8) | data[9]);
         data_struct->gyro_y = (int16_t)((data[10] << 8) | data[11]);
         data_struct->gyro_z = (int16_t)((data[12] << 8) | data[13]);
 
         // Convert temperature to degrees Celsius
-        data_struct->temp = data_struct->temp / 340.0 + 36.53;
+        data_struct->temp = (int16_t)((data[6] << 8) | data[7]) / 340.0f + 36.53f;
     } else {
         ESP_LOGE("MPU6050", "Failed to read sensor data: %s", esp_err_to_name(ret));
     }
+    return ret;
 }
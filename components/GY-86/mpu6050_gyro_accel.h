@@ -27,9 +27,14 @@ esp_err_t mpu6050_init(i2c_master_bus_handle_t bus_handle, i2c_master_dev_handle
 
 /**
  * @brief Read accelerometer and gyroscope data from the MPU6050 sensor.
+ *
+ * The burst is decoded straight into data_struct, which may point into a frame slot.
+ * On failure data_struct is left untouched.
+ *
  * @param dev_handle I2C device handle.
  * @param data_struct Pointer to the structure to hold the raw accelerometer and gyroscope data.
+ * @return esp_err_t ESP_OK on success, or an error code on failure.
  */
-void mpu6050_read_data(i2c_master_dev_handle_t dev_handle, mpu6050_raw_data_t *data_struct);
+esp_err_t mpu6050_read_data(i2c_master_dev_handle_t dev_handle, mpu6050_raw_data_t *data_struct);
 
 #endif //ESP_GYRO_MPU6050_GYRO_ACCEL_H
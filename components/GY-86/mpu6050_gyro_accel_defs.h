@@ -115,6 +115,10 @@
 /* Data Length */
 #define MPU6050_DATA_LENGTH 14  ///< Data length for accelerometer and gyroscope readings
 
+/* Sensitivity */
+#define MPU6050_ACCEL_LSB_PER_G 16384.0f  ///< Accelerometer sensitivity at the +-2g range set by mpu6050_init
+#define MPU6050_GYRO_LSB_PER_DPS 131.0f   ///< Gyroscope sensitivity at the +-250 deg/s range set by mpu6050_init
+
 /********************************************************* */
 /*!               Data Structures                         */
 /********************************************************* */
@@ -126,10 +130,10 @@ typedef struct {
     int16_t accel_x;  ///< Raw accelerometer X-axis data
     int16_t accel_y;  ///< Raw accelerometer Y-axis data
     int16_t accel_z;  ///< Raw accelerometer Z-axis data
-    double temp;      ///< Temperature data
     int16_t gyro_x;   ///< Raw gyroscope X-axis data
     int16_t gyro_y;   ///< Raw gyroscope Y-axis data
     int16_t gyro_z;   ///< Raw gyroscope Z-axis data
+    float temp;       ///< Temperature in degrees Celsius
 } mpu6050_raw_data_t;
 
 /**
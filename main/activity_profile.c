@@ -0,0 +1,107 @@
+#include "activity_profile.h"
+#include "device_config.h"
+#include "../components/GY-86/gy86_data.h"
+#include "../components/ESP32_Wifi_custom/ESP32_Wifi_custom.h"
+#include "../components/ESP32_Mqtt_custom/json_writer.h"
+
+static activity_profile_t activity_profiles[GY86_ACTIVITY_COUNT] = {
+        [GY86_ACTIVITY_IDLE] = {60000, WIFI_PS_MAX_MODEM},
+        [GY86_ACTIVITY_ACTIVE] = {0, WIFI_PS_MIN_MODEM},
+        [GY86_ACTIVITY_MOVING] = {100, WIFI_PS_NONE},
+};
+static TaskHandle_t activity_publisher = NULL;
+static volatile gy86_activity_state_t activity_state = GY86_ACTIVITY_INITIAL_STATE;
+
+void set_activity_profile(gy86_activity_state_t state, const activity_profile_t *profile) {
+    if (state < GY86_ACTIVITY_COUNT) {
+        activity_profiles[state] = *profile;
+    }
+}
+
+activity_profile_t get_activity_profile(gy86_activity_state_t state) {
+    return activity_profiles[state < GY86_ACTIVITY_COUNT ? state : GY86_ACTIVITY_IDLE];
+}
+
+/**
+ * @brief Apply the profile of a new activity state, called by the sampling task.
+ * @param state New state.
+ * @param arg Unused.
+ */
+static void apply_activity_profile(gy86_activity_state_t state, void *arg) {
+    activity_state = state;
+    if (!get_gy86_activity_enabled()) {
+        return;
+    }
+    set_wifi_power_save(activity_profiles[state].power_save);
+    if (activity_publisher != NULL) {
+        xTaskNotifyGive(activity_publisher);
+    }
+}
+
+void set_activity_adaptive(bool enabled) {
+    set_gy86_activity_enabled(enabled);
+    set_wifi_power_save(enabled ? activity_profiles[activity_state].power_save : WIFI_POWER_SAVE);
+    if (activity_publisher != NULL) {
+        xTaskNotifyGive(activity_publisher);
+    }
+}
+
+void activity_profiles_start(TaskHandle_t publisher) {
+    activity_publisher = publisher;
+    set_gy86_activity_callback(apply_activity_profile, NULL);
+}
+
+/**
+ * @brief Get the publish interval of the main loop in an activity state.
+ * @param state Activity state.
+ * @return Interval of the state's profile bounded by the configured one, the configured one while not adapting.
+ */
+static uint32_t activity_publish_interval_ms(gy86_activity_state_t state) {
+    uint32_t configured = get_device_publish_interval_ms();
+    uint32_t interval_ms = activity_profiles[state].publish_interval_ms;
+    if (!get_gy86_activity_enabled() || interval_ms == 0) {
+        return configured;
+    }
+    // Idle only publishes less often than configured, moving only more often
+    if (state < GY86_ACTIVITY_ACTIVE) {
+        return interval_ms > configured ? interval_ms : configured;
+    }
+    if (state > GY86_ACTIVITY_ACTIVE) {
+        return interval_ms < configured ? interval_ms : configured;
+    }
+    return interval_ms;
+}
+
+bool wait_for_next_publish(void) {
+    return ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(activity_publish_interval_ms(activity_state))) > 0;
+}
+
+void send_activity_report(esp_mqtt_client_handle_t client, const char *topic) {
+    gy86_activity_t activity;
+    gy86_activity_read(&activity);
+
+    char message[ACTIVITY_REPORT_BUFFER_SIZE];
+    json_writer_t writer;
+
+    json_writer_init(&writer, message, sizeof(message), false);
+    json_writer_begin_object(&writer, NULL);
+    json_writer_string(&writer, "state", get_gy86_activity_level(activity.state).name);
+    json_writer_int(&writer, "adaptive", get_gy86_activity_enabled());
+    json_writer_int(&writer, "transitions", activity.transitions);
+    json_writer_decimal(&writer, "accel_variance", activity.accel_variance, 6);
+    json_writer_decimal(&writer, "gyro_variance", activity.gyro_variance, 3);
+    json_writer_decimal(&writer, "pressure_trend", activity.pressure_trend, 3);
+    json_writer_int(&writer, "sample_ms", get_gy86_sample_period_ms());
+    json_writer_int(&writer, "baro_divider", gy86_activity_baro_divider(get_gy86_baro_divider()));
+    json_writer_int(&writer, "publish_ms", activity_publish_interval_ms(activity.state));
+    json_writer_begin_object(&writer, "time_s");
+    for (int i = 0; i < GY86_ACTIVITY_COUNT; i++) {
+        json_writer_int(&writer, get_gy86_activity_level((gy86_activity_state_t)i).name, activity.time_ms[i] / 1000);
+    }
+    json_writer_end_object(&writer);
+    json_writer_end_object(&writer);
+
+    if (json_writer_finish(&writer) != NULL) {
+        mqtt_publish_message(client, topic, message, (int)writer.length, MQTT_CLASS_STATS, 0);
+    }
+}
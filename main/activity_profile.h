@@ -0,0 +1,83 @@
+#ifndef ESP_GYRO_ACTIVITY_PROFILE_H
+#define ESP_GYRO_ACTIVITY_PROFILE_H
+
+#include "stdint.h"
+#include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "../components/GY-86/gy86_activity.h"
+#include "../components/ESP32_Mqtt_custom/ESP32_Mqtt_custom.h"
+
+/**
+ * @file activity_profile.h
+ * @brief Publish interval and radio power save of every activity state of gy86_activity.h.
+ *
+ * The GY-86 component adapts its barometer rate to the activity state; the profiles here adapt the rest
+ * of the firmware: how often the main loop publishes and how deep the WiFi modem sleeps. Adapting is on
+ * by default, see GY86_ACTIVITY_ENABLED, and bounded by the configured publish interval: the active state
+ * publishes at get_device_publish_interval_ms(), idle never more often and moving never less often.
+ */
+
+#define ACTIVITY_REPORT_BUFFER_SIZE 512     ///< Stack buffer for the activity report in bytes
+
+/**
+ * @struct activity_profile_t
+ * @brief What the firmware does in one activity state.
+ */
+typedef struct {
+    uint32_t publish_interval_ms;   ///< Pause of the main loop between two publishes, 0 for the configured one
+    wifi_ps_type_t power_save;      ///< Modem power save of the station
+} activity_profile_t;
+
+/**
+ * @brief Apply the profile of every activity state from now on.
+ *
+ * The publishing task is woken on every state change, so a state with a shorter publish interval
+ * takes effect at once instead of after the pause of the previous one. Call it before start_gy86_sampling().
+ *
+ * @param publisher Task that waits with wait_for_next_publish().
+ */
+void activity_profiles_start(TaskHandle_t publisher);
+
+/**
+ * @brief Turn adapting to the activity state on or off.
+ *
+ * Applies the power save of the current state, or WIFI_POWER_SAVE when turned off, and wakes the
+ * publishing task so its publish interval changes at once.
+ *
+ * @param enabled true to adapt the barometer rate, the publish interval and the power save.
+ */
+void set_activity_adaptive(bool enabled);
+
+/**
+ * @brief Set the profile of an activity state.
+ * @param state Activity state.
+ * @param profile Profile, copied.
+ */
+void set_activity_profile(gy86_activity_state_t state, const activity_profile_t *profile);
+
+/**
+ * @brief Get the profile of an activity state.
+ * @param state Activity state.
+ * @return Profile of the state.
+ */
+activity_profile_t get_activity_profile(gy86_activity_state_t state);
+
+/**
+ * @brief Wait for the next publish of the main loop.
+ *
+ * Waits for the publish interval of the current activity state bounded by get_device_publish_interval_ms(),
+ * or for the latter while adaptation is disabled, and returns early when the state changes.
+ *
+ * @return true if the wait ended with a state change.
+ */
+bool wait_for_next_publish(void);
+
+/**
+ * @brief Publish the activity state, its features, the transitions and the time spent per state.
+ * @param client MQTT client handle.
+ * @param topic MQTT topic to publish on.
+ */
+void send_activity_report(esp_mqtt_client_handle_t client, const char *topic);
+
+#endif //ESP_GYRO_ACTIVITY_PROFILE_H
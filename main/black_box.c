@@ -0,0 +1,123 @@
+#include "black_box.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/task.h"
+
+/* Notification bits of the upload task */
+#define BLACK_BOX_NOTIFY_CONFIRMED  (1 << 0)    ///< The broker acknowledged the outstanding chunk
+#define BLACK_BOX_NOTIFY_DROPPED    (1 << 1)    ///< The outstanding chunk was lost on its way
+
+static TaskHandle_t black_box_task_handle = NULL;
+static esp_mqtt_client_handle_t black_box_client = NULL;
+static const char *black_box_topic = NULL;
+static uint8_t black_box_chunk[BLACK_BOX_CHUNK_SIZE];
+
+/**
+ * @brief Trigger a capture on every message of the command topic.
+ */
+static void black_box_command_handler(esp_mqtt_client_handle_t client, const char *topic, const char *data,
+                                      int length, void *arg) {
+    if (gy86_capture_trigger(GY86_CAPTURE_REASON_COMMAND, esp_timer_get_time())) {
+        ESP_LOGI("GY86", "Capture requested");
+    } else {
+        ESP_LOGW("GY86", "Capture request ignored, a capture is running or not uploaded yet");
+    }
+}
+
+/**
+ * @brief Tell the upload task the outcome of its outstanding chunk.
+ * @param delivery Outcome of the chunk.
+ * @param arg Unused.
+ */
+static void black_box_delivered(mqtt_delivery_t delivery, void *arg) {
+    xTaskNotify(black_box_task_handle,
+                delivery == MQTT_DELIVERY_CONFIRMED ? BLACK_BOX_NOTIFY_CONFIRMED : BLACK_BOX_NOTIFY_DROPPED, eSetBits);
+}
+
+/**
+ * @brief Publish a chunk until the broker has acknowledged it.
+ * @param chunk Encoded chunk, kept until it is acknowledged.
+ * @param length Length of the chunk in bytes.
+ */
+static void publish_chunk(const uint8_t *chunk, size_t length) {
+    while (1) {
+        if (mqtt_can_publish(black_box_client, MQTT_CLASS_CAPTURE, (int)length) &&
+            mqtt_publish_tracked(black_box_client, black_box_topic, (const char *)chunk, (int)length,
+                                 MQTT_CLASS_CAPTURE, 0, black_box_delivered, NULL) >= 0) {
+            // The outcome always follows an accepted publish
+            uint32_t outcome = 0;
+            xTaskNotifyWait(0, UINT32_MAX, &outcome, portMAX_DELAY);
+            if (outcome & BLACK_BOX_NOTIFY_CONFIRMED) {
+                return;
+            }
+            ESP_LOGW("GY86", "Capture chunk lost, sending it again");
+        }
+        vTaskDelay(pdMS_TO_TICKS(BLACK_BOX_RETRY_MS));
+    }
+}
+
+/**
+ * @brief Encode and publish a frozen capture chunk by chunk.
+ * @param window Window of the capture.
+ */
+static void upload_capture(const gy86_capture_window_t *window) {
+    // The low 32 bits, like the sample times; the wall clock time below is the absolute one
+    gy86_capture_header_t header = {
+            .reason = window->reason,
+            .capture_id = window->capture_id,
+            .trigger_time_us = (uint32_t)window->trigger_us,
+    };
+    if (!mqtt_wall_clock_ms(window->trigger_us, &header.trigger_wall_ms)) {
+        header.trigger_wall_ms = 0;
+    }
+
+    uint32_t index = 0;
+    size_t bytes = 0;
+    do {
+        gy86_capture_encoder_t encoder;
+        gy86_capture_encoder_begin(&encoder, black_box_chunk, sizeof(black_box_chunk), &header);
+        while (index < window->count && gy86_capture_encoder_add(&encoder, gy86_capture_sample(window, index))) {
+            index++;
+        }
+        size_t length = gy86_capture_encoder_finish(&encoder, index == window->count);
+
+        publish_chunk(black_box_chunk, length);
+        header.chunk_index++;
+        bytes += length;
+    } while (index < window->count);
+
+    ESP_LOGI("GY86", "Capture %lu uploaded: %lu samples, %u chunks, %u bytes (%u raw)",
+             (unsigned long)window->capture_id, (unsigned long)window->count, (unsigned)header.chunk_index,
+             (unsigned)bytes, (unsigned)(window->count * sizeof(gy86_capture_sample_t)));
+}
+
+/**
+ * @brief Task uploading captures as the sampling task freezes them.
+ * @param arg Unused.
+ */
+static void black_box_task(void *arg) {
+    gy86_capture_window_t window;
+
+    while (1) {
+        if (gy86_capture_take(&window, portMAX_DELAY)) {
+            upload_capture(&window);
+            gy86_capture_release();
+        }
+    }
+}
+
+esp_err_t start_black_box_upload(esp_mqtt_client_handle_t client, const char *topic, const char *command_topic) {
+    if (black_box_task_handle != NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    black_box_client = client;
+    black_box_topic = topic;
+    if (xTaskCreate(black_box_task, "black_box", BLACK_BOX_TASK_STACK, NULL, BLACK_BOX_TASK_PRIORITY,
+                    &black_box_task_handle) != pdPASS) {
+        black_box_task_handle = NULL;
+        ESP_LOGE("GY86", "Failed to start the black box task");
+        return ESP_ERR_NO_MEM;
+    }
+    return mqtt_subscribe_handler(client, command_topic, 1, black_box_command_handler, NULL);
+}
@@ -0,0 +1,36 @@
+#ifndef ESP_GYRO_BLACK_BOX_H
+#define ESP_GYRO_BLACK_BOX_H
+
+#include "esp_err.h"
+#include "../components/GY-86/gy86_capture.h"
+#include "../components/ESP32_Mqtt_custom/ESP32_Mqtt_custom.h"
+
+/**
+ * @file black_box.h
+ * @brief Uploads the black box captures of gy86_capture.h and takes capture requests over MQTT.
+ */
+
+#define BLACK_BOX_CHUNK_SIZE        1024    ///< Static buffer for one chunk in bytes
+#define BLACK_BOX_RETRY_MS          500     ///< Pause before a chunk is offered again after it was refused or lost
+#define BLACK_BOX_TASK_STACK        3072    ///< Stack size of the upload task in bytes
+#define BLACK_BOX_TASK_PRIORITY     2       ///< FreeRTOS priority of the upload task, below the sampling task
+
+/**
+ * @brief Start the task that uploads every frozen capture and subscribe to capture requests.
+ *
+ * A capture is encoded chunk by chunk into a static buffer straight from the ring and published as
+ * MQTT_CLASS_CAPTURE. It shares the bulk lane with live data and backfill in the order the messages are
+ * queued, but is admitted up to a larger share of the outbox than backfill, so a backlog drain that
+ * fills its share holds back its own batches and not the capture. The next chunk is only encoded once
+ * the broker has acknowledged the current one; a chunk that is refused or lost is sent again. The ring
+ * stays frozen meanwhile and is released once the last chunk is acknowledged. Any message on
+ * command_topic triggers a capture centered on its arrival; it should not be retained.
+ *
+ * @param client MQTT client handle.
+ * @param topic MQTT topic to publish the chunks on.
+ * @param command_topic MQTT topic of capture requests, must stay valid.
+ * @return ESP_OK, ESP_ERR_INVALID_STATE if already running, or ESP_ERR_NO_MEM.
+ */
+esp_err_t start_black_box_upload(esp_mqtt_client_handle_t client, const char *topic, const char *command_topic);
+
+#endif //ESP_GYRO_BLACK_BOX_H
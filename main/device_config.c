@@ -0,0 +1,172 @@
+#include "device_config.h"
+#include "math.h"
+#include "activity_profile.h"
+#include "../components/GY-86/gy86_data.h"
+#include "../components/GY-86/gy86_stats.h"
+#include "../components/GY-86/gy86_activity.h"
+#include "../components/GY-86/gy86_events.h"
+#include "../components/GY-86/gy86_capture.h"
+#include "../components/GY-86/gy86_topics.h"
+#include "../components/ESP32_Backlog_custom/ESP32_Backlog_custom.h"
+#include "../components/ESP32_Mqtt_custom/mqtt_lanes.h"
+
+static uint32_t publish_interval_ms = DEVICE_PUBLISH_INTERVAL_MS;
+
+static const char *const payload_format_names[] = {"json", "packed"};
+
+uint32_t get_device_publish_interval_ms(void) {
+    return publish_interval_ms;
+}
+
+// Adapters between the config_param_t accessors and the component setters
+
+static int32_t get_publish_interval(void) { return (int32_t)publish_interval_ms; }
+static void set_publish_interval(int32_t value) { publish_interval_ms = (uint32_t)value; }
+
+static int32_t get_sample_period(void) { return (int32_t)get_gy86_sample_period_ms(); }
+static void set_sample_period(int32_t value) { set_gy86_sample_period_ms((uint32_t)value); }
+
+static int32_t get_adaptive(void) { return get_gy86_activity_enabled(); }
+static void set_adaptive(int32_t value) { set_activity_adaptive(value != 0); }
+
+/**
+ * @brief Set the publish interval of an activity state, keeping its power save.
+ * @param state Activity state.
+ * @param interval_ms Publish interval in milliseconds.
+ */
+static void set_state_publish_interval(gy86_activity_state_t state, int32_t interval_ms) {
+    activity_profile_t profile = get_activity_profile(state);
+    profile.publish_interval_ms = (uint32_t)interval_ms;
+    set_activity_profile(state, &profile);
+}
+
+/**
+ * @brief Set the barometer divider of an activity state, keeping its thresholds.
+ * @param state Activity state.
+ * @param divider IMU samples per barometer sample.
+ */
+static void set_state_baro_divider(gy86_activity_state_t state, int32_t divider) {
+    gy86_activity_level_t level = get_gy86_activity_level(state);
+    level.baro_divider = (uint32_t)divider;
+    set_gy86_activity_level(state, &level);
+}
+
+static int32_t get_idle_publish(void) { return (int32_t)get_activity_profile(GY86_ACTIVITY_IDLE).publish_interval_ms; }
+static void set_idle_publish(int32_t value) { set_state_publish_interval(GY86_ACTIVITY_IDLE, value); }
+
+static int32_t get_active_publish(void) { return (int32_t)get_activity_profile(GY86_ACTIVITY_ACTIVE).publish_interval_ms; }
+static void set_active_publish(int32_t value) { set_state_publish_interval(GY86_ACTIVITY_ACTIVE, value); }
+
+static int32_t get_moving_publish(void) { return (int32_t)get_activity_profile(GY86_ACTIVITY_MOVING).publish_interval_ms; }
+static void set_moving_publish(int32_t value) { set_state_publish_interval(GY86_ACTIVITY_MOVING, value); }
+
+static int32_t get_idle_baro(void) { return (int32_t)get_gy86_activity_level(GY86_ACTIVITY_IDLE).baro_divider; }
+static void set_idle_baro(int32_t value) { set_state_baro_divider(GY86_ACTIVITY_IDLE, value); }
+
+static int32_t get_active_baro(void) { return (int32_t)get_gy86_activity_level(GY86_ACTIVITY_ACTIVE).baro_divider; }
+static void set_active_baro(int32_t value) { set_state_baro_divider(GY86_ACTIVITY_ACTIVE, value); }
+
+static int32_t get_moving_baro(void) { return (int32_t)get_gy86_activity_level(GY86_ACTIVITY_MOVING).baro_divider; }
+static void set_moving_baro(int32_t value) { set_state_baro_divider(GY86_ACTIVITY_MOVING, value); }
+
+static int32_t get_baro_divider(void) { return (int32_t)get_gy86_baro_divider(); }
+static void set_baro_divider(int32_t value) { set_gy86_baro_divider((uint32_t)value); }
+
+static int32_t get_stats_window(void) { return (int32_t)get_gy86_stats_window_ms(); }
+static void set_stats_window(int32_t value) { set_gy86_stats_window_ms((uint32_t)value); }
+
+static int32_t get_backfill_interval(void) { return (int32_t)get_backlog_backfill_interval_ms(); }
+static void set_backfill_interval(int32_t value) { set_backlog_backfill_interval_ms((uint32_t)value); }
+
+/**
+ * @brief Change one event threshold, keeping the others.
+ * @param member Threshold to change.
+ * @param value New value.
+ */
+#define SET_EVENT_THRESHOLD(member, value) do { \
+        gy86_event_thresholds_t thresholds = get_gy86_event_thresholds(); \
+        thresholds.member = (value); \
+        set_gy86_event_thresholds(&thresholds); \
+    } while (0)
+
+static int32_t get_free_fall_mg(void) { return (int32_t)lroundf(get_gy86_event_thresholds().free_fall_g * 1000); }
+static void set_free_fall_mg(int32_t value) { SET_EVENT_THRESHOLD(free_fall_g, value / 1000.0f); }
+
+static int32_t get_free_fall_ms(void) { return (int32_t)get_gy86_event_thresholds().free_fall_ms; }
+static void set_free_fall_ms(int32_t value) { SET_EVENT_THRESHOLD(free_fall_ms, (uint32_t)value); }
+
+static int32_t get_shock_mg(void) { return (int32_t)lroundf(get_gy86_event_thresholds().shock_g * 1000); }
+static void set_shock_mg(int32_t value) { SET_EVENT_THRESHOLD(shock_g, value / 1000.0f); }
+
+static int32_t get_jerk(void) { return (int32_t)get_gy86_event_thresholds().jerk_g_per_s; }
+static void set_jerk(int32_t value) { SET_EVENT_THRESHOLD(jerk_g_per_s, (float)value); }
+
+static int32_t get_tap_mg(void) { return (int32_t)lroundf(get_gy86_event_thresholds().tap_g * 1000); }
+static void set_tap_mg(int32_t value) { SET_EVENT_THRESHOLD(tap_g, value / 1000.0f); }
+
+static int32_t get_tilt_deg(void) { return (int32_t)get_gy86_event_thresholds().tilt_deg; }
+static void set_tilt_deg(int32_t value) { SET_EVENT_THRESHOLD(tilt_deg, (float)value); }
+
+static int32_t get_capture_pre(void) { return (int32_t)get_gy86_capture_pre_ms(); }
+static void set_capture_pre(int32_t value) { set_gy86_capture_pre_ms((uint32_t)value); }
+
+static int32_t get_capture_post(void) { return (int32_t)get_gy86_capture_post_ms(); }
+static void set_capture_post(int32_t value) { set_gy86_capture_post_ms((uint32_t)value); }
+
+static int32_t get_capture_events(void) { return (int32_t)get_gy86_capture_trigger_events(); }
+static void set_capture_events(int32_t value) { set_gy86_capture_trigger_events((uint32_t)value); }
+
+/**
+ * @brief Set the QoS of a message class, keeping the rest of its policy.
+ * @param message_class Message class.
+ * @param qos MQTT QoS level.
+ */
+static void set_class_qos(mqtt_message_class_t message_class, int32_t qos) {
+    mqtt_publish_policy_t policy = get_mqtt_publish_policy(message_class);
+    policy.qos = qos;
+    set_mqtt_publish_policy(message_class, &policy);
+}
+
+static int32_t get_telemetry_qos(void) { return get_mqtt_publish_policy(MQTT_CLASS_TELEMETRY).qos; }
+static void set_telemetry_qos(int32_t value) { set_class_qos(MQTT_CLASS_TELEMETRY, value); }
+
+static int32_t get_state_qos(void) { return get_mqtt_publish_policy(MQTT_CLASS_STATE).qos; }
+static void set_state_qos(int32_t value) { set_class_qos(MQTT_CLASS_STATE, value); }
+
+static int32_t get_bulk_share(void) { return get_mqtt_bulk_share(); }
+static void set_bulk_share(int32_t value) { set_mqtt_bulk_share((uint8_t)value); }
+
+static int32_t get_telemetry_format(void) { return get_mqtt_payload_format(gy86_get_topics()->telemetry); }
+static void set_telemetry_format(int32_t value) { set_mqtt_payload_format(gy86_get_topics()->telemetry, (mqtt_payload_format_t)value); }
+
+const config_param_t device_config_params[] = {
+        {"publish_ms",      1000, 3600000, NULL,                 get_publish_interval,  set_publish_interval},
+        {"sample_ms",       10,   10000,   NULL,                 get_sample_period,     set_sample_period},
+        {"baro_divider",    1,    100,     NULL,                 get_baro_divider,      set_baro_divider},
+        {"adaptive",        0,    1,       NULL,                 get_adaptive,          set_adaptive},
+        {"idle_pub_ms",     100,  3600000, NULL,                 get_idle_publish,      set_idle_publish},
+        {"active_pub_ms",   0,    3600000, NULL,                 get_active_publish,    set_active_publish},
+        {"moving_pub_ms",   100,  3600000, NULL,                 get_moving_publish,    set_moving_publish},
+        {"idle_baro_div",   1,    100,     NULL,                 get_idle_baro,         set_idle_baro},
+        {"active_baro_div", 0,    100,     NULL,                 get_active_baro,       set_active_baro},
+        {"moving_baro_div", 1,    100,     NULL,                 get_moving_baro,       set_moving_baro},
+        {"free_fall_mg",    50,   900,     NULL,                 get_free_fall_mg,      set_free_fall_mg},
+        {"free_fall_ms",    20,   2000,    NULL,                 get_free_fall_ms,      set_free_fall_ms},
+        {"shock_mg",        500,  3500,    NULL,                 get_shock_mg,          set_shock_mg},
+        {"jerk_g_s",        1,    1000,    NULL,                 get_jerk,              set_jerk},
+        {"tap_mg",          50,   2000,    NULL,                 get_tap_mg,            set_tap_mg},
+        {"tilt_deg",        5,    90,      NULL,                 get_tilt_deg,          set_tilt_deg},
+        {"capture_pre_ms",  0,    60000,   NULL,                 get_capture_pre,       set_capture_pre},
+        {"capture_post_ms", 0,    60000,   NULL,                 get_capture_post,      set_capture_post},
+        {"capture_events",  0,    (1 << GY86_EVENT_COUNT) - 1, NULL,
+                                                                 get_capture_events,    set_capture_events},
+        {"stats_window_ms", 1000, 3600000, NULL,                 get_stats_window,      set_stats_window},
+        {"backfill_ms",     10,   60000,   NULL,                 get_backfill_interval, set_backfill_interval},
+        {"telemetry_qos",   0,    2,       NULL,                 get_telemetry_qos,     set_telemetry_qos},
+        {"state_qos",       0,    2,       NULL,                 get_state_qos,         set_state_qos},
+        {"bulk_share",      1,    100,     NULL,                 get_bulk_share,        set_bulk_share},
+        {"telemetry_fmt",   MQTT_PAYLOAD_FORMAT_JSON, MQTT_PAYLOAD_FORMAT_PACKED, payload_format_names,
+                                                                 get_telemetry_format,  set_telemetry_format},
+};
+
+const size_t device_config_param_count = sizeof(device_config_params) / sizeof(device_config_params[0]);
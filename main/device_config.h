@@ -0,0 +1,30 @@
+#ifndef ESP_GYRO_DEVICE_CONFIG_H
+#define ESP_GYRO_DEVICE_CONFIG_H
+
+#include "stdint.h"
+#include "../components/ESP32_Config_custom/ESP32_Config_custom.h"
+
+/**
+ * @file device_config.h
+ * @brief Parameters of the firmware that can be tuned over the command topic.
+ */
+
+#define DEVICE_PUBLISH_INTERVAL_MS  20000   ///< Default pause of the main loop between two publishes
+
+/**
+ * @brief Parameter table for config_init().
+ */
+extern const config_param_t device_config_params[];
+
+/**
+ * @brief Number of entries in device_config_params.
+ */
+extern const size_t device_config_param_count;
+
+/**
+ * @brief Get the pause of the main loop between two publishes.
+ * @return Pause in milliseconds.
+ */
+uint32_t get_device_publish_interval_ms(void);
+
+#endif //ESP_GYRO_DEVICE_CONFIG_H
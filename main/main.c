@@ -1,13 +1,22 @@
 #include <stdio.h>
 #include <nvs_flash.h>
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
 #include "../components/ESP32_I2C_custom/ESP32_I2C_custom.h"
 #include "../components/ESP32_Wifi_custom/ESP32_Wifi_custom.h"
 #include "../components/GY-86/gy86_data.h"
+#include "../components/GY-86/gy86_stats.h"
+#include "../components/GY-86/gy86_topics.h"
 #include "../components/ESP32_Mqtt_custom/ESP32_Mqtt_custom.h"
+#include "../components/ESP32_Backlog_custom/ESP32_Backlog_custom.h"
+#include "../components/ESP32_Config_custom/ESP32_Config_custom.h"
+#include "device_config.h"
+#include "activity_profile.h"
+#include "motion_events.h"
+#include "black_box.h"
 
 /**
  * @file main.c
@@ -17,19 +26,32 @@
  * It periodically reads sensor data and publishes it to an MQTT broker.
  */
 
+/**
+ * @brief Keep a telemetry frame that was dropped after it was queued, so the backfilled series has no gap.
+ * @param message_class MQTT_CLASS_TELEMETRY.
+ * @param data Packed frame.
+ * @param length Length of the frame in bytes.
+ * @param arg Unused.
+ */
+static void keep_dropped_telemetry(mqtt_message_class_t message_class, const char *data, int length, void *arg) {
+    backlog_push((const uint8_t *)data, (size_t)length);
+}
+
 /**
  * @brief Main application entry point.
  *
- * This function initializes the I2C bus, GY-86 sensor suite, NVS, WiFi, and MQTT. It then enters a loop
- * where it periodically reads sensor data from the GY-86 sensors and publishes the data to an MQTT broker.
+ * This function initializes the I2C bus, GY-86 sensor suite, NVS, WiFi, and MQTT. The sensors are sampled
+ * by a background task; the main loop periodically takes the newest snapshot and publishes it to an MQTT broker.
  */
 void app_main() {
     // I2C bus handle
     i2c_master_bus_handle_t bus_handle = NULL;
     i2c_master_init(&bus_handle);
 
-    // Initialize GY-86 sensor suite
+    // Initialize GY-86 sensor suite and start sampling it in the background, at the rates of the activity state
     init_gy86_module(bus_handle);
+    activity_profiles_start(xTaskGetCurrentTaskHandle());
+    start_gy86_sampling(GY86_SAMPLE_PERIOD_MS);
 
     // Initialize NVS (necessary for WiFi)
     esp_err_t ret = nvs_flash_init();
@@ -39,24 +61,99 @@ void app_main() {
     }
     ESP_ERROR_CHECK(ret);
 
-    // Initialize WiFi in station mode
+    // Derive the device identity from the MAC address and build every topic once
+    ESP_ERROR_CHECK(gy86_topics_init());
+    const gy86_topics_t *topics = gy86_get_topics();
+
+    // Keep frames that cannot be published, recovering what is left from before a reset
+    ESP_ERROR_CHECK(backlog_init());
+
+    // Initialize WiFi in station mode and give it a chance to connect before MQTT starts
     wifi_init_sta();
+    if (!wifi_wait_for_ip(WIFI_CONNECT_TIMEOUT_MS)) {
+        ESP_LOGW("MAIN", "No IP address yet, starting offline");
+    }
+
+    // Wall-clock time lets every published frame carry its sample and publish time
+    wifi_start_time_sync(WIFI_SNTP_SERVER);
 
     // Initialize and start MQTT client
     esp_mqtt_client_handle_t mqttClientHandle;
     mqttClientHandle = mqtt_app_start();
 
+    // Publish one batched document per cycle, discovery points every sensor at it
+    set_mqtt_state_mode(MQTT_STATE_MODE_BATCHED);
+    set_mqtt_device_state_topic(topics->device_state);
+
+    // The ingest pipeline gets packed binary frames instead of JSON, sent as droppable QoS 0 telemetry
+    set_mqtt_payload_format(topics->telemetry, MQTT_PAYLOAD_FORMAT_PACKED);
+    set_mqtt_topic_class(topics->telemetry, MQTT_CLASS_TELEMETRY);
+    set_mqtt_drop_handler(MQTT_CLASS_TELEMETRY, keep_dropped_telemetry, NULL);
+
+    // Values tuned over the command topic override the defaults set above
+    config_init(device_config_params, device_config_param_count);
+    start_config_commands(mqttClientHandle, topics->command, topics->command_response);
+
+    // Publish free fall, shocks, taps and tilt the moment the sampling task detects them
+    start_motion_event_publisher(mqttClientHandle, topics->event);
+
+    // Upload the seconds around free fall, shocks and requested captures from the black box ring
+    start_black_box_upload(mqttClientHandle, topics->capture, topics->capture_command);
+
+    // Send what was recorded while offline, throttled so live frames go first
+    start_backlog_backfill(mqttClientHandle, topics->backfill);
+
+    // Announce all channels in one device discovery message, MQTT_DISCOVERY_MODE_ENTITY for older Home Assistant
+    set_mqtt_discovery_mode(MQTT_DISCOVERY_MODE_DEVICE);
+
     // Send sensor discovery messages to MQTT broker
     send_all_sensor_discoveries(mqttClientHandle, sensor_configs, NUM_SENSORS);
 
+    sensor_snapshot_t snapshot;
+    sensor_stats_window_t stats_window;
+    uint32_t last_stats_sequence = 0;
+    int64_t last_diagnostics_us = 0;
+    bool activity_changed = false;
     while (1) {
-        int sensor_count;
-        // Get sensor data from GY-86 sensor suite
-        sensor_data_t *sensor_data = get_sensor_data(&sensor_count);
-        // Send sensor data to MQTT broker
-        send_sensor_data_array(mqttClientHandle, sensor_data, sensor_count);
-
-        // Delay for 20 seconds
-        vTaskDelay(pdMS_TO_TICKS(20000));
+        // Copy the newest consistent frame from the sampling task and send it to the MQTT broker
+        if (gy86_snapshot_read(&snapshot)) {
+            // Skip what the pipeline would drop anyway instead of feeding a dead socket
+            if (mqtt_can_publish(mqttClientHandle, MQTT_CLASS_STATE, MQTT_JSON_BUFFER_SIZE)) {
+                send_sensor_frame(mqttClientHandle, sensor_fields, NUM_SENSORS, &snapshot,
+                                  snapshot.sequence, snapshot.timestamp_us);
+            }
+            if (!mqtt_can_publish(mqttClientHandle, MQTT_CLASS_TELEMETRY, MQTT_PACKED_BUFFER_SIZE) ||
+                send_sensor_record(mqttClientHandle, topics->telemetry, sensor_fields, NUM_SENSORS, &snapshot,
+                                   snapshot.sequence, snapshot.timestamp_us) < 0) {
+                // Offline or dropped, record it for backfill so the series has no gap
+                backlog_push_frame(sensor_fields, NUM_SENSORS, &snapshot, snapshot.sequence, snapshot.timestamp_us);
+            }
+        }
+
+        // Send the summary of every sample taken since the last closed window, and how many windows were missed
+        if (gy86_stats_read_window(&stats_window) && stats_window.sequence != last_stats_sequence &&
+            mqtt_can_publish(mqttClientHandle, MQTT_CLASS_STATS, MQTT_STATS_BUFFER_SIZE)) {
+            uint32_t skipped_windows = stats_window.sequence - last_stats_sequence - 1;
+            last_stats_sequence = stats_window.sequence;
+            send_sensor_stats(mqttClientHandle, topics->stats, sensor_fields, stats_window.channels, NUM_SENSORS,
+                              (uint32_t)((stats_window.end_us - stats_window.start_us) / 1000), skipped_windows);
+        }
+
+        // Report how the MQTT pipeline is doing, for tuning QoS, batching and keepalive
+        if (esp_timer_get_time() - last_diagnostics_us >= (int64_t)MQTT_DIAGNOSTICS_PERIOD_MS * 1000 &&
+            mqtt_can_publish(mqttClientHandle, MQTT_CLASS_STATS, MQTT_DIAGNOSTICS_BUFFER_SIZE)) {
+            last_diagnostics_us = esp_timer_get_time();
+            send_mqtt_diagnostics(mqttClientHandle, topics->diagnostics);
+            activity_changed = true;
+        }
+
+        // Report every activity change, and the time per state along with the diagnostics
+        if (activity_changed && mqtt_can_publish(mqttClientHandle, MQTT_CLASS_STATS, ACTIVITY_REPORT_BUFFER_SIZE)) {
+            send_activity_report(mqttClientHandle, topics->activity);
+            activity_changed = false;
+        }
+
+        // Wait for the next publish, the activity state sets the interval and cuts the wait short when it changes
+        activity_changed |= wait_for_next_publish();
     }
 }
@@ -0,0 +1,74 @@
+#include "motion_events.h"
+#include "esp_log.h"
+#include "freertos/task.h"
+#include "../components/ESP32_Mqtt_custom/json_writer.h"
+
+static TaskHandle_t motion_event_task_handle = NULL;
+static esp_mqtt_client_handle_t motion_event_client = NULL;
+static const char *motion_event_topic = NULL;
+
+/**
+ * @brief Publish one event.
+ * @param event Detected event.
+ */
+static void publish_motion_event(const gy86_event_t *event) {
+    char message[MOTION_EVENT_BUFFER_SIZE];
+    json_writer_t writer;
+
+    json_writer_init(&writer, message, sizeof(message), false);
+    json_writer_begin_object(&writer, NULL);
+    json_writer_string(&writer, "type", gy86_event_name(event->type));
+    json_writer_int(&writer, "seq", event->sequence);
+    int64_t wall_ms;
+    if (mqtt_wall_clock_ms(event->timestamp_us, &wall_ms)) {
+        json_writer_int(&writer, "ts", wall_ms);
+    }
+    json_writer_int(&writer, "uptime_ms", event->timestamp_us / 1000);
+    if (event->type == GY86_EVENT_TILT) {
+        json_writer_int(&writer, "tilted", event->tilted);
+        json_writer_decimal(&writer, "angle", event->angle_deg, 1);
+    } else {
+        json_writer_int(&writer, "duration_ms", event->duration_ms);
+        json_writer_decimal(&writer, "peak_g", event->peak_g, 2);
+        if (event->type != GY86_EVENT_FREE_FALL) {
+            json_writer_decimal(&writer, "peak_jerk", event->peak_jerk_g_per_s, 1);
+        }
+    }
+    json_writer_end_object(&writer);
+
+    if (json_writer_finish(&writer) != NULL) {
+        mqtt_publish_message(motion_event_client, motion_event_topic, message, (int)writer.length, MQTT_CLASS_EVENT,
+                             event->timestamp_us);
+    }
+}
+
+/**
+ * @brief Task publishing events as soon as the sampling task queues them.
+ * @param arg Unused.
+ */
+static void motion_event_task(void *arg) {
+    gy86_event_t event;
+
+    while (1) {
+        if (gy86_event_receive(&event, portMAX_DELAY)) {
+            ESP_LOGI("GY86", "Motion event %s", gy86_event_name(event.type));
+            publish_motion_event(&event);
+        }
+    }
+}
+
+esp_err_t start_motion_event_publisher(esp_mqtt_client_handle_t client, const char *topic) {
+    if (motion_event_task_handle != NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    motion_event_client = client;
+    motion_event_topic = topic;
+    if (xTaskCreate(motion_event_task, "motion_events", MOTION_EVENT_TASK_STACK, NULL, MOTION_EVENT_TASK_PRIORITY,
+                    &motion_event_task_handle) != pdPASS) {
+        motion_event_task_handle = NULL;
+        ESP_LOGE("GY86", "Failed to start the motion event task");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,30 @@
+#ifndef ESP_GYRO_MOTION_EVENTS_H
+#define ESP_GYRO_MOTION_EVENTS_H
+
+#include "esp_err.h"
+#include "../components/GY-86/gy86_events.h"
+#include "../components/ESP32_Mqtt_custom/ESP32_Mqtt_custom.h"
+
+/**
+ * @file motion_events.h
+ * @brief Publishes the motion events of gy86_events.h as they are detected.
+ */
+
+#define MOTION_EVENT_BUFFER_SIZE    256     ///< Stack buffer for an event message in bytes
+#define MOTION_EVENT_TASK_STACK     3072    ///< Stack size of the event task in bytes
+#define MOTION_EVENT_TASK_PRIORITY  6       ///< FreeRTOS priority of the event task, above the sampling task
+
+/**
+ * @brief Start the task that publishes every detected event as its own message.
+ *
+ * Events go out as MQTT_CLASS_EVENT, which takes the urgent lane past bulk telemetry. Each message carries
+ * the event type, the frame sequence number, the start time ("ts" in Unix milliseconds once the wall clock
+ * is set, "uptime_ms" always) and the peak values of the event.
+ *
+ * @param client MQTT client handle.
+ * @param topic MQTT topic to publish on.
+ * @return ESP_OK, ESP_ERR_INVALID_STATE if already running, or ESP_ERR_NO_MEM.
+ */
+esp_err_t start_motion_event_publisher(esp_mqtt_client_handle_t client, const char *topic);
+
+#endif //ESP_GYRO_MOTION_EVENTS_H
@@ -0,0 +1,147 @@
+/**
+ * @file capture_decode.c
+ * @brief Convert uploaded black box captures to CSV.
+ *
+ * Reads concatenated capture chunks, e.g. captured with
+ * `mosquitto_sub -t homeassistant/sensor/GY86_240AC4A1B2C3/capture -N > capture.bin`, and prints one CSV
+ * row per sample. Time is given relative to the trigger, so the pre-trigger part is negative. The
+ * device times are the low 32 bits of its microsecond timer and wrap every 71.6 minutes, so they are
+ * only subtracted modulo 2^32; trigger_ms, the wall clock time, is the absolute time of a capture. Chunks
+ * missing from a capture are reported on stderr, the samples of the others are still printed.
+ *
+ * Usage: capture_decode [file ...]
+ */
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "gy86_capture_codec.h"
+
+#define DECODE_READ_CHUNK   4096    ///< Bytes read from the input at a time
+
+/**
+ * @brief Append a whole stream to a growing buffer.
+ * @param stream Input stream.
+ * @param data Buffer, reallocated as needed.
+ * @param length Number of bytes in the buffer, updated.
+ * @return 0 on success, -1 on a read or allocation error.
+ */
+static int read_stream(FILE *stream, uint8_t **data, size_t *length) {
+    size_t capacity = *length;
+    while (1) {
+        if (capacity - *length < DECODE_READ_CHUNK) {
+            capacity = (capacity + DECODE_READ_CHUNK) * 2;
+            uint8_t *grown = realloc(*data, capacity);
+            if (grown == NULL) {
+                return -1;
+            }
+            *data = grown;
+        }
+        size_t count = fread(*data + *length, 1, DECODE_READ_CHUNK, stream);
+        *length += count;
+        if (count < DECODE_READ_CHUNK) {
+            return ferror(stream) ? -1 : 0;
+        }
+    }
+}
+
+static const char *reason_text(uint8_t reason) {
+    // gy86_event_type_t order, see gy86_events.h
+    static const char *const event_names[] = {"free_fall", "shock", "tap", "tilt"};
+    if (reason == GY86_CAPTURE_REASON_COMMAND) {
+        return "command";
+    }
+    return reason < sizeof(event_names) / sizeof(event_names[0]) ? event_names[reason] : "unknown";
+}
+
+static const char *status_text(gy86_capture_status_t status) {
+    switch (status) {
+        case GY86_CAPTURE_ERR_TRUNCATED: return "truncated chunk";
+        case GY86_CAPTURE_ERR_VERSION:   return "unsupported format version";
+        case GY86_CAPTURE_ERR_SPACE:     return "out of memory";
+        default:                         return "ok";
+    }
+}
+
+static void print_sample(const gy86_capture_header_t *header, const gy86_capture_sample_t *sample) {
+    // Wrapping subtraction, correct across a wrap of the 32 bit device time
+    int32_t since_trigger_us = (int32_t)(sample->time_us - header->trigger_time_us);
+
+    printf("%lu,%s,%lld,%.3f,%d,%d,%d,%d,%d,%d,%d,%d,%d,%.2f,%.3f,%u\n",
+           (unsigned long)header->capture_id, reason_text(header->reason),
+           header->trigger_wall_ms != 0 ? (long long)header->trigger_wall_ms : -1LL,
+           since_trigger_us / 1000.0,
+           sample->accel[0], sample->accel[1], sample->accel[2],
+           sample->gyro[0], sample->gyro[1], sample->gyro[2],
+           sample->mag[0], sample->mag[1], sample->mag[2],
+           sample->temperature / 100.0, sample->pressure / 1000.0, sample->fresh);
+}
+
+int main(int argc, char **argv) {
+    uint8_t *data = NULL;
+    size_t length = 0;
+
+    if (argc < 2) {
+        if (read_stream(stdin, &data, &length) != 0) {
+            fprintf(stderr, "failed to read stdin\n");
+            return 1;
+        }
+    }
+    for (int i = 1; i < argc; i++) {
+        FILE *file = fopen(argv[i], "rb");
+        if (file == NULL || read_stream(file, &data, &length) != 0) {
+            fprintf(stderr, "failed to read %s\n", argv[i]);
+            return 1;
+        }
+        fclose(file);
+    }
+
+    puts("capture,reason,trigger_ms,t_ms,accel_x,accel_y,accel_z,gyro_x,gyro_y,gyro_z,mag_x,mag_y,mag_z,"
+         "temperature,pressure,fresh");
+
+    gy86_capture_sample_t *samples = malloc(UINT16_MAX * sizeof(gy86_capture_sample_t));
+    gy86_capture_header_t header;
+    uint32_t capture_id = 0;
+    int32_t next_chunk = -1;    ///< Chunk expected next, -1 once the last one was seen
+    size_t offset = 0;
+    while (offset < length) {
+        size_t consumed = 0;
+        gy86_capture_status_t status = samples == NULL ? GY86_CAPTURE_ERR_SPACE :
+                gy86_capture_decode_chunk(data + offset, length - offset, &header, samples, UINT16_MAX, &consumed);
+        if (status != GY86_CAPTURE_OK) {
+            // Chunks have no length prefix, so decoding cannot resume after a bad one
+            fprintf(stderr, "offset %zu: %s\n", offset, status_text(status));
+            free(samples);
+            free(data);
+            return 1;
+        }
+
+        if (header.capture_id != capture_id) {
+            if (next_chunk >= 0) {
+                fprintf(stderr, "capture %lu: last chunk missing\n", (unsigned long)capture_id);
+            }
+            capture_id = header.capture_id;
+            next_chunk = 0;
+        } else if (next_chunk < 0 || header.chunk_index < next_chunk) {
+            // QoS 1 may deliver a chunk twice
+            offset += consumed;
+            continue;
+        }
+        if (header.chunk_index > next_chunk) {
+            fprintf(stderr, "capture %lu: chunks %ld to %u missing\n", (unsigned long)capture_id,
+                    (long)next_chunk, (unsigned)header.chunk_index - 1);
+        }
+        next_chunk = (header.flags & GY86_CAPTURE_FLAG_LAST) ? -1 : header.chunk_index + 1;
+
+        for (uint16_t i = 0; i < header.sample_count; i++) {
+            print_sample(&header, &samples[i]);
+        }
+        offset += consumed;
+    }
+    if (next_chunk >= 0) {
+        fprintf(stderr, "capture %lu: last chunk missing\n", (unsigned long)capture_id);
+    }
+
+    free(samples);
+    free(data);
+    return 0;
+}
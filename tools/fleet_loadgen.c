@@ -0,0 +1,937 @@
+/**
+ * @file fleet_loadgen.c
+ * @brief Simulate a fleet of GY-86 devices publishing to an MQTT broker, for broker and ingest scaling tests.
+ *
+ * Every virtual device has its own MQTT connection, client ID and GY86_<MAC> topic namespace, and publishes
+ * synthetic motion in the real sample frame (sensor_snapshot_t from gy86_data_defs.h). The field table is
+ * expanded from gy86_schema.h and the payloads are written with json_writer and telemetry_codec, so they are
+ * byte-compatible with the firmware: batched JSON state documents with "seq", "frame", "ts" and "pts" (readable
+ * by latency_analyze), or packed telemetry frames (readable by telemetry_decode).
+ *
+ * Devices behave like boards on Wi-Fi: they connect with a ramp, drop their connection without a DISCONNECT
+ * after a random session time, stay offline for a random outage and reconnect with exponential backoff and
+ * jitter when the broker refuses or does not answer. Publishes that do not fit into a device's send buffer
+ * are dropped and counted, like the outbox budget of the firmware.
+ *
+ * The MQTT 3.1.1 client is built in, one thread drives all connections through poll(), so no MQTT library
+ * is needed. More than about 1000 devices need a higher open file limit (`ulimit -n`).
+ *
+ * Usage: fleet_loadgen [-h host] [-p port] [-n devices] [-i interval_ms] [-f json|packed] [-q 0|1]
+ *                      [-d seconds] [-w ramp_seconds] [-s session_seconds] [-o outage_seconds]
+ *                      [-r topic_root] [-S seed]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stdint.h"
+#include "stdbool.h"
+#include "stddef.h"
+#include "math.h"
+#include "time.h"
+#include "errno.h"
+#include "signal.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "poll.h"
+#include "netdb.h"
+#include "sys/socket.h"
+#include "netinet/in.h"
+#include "netinet/tcp.h"
+#include "json_writer.h"
+#include "telemetry_codec.h"
+#include "gy86_data_defs.h"
+
+#define LOADGEN_MAX_DEVICES         20000   ///< Largest fleet simulated
+#define LOADGEN_TX_BUFFER_SIZE      8192    ///< Send buffer of a device in bytes
+#define LOADGEN_RX_BUFFER_SIZE      512     ///< Receive buffer of a device in bytes
+#define LOADGEN_PAYLOAD_SIZE        1024    ///< Largest payload in bytes
+#define LOADGEN_TOPIC_SIZE          160     ///< Largest topic in bytes
+#define LOADGEN_MAX_IN_FLIGHT       32      ///< QoS 1 messages awaiting PUBACK per device
+#define LOADGEN_KEEPALIVE_S         60      ///< MQTT keep-alive in seconds
+#define LOADGEN_CONNECT_TIMEOUT_MS  10000   ///< Time allowed for TCP connect and CONNACK
+#define LOADGEN_BACKOFF_MIN_MS      1000    ///< First reconnect delay after a failed connect
+#define LOADGEN_BACKOFF_MAX_MS      30000   ///< Longest reconnect delay
+#define LOADGEN_REPORT_PERIOD_MS    5000    ///< Period of the progress line
+#define LOADGEN_ACCEL_LSB_PER_G     16384.0 ///< MPU6050 accelerometer sensitivity at +-2 g
+
+#define LOADGEN_FIELD(id, key, device_class, unit, value_type, kind, ctype, member, source, scale, report) \
+    {NULL, #key, value_type, offsetof(sensor_snapshot_t, member), scale, report},
+
+static const sensor_field_t fields[] = { GY86_CHANNELS(LOADGEN_FIELD) };
+#define FIELD_COUNT (sizeof(fields) / sizeof(fields[0]))
+
+/**
+ * @brief Payload format published by the fleet.
+ */
+typedef enum {
+    LOADGEN_FORMAT_JSON,    ///< Batched JSON state document on the state topic
+    LOADGEN_FORMAT_PACKED   ///< Packed telemetry frame on the telemetry topic
+} loadgen_format_t;
+
+/**
+ * @brief Connection state of a virtual device.
+ */
+typedef enum {
+    DEVICE_OFFLINE,     ///< Waiting for next_event_ms to connect
+    DEVICE_CONNECTING,  ///< TCP connect in progress
+    DEVICE_CONNACK,     ///< CONNECT sent, waiting for CONNACK
+    DEVICE_ONLINE       ///< Publishing
+} device_state_t;
+
+/**
+ * @brief QoS 1 message awaiting its PUBACK.
+ */
+typedef struct {
+    uint16_t packet_id;     ///< MQTT packet identifier, 0 if the entry is free
+    double sent_ms;         ///< Time the PUBLISH was queued
+} in_flight_t;
+
+/**
+ * @brief One simulated device.
+ */
+typedef struct {
+    int fd;                                 ///< Socket, -1 while offline
+    device_state_t state;                   ///< Connection state
+    char client_id[24];                     ///< MQTT client ID, GY86_<MAC>
+    char topic[LOADGEN_TOPIC_SIZE];         ///< Topic the frames are published on
+    double next_event_ms;                   ///< Connect attempt while offline, connect timeout while connecting
+    double next_publish_ms;                 ///< Next frame while online
+    double session_end_ms;                  ///< Simulated loss of the connection while online
+    double connect_started_ms;              ///< Start of the current connect attempt
+    double last_sent_ms;                    ///< Last packet queued, for the keep-alive
+    uint32_t backoff_ms;                    ///< Delay before the next attempt after a failure
+    uint32_t sequence;                      ///< Frame sequence number, kept across reconnects
+    uint16_t packet_id;                     ///< Last packet identifier used
+    in_flight_t in_flight[LOADGEN_MAX_IN_FLIGHT];
+    double phase;                           ///< Phase of the synthetic motion
+    double frequency;                       ///< Frequency of the synthetic motion in Hz
+    double base_altitude;                   ///< Altitude the device moves around in metres
+    double previous_altitude;               ///< Altitude of the previous frame
+    double previous_speed;                  ///< Vertical speed of the previous frame
+    double previous_frame_ms;               ///< Time of the previous frame, 0 before the first
+    sensor_snapshot_t frame;                ///< Frame the payloads are serialized from
+    uint8_t tx[LOADGEN_TX_BUFFER_SIZE];     ///< Bytes queued for the socket
+    size_t tx_length;                       ///< Number of queued bytes
+    uint8_t rx[LOADGEN_RX_BUFFER_SIZE];     ///< Bytes received but not parsed yet
+    size_t rx_length;                       ///< Number of received bytes
+} virtual_device_t;
+
+/**
+ * @brief Growing array of doubles.
+ */
+typedef struct {
+    double *values;     ///< Elements
+    size_t count;       ///< Number of elements
+    size_t capacity;    ///< Allocated elements
+} sample_array_t;
+
+/**
+ * @brief Counters of a run.
+ */
+typedef struct {
+    uint64_t connect_attempts;      ///< TCP connects started
+    uint64_t connects;              ///< CONNACKs accepting the session
+    uint64_t connect_failed;        ///< TCP connects that failed or timed out
+    uint64_t connack_refused;       ///< CONNACKs refusing the session
+    uint64_t sessions_dropped;      ///< Connections dropped by the simulation
+    uint64_t broker_closed;         ///< Connections closed or reset by the broker
+    uint64_t published;             ///< PUBLISH packets queued
+    uint64_t payload_bytes;         ///< Payload bytes of the queued packets
+    uint64_t wire_bytes;            ///< Bytes written to the sockets
+    uint64_t dropped_backpressure;  ///< Frames dropped because the send buffer or in-flight window was full
+    uint64_t dropped_offline;       ///< Frames due while the device was offline
+    uint64_t acked;                 ///< PUBACKs received
+    uint64_t unacked;               ///< QoS 1 messages lost with their connection
+} loadgen_counters_t;
+
+/**
+ * @brief Options of a run.
+ */
+typedef struct {
+    const char *host;           ///< Broker host
+    const char *port;           ///< Broker port
+    int devices;                ///< Number of devices
+    uint32_t interval_ms;       ///< Publish interval of every device
+    loadgen_format_t format;    ///< Payload format
+    int qos;                    ///< QoS of the frames, 0 or 1
+    double duration_s;          ///< Length of the run
+    double ramp_s;              ///< Devices connect spread over this time
+    double session_s;           ///< Mean time a connection lasts, 0 to keep it
+    double outage_s;            ///< Mean time a device stays offline after a dropped connection
+    const char *topic_root;     ///< Root of the device topics
+    uint64_t seed;              ///< Seed of the random generator
+} loadgen_options_t;
+
+static virtual_device_t *devices;
+static loadgen_options_t options;
+static loadgen_counters_t counters;
+static sample_array_t ack_latency;      ///< PUBLISH to PUBACK in milliseconds
+static sample_array_t connect_latency;  ///< Connect start to CONNACK in milliseconds
+static struct addrinfo *broker_address;
+static uint64_t random_state;
+static volatile sig_atomic_t interrupted = 0;
+
+/**
+ * @brief Stop the run and print the report.
+ * @param signal_number Unused.
+ */
+static void handle_interrupt(int signal_number) {
+    (void)signal_number;
+    interrupted = 1;
+}
+
+/**
+ * @brief Monotonic time.
+ * @return Milliseconds since an arbitrary point.
+ */
+static double monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec * 1000.0 + (double)now.tv_nsec / 1e6;
+}
+
+/**
+ * @brief Wall-clock time.
+ * @return Unix time in milliseconds.
+ */
+static int64_t wall_clock_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Uniform random number, xorshift64*.
+ * @return Value in [0, 1).
+ */
+static double random_uniform(void) {
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return (double)((random_state * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.0;
+}
+
+/**
+ * @brief Exponentially distributed random number.
+ * @param mean Mean of the distribution.
+ * @return Value with the given mean.
+ */
+static double random_exponential(double mean) {
+    return -mean * log(1.0 - random_uniform());
+}
+
+/**
+ * @brief Append a value to a growing array.
+ * @param array Array.
+ * @param value Value to append.
+ */
+static void sample_append(sample_array_t *array, double value) {
+    if (array->count == array->capacity) {
+        size_t capacity = array->capacity > 0 ? array->capacity * 2 : 1024;
+        double *values = realloc(array->values, capacity * sizeof(double));
+        if (values == NULL) {
+            fprintf(stderr, "fleet_loadgen: out of memory\n");
+            exit(1);
+        }
+        array->values = values;
+        array->capacity = capacity;
+    }
+    array->values[array->count++] = value;
+}
+
+/**
+ * @brief Order doubles for qsort().
+ * @param a First value.
+ * @param b Second value.
+ * @return Negative, zero or positive.
+ */
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Percentile of a sorted array, by nearest rank.
+ * @param array Sorted array with at least one element.
+ * @param percent Percentile between 0 and 100.
+ * @return Value at the percentile.
+ */
+static double percentile(const sample_array_t *array, double percent) {
+    size_t rank = (size_t)ceil(percent / 100.0 * (double)array->count);
+    return array->values[rank > 0 ? rank - 1 : 0];
+}
+
+/**
+ * @brief Queue a complete MQTT packet on a device.
+ * @param device Device.
+ * @param type_flags First byte of the fixed header.
+ * @param parts Variable header and payload parts, concatenated.
+ * @param lengths Lengths of the parts.
+ * @param part_count Number of parts.
+ * @return true if the packet fits into the send buffer.
+ */
+static bool queue_packet(virtual_device_t *device, uint8_t type_flags, const void *const *parts, const size_t *lengths,
+                         size_t part_count) {
+    size_t remaining = 0;
+    for (size_t i = 0; i < part_count; i++) {
+        remaining += lengths[i];
+    }
+
+    uint8_t header[5];
+    size_t header_length = 1;
+    header[0] = type_flags;
+    size_t value = remaining;
+    do {
+        uint8_t digit = value % 128;
+        value /= 128;
+        header[header_length++] = digit | (value > 0 ? 0x80 : 0);
+    } while (value > 0);
+
+    if (device->tx_length + header_length + remaining > sizeof(device->tx)) {
+        return false;
+    }
+    memcpy(device->tx + device->tx_length, header, header_length);
+    device->tx_length += header_length;
+    for (size_t i = 0; i < part_count; i++) {
+        memcpy(device->tx + device->tx_length, parts[i], lengths[i]);
+        device->tx_length += lengths[i];
+    }
+    device->last_sent_ms = monotonic_ms();
+    return true;
+}
+
+/**
+ * @brief Write an MQTT string (big-endian length and bytes) into a buffer.
+ * @param buffer Destination, at least 2 + strlen(string) bytes.
+ * @param string String.
+ * @return Number of bytes written.
+ */
+static size_t put_string(uint8_t *buffer, const char *string) {
+    size_t length = strlen(string);
+    buffer[0] = (uint8_t)(length >> 8);
+    buffer[1] = (uint8_t)length;
+    memcpy(buffer + 2, string, length);
+    return length + 2;
+}
+
+/**
+ * @brief Close the connection of a device and schedule its next connect.
+ * @param device Device.
+ * @param delay_ms Time until the next connect attempt.
+ */
+static void close_device(virtual_device_t *device, double delay_ms) {
+    if (device->fd >= 0) {
+        close(device->fd);
+    }
+    for (size_t i = 0; i < LOADGEN_MAX_IN_FLIGHT; i++) {
+        if (device->in_flight[i].packet_id != 0) {
+            counters.unacked++;
+            device->in_flight[i].packet_id = 0;
+        }
+    }
+    device->fd = -1;
+    device->state = DEVICE_OFFLINE;
+    device->tx_length = 0;
+    device->rx_length = 0;
+    device->next_event_ms = monotonic_ms() + delay_ms;
+}
+
+/**
+ * @brief Close a connection that failed and back off exponentially, with full jitter.
+ * @param device Device.
+ */
+static void fail_device(virtual_device_t *device) {
+    uint32_t backoff = device->backoff_ms;
+    device->backoff_ms = backoff * 2 < LOADGEN_BACKOFF_MAX_MS ? backoff * 2 : LOADGEN_BACKOFF_MAX_MS;
+    close_device(device, random_uniform() * backoff);
+}
+
+/**
+ * @brief Start the TCP connect of a device.
+ * @param device Device.
+ */
+static void connect_device(virtual_device_t *device) {
+    counters.connect_attempts++;
+    device->connect_started_ms = monotonic_ms();
+    device->next_event_ms = device->connect_started_ms + LOADGEN_CONNECT_TIMEOUT_MS;
+
+    int fd = socket(broker_address->ai_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        counters.connect_failed++;
+        fail_device(device);
+        return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    device->fd = fd;
+    device->state = DEVICE_CONNECTING;
+    if (connect(fd, broker_address->ai_addr, broker_address->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        counters.connect_failed++;
+        fail_device(device);
+    }
+}
+
+/**
+ * @brief Queue the CONNECT packet once the TCP connection is up.
+ * @param device Device.
+ */
+static void send_connect(virtual_device_t *device) {
+    static const uint8_t variable_header[] = {0, 4, 'M', 'Q', 'T', 'T', 4, 0x02,
+                                              LOADGEN_KEEPALIVE_S >> 8, LOADGEN_KEEPALIVE_S & 0xFF};
+    uint8_t client_id[2 + sizeof(device->client_id)];
+    size_t client_id_length = put_string(client_id, device->client_id);
+
+    const void *parts[] = {variable_header, client_id};
+    size_t lengths[] = {sizeof(variable_header), client_id_length};
+    queue_packet(device, 0x10, parts, lengths, 2);
+    device->state = DEVICE_CONNACK;
+}
+
+/**
+ * @brief Advance the synthetic motion of a device and fill its frame.
+ *
+ * The device sways in roll and pitch, turns slowly and drifts in altitude; pressure, acceleration and the
+ * filtered channels are derived so the frame is self-consistent.
+ *
+ * @param device Device.
+ * @param now_ms Current monotonic time.
+ */
+static void update_frame(virtual_device_t *device, double now_ms) {
+    sensor_snapshot_t *frame = &device->frame;
+    static const char *const directions[] = {"N", "NE", "E", "SE", "S", "SW", "W", "NW"};
+    double t = now_ms / 1000.0;
+    double dt = device->previous_frame_ms > 0 ? (now_ms - device->previous_frame_ms) / 1000.0 : 0.0;
+
+    frame->roll = (float)(15.0 * sin(2.0 * PI * device->frequency * t + device->phase));
+    frame->pitch = (float)(10.0 * cos(2.0 * PI * device->frequency * 0.7 * t + device->phase));
+    frame->heading = (float)fmod(device->phase * RAD_TO_DEG + 3.0 * t, 360.0);
+    frame->compass = directions[(int)((frame->heading + 22.5f) / 45.0f) % 8];
+
+    device->base_altitude += (random_uniform() - 0.5) * 0.2;
+    double altitude = device->base_altitude + 2.0 * sin(2.0 * PI * device->frequency * 0.1 * t);
+    double speed = dt > 0 ? (altitude - device->previous_altitude) / dt : 0.0;
+    double acceleration = dt > 0 ? (speed - device->previous_speed) / dt : 0.0;
+    frame->altitude = (float)(altitude + (random_uniform() - 0.5) * 0.5);
+    frame->altitude_filtered = (float)altitude;
+    frame->vertical_speed = (float)speed;
+    frame->vertical_acceleration = (float)acceleration;
+    frame->baro.pressure = (float)(SEA_LEVEL_PRESSURE_HPA * pow(1.0 - altitude / 44330.0, 5.255));
+    frame->baro.temperature = (float)(22.0 + 0.5 * sin(t / 600.0 + device->phase));
+
+    // Gravity seen by the accelerometer at the current attitude, plus noise
+    double roll = frame->roll / RAD_TO_DEG, pitch = frame->pitch / RAD_TO_DEG;
+    frame->imu.accel_x = (int16_t)(LOADGEN_ACCEL_LSB_PER_G * -sin(pitch) + (random_uniform() - 0.5) * 200.0);
+    frame->imu.accel_y = (int16_t)(LOADGEN_ACCEL_LSB_PER_G * sin(roll) * cos(pitch) + (random_uniform() - 0.5) * 200.0);
+    frame->imu.accel_z = (int16_t)(LOADGEN_ACCEL_LSB_PER_G * cos(roll) * cos(pitch) + (random_uniform() - 0.5) * 200.0);
+
+    device->previous_altitude = altitude;
+    device->previous_speed = speed;
+    device->previous_frame_ms = now_ms;
+    frame->sequence = ++device->sequence;
+    frame->timestamp_us = (int64_t)(now_ms * 1000.0);
+    frame->fresh = GY86_FRAME_IMU_FRESH | GY86_FRAME_BARO_FRESH | GY86_FRAME_MAG_FRESH;
+}
+
+/**
+ * @brief Add a channel value to a JSON object the way the firmware does.
+ * @param writer JSON writer with an open object.
+ * @param key JSON key of the value.
+ * @param value Value to add.
+ */
+static void add_sensor_value(json_writer_t *writer, const char *key, const sensor_value_t *value) {
+    switch (value->type) {
+        case VALUE_TYPE_FLOAT:
+            json_writer_fixed_string(writer, key, value->float_value, 2);
+            break;
+        case VALUE_TYPE_INT:
+        case VALUE_TYPE_INT16:
+            json_writer_int(writer, key, value->int_value);
+            break;
+        case VALUE_TYPE_DOUBLE:
+            json_writer_fixed_string(writer, key, value->double_value, 2);
+            break;
+        case VALUE_TYPE_STRING:
+            json_writer_string(writer, key, value->string_value);
+            break;
+    }
+}
+
+/**
+ * @brief Serialize the frame of a device.
+ * @param device Device with an updated frame.
+ * @param payload Output buffer of LOADGEN_PAYLOAD_SIZE bytes.
+ * @return Length of the payload, 0 if it does not fit.
+ */
+static size_t serialize_frame(const virtual_device_t *device, uint8_t *payload) {
+    const sensor_snapshot_t *frame = &device->frame;
+    if (options.format == LOADGEN_FORMAT_PACKED) {
+        return telemetry_encode_frame(payload, LOADGEN_PAYLOAD_SIZE, fields, FIELD_COUNT, frame, frame->sequence,
+                                      frame->timestamp_us);
+    }
+
+    // Same document as send_sensor_record(), sampled and published at the same instant
+    json_writer_t writer;
+    int64_t now_ms = wall_clock_ms();
+    json_writer_init(&writer, (char *)payload, LOADGEN_PAYLOAD_SIZE, false);
+    json_writer_begin_object(&writer, NULL);
+    for (size_t i = 0; i < FIELD_COUNT; i++) {
+        sensor_value_t value = sensor_field_value(&fields[i], frame);
+        add_sensor_value(&writer, fields[i].sensor_type, &value);
+    }
+    // Every frame of a virtual device is published, so its message number is its frame number
+    json_writer_int(&writer, "seq", frame->sequence);
+    json_writer_int(&writer, "frame", frame->sequence);
+    json_writer_int(&writer, "ts", now_ms);
+    json_writer_int(&writer, "pts", now_ms);
+    json_writer_end_object(&writer);
+    return json_writer_finish(&writer) != NULL ? writer.length : 0;
+}
+
+/**
+ * @brief Publish the next frame of an online device.
+ * @param device Device.
+ * @param now_ms Current monotonic time.
+ */
+static void publish_frame(virtual_device_t *device, double now_ms) {
+    uint8_t payload[LOADGEN_PAYLOAD_SIZE];
+    update_frame(device, now_ms);
+    size_t payload_length = serialize_frame(device, payload);
+    if (payload_length == 0) {
+        fprintf(stderr, "fleet_loadgen: frame does not fit into %d bytes\n", LOADGEN_PAYLOAD_SIZE);
+        exit(1);
+    }
+
+    in_flight_t *slot = NULL;
+    if (options.qos > 0) {
+        for (size_t i = 0; i < LOADGEN_MAX_IN_FLIGHT && slot == NULL; i++) {
+            if (device->in_flight[i].packet_id == 0) {
+                slot = &device->in_flight[i];
+            }
+        }
+        if (slot == NULL) {
+            counters.dropped_backpressure++;
+            return;
+        }
+    }
+
+    uint8_t topic[2 + LOADGEN_TOPIC_SIZE];
+    size_t topic_length = put_string(topic, device->topic);
+    if (slot != NULL) {
+        device->packet_id = device->packet_id == UINT16_MAX ? 1 : device->packet_id + 1;
+        topic[topic_length++] = (uint8_t)(device->packet_id >> 8);
+        topic[topic_length++] = (uint8_t)device->packet_id;
+    }
+
+    const void *parts[] = {topic, payload};
+    size_t lengths[] = {topic_length, payload_length};
+    if (!queue_packet(device, 0x30 | (options.qos << 1), parts, lengths, 2)) {
+        counters.dropped_backpressure++;
+        return;
+    }
+    if (slot != NULL) {
+        slot->packet_id = device->packet_id;
+        slot->sent_ms = now_ms;
+    }
+    counters.published++;
+    counters.payload_bytes += payload_length;
+}
+
+/**
+ * @brief Handle one complete packet received from the broker.
+ * @param device Device.
+ * @param type_flags First byte of the fixed header.
+ * @param body Variable header and payload.
+ * @param length Length of the body.
+ */
+static void handle_packet(virtual_device_t *device, uint8_t type_flags, const uint8_t *body, size_t length) {
+    double now_ms = monotonic_ms();
+
+    switch (type_flags >> 4) {
+        case 2:     // CONNACK
+            if (length < 2 || body[1] != 0) {
+                counters.connack_refused++;
+                fail_device(device);
+                return;
+            }
+            counters.connects++;
+            sample_append(&connect_latency, now_ms - device->connect_started_ms);
+            device->state = DEVICE_ONLINE;
+            device->backoff_ms = LOADGEN_BACKOFF_MIN_MS;
+            device->next_publish_ms = now_ms + random_uniform() * options.interval_ms;
+            device->session_end_ms = options.session_s > 0 ? now_ms + random_exponential(options.session_s * 1000.0)
+                                                           : INFINITY;
+            break;
+        case 4:     // PUBACK
+            if (length < 2) {
+                return;
+            }
+            uint16_t packet_id = (uint16_t)(body[0] << 8 | body[1]);
+            for (size_t i = 0; i < LOADGEN_MAX_IN_FLIGHT; i++) {
+                if (device->in_flight[i].packet_id == packet_id) {
+                    sample_append(&ack_latency, now_ms - device->in_flight[i].sent_ms);
+                    device->in_flight[i].packet_id = 0;
+                    counters.acked++;
+                    break;
+                }
+            }
+            break;
+        default:    // PINGRESP and anything else
+            break;
+    }
+}
+
+/**
+ * @brief Read from the socket of a device and handle every complete packet.
+ * @param device Device.
+ */
+static void receive_packets(virtual_device_t *device) {
+    ssize_t count = recv(device->fd, device->rx + device->rx_length, sizeof(device->rx) - device->rx_length, 0);
+    if (count == 0 || (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        counters.broker_closed++;
+        fail_device(device);
+        return;
+    }
+    if (count < 0) {
+        return;
+    }
+    device->rx_length += (size_t)count;
+
+    size_t position = 0;
+    while (device->fd >= 0 && device->rx_length - position >= 2) {
+        size_t remaining = 0, header_length = 1;
+        uint32_t multiplier = 1;
+        bool complete_length = false;
+        while (header_length < 5 && position + header_length < device->rx_length) {
+            uint8_t digit = device->rx[position + header_length++];
+            remaining += (digit & 0x7F) * multiplier;
+            multiplier *= 128;
+            if ((digit & 0x80) == 0) {
+                complete_length = true;
+                break;
+            }
+        }
+        if (!complete_length || position + header_length + remaining > device->rx_length) {
+            break;
+        }
+        handle_packet(device, device->rx[position], device->rx + position + header_length, remaining);
+        position += header_length + remaining;
+    }
+    if (device->fd < 0) {
+        return;
+    }
+
+    memmove(device->rx, device->rx + position, device->rx_length - position);
+    device->rx_length -= position;
+    if (device->rx_length == sizeof(device->rx)) {
+        // Nothing the broker sends a publisher is this large
+        counters.broker_closed++;
+        fail_device(device);
+    }
+}
+
+/**
+ * @brief Write as much of the send buffer of a device as the socket takes.
+ * @param device Device.
+ */
+static void flush_device(virtual_device_t *device) {
+    ssize_t count = send(device->fd, device->tx, device->tx_length, MSG_NOSIGNAL);
+    if (count < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            counters.broker_closed++;
+            fail_device(device);
+        }
+        return;
+    }
+    counters.wire_bytes += (uint64_t)count;
+    memmove(device->tx, device->tx + count, device->tx_length - (size_t)count);
+    device->tx_length -= (size_t)count;
+}
+
+/**
+ * @brief Run the timers of a device: connects, timeouts, publishes, keep-alive and simulated drops.
+ * @param device Device.
+ * @param now_ms Current monotonic time.
+ */
+static void run_timers(virtual_device_t *device, double now_ms) {
+    switch (device->state) {
+        case DEVICE_OFFLINE:
+            if (now_ms >= device->next_event_ms) {
+                connect_device(device);
+            }
+            break;
+        case DEVICE_CONNECTING:
+        case DEVICE_CONNACK:
+            if (now_ms >= device->next_event_ms) {
+                counters.connect_failed++;
+                fail_device(device);
+            }
+            break;
+        case DEVICE_ONLINE:
+            if (now_ms >= device->session_end_ms) {
+                // Like losing Wi-Fi: no DISCONNECT, the broker notices on its own
+                counters.sessions_dropped++;
+                close_device(device, random_exponential(options.outage_s * 1000.0));
+                break;
+            }
+            if (now_ms >= device->next_publish_ms) {
+                publish_frame(device, now_ms);
+                // +-10 % jitter keeps the fleet from publishing in lockstep
+                device->next_publish_ms += options.interval_ms * (0.9 + 0.2 * random_uniform());
+                if (device->next_publish_ms < now_ms) {
+                    device->next_publish_ms = now_ms + options.interval_ms;
+                }
+            }
+            if (now_ms - device->last_sent_ms >= LOADGEN_KEEPALIVE_S * 500.0) {
+                static const uint8_t nothing = 0;
+                const void *parts[] = {&nothing};
+                size_t lengths[] = {0};
+                queue_packet(device, 0xC0, parts, lengths, 1);
+            }
+            break;
+    }
+}
+
+/**
+ * @brief Count the frames that offline devices would have published.
+ * @param elapsed_ms Time since the last call.
+ */
+static void count_offline_frames(double elapsed_ms) {
+    static double carry = 0;
+    int offline = 0;
+    for (int i = 0; i < options.devices; i++) {
+        offline += devices[i].state != DEVICE_ONLINE;
+    }
+    carry += offline * elapsed_ms / options.interval_ms;
+    counters.dropped_offline += (uint64_t)carry;
+    carry -= floor(carry);
+}
+
+/**
+ * @brief Print the p50, p90, p99 and maximum of an array.
+ * @param name Name of the measurement.
+ * @param array Array, sorted in place.
+ */
+static void print_percentiles(const char *name, sample_array_t *array) {
+    if (array->count == 0) {
+        printf("%-22s -\n", name);
+        return;
+    }
+    qsort(array->values, array->count, sizeof(double), compare_doubles);
+    printf("%-22s p50 %.2f  p90 %.2f  p99 %.2f  max %.2f ms (%zu samples)\n", name, percentile(array, 50),
+           percentile(array, 90), percentile(array, 99), array->values[array->count - 1], array->count);
+}
+
+/**
+ * @brief Print the report of the run.
+ * @param elapsed_s Length of the run in seconds.
+ */
+static void print_report(double elapsed_s) {
+    printf("\n%d devices, %s QoS %d every %u ms, %.1f s\n", options.devices,
+           options.format == LOADGEN_FORMAT_PACKED ? "packed" : "json", options.qos, options.interval_ms, elapsed_s);
+    printf("%-22s %llu attempts, %llu accepted, %llu failed, %llu refused\n", "connects",
+           (unsigned long long)counters.connect_attempts, (unsigned long long)counters.connects,
+           (unsigned long long)counters.connect_failed, (unsigned long long)counters.connack_refused);
+    printf("%-22s %llu dropped by the simulation, %llu closed by the broker\n", "sessions",
+           (unsigned long long)counters.sessions_dropped, (unsigned long long)counters.broker_closed);
+    printf("%-22s %llu (%.1f msg/s), %.1f KiB/s payload, %.1f KiB/s on the wire, %.1f bytes each\n", "published",
+           (unsigned long long)counters.published, counters.published / elapsed_s,
+           counters.payload_bytes / elapsed_s / 1024.0, counters.wire_bytes / elapsed_s / 1024.0,
+           counters.published > 0 ? (double)counters.payload_bytes / counters.published : 0.0);
+    printf("%-22s %llu backpressure, %llu offline\n", "dropped",
+           (unsigned long long)counters.dropped_backpressure, (unsigned long long)counters.dropped_offline);
+    if (options.qos > 0) {
+        printf("%-22s %llu acked, %llu lost with their connection\n", "qos 1",
+               (unsigned long long)counters.acked, (unsigned long long)counters.unacked);
+        print_percentiles("ack latency", &ack_latency);
+    }
+    print_percentiles("connect latency", &connect_latency);
+}
+
+/**
+ * @brief Print the command line help.
+ * @param program Name of the program.
+ */
+static void print_usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [-h host] [-p port] [-n devices] [-i interval_ms] [-f json|packed] [-q 0|1]\n"
+            "       [-d seconds] [-w ramp_seconds] [-s session_seconds] [-o outage_seconds]\n"
+            "       [-r topic_root] [-S seed]\n", program);
+}
+
+/**
+ * @brief Parse the command line into options.
+ * @param argc Argument count.
+ * @param argv Arguments.
+ * @return true if the options are valid.
+ */
+static bool parse_options(int argc, char **argv) {
+    options = (loadgen_options_t) {"localhost", "1883", 100, 1000, LOADGEN_FORMAT_JSON, 0, 60.0, 10.0, 0.0, 5.0,
+                                   GY86_TOPIC_ROOT, 1};
+    int option;
+    while ((option = getopt(argc, argv, "h:p:n:i:f:q:d:w:s:o:r:S:")) != -1) {
+        switch (option) {
+            case 'h': options.host = optarg; break;
+            case 'p': options.port = optarg; break;
+            case 'n': options.devices = atoi(optarg); break;
+            case 'i': options.interval_ms = (uint32_t)atol(optarg); break;
+            case 'q': options.qos = atoi(optarg); break;
+            case 'd': options.duration_s = atof(optarg); break;
+            case 'w': options.ramp_s = atof(optarg); break;
+            case 's': options.session_s = atof(optarg); break;
+            case 'o': options.outage_s = atof(optarg); break;
+            case 'r': options.topic_root = optarg; break;
+            case 'S': options.seed = strtoull(optarg, NULL, 10); break;
+            case 'f':
+                if (strcmp(optarg, "json") == 0) {
+                    options.format = LOADGEN_FORMAT_JSON;
+                } else if (strcmp(optarg, "packed") == 0) {
+                    options.format = LOADGEN_FORMAT_PACKED;
+                } else {
+                    return false;
+                }
+                break;
+            default:
+                return false;
+        }
+    }
+    return optind == argc && options.devices > 0 && options.devices <= LOADGEN_MAX_DEVICES &&
+           options.interval_ms > 0 && (options.qos == 0 || options.qos == 1) && options.duration_s > 0;
+}
+
+int main(int argc, char **argv) {
+    if (!parse_options(argc, argv)) {
+        print_usage(argv[0]);
+        return 2;
+    }
+
+    struct addrinfo hints = {0};
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(options.host, options.port, &hints, &broker_address);
+    if (err != 0) {
+        fprintf(stderr, "fleet_loadgen: %s: %s\n", options.host, gai_strerror(err));
+        return 1;
+    }
+
+    devices = calloc((size_t)options.devices, sizeof(virtual_device_t));
+    struct pollfd *polls = calloc((size_t)options.devices, sizeof(struct pollfd));
+    int *poll_devices = calloc((size_t)options.devices, sizeof(int));
+    if (devices == NULL || polls == NULL || poll_devices == NULL) {
+        fprintf(stderr, "fleet_loadgen: out of memory\n");
+        return 1;
+    }
+
+    random_state = options.seed * 0x9E3779B97F4A7C15ULL + 1;
+    double start_ms = monotonic_ms();
+    const char *leaf = options.format == LOADGEN_FORMAT_PACKED ? GY86_TELEMETRY_LEAF : GY86_STATE_LEAF;
+    for (int i = 0; i < options.devices; i++) {
+        virtual_device_t *device = &devices[i];
+        // Locally administered MAC addresses, so they never collide with real boards
+        snprintf(device->client_id, sizeof(device->client_id), GY86_DEVICE_ID "_02FE%08X", (unsigned)i);
+        snprintf(device->topic, sizeof(device->topic), "%s/%s/%s", options.topic_root, device->client_id, leaf);
+        device->fd = -1;
+        device->state = DEVICE_OFFLINE;
+        device->next_event_ms = start_ms + random_uniform() * options.ramp_s * 1000.0;
+        device->backoff_ms = LOADGEN_BACKOFF_MIN_MS;
+        device->phase = random_uniform() * 2.0 * PI;
+        device->frequency = 0.05 + random_uniform() * 0.2;
+        device->base_altitude = 100.0 + random_uniform() * 400.0;
+    }
+
+    struct sigaction action = {0};
+    action.sa_handler = handle_interrupt;
+    sigaction(SIGINT, &action, NULL);
+
+    double end_ms = start_ms + options.duration_s * 1000.0;
+    double previous_ms = start_ms, next_report_ms = start_ms + LOADGEN_REPORT_PERIOD_MS;
+    uint64_t reported_published = 0;
+    double now_ms = start_ms;
+
+    while (!interrupted && now_ms < end_ms) {
+        nfds_t poll_count = 0;
+        for (int i = 0; i < options.devices; i++) {
+            virtual_device_t *device = &devices[i];
+            if (device->fd < 0) {
+                continue;
+            }
+            bool writable = device->state == DEVICE_CONNECTING || device->tx_length > 0;
+            polls[poll_count] = (struct pollfd) {device->fd, (short)(POLLIN | (writable ? POLLOUT : 0)), 0};
+            poll_devices[poll_count++] = i;
+        }
+        // Timers are checked every few milliseconds, fine against publish intervals of a second
+        poll(polls, poll_count, 5);
+
+        for (nfds_t j = 0; j < poll_count; j++) {
+            virtual_device_t *device = &devices[poll_devices[j]];
+            short revents = polls[j].revents;
+            if (revents == 0 || device->fd != polls[j].fd) {
+                continue;
+            }
+            if (device->state == DEVICE_CONNECTING) {
+                int socket_error = 0;
+                socklen_t length = sizeof(socket_error);
+                getsockopt(device->fd, SOL_SOCKET, SO_ERROR, &socket_error, &length);
+                if (socket_error != 0 || (revents & (POLLERR | POLLHUP))) {
+                    counters.connect_failed++;
+                    fail_device(device);
+                    continue;
+                }
+                if (revents & POLLOUT) {
+                    send_connect(device);
+                }
+            }
+            if (device->fd >= 0 && (revents & (POLLIN | POLLERR | POLLHUP))) {
+                receive_packets(device);
+            }
+            if (device->fd >= 0 && device->tx_length > 0 && (revents & POLLOUT)) {
+                flush_device(device);
+            }
+        }
+
+        now_ms = monotonic_ms();
+        for (int i = 0; i < options.devices; i++) {
+            run_timers(&devices[i], now_ms);
+        }
+        count_offline_frames(now_ms - previous_ms);
+        previous_ms = now_ms;
+
+        if (now_ms >= next_report_ms) {
+            int online = 0;
+            for (int i = 0; i < options.devices; i++) {
+                online += devices[i].state == DEVICE_ONLINE;
+            }
+            printf("%6.0f s  %d/%d online  %.1f msg/s  %llu dropped\n", (now_ms - start_ms) / 1000.0, online,
+                   options.devices, (counters.published - reported_published) * 1000.0 / LOADGEN_REPORT_PERIOD_MS,
+                   (unsigned long long)(counters.dropped_backpressure + counters.dropped_offline));
+            fflush(stdout);
+            reported_published = counters.published;
+            next_report_ms += LOADGEN_REPORT_PERIOD_MS;
+        }
+    }
+
+    // End cleanly so the broker does not publish wills or keep sessions around
+    for (int i = 0; i < options.devices; i++) {
+        virtual_device_t *device = &devices[i];
+        if (device->state == DEVICE_ONLINE) {
+            static const uint8_t nothing = 0;
+            const void *parts[] = {&nothing};
+            size_t lengths[] = {0};
+            queue_packet(device, 0xE0, parts, lengths, 1);
+            flush_device(device);
+        }
+        if (device->fd >= 0) {
+            close_device(device, 0);
+        }
+    }
+
+    print_report((monotonic_ms() - start_ms) / 1000.0);
+    freeaddrinfo(broker_address);
+    free(poll_devices);
+    free(polls);
+    free(devices);
+    return 0;
+}
@@ -0,0 +1,431 @@
+/**
+ * @file json_bench.c
+ * @brief Host benchmark of the streaming JSON writer against the cJSON path it replaced.
+ *
+ * Builds the batched state document, the statistics document and a discovery document of the
+ * GY-86 channels both ways, checks that the output is byte-identical and that values too large for
+ * the integer path are still formatted correctly, then measures documents per second and heap
+ * allocations per document. cJSON allocations are counted through cJSON_InitHooks().
+ *
+ * Usage: json_bench [iterations]
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "math.h"
+#include "time.h"
+#include "cJSON.h"
+#include "json_writer.h"
+#include "ESP32_Mqtt_custom_defs.h"
+#include "gy86_schema.h"
+
+#define BENCH_ITERATIONS    200000  ///< Default number of documents per measurement
+#define BENCH_BUFFER_SIZE   2048    ///< Output buffer of the streaming writer
+
+#define BENCH_KEY(id, key, device_class, unit, value_type, kind, ctype, member, source, scale, report) #key,
+#define BENCH_TYPE(id, key, device_class, unit, value_type, kind, ctype, member, source, scale, report) value_type,
+
+static const char *const channel_keys[] = { GY86_CHANNELS(BENCH_KEY) };
+static const value_type_t channel_types[] = { GY86_CHANNELS(BENCH_TYPE) };
+#define CHANNEL_COUNT (sizeof(channel_keys) / sizeof(channel_keys[0]))
+
+static size_t allocations = 0;  ///< Number of malloc calls made by cJSON
+
+static void *counting_malloc(size_t size) {
+    allocations++;
+    return malloc(size);
+}
+
+/**
+ * @brief Fill a frame with plausible channel values.
+ * @param values Values in channel order.
+ * @param seed Varies the values between frames.
+ */
+static void make_frame(sensor_value_t *values, unsigned seed) {
+    static const char *const directions[] = {"N", "NE", "E", "SE", "S", "SW", "W", "NW"};
+
+    for (size_t i = 0; i < CHANNEL_COUNT; i++) {
+        values[i].type = channel_types[i];
+        switch (channel_types[i]) {
+            case VALUE_TYPE_FLOAT:
+                values[i].float_value = (float)(seed % 100000) / 7.0f - 5000.0f + (float)i * 13.37f;
+                break;
+            case VALUE_TYPE_INT16:
+                values[i].type = VALUE_TYPE_INT;
+                values[i].int_value = (int)(seed * 31u % 65536u) - 32768;
+                break;
+            case VALUE_TYPE_INT:
+                values[i].int_value = (int)seed;
+                break;
+            case VALUE_TYPE_DOUBLE:
+                values[i].double_value = seed / 3.0;
+                break;
+            case VALUE_TYPE_STRING:
+                values[i].string_value = directions[seed % 8];
+                break;
+        }
+    }
+}
+
+/**
+ * @brief Build the batched state document the way the firmware did with cJSON.
+ * @param values Values in channel order.
+ * @return Document allocated by cJSON.
+ */
+static char *state_cjson(const sensor_value_t *values) {
+    char json_string[48];
+    cJSON *root = cJSON_CreateObject();
+
+    for (size_t i = 0; i < CHANNEL_COUNT; i++) {
+        switch (values[i].type) {
+            case VALUE_TYPE_FLOAT:
+                snprintf(json_string, sizeof(json_string), "%.2f", values[i].float_value);
+                cJSON_AddStringToObject(root, channel_keys[i], json_string);
+                break;
+            case VALUE_TYPE_INT:
+            case VALUE_TYPE_INT16:
+                cJSON_AddNumberToObject(root, channel_keys[i], values[i].int_value);
+                break;
+            case VALUE_TYPE_DOUBLE:
+                snprintf(json_string, sizeof(json_string), "%.2f", values[i].double_value);
+                cJSON_AddStringToObject(root, channel_keys[i], json_string);
+                break;
+            case VALUE_TYPE_STRING:
+                cJSON_AddStringToObject(root, channel_keys[i], values[i].string_value);
+                break;
+        }
+    }
+
+    char *message = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return message;
+}
+
+/**
+ * @brief Build the batched state document with the streaming writer.
+ * @param values Values in channel order.
+ * @param buffer Output buffer.
+ * @return Document inside buffer, or NULL on overflow.
+ */
+static const char *state_writer(const sensor_value_t *values, char *buffer) {
+    json_writer_t writer;
+
+    json_writer_init(&writer, buffer, BENCH_BUFFER_SIZE, false);
+    json_writer_begin_object(&writer, NULL);
+    for (size_t i = 0; i < CHANNEL_COUNT; i++) {
+        switch (values[i].type) {
+            case VALUE_TYPE_FLOAT:
+                json_writer_fixed_string(&writer, channel_keys[i], values[i].float_value, 2);
+                break;
+            case VALUE_TYPE_INT:
+            case VALUE_TYPE_INT16:
+                json_writer_int(&writer, channel_keys[i], values[i].int_value);
+                break;
+            case VALUE_TYPE_DOUBLE:
+                json_writer_fixed_string(&writer, channel_keys[i], values[i].double_value, 2);
+                break;
+            case VALUE_TYPE_STRING:
+                json_writer_string(&writer, channel_keys[i], values[i].string_value);
+                break;
+        }
+    }
+    json_writer_end_object(&writer);
+    return json_writer_finish(&writer);
+}
+
+/**
+ * @brief Build a statistics document the way the firmware did with cJSON.
+ * @param stats Statistics in channel order.
+ * @return Document allocated by cJSON.
+ */
+static char *stats_cjson(const sensor_stats_t *stats) {
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "window_ms", 20000);
+
+    for (size_t i = 0; i < CHANNEL_COUNT; i++) {
+        float variance = stats[i].m2 / stats[i].count;
+        float rms = sqrtf(stats[i].mean * stats[i].mean + variance);
+
+        cJSON *item = cJSON_AddObjectToObject(root, channel_keys[i]);
+        cJSON_AddNumberToObject(item, "count", stats[i].count);
+        cJSON_AddNumberToObject(item, "mean", round((double)stats[i].mean * 100.0) / 100.0);
+        cJSON_AddNumberToObject(item, "min", round((double)stats[i].min * 100.0) / 100.0);
+        cJSON_AddNumberToObject(item, "max", round((double)stats[i].max * 100.0) / 100.0);
+        cJSON_AddNumberToObject(item, "rms", round((double)rms * 100.0) / 100.0);
+        cJSON_AddNumberToObject(item, "variance", round((double)variance * 100.0) / 100.0);
+    }
+
+    char *message = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return message;
+}
+
+/**
+ * @brief Build a statistics document with the streaming writer.
+ * @param stats Statistics in channel order.
+ * @param buffer Output buffer.
+ * @return Document inside buffer, or NULL on overflow.
+ */
+static const char *stats_writer(const sensor_stats_t *stats, char *buffer) {
+    json_writer_t writer;
+
+    json_writer_init(&writer, buffer, BENCH_BUFFER_SIZE, false);
+    json_writer_begin_object(&writer, NULL);
+    json_writer_int(&writer, "window_ms", 20000);
+
+    for (size_t i = 0; i < CHANNEL_COUNT; i++) {
+        float variance = stats[i].m2 / stats[i].count;
+        float rms = sqrtf(stats[i].mean * stats[i].mean + variance);
+
+        json_writer_begin_object(&writer, channel_keys[i]);
+        json_writer_int(&writer, "count", stats[i].count);
+        json_writer_decimal(&writer, "mean", stats[i].mean, 2);
+        json_writer_decimal(&writer, "min", stats[i].min, 2);
+        json_writer_decimal(&writer, "max", stats[i].max, 2);
+        json_writer_decimal(&writer, "rms", rms, 2);
+        json_writer_decimal(&writer, "variance", variance, 2);
+        json_writer_end_object(&writer);
+    }
+
+    json_writer_end_object(&writer);
+    return json_writer_finish(&writer);
+}
+
+/**
+ * @brief Build a discovery document the way the firmware did with cJSON.
+ * @return Document allocated by cJSON.
+ */
+static char *discovery_cjson(void) {
+    const char *identifiers = GY86_DEVICE_ID;
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "device_class", "temperature");
+    cJSON_AddStringToObject(root, "state_topic", GY86_TOPIC_ROOT "/" GY86_DEVICE_ID "/" GY86_STATE_LEAF);
+    cJSON_AddStringToObject(root, "unit_of_measurement", "°C");
+    cJSON_AddStringToObject(root, "value_template", "{{ value_json.temperature }}");
+    cJSON_AddStringToObject(root, "unique_id", GY86_DEVICE_ID "_temperature");
+
+    cJSON *device = cJSON_CreateObject();
+    cJSON_AddItemToObject(root, "device", device);
+    cJSON_AddItemToObject(device, "identifiers", cJSON_CreateStringArray(&identifiers, 1));
+    cJSON_AddStringToObject(device, "name", GY86_DEVICE_NAME);
+    cJSON_AddStringToObject(device, "manufacturer", GY86_DEVICE_MANUFACTURER);
+    cJSON_AddStringToObject(device, "model", GY86_DEVICE_MODEL);
+
+    char *message = cJSON_Print(root);
+    cJSON_Delete(root);
+    return message;
+}
+
+/**
+ * @brief Build a discovery document with the streaming writer.
+ * @param buffer Output buffer.
+ * @return Document inside buffer, or NULL on overflow.
+ */
+static const char *discovery_writer(char *buffer) {
+    json_writer_t writer;
+
+    json_writer_init(&writer, buffer, BENCH_BUFFER_SIZE, true);
+    json_writer_begin_object(&writer, NULL);
+    json_writer_string(&writer, "device_class", "temperature");
+    json_writer_string(&writer, "state_topic", GY86_TOPIC_ROOT "/" GY86_DEVICE_ID "/" GY86_STATE_LEAF);
+    json_writer_string(&writer, "unit_of_measurement", "°C");
+    json_writer_string(&writer, "value_template", "{{ value_json.temperature }}");
+    json_writer_string(&writer, "unique_id", GY86_DEVICE_ID "_temperature");
+
+    json_writer_begin_object(&writer, "device");
+    json_writer_begin_array(&writer, "identifiers");
+    json_writer_string(&writer, NULL, GY86_DEVICE_ID);
+    json_writer_end_array(&writer);
+    json_writer_string(&writer, "name", GY86_DEVICE_NAME);
+    json_writer_string(&writer, "manufacturer", GY86_DEVICE_MANUFACTURER);
+    json_writer_string(&writer, "model", GY86_DEVICE_MODEL);
+    json_writer_end_object(&writer);
+    json_writer_end_object(&writer);
+    return json_writer_finish(&writer);
+}
+
+/**
+ * @brief Fill statistics with plausible values.
+ * @param stats Statistics in channel order.
+ * @param seed Varies the values between windows.
+ */
+static void make_stats(sensor_stats_t *stats, unsigned seed) {
+    for (size_t i = 0; i < CHANNEL_COUNT; i++) {
+        stats[i].count = 200 + seed % 7;
+        stats[i].mean = (float)(seed % 10000) / 3.0f - 1000.0f;
+        stats[i].m2 = (float)(seed % 977) * 1.25f;
+        stats[i].min = stats[i].mean - 1.125f;
+        stats[i].max = stats[i].mean + 2.375f;
+    }
+}
+
+/**
+ * @brief Compare both paths over many documents.
+ * @return Number of documents that differ.
+ */
+static unsigned check_identical(void) {
+    char buffer[BENCH_BUFFER_SIZE];
+    sensor_value_t values[CHANNEL_COUNT];
+    sensor_stats_t stats[CHANNEL_COUNT];
+    unsigned mismatches = 0;
+
+    for (unsigned seed = 0; seed < 100000; seed++) {
+        make_frame(values, seed * 2654435761u);
+        char *expected = state_cjson(values);
+        const char *actual = state_writer(values, buffer);
+        if (actual == NULL || strcmp(expected, actual) != 0) {
+            if (mismatches++ < 5) {
+                printf("state mismatch:\n  cJSON:  %s\n  writer: %s\n", expected, actual ? actual : "(overflow)");
+            }
+        }
+        free(expected);
+
+        make_stats(stats, seed * 40503u);
+        expected = stats_cjson(stats);
+        actual = stats_writer(stats, buffer);
+        if (actual == NULL || strcmp(expected, actual) != 0) {
+            if (mismatches++ < 5) {
+                printf("stats mismatch:\n  cJSON:  %s\n  writer: %s\n", expected, actual ? actual : "(overflow)");
+            }
+        }
+        free(expected);
+    }
+
+    char *expected = discovery_cjson();
+    const char *actual = discovery_writer(buffer);
+    if (actual == NULL || strcmp(expected, actual) != 0) {
+        mismatches++;
+        printf("discovery mismatch:\n%s\n%s\n", expected, actual ? actual : "(overflow)");
+    }
+    free(expected);
+
+    return mismatches;
+}
+
+/**
+ * @brief Check values whose scaled magnitude is at or beyond 64 bits.
+ *
+ * Fixed strings have to match printf. Decimals have to parse back to the rounded value; cJSON is no
+ * reference there, scaling by 10^9 and back loses the last digit of such values.
+ *
+ * @return Number of values that differ.
+ */
+static unsigned check_edges(void) {
+    static const struct {
+        double value;
+        uint8_t decimals;
+    } edges[] = {
+            {1e14, 9}, {2e13, 9}, {123456789012.5, 9}, {1e14, 6}, {-1e14, 6}, {1.8e10, 9}, {1.7e10, 9},
+            {9.2e18, 0}, {1.9e19, 0}, {16777216.0f, 9}, {-0.005f, 2}, {0.125, 2},
+    };
+    char buffer[BENCH_BUFFER_SIZE];
+    char expected[128];
+    unsigned mismatches = 0;
+
+    for (size_t i = 0; i < sizeof(edges) / sizeof(edges[0]); i++) {
+        json_writer_t writer;
+        json_writer_init(&writer, buffer, sizeof(buffer), false);
+        json_writer_fixed_string(&writer, NULL, edges[i].value, edges[i].decimals);
+        const char *actual = json_writer_finish(&writer);
+        snprintf(expected, sizeof(expected), "\"%.*f\"", edges[i].decimals, edges[i].value);
+        if (actual == NULL || strcmp(expected, actual) != 0) {
+            mismatches++;
+            printf("edge mismatch:\n  printf: %s\n  writer: %s\n", expected, actual ? actual : "(overflow)");
+        }
+
+        json_writer_init(&writer, buffer, sizeof(buffer), false);
+        json_writer_decimal(&writer, NULL, edges[i].value, edges[i].decimals);
+        actual = json_writer_finish(&writer);
+        double tolerance = 0.5 / pow(10, edges[i].decimals) + fabs(edges[i].value) * 1e-15;
+        if (actual == NULL || fabs(strtod(actual, NULL) - edges[i].value) > tolerance) {
+            mismatches++;
+            printf("edge mismatch:\n  value:  %.17g\n  writer: %s\n", edges[i].value, actual ? actual : "(overflow)");
+        }
+    }
+    return mismatches;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Print one result line.
+ * @param name Name of the measurement.
+ * @param iterations Number of documents built.
+ * @param seconds Time taken.
+ * @param allocs Number of allocations made.
+ * @param bytes Total document length.
+ */
+static void report(const char *name, unsigned iterations, double seconds, size_t allocs, size_t bytes) {
+    printf("%-18s %10.0f docs/s %8.1f ns/doc %8.2f allocs/doc %6zu bytes/doc\n", name,
+           iterations / seconds, seconds * 1e9 / iterations, (double)allocs / iterations, bytes / iterations);
+}
+
+int main(int argc, char **argv) {
+    unsigned iterations = argc > 1 ? (unsigned)strtoul(argv[1], NULL, 10) : BENCH_ITERATIONS;
+    if (iterations == 0) {
+        iterations = BENCH_ITERATIONS;
+    }
+
+    cJSON_Hooks hooks = {.malloc_fn = counting_malloc, .free_fn = free};
+    cJSON_InitHooks(&hooks);
+
+    unsigned mismatches = check_identical() + check_edges();
+    if (mismatches != 0) {
+        printf("%u documents differ between cJSON and json_writer\n", mismatches);
+        return 1;
+    }
+    printf("output is byte-identical for %d channels\n\n", (int)CHANNEL_COUNT);
+
+    char buffer[BENCH_BUFFER_SIZE];
+    sensor_value_t values[CHANNEL_COUNT];
+    sensor_stats_t stats[CHANNEL_COUNT];
+    size_t bytes;
+    double start;
+
+    bytes = 0;
+    allocations = 0;
+    start = now_seconds();
+    for (unsigned i = 0; i < iterations; i++) {
+        make_frame(values, i);
+        char *message = state_cjson(values);
+        bytes += strlen(message);
+        free(message);
+    }
+    report("state cJSON", iterations, now_seconds() - start, allocations, bytes);
+
+    bytes = 0;
+    start = now_seconds();
+    for (unsigned i = 0; i < iterations; i++) {
+        make_frame(values, i);
+        bytes += strlen(state_writer(values, buffer));
+    }
+    report("state json_writer", iterations, now_seconds() - start, 0, bytes);
+
+    bytes = 0;
+    allocations = 0;
+    start = now_seconds();
+    for (unsigned i = 0; i < iterations; i++) {
+        make_stats(stats, i);
+        char *message = stats_cjson(stats);
+        bytes += strlen(message);
+        free(message);
+    }
+    report("stats cJSON", iterations, now_seconds() - start, allocations, bytes);
+
+    bytes = 0;
+    start = now_seconds();
+    for (unsigned i = 0; i < iterations; i++) {
+        make_stats(stats, i);
+        bytes += strlen(stats_writer(stats, buffer));
+    }
+    report("stats json_writer", iterations, now_seconds() - start, 0, bytes);
+
+    return 0;
+}
@@ -0,0 +1,350 @@
+/**
+ * @file latency_analyze.c
+ * @brief Report end-to-end latency, loss, reordering and jitter of published frames per device.
+ *
+ * Reads messages as printed by mosquitto_sub with arrival times, e.g.
+ * `mosquitto_sub -h localhost -t 'homeassistant/sensor/+/state' -F '%U %t %p' | latency_analyze`,
+ * one "<arrival unix time> <topic> <payload>" line per message. Every topic is one device. The
+ * "seq" key of the JSON payloads numbers the messages on their topic and gives loss, duplicates and
+ * reordering; "frame", the sampler's frame number, is not used, it skips frames that were never
+ * published. Once the devices have wall-clock time, "ts" (sample time) and "pts" (publish time) give
+ * the latency from sampling to arrival, split into time spent on the device and time spent in the
+ * network and broker. Clocks are synchronised with SNTP, so latencies below a few milliseconds are
+ * within their error.
+ *
+ * Usage: latency_analyze [-d seconds] [file ...]
+ * The report is printed at the end of the input, after -d seconds of arrival time, or on Ctrl-C.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stdint.h"
+#include "stdbool.h"
+#include "signal.h"
+#include "math.h"
+
+#define ANALYZE_LINE_SIZE       4096    ///< Longest input line in bytes
+#define ANALYZE_MAX_DEVICES     1024    ///< Largest number of topics tracked
+#define ANALYZE_RESTART_GAP     1000    ///< A sequence number this far below the highest one means the device restarted
+
+/**
+ * @brief Growing array of doubles.
+ */
+typedef struct {
+    double *values;     ///< Elements
+    size_t count;       ///< Number of elements
+    size_t capacity;    ///< Allocated elements
+} sample_array_t;
+
+/**
+ * @brief Statistics of one device.
+ */
+typedef struct {
+    char *topic;                ///< Topic the device publishes on
+    uint64_t received;          ///< Messages with a sequence number
+    uint64_t lost;              ///< Sequence numbers never received
+    uint64_t duplicates;        ///< Sequence numbers received more than once
+    uint64_t reordered;         ///< Messages older than one received before them
+    uint64_t restarts;          ///< Times the sequence started over
+    uint32_t max_sequence;      ///< Highest sequence number of the current run
+    sample_array_t sequences;   ///< Sequence numbers of the current run
+    sample_array_t latency;     ///< Arrival minus sample time in milliseconds
+    sample_array_t device;      ///< Publish minus sample time in milliseconds
+    sample_array_t network;     ///< Arrival minus publish time in milliseconds
+    bool has_previous;          ///< previous_arrival and previous_sample are set
+    double previous_arrival;    ///< Arrival time of the previous timed message in milliseconds
+    double previous_sample;     ///< Sample time of the previous timed message in milliseconds
+    double jitter;              ///< RFC 3550 interarrival jitter in milliseconds
+} device_stats_t;
+
+static device_stats_t devices[ANALYZE_MAX_DEVICES];
+static size_t device_count = 0;
+static volatile sig_atomic_t interrupted = 0;
+
+/**
+ * @brief Stop reading and print the report.
+ * @param signal_number Unused.
+ */
+static void handle_interrupt(int signal_number) {
+    (void)signal_number;
+    interrupted = 1;
+}
+
+/**
+ * @brief Append a value to a growing array.
+ * @param array Array.
+ * @param value Value to append.
+ */
+static void sample_append(sample_array_t *array, double value) {
+    if (array->count == array->capacity) {
+        size_t capacity = array->capacity > 0 ? array->capacity * 2 : 256;
+        double *values = realloc(array->values, capacity * sizeof(double));
+        if (values == NULL) {
+            fprintf(stderr, "latency_analyze: out of memory\n");
+            exit(1);
+        }
+        array->values = values;
+        array->capacity = capacity;
+    }
+    array->values[array->count++] = value;
+}
+
+/**
+ * @brief Order doubles for qsort().
+ * @param a First value.
+ * @param b Second value.
+ * @return Negative, zero or positive.
+ */
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Percentile of a sorted array, by nearest rank.
+ * @param array Sorted array with at least one element.
+ * @param percent Percentile between 0 and 100.
+ * @return Value at the percentile.
+ */
+static double percentile(const sample_array_t *array, double percent) {
+    size_t rank = (size_t)ceil(percent / 100.0 * (double)array->count);
+    return array->values[rank > 0 ? rank - 1 : 0];
+}
+
+/**
+ * @brief Count the lost and duplicate sequence numbers of a run and start a new one.
+ * @param stats Device statistics.
+ */
+static void close_run(device_stats_t *stats) {
+    sample_array_t *sequences = &stats->sequences;
+    if (sequences->count == 0) {
+        return;
+    }
+
+    qsort(sequences->values, sequences->count, sizeof(double), compare_doubles);
+    uint64_t unique = 1;
+    for (size_t i = 1; i < sequences->count; i++) {
+        if (sequences->values[i] == sequences->values[i - 1]) {
+            stats->duplicates++;
+        } else {
+            unique++;
+        }
+    }
+    // Frames before the first one received are not counted, the analyser may have started late
+    uint64_t expected = (uint64_t)(sequences->values[sequences->count - 1] - sequences->values[0]) + 1;
+    stats->lost += expected - unique;
+
+    sequences->count = 0;
+    stats->max_sequence = 0;
+}
+
+/**
+ * @brief Find the statistics of a topic, creating them on first use.
+ * @param topic Topic.
+ * @return Statistics, or NULL if ANALYZE_MAX_DEVICES topics are tracked already.
+ */
+static device_stats_t *find_device(const char *topic) {
+    for (size_t i = 0; i < device_count; i++) {
+        if (strcmp(devices[i].topic, topic) == 0) {
+            return &devices[i];
+        }
+    }
+    if (device_count == ANALYZE_MAX_DEVICES) {
+        return NULL;
+    }
+    device_stats_t *stats = &devices[device_count++];
+    stats->topic = strdup(topic);
+    return stats;
+}
+
+/**
+ * @brief Read a numeric key of a flat JSON payload.
+ * @param payload Payload.
+ * @param key Key, including its quotes.
+ * @param value Filled with the value.
+ * @return true if the key was found with a numeric value.
+ */
+static bool json_number(const char *payload, const char *key, double *value) {
+    const char *position = strstr(payload, key);
+    if (position == NULL) {
+        return false;
+    }
+    position += strlen(key);
+    if (*position != ':') {
+        return false;
+    }
+    char *end;
+    *value = strtod(position + 1, &end);
+    return end != position + 1;
+}
+
+/**
+ * @brief Account one received message.
+ * @param arrival_ms Arrival time in Unix milliseconds.
+ * @param topic Topic.
+ * @param payload Payload.
+ */
+static void process_message(double arrival_ms, const char *topic, const char *payload) {
+    double sequence, sample_ms, publish_ms;
+    if (!json_number(payload, "\"seq\"", &sequence)) {
+        return;
+    }
+    device_stats_t *stats = find_device(topic);
+    if (stats == NULL) {
+        return;
+    }
+
+    uint32_t seq = (uint32_t)sequence;
+    if (stats->sequences.count > 0 && seq + ANALYZE_RESTART_GAP < stats->max_sequence) {
+        close_run(stats);
+        stats->restarts++;
+        stats->has_previous = false;
+    }
+    if (stats->sequences.count > 0 && seq < stats->max_sequence) {
+        stats->reordered++;
+    }
+    if (seq > stats->max_sequence) {
+        stats->max_sequence = seq;
+    }
+    sample_append(&stats->sequences, seq);
+    stats->received++;
+
+    if (!json_number(payload, "\"ts\"", &sample_ms)) {
+        return;
+    }
+    sample_append(&stats->latency, arrival_ms - sample_ms);
+    if (json_number(payload, "\"pts\"", &publish_ms)) {
+        sample_append(&stats->device, publish_ms - sample_ms);
+        sample_append(&stats->network, arrival_ms - publish_ms);
+    }
+
+    // Change in transit time between consecutive messages, smoothed as in RFC 3550
+    if (stats->has_previous) {
+        double difference = (arrival_ms - stats->previous_arrival) - (sample_ms - stats->previous_sample);
+        stats->jitter += (fabs(difference) - stats->jitter) / 16.0;
+    }
+    stats->has_previous = true;
+    stats->previous_arrival = arrival_ms;
+    stats->previous_sample = sample_ms;
+}
+
+/**
+ * @brief Print the p50, p90, p99 and maximum of an array, or dashes if it is empty.
+ * @param array Array, sorted in place.
+ */
+static void print_percentiles(sample_array_t *array) {
+    if (array->count == 0) {
+        printf(" %8s %8s %8s %8s", "-", "-", "-", "-");
+        return;
+    }
+    qsort(array->values, array->count, sizeof(double), compare_doubles);
+    printf(" %8.1f %8.1f %8.1f %8.1f", percentile(array, 50), percentile(array, 90), percentile(array, 99),
+           array->values[array->count - 1]);
+}
+
+/**
+ * @brief Print the report of all devices.
+ */
+static void print_report(void) {
+    printf("%-40s %9s %8s %7s %6s %6s %4s %8s %8s %8s %8s %8s %8s %8s\n", "topic", "received", "lost", "loss%",
+           "dup", "reord", "rst", "lat_p50", "lat_p90", "lat_p99", "lat_max", "dev_p50", "net_p50", "jitter");
+    for (size_t i = 0; i < device_count; i++) {
+        device_stats_t *stats = &devices[i];
+        close_run(stats);
+
+        uint64_t expected = stats->received - stats->duplicates + stats->lost;
+        double loss = expected > 0 ? 100.0 * (double)stats->lost / (double)expected : 0.0;
+        printf("%-40s %9llu %8llu %7.3f %6llu %6llu %4llu", stats->topic, (unsigned long long)stats->received,
+               (unsigned long long)stats->lost, loss, (unsigned long long)stats->duplicates,
+               (unsigned long long)stats->reordered, (unsigned long long)stats->restarts);
+        print_percentiles(&stats->latency);
+
+        sample_array_t *parts[] = {&stats->device, &stats->network};
+        for (size_t j = 0; j < 2; j++) {
+            if (parts[j]->count == 0) {
+                printf(" %8s", "-");
+                continue;
+            }
+            qsort(parts[j]->values, parts[j]->count, sizeof(double), compare_doubles);
+            printf(" %8.1f", percentile(parts[j], 50));
+        }
+        if (stats->latency.count > 1) {
+            printf(" %8.2f\n", stats->jitter);
+        } else {
+            printf(" %8s\n", "-");
+        }
+    }
+    printf("All times in milliseconds.\n");
+}
+
+/**
+ * @brief Process the messages of one input stream.
+ * @param stream Input stream.
+ * @param duration_ms Stop after this much arrival time, 0 to read to the end.
+ * @param first_arrival_ms Arrival time of the first message, negative until it is known.
+ * @return true if reading should continue with the next input.
+ */
+static bool process_stream(FILE *stream, double duration_ms, double *first_arrival_ms) {
+    char line[ANALYZE_LINE_SIZE];
+
+    while (!interrupted && fgets(line, sizeof(line), stream) != NULL) {
+        char *end;
+        double arrival_ms = strtod(line, &end) * 1000.0;
+        if (end == line || *end != ' ') {
+            continue;
+        }
+        char *topic = end + 1;
+        char *payload = strchr(topic, ' ');
+        if (payload == NULL) {
+            continue;
+        }
+        *payload++ = '\0';
+
+        if (*first_arrival_ms < 0) {
+            *first_arrival_ms = arrival_ms;
+        }
+        if (duration_ms > 0 && arrival_ms - *first_arrival_ms > duration_ms) {
+            return false;
+        }
+        process_message(arrival_ms, topic, payload);
+    }
+    return !interrupted;
+}
+
+int main(int argc, char **argv) {
+    double duration_ms = 0;
+    int first_file = 1;
+
+    if (argc > 2 && strcmp(argv[1], "-d") == 0) {
+        duration_ms = atof(argv[2]) * 1000.0;
+        first_file = 3;
+    }
+
+    // No SA_RESTART, so Ctrl-C also interrupts a blocking read
+    struct sigaction action = {0};
+    action.sa_handler = handle_interrupt;
+    sigaction(SIGINT, &action, NULL);
+
+    double first_arrival_ms = -1;
+    if (first_file == argc) {
+        process_stream(stdin, duration_ms, &first_arrival_ms);
+    }
+    for (int i = first_file; i < argc; i++) {
+        FILE *stream = fopen(argv[i], "r");
+        if (stream == NULL) {
+            perror(argv[i]);
+            return 1;
+        }
+        bool more = process_stream(stream, duration_ms, &first_arrival_ms);
+        fclose(stream);
+        if (!more) {
+            break;
+        }
+    }
+
+    print_report();
+    return 0;
+}
@@ -0,0 +1,213 @@
+/**
+ * @file telemetry_decode.c
+ * @brief Convert captured packed telemetry frames back to JSON or CSV.
+ *
+ * Reads concatenated packed frames, e.g. captured with
+ * `mosquitto_sub -t homeassistant/sensor/GY86_240AC4A1B2C3/telemetry -N > capture.bin`, and prints
+ * one JSON object or CSV row per frame. The channel list is expanded from gy86_schema.h, so the tool
+ * must be built from the same schema as the firmware; the schema ID in every frame is checked.
+ *
+ * Usage: telemetry_decode [-f json|csv] [file ...]
+ */
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "math.h"
+#include "json_writer.h"
+#include "telemetry_codec.h"
+#include "gy86_schema.h"
+
+#define DECODE_READ_CHUNK   4096    ///< Bytes read from the input at a time
+#define DECODE_LINE_SIZE    2048    ///< Output buffer for one JSON line
+
+#define DECODE_FIELD(id, key, device_class, unit, value_type, kind, ctype, member, source, scale, report) \
+    {NULL, #key, value_type, 0, scale, report},
+
+static const sensor_field_t fields[] = { GY86_CHANNELS(DECODE_FIELD) };
+#define FIELD_COUNT (sizeof(fields) / sizeof(fields[0]))
+
+/**
+ * @brief Output format of the tool.
+ */
+typedef enum {
+    OUTPUT_JSON,    ///< One JSON object per line
+    OUTPUT_CSV      ///< Header row, then one row per frame
+} output_format_t;
+
+/**
+ * @brief Number of decimals that represents a fixed-point scale without loss.
+ * @param scale Fixed-point factor.
+ * @return Number of decimals.
+ */
+static uint8_t scale_decimals(float scale) {
+    uint8_t decimals = 0;
+    for (double power = 1.0; power < scale && decimals < 9; power *= 10.0) {
+        decimals++;
+    }
+    return decimals;
+}
+
+/**
+ * @brief Append a whole stream to a growing buffer.
+ * @param stream Input stream.
+ * @param data Buffer, reallocated as needed.
+ * @param length Number of bytes in the buffer, updated.
+ * @return 0 on success, -1 on a read or allocation error.
+ */
+static int read_stream(FILE *stream, uint8_t **data, size_t *length) {
+    size_t capacity = *length;
+    while (1) {
+        if (capacity - *length < DECODE_READ_CHUNK) {
+            capacity = (capacity + DECODE_READ_CHUNK) * 2;
+            uint8_t *grown = realloc(*data, capacity);
+            if (grown == NULL) {
+                return -1;
+            }
+            *data = grown;
+        }
+        size_t count = fread(*data + *length, 1, DECODE_READ_CHUNK, stream);
+        *length += count;
+        if (count < DECODE_READ_CHUNK) {
+            return ferror(stream) ? -1 : 0;
+        }
+    }
+}
+
+static void print_json(const telemetry_header_t *header, const sensor_value_t *values) {
+    char line[DECODE_LINE_SIZE];
+    json_writer_t writer;
+
+    json_writer_init(&writer, line, sizeof(line), false);
+    json_writer_begin_object(&writer, NULL);
+    json_writer_int(&writer, "sequence", header->sequence);
+    json_writer_int(&writer, "timestamp_us", header->timestamp_us);
+    for (size_t i = 0; i < FIELD_COUNT; i++) {
+        switch (values[i].type) {
+            case VALUE_TYPE_DOUBLE:
+                json_writer_decimal(&writer, fields[i].sensor_type, values[i].double_value, scale_decimals(fields[i].scale));
+                break;
+            case VALUE_TYPE_STRING:
+                json_writer_string(&writer, fields[i].sensor_type, values[i].string_value);
+                break;
+            default:
+                json_writer_int(&writer, fields[i].sensor_type, values[i].int_value);
+                break;
+        }
+    }
+    json_writer_end_object(&writer);
+
+    const char *json = json_writer_finish(&writer);
+    puts(json != NULL ? json : "{}");
+}
+
+static void print_csv_header(void) {
+    printf("sequence,timestamp_us");
+    for (size_t i = 0; i < FIELD_COUNT; i++) {
+        printf(",%s", fields[i].sensor_type);
+    }
+    putchar('\n');
+}
+
+static void print_csv(const telemetry_header_t *header, const sensor_value_t *values) {
+    printf("%lu,%lld", (unsigned long)header->sequence, (long long)header->timestamp_us);
+    for (size_t i = 0; i < FIELD_COUNT; i++) {
+        putchar(',');
+        switch (values[i].type) {
+            case VALUE_TYPE_DOUBLE:
+                // Missing values stay empty
+                if (!isnan(values[i].double_value)) {
+                    printf("%.*f", scale_decimals(fields[i].scale), values[i].double_value);
+                }
+                break;
+            case VALUE_TYPE_STRING:
+                if (strpbrk(values[i].string_value, ",\"\n") != NULL) {
+                    putchar('"');
+                    for (const char *p = values[i].string_value; *p != '\0'; p++) {
+                        if (*p == '"') {
+                            putchar('"');
+                        }
+                        putchar(*p);
+                    }
+                    putchar('"');
+                } else {
+                    fputs(values[i].string_value, stdout);
+                }
+                break;
+            default:
+                printf("%d", values[i].int_value);
+                break;
+        }
+    }
+    putchar('\n');
+}
+
+static const char *status_text(telemetry_status_t status) {
+    switch (status) {
+        case TELEMETRY_ERR_TRUNCATED: return "truncated frame";
+        case TELEMETRY_ERR_VERSION:   return "unsupported format version";
+        case TELEMETRY_ERR_SCHEMA:    return "frame was encoded with a different channel schema";
+        default:                      return "ok";
+    }
+}
+
+int main(int argc, char **argv) {
+    output_format_t format = OUTPUT_JSON;
+    uint8_t *data = NULL;
+    size_t length = 0;
+    int first_file = 1;
+
+    if (argc > 2 && strcmp(argv[1], "-f") == 0) {
+        if (strcmp(argv[2], "csv") == 0) {
+            format = OUTPUT_CSV;
+        } else if (strcmp(argv[2], "json") != 0) {
+            fprintf(stderr, "usage: %s [-f json|csv] [file ...]\n", argv[0]);
+            return 2;
+        }
+        first_file = 3;
+    }
+
+    if (first_file >= argc) {
+        if (read_stream(stdin, &data, &length) != 0) {
+            fprintf(stderr, "failed to read stdin\n");
+            return 1;
+        }
+    }
+    for (int i = first_file; i < argc; i++) {
+        FILE *file = fopen(argv[i], "rb");
+        if (file == NULL || read_stream(file, &data, &length) != 0) {
+            fprintf(stderr, "failed to read %s\n", argv[i]);
+            return 1;
+        }
+        fclose(file);
+    }
+
+    if (format == OUTPUT_CSV) {
+        print_csv_header();
+    }
+
+    sensor_value_t values[FIELD_COUNT];
+    telemetry_header_t header;
+    size_t offset = 0;
+    while (offset < length) {
+        size_t consumed = 0;
+        telemetry_status_t status = telemetry_decode_frame(data + offset, length - offset, fields, FIELD_COUNT,
+                                                           &header, values, &consumed);
+        if (status != TELEMETRY_OK) {
+            // Frames have no length prefix, so decoding cannot resume after a bad one
+            fprintf(stderr, "offset %zu: %s\n", offset, status_text(status));
+            free(data);
+            return 1;
+        }
+
+        if (format == OUTPUT_CSV) {
+            print_csv(&header, values);
+        } else {
+            print_json(&header, values);
+        }
+        offset += consumed;
+    }
+
+    free(data);
+    return 0;
+}